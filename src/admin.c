@@ -0,0 +1,384 @@
+#include "admin.h"
+#include "buffer.h"
+#include "log.h"
+#include "report.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define ADMIN_MAX_LISTENERS 8
+#define ADMIN_LISTEN_BACKLOG 16
+#define ADMIN_MAX_ACCEPTS 16		// connections accepted per wakeup
+#define ADMIN_MAX_REQUEST 8192
+#define ADMIN_CHUNK_SIZE 65536		// response bytes rendered at a time
+#define ADMIN_TIMEOUT 10.0		// seconds without any progress
+
+#ifdef MSG_NOSIGNAL
+#define ADMIN_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define ADMIN_SEND_FLAGS 0
+#endif
+
+struct admin_listener {
+	admin_server_t *admin;
+	int sd;
+	ev_io watcher;
+};
+
+struct admin_conn {
+	admin_server_t *admin;
+	int sd;
+	ev_io watcher;
+	ev_timer timeout_watcher;
+	buffer_t buffer;		// the request, then the response
+	stats_snapshot_t *snapshot;	// set while a report is being sent
+	report_t report;
+	struct admin_conn *prev;
+	struct admin_conn *next;
+};
+
+struct admin_server {
+	struct ev_loop *loop;
+	stats_server_t *server;
+	struct admin_listener listeners[ADMIN_MAX_LISTENERS];
+	int num_listeners;
+	struct admin_conn *conns;
+};
+
+admin_server_t *admin_server_create(struct ev_loop *loop, stats_server_t *server) {
+	admin_server_t *admin = calloc(1, sizeof(admin_server_t));
+	if (admin == NULL) {
+		return NULL;
+	}
+	admin->loop = loop;
+	admin->server = server;
+	return admin;
+}
+
+static void admin_conn_close(struct admin_conn *conn) {
+	admin_server_t *admin = conn->admin;
+
+	ev_io_stop(admin->loop, &conn->watcher);
+	ev_timer_stop(admin->loop, &conn->timeout_watcher);
+	close(conn->sd);
+	if (conn->prev != NULL) {
+		conn->prev->next = conn->next;
+	} else {
+		admin->conns = conn->next;
+	}
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	}
+	stats_snapshot_destroy(conn->snapshot);
+	buffer_destroy(&conn->buffer);
+	free(conn);
+}
+
+static void admin_conn_timeout(struct ev_loop *loop, ev_timer *watcher, int revents) {
+	struct admin_conn *conn = (struct admin_conn *) watcher->data;
+	stats_debug_log("admin: closing idle connection fd %d", conn->sd);
+	admin_conn_close(conn);
+}
+
+// Start sending whatever is in the buffer. For a report, the rest of it
+// follows as the socket drains.
+static void admin_start_response(struct admin_conn *conn,
+				 const char *status,
+				 const char *content_type,
+				 const char *body) {
+	char header[256];
+	int len;
+
+	if (body != NULL) {
+		len = snprintf(header, sizeof(header),
+			       "HTTP/1.1 %s\r\n"
+			       "Content-Type: %s\r\n"
+			       "Content-Length: %zu\r\n"
+			       "Connection: close\r\n\r\n%s",
+			       status, content_type, strlen(body), body);
+	} else {
+		len = snprintf(header, sizeof(header),
+			       "HTTP/1.1 %s\r\n"
+			       "Content-Type: %s\r\n"
+			       "Connection: close\r\n\r\n",
+			       status, content_type);
+	}
+	buffer_consume(&conn->buffer, buffer_datacount(&conn->buffer));
+	buffer_realign(&conn->buffer);
+	buffer_set(&conn->buffer, header, len);
+
+	ev_io_stop(conn->admin->loop, &conn->watcher);
+	ev_io_set(&conn->watcher, conn->sd, EV_WRITE);
+	ev_io_start(conn->admin->loop, &conn->watcher);
+}
+
+static void admin_handle_request(struct admin_conn *conn, char *request) {
+	enum report_format format;
+	const char *content_type;
+
+	char *target = strchr(request, ' ');
+	if (target == NULL) {
+		admin_start_response(conn, "400 Bad Request", "text/plain", "bad request\n");
+		return;
+	}
+	*target++ = '\0';
+	target[strcspn(target, " ?")] = '\0';
+
+	bool head = strcmp(request, "HEAD") == 0;
+	if (!head && strcmp(request, "GET") != 0) {
+		admin_start_response(conn, "405 Method Not Allowed", "text/plain", "only GET is allowed\n");
+		return;
+	}
+	if (strcmp(target, "/metrics") == 0) {
+		format = REPORT_PROMETHEUS;
+		content_type = "text/plain; version=0.0.4; charset=utf-8";
+	} else if (strcmp(target, "/stats.json") == 0) {
+		format = REPORT_JSON;
+		content_type = "application/json";
+	} else {
+		admin_start_response(conn, "404 Not Found", "text/plain", "not found\n");
+		return;
+	}
+
+	if (!head) {
+		conn->snapshot = stats_server_snapshot(conn->admin->server);
+		if (conn->snapshot == NULL) {
+			stats_error_log("admin: failed to allocate a stats snapshot");
+			admin_start_response(conn, "500 Internal Server Error", "text/plain", "out of memory\n");
+			return;
+		}
+		report_init(&conn->report, conn->snapshot, format);
+	}
+	admin_start_response(conn, "200 OK", content_type, NULL);
+}
+
+// Returns the end of the request line once all of the headers are in
+static char *admin_request_complete(buffer_t *buffer) {
+	char *head = buffer_head(buffer);
+	char *end = buffer_tail(buffer);
+	char *line_end = NULL;
+
+	for (char *p = head; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+		if (line_end == NULL) {
+			line_end = p;
+		}
+		if ((p + 1 < end && p[1] == '\n') ||
+		    (p + 2 < end && p[1] == '\r' && p[2] == '\n')) {
+			return line_end;
+		}
+	}
+	return NULL;
+}
+
+static void admin_conn_read(struct admin_conn *conn) {
+	if (buffer_spacecount(&conn->buffer) == 0 &&
+	    buffer_expand(&conn->buffer) != 0) {
+		admin_conn_close(conn);
+		return;
+	}
+	ssize_t len = recv(conn->sd, buffer_tail(&conn->buffer),
+			   buffer_spacecount(&conn->buffer), 0);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			stats_debug_log("admin: error reading from fd %d: %s", conn->sd, strerror(errno));
+			admin_conn_close(conn);
+		}
+		return;
+	}
+	if (len == 0) {
+		admin_conn_close(conn);
+		return;
+	}
+	buffer_produced(&conn->buffer, len);
+	ev_timer_again(conn->admin->loop, &conn->timeout_watcher);
+
+	char *line_end = admin_request_complete(&conn->buffer);
+	if (line_end != NULL) {
+		if (line_end > buffer_head(&conn->buffer) && line_end[-1] == '\r') {
+			line_end--;
+		}
+		*line_end = '\0';
+		admin_handle_request(conn, buffer_head(&conn->buffer));
+	} else if (buffer_datacount(&conn->buffer) >= ADMIN_MAX_REQUEST) {
+		admin_start_response(conn, "431 Request Header Fields Too Large",
+				     "text/plain", "request too large\n");
+	}
+}
+
+// Sends at most one chunk per wakeup, so that a large report is spread
+// over several iterations of the loop.
+static void admin_conn_write(struct admin_conn *conn) {
+	if (buffer_datacount(&conn->buffer) == 0 && conn->snapshot != NULL) {
+		buffer_realign(&conn->buffer);
+		int more = report_write(&conn->report, &conn->buffer, ADMIN_CHUNK_SIZE);
+		if (more < 0) {
+			stats_error_log("admin: failed to allocate memory for a response");
+			admin_conn_close(conn);
+			return;
+		}
+		if (more == 0) {
+			stats_snapshot_destroy(conn->snapshot);
+			conn->snapshot = NULL;
+		}
+	}
+	if (buffer_datacount(&conn->buffer) == 0) {
+		admin_conn_close(conn);
+		return;
+	}
+
+	ssize_t len = send(conn->sd, buffer_head(&conn->buffer),
+			   buffer_datacount(&conn->buffer), ADMIN_SEND_FLAGS);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			stats_debug_log("admin: error writing to fd %d: %s", conn->sd, strerror(errno));
+			admin_conn_close(conn);
+		}
+		return;
+	}
+	buffer_consume(&conn->buffer, len);
+	ev_timer_again(conn->admin->loop, &conn->timeout_watcher);
+}
+
+static void admin_conn_callback(struct ev_loop *loop, ev_io *watcher, int revents) {
+	struct admin_conn *conn = (struct admin_conn *) watcher->data;
+
+	if (revents & EV_READ) {
+		admin_conn_read(conn);
+	} else if (revents & EV_WRITE) {
+		admin_conn_write(conn);
+	}
+}
+
+static void admin_accept(struct ev_loop *loop, ev_io *watcher, int revents) {
+	struct admin_listener *listener = (struct admin_listener *) watcher->data;
+	admin_server_t *admin = listener->admin;
+
+	for (int i = 0; i < ADMIN_MAX_ACCEPTS; i++) {
+		int sd = accept(listener->sd, NULL, NULL);
+		if (sd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				stats_error_log("admin: error accepting connection: %s", strerror(errno));
+			}
+			return;
+		}
+		if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) != 0) {
+			stats_error_log("admin: error setting socket to non-blocking: %s", strerror(errno));
+			close(sd);
+			continue;
+		}
+		struct admin_conn *conn = calloc(1, sizeof(struct admin_conn));
+		if (conn == NULL || buffer_init(&conn->buffer) != 0) {
+			stats_error_log("admin: failed to allocate a connection");
+			free(conn);
+			close(sd);
+			continue;
+		}
+		conn->admin = admin;
+		conn->sd = sd;
+		conn->next = admin->conns;
+		if (admin->conns != NULL) {
+			admin->conns->prev = conn;
+		}
+		admin->conns = conn;
+
+		ev_io_init(&conn->watcher, admin_conn_callback, sd, EV_READ);
+		conn->watcher.data = conn;
+		ev_io_start(loop, &conn->watcher);
+		ev_timer_init(&conn->timeout_watcher, admin_conn_timeout, 0, ADMIN_TIMEOUT);
+		conn->timeout_watcher.data = conn;
+		ev_timer_again(loop, &conn->timeout_watcher);
+	}
+}
+
+static int admin_listen(admin_server_t *admin, const struct addrinfo *addr) {
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+	int yes = 1;
+
+	if (admin->num_listeners >= ADMIN_MAX_LISTENERS) {
+		stats_error_log("admin: Unable to create more than %d listeners", ADMIN_MAX_LISTENERS);
+		return 1;
+	}
+	if (getnameinfo(addr->ai_addr, addr->ai_addrlen, host, sizeof(host),
+			port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+		strcpy(host, "?");
+		strcpy(port, "?");
+	}
+
+	int sd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (sd < 0) {
+		stats_error_log("admin: Error creating socket %s[:%s]: %s", host, port, strerror(errno));
+		return 1;
+	}
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != 0 ||
+	    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) != 0 ||
+	    bind(sd, addr->ai_addr, addr->ai_addrlen) != 0 ||
+	    listen(sd, ADMIN_LISTEN_BACKLOG) != 0) {
+		stats_error_log("admin: Error listening on %s[:%s]: %s", host, port, strerror(errno));
+		close(sd);
+		return 1;
+	}
+
+	struct admin_listener *listener = &admin->listeners[admin->num_listeners++];
+	listener->admin = admin;
+	listener->sd = sd;
+	ev_io_init(&listener->watcher, admin_accept, sd, EV_READ);
+	listener->watcher.data = listener;
+	ev_io_start(admin->loop, &listener->watcher);
+	stats_log("admin: Listening on %s[:%s], fd = %d", host, port, sd);
+	return 0;
+}
+
+int admin_server_bind(admin_server_t *admin, const char *address_and_port) {
+	struct addrinfo hints, *addrs;
+	int bound = 0;
+
+	const char *colon = strrchr(address_and_port, ':');
+	if (colon == NULL) {
+		stats_error_log("admin: missing port in %s", address_and_port);
+		return 1;
+	}
+	char *host = strndup(address_and_port, colon - address_and_port);
+	if (host == NULL) {
+		stats_error_log("admin: strndup(3) failed");
+		return 1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	int err = getaddrinfo(host, colon + 1, &hints, &addrs);
+	free(host);
+	if (err != 0) {
+		stats_error_log("admin: getaddrinfo error: %s", gai_strerror(err));
+		return 1;
+	}
+	for (struct addrinfo *p = addrs; p != NULL; p = p->ai_next) {
+		if (admin_listen(admin, p) == 0) {
+			bound++;
+		}
+	}
+	freeaddrinfo(addrs);
+	return bound == 0;
+}
+
+void admin_server_destroy(admin_server_t *admin) {
+	if (admin == NULL) {
+		return;
+	}
+	while (admin->conns != NULL) {
+		admin_conn_close(admin->conns);
+	}
+	for (int i = 0; i < admin->num_listeners; i++) {
+		ev_io_stop(admin->loop, &admin->listeners[i].watcher);
+		close(admin->listeners[i].sd);
+	}
+	free(admin);
+}
@@ -0,0 +1,28 @@
+// A small HTTP listener for scraping a server's stats, separate from
+// the ports that metrics come in on. It runs on the event loop of the
+// server's first worker and answers:
+//
+//   GET /metrics     Prometheus text format
+//   GET /stats.json  the same counters as JSON
+//
+// Responses are written a chunk at a time as the socket drains, so any
+// number of backends can be reported without holding up the loop.
+
+#ifndef STATSRELAY_ADMIN_H
+#define STATSRELAY_ADMIN_H
+
+#include "stats.h"
+
+#include <ev.h>
+
+typedef struct admin_server admin_server_t;
+
+admin_server_t *admin_server_create(struct ev_loop *loop, stats_server_t *server);
+
+// Listen on host:port; returns non-zero if no address could be bound
+int admin_server_bind(admin_server_t *admin, const char *address_and_port);
+
+// Closes the listeners and any connections that are still open
+void admin_server_destroy(admin_server_t *admin);
+
+#endif  // STATSRELAY_ADMIN_H
@@ -0,0 +1,258 @@
+#include "aggregate.h"
+#include "hashlib.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AGGREGATE_NUMBER_LEN 64
+
+int aggregate_init(aggregate_t *agg) {
+	agg->capacity = AGGREGATE_INITIAL_SIZE;
+	agg->count = 0;
+	agg->table = calloc(agg->capacity, sizeof(struct aggregate_entry));
+	agg->keys = NULL;
+	agg->keys_len = 0;
+	agg->keys_cap = 0;
+	agg->line = NULL;
+	agg->line_cap = 0;
+	return agg->table == NULL;
+}
+
+// Parse a number out of a field that is not NUL terminated
+static bool aggregate_parse_number(const char *str, size_t len, double *value) {
+	char buf[AGGREGATE_NUMBER_LEN];
+	char *endptr;
+
+	if (len == 0 || len >= sizeof(buf)) {
+		return false;
+	}
+	if (!((str[0] >= '0' && str[0] <= '9') || str[0] == '-' || str[0] == '+' || str[0] == '.')) {
+		return false;
+	}
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+	*value = strtod(buf, &endptr);
+	return endptr == buf + len && isfinite(*value);
+}
+
+static int aggregate_grow(aggregate_t *agg, size_t capacity) {
+	struct aggregate_entry *table = calloc(capacity, sizeof(struct aggregate_entry));
+	if (table == NULL) {
+		return -1;
+	}
+	const size_t mask = capacity - 1;
+	for (size_t i = 0; i < agg->capacity; i++) {
+		const struct aggregate_entry *entry = &agg->table[i];
+		if (entry->key_len == 0) {
+			continue;
+		}
+		size_t j = entry->hash & mask;
+		while (table[j].key_len != 0) {
+			j = (j + 1) & mask;
+		}
+		table[j] = *entry;
+	}
+	free(agg->table);
+	agg->table = table;
+	agg->capacity = capacity;
+	return 0;
+}
+
+static int aggregate_store_key(aggregate_t *agg, const char *key, size_t len, size_t *offset) {
+	if (agg->keys_len + len > agg->keys_cap) {
+		size_t cap = agg->keys_cap > 0 ? agg->keys_cap : 16384;
+		while (cap < agg->keys_len + len) {
+			cap *= 2;
+		}
+		char *keys = realloc(agg->keys, cap);
+		if (keys == NULL) {
+			return -1;
+		}
+		agg->keys = keys;
+		agg->keys_cap = cap;
+	}
+	memcpy(agg->keys + agg->keys_len, key, len);
+	*offset = agg->keys_len;
+	agg->keys_len += len;
+	return 0;
+}
+
+int aggregate_add(aggregate_t *agg, const char *line, size_t len) {
+	const char *end = line + len;
+	const char *colon = memchr(line, ':', len);
+	if (colon == NULL || colon == line) {
+		return 1;
+	}
+	const char *value = colon + 1;
+	const char *bar = memchr(value, '|', end - value);
+	if (bar == NULL) {
+		return 1;
+	}
+	const char *type = bar + 1;
+	const char *type_end = memchr(type, '|', end - type);
+	if (type_end == NULL) {
+		type_end = end;
+	}
+	if (type_end - type != 1) {
+		return 1;
+	}
+
+	double number, rate = 1.0;
+	bool relative = false;
+	const char kind = *type;
+	if (kind == 'c') {
+		// Only a sample rate may follow a counter
+		if (type_end != end) {
+			const char *sample = type_end + 1;
+			if (end - sample < 2 || sample[0] != '@' ||
+			    !aggregate_parse_number(sample + 1, end - sample - 1, &rate) ||
+			    rate <= 0 || rate > 1) {
+				return 1;
+			}
+		}
+	} else if (kind == 'g') {
+		if (type_end != end) {
+			return 1;
+		}
+		relative = *value == '+' || *value == '-';
+	} else {
+		return 1;
+	}
+	if (!aggregate_parse_number(value, bar - value, &number)) {
+		return 1;
+	}
+	if (kind == 'c') {
+		number /= rate;
+	}
+
+	// Keep the load factor under 70%
+	if ((agg->count + 1) * 10 > agg->capacity * 7 &&
+	    aggregate_grow(agg, agg->capacity * 2) != 0) {
+		return -1;
+	}
+
+	const uint32_t key_len = colon - line;
+	const uint32_t hash = stats_hash_raw(line, key_len) ^ (uint32_t) kind;
+	const size_t mask = agg->capacity - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		struct aggregate_entry *entry = &agg->table[i];
+		if (entry->key_len == 0) {
+			if (aggregate_store_key(agg, line, key_len, &entry->key_offset) != 0) {
+				return -1;
+			}
+			entry->hash = hash;
+			entry->key_len = key_len;
+			entry->type = kind;
+			entry->relative = relative;
+			entry->value = number;
+			agg->count++;
+			return 0;
+		}
+		if (entry->hash == hash && entry->key_len == key_len && entry->type == kind &&
+		    memcmp(agg->keys + entry->key_offset, line, key_len) == 0) {
+			if (kind == 'g' && !relative) {
+				entry->relative = false;
+				entry->value = number;
+			} else {
+				entry->value += number;
+			}
+			return 0;
+		}
+	}
+}
+
+size_t aggregate_count(const aggregate_t *agg) {
+	return agg->count;
+}
+
+// Integral values are written out in full rather than with an exponent
+static int aggregate_format_number(char *buf, size_t len, double value, bool sign) {
+	if (value > -9e15 && value < 9e15 && value == (double) (int64_t) value) {
+		return snprintf(buf, len, sign ? "%+" PRId64 : "%" PRId64, (int64_t) value);
+	}
+	return snprintf(buf, len, sign ? "%+.15g" : "%.15g", value);
+}
+
+static void aggregate_emit_line(aggregate_t *agg,
+				const struct aggregate_entry *entry,
+				double value,
+				bool sign,
+				aggregate_emit_t emit,
+				void *ctx) {
+	char number[AGGREGATE_NUMBER_LEN];
+	int number_len = aggregate_format_number(number, sizeof(number), value, sign);
+	size_t len = entry->key_len + number_len + 4;	// ':', '|', type, '\n'
+
+	if (len > agg->line_cap) {
+		char *line = realloc(agg->line, len);
+		if (line == NULL) {
+			return;
+		}
+		agg->line = line;
+		agg->line_cap = len;
+	}
+	char *p = agg->line;
+	memcpy(p, agg->keys + entry->key_offset, entry->key_len);
+	p += entry->key_len;
+	*p++ = ':';
+	memcpy(p, number, number_len);
+	p += number_len;
+	*p++ = '|';
+	*p++ = entry->type;
+	*p++ = '\n';
+	emit(ctx, agg->line, len);
+}
+
+size_t aggregate_flush(aggregate_t *agg, aggregate_emit_t emit, void *ctx) {
+	size_t lines = 0;
+
+	if (agg->count == 0) {
+		return 0;
+	}
+	for (size_t i = 0; i < agg->capacity; i++) {
+		const struct aggregate_entry *entry = &agg->table[i];
+		if (entry->key_len == 0) {
+			continue;
+		}
+		if (entry->type == 'g' && entry->relative) {
+			aggregate_emit_line(agg, entry, entry->value, true, emit, ctx);
+		} else if (entry->type == 'g' && entry->value < 0) {
+			// A gauge can only be set to a negative value by
+			// resetting it to zero first
+			aggregate_emit_line(agg, entry, 0, false, emit, ctx);
+			aggregate_emit_line(agg, entry, entry->value, true, emit, ctx);
+			lines++;
+		} else {
+			aggregate_emit_line(agg, entry, entry->value, false, emit, ctx);
+		}
+		lines++;
+	}
+
+	// Give back memory after a burst of keys, a bit at a time
+	const size_t count = agg->count;
+	agg->count = 0;
+	agg->keys_len = 0;
+	if (agg->capacity > AGGREGATE_INITIAL_SIZE && count * 8 < agg->capacity) {
+		struct aggregate_entry *table = calloc(agg->capacity / 2, sizeof(struct aggregate_entry));
+		if (table != NULL) {
+			free(agg->table);
+			agg->table = table;
+			agg->capacity /= 2;
+			return lines;
+		}
+	}
+	memset(agg->table, 0, agg->capacity * sizeof(struct aggregate_entry));
+	return lines;
+}
+
+void aggregate_destroy(aggregate_t *agg) {
+	free(agg->table);
+	free(agg->keys);
+	free(agg->line);
+	agg->table = NULL;
+	agg->keys = NULL;
+	agg->line = NULL;
+}
@@ -0,0 +1,58 @@
+// Folds statsd counters and gauges for one backend between flushes, so
+// that a key sent thousands of times a second goes out once per
+// interval. Counters are summed (corrected for their sample rate),
+// absolute gauges keep the last value, and relative gauges (+n/-n) are
+// summed, or applied to an absolute gauge seen earlier in the same
+// interval. Anything else (timers, sets, lines with tags) is left for
+// the caller to forward as it is.
+
+#ifndef STATSRELAY_AGGREGATE_H
+#define STATSRELAY_AGGREGATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AGGREGATE_INITIAL_SIZE 1024	// must be a power of two
+
+struct aggregate_entry {
+	uint32_t hash;
+	uint32_t key_len;	// 0 for an empty slot
+	size_t key_offset;	// into the key arena
+	char type;		// 'c' or 'g'
+	bool relative;		// a gauge made only of +n/-n updates
+	double value;
+};
+
+typedef struct aggregate {
+	struct aggregate_entry *table;	// open addressing, linear probing
+	size_t capacity;
+	size_t count;
+	char *keys;			// names of the keys in the table
+	size_t keys_len;
+	size_t keys_cap;
+	char *line;			// scratch space for flushed lines
+	size_t line_cap;
+} aggregate_t;
+
+// Called for every line that a flush produces; line includes the
+// trailing newline.
+typedef void (*aggregate_emit_t)(void *ctx, const char *line, size_t len);
+
+int aggregate_init(aggregate_t *agg);
+
+// Fold a statsd line (without its newline) into the table. Returns 0 if
+// it was folded, 1 if it is not a line that can be aggregated, and -1 if
+// memory ran out.
+int aggregate_add(aggregate_t *agg, const char *line, size_t len);
+
+// Number of distinct keys waiting to be flushed
+size_t aggregate_count(const aggregate_t *agg);
+
+// Emit one line per key (two for a gauge that has to be reset below
+// zero) and empty the table. Returns the number of lines emitted.
+size_t aggregate_flush(aggregate_t *agg, aggregate_emit_t emit, void *ctx);
+
+void aggregate_destroy(aggregate_t *agg);
+
+#endif  // STATSRELAY_AGGREGATE_H
@@ -1,7 +1,9 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "buffer.h"
+#include "pool.h"
 
 #define INITIAL_BUFFER_SIZE 4096
 
@@ -19,6 +21,7 @@ int buffer_allocate(buffer_t *b, size_t size)
 {
     b->size = size;
     b->ptr = (char *)malloc(b->size);
+    b->pool = NULL;
     if (!b->ptr) return -1;
 #ifdef SANITIZE_BUFFERS
 	memset(b->ptr, 0, size);
@@ -33,6 +36,16 @@ int buffer_init(buffer_t *b)
     return buffer_allocate(b, INITIAL_BUFFER_SIZE);
 }
 
+int buffer_init_pooled(buffer_t *b, struct bufpool *pool)
+{
+    b->ptr = NULL;
+    b->head = NULL;
+    b->tail = NULL;
+    b->size = 0;
+    b->pool = pool;
+    return 0;
+}
+
 int buffer_init_contents(buffer_t *b, const char *data, size_t size)
 {
     buffer_allocate(b, size);
@@ -81,9 +94,27 @@ char *myrealloc(char *p, size_t old, size_t new)
     return pnew;
 }
 
+/* Pooled buffers move to the pool's next size up */
+static char *pool_realloc(struct bufpool *pool, char *p, size_t old, size_t new)
+{
+    char *pnew = bufpool_get(pool, new);
+    if (pnew == NULL) {
+        return NULL;
+    }
+    if (p != NULL) {
+        memcpy(pnew, p, old);
+        bufpool_put(pool, p, old);
+    }
+    return pnew;
+}
+
 int buffer_newsize(buffer_t *b, size_t newsize)
 {
-    char *pnew = myrealloc(b->ptr, b->size, newsize);
+    char *pnew;
+    if (b->pool != NULL)
+        pnew = pool_realloc(b->pool, b->ptr, b->size, newsize);
+    else
+        pnew = myrealloc(b->ptr, b->size, newsize);
     if (!pnew)
         return -1;
     b->head = pnew + (b->head - b->ptr);
@@ -95,7 +126,7 @@ int buffer_newsize(buffer_t *b, size_t newsize)
 
 int buffer_expand(buffer_t *b)
 {
-    return buffer_newsize(b, b->size * 2);
+    return buffer_newsize(b, b->size > 0 ? b->size * 2 : INITIAL_BUFFER_SIZE);
 }
 
 int buffer_consume(buffer_t *b, size_t amt)
@@ -126,8 +157,40 @@ int buffer_set(buffer_t *b, const char *data, size_t size)
     return buffer_produced(b, size);
 }
 
+int buffer_vprintf(buffer_t *b, const char *format, va_list args)
+{
+    va_list copy;
+    int len;
+
+    for (;;) {
+        va_copy(copy, args);
+        len = vsnprintf(b->tail, buffer_spacecount(b), format, copy);
+        va_end(copy);
+        if (len < 0)
+            return -1;
+        if ((size_t)len < buffer_spacecount(b))
+            return buffer_produced(b, len);
+        buffer_realign(b);
+        if (buffer_spacecount(b) <= (size_t)len && 0 != buffer_expand(b))
+            return -1;
+    }
+}
+
+int buffer_printf(buffer_t *b, const char *format, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, format);
+    ret = buffer_vprintf(b, format, args);
+    va_end(args);
+    return ret;
+}
+
 int buffer_realign(buffer_t *b)
 {
+    if (b->ptr == NULL)
+        return 0;
     if (b->tail != b->head) {
         memmove(b->ptr, b->head, b->tail - b->head);
     }
@@ -137,9 +200,26 @@ int buffer_realign(buffer_t *b)
     return 0;
 }
 
+void buffer_release(buffer_t *b)
+{
+    if (b->pool == NULL || b->ptr == NULL || b->head != b->tail)
+        return;
+    bufpool_put(b->pool, b->ptr, b->size);
+    b->ptr = NULL;
+    b->head = NULL;
+    b->tail = NULL;
+    b->size = 0;
+}
+
 void buffer_destroy(buffer_t *b)
 {
-    free(b->ptr);
+    if (b->pool != NULL) {
+        if (b->ptr != NULL)
+            bufpool_put(b->pool, b->ptr, b->size);
+    } else {
+        free(b->ptr);
+    }
+    b->ptr = NULL;
     b->head = NULL;
     b->tail = NULL;
     b->size = 0;
@@ -158,4 +238,5 @@ void buffer_wrap(buffer_t *b, const char *data, size_t size)
     b->head = b->ptr;
     b->tail = b->head + size;
     b->size = 0;
+    b->pool = NULL;
 }
@@ -1,13 +1,17 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+#include <stdarg.h>
 #include <sys/types.h>
 
+struct bufpool;
+
 struct buffer {
     char *ptr;
     char *head;
     char *tail;
     size_t size;
+    struct bufpool *pool;  // NULL unless the memory comes from a pool
 };
 
 typedef struct buffer buffer_t;
@@ -15,6 +19,8 @@ typedef struct buffer buffer_t;
 // Init a buffer to default size
 int buffer_init(buffer_t *);
 int buffer_init_contents(buffer_t *, const char *, size_t);
+// Init an empty buffer whose memory comes from a pool, as it's needed
+int buffer_init_pooled(buffer_t *, struct bufpool *);
 // Create a new buffer at specified size
 buffer_t *create_buffer(size_t size);
 
@@ -45,9 +51,16 @@ int buffer_produced(buffer_t *, size_t);
 // Sets to the new contents, expanding if necessary
 int buffer_set(buffer_t *, const char *data, size_t size);
 
+// Appends formatted text, expanding if necessary
+int buffer_printf(buffer_t *, const char *format, ...);
+int buffer_vprintf(buffer_t *, const char *format, va_list args);
+
 // Copy data from head to the beginning of the buffer
 int buffer_realign(buffer_t *);
 
+// Hands the memory of an empty pooled buffer back to its pool
+void buffer_release(buffer_t *);
+
 // Frees all memory associated with the buffer
 void buffer_destroy(buffer_t *);
 // Delete the buffer object
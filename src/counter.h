@@ -0,0 +1,26 @@
+// Counters that one thread updates while others read them, such as the
+// statistics of a worker that are summed up by another worker. The thread
+// that owns a counter is the only one that may change it, and does so
+// with a relaxed atomic store; anyone can read it with a relaxed atomic
+// load. On common hardware both cost the same as plain accesses. Nothing
+// else is ordered by them, so they're only good for statistics.
+
+#ifndef STATSRELAY_COUNTER_H
+#define STATSRELAY_COUNTER_H
+
+#include <stdint.h>
+
+static inline uint64_t counter_get(const uint64_t *counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline void counter_set(uint64_t *counter, uint64_t value) {
+	__atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+// The owner's own plain read can't race, as nobody else writes
+static inline void counter_add(uint64_t *counter, uint64_t n) {
+	counter_set(counter, *counter + n);
+}
+
+#endif  // STATSRELAY_COUNTER_H
@@ -0,0 +1,107 @@
+#include "egress.h"
+
+#include "log.h"
+
+#include <signal.h>
+#include <string.h>
+
+static void egress_consume(egress_t *egress) {
+	void *record;
+	size_t len;
+
+	while ((record = spsc_ring_peek(&egress->ring, &len)) != NULL) {
+		egress->callback(egress->callback_context, record, len);
+		spsc_ring_consume(&egress->ring);
+	}
+}
+
+static void egress_wakeup(struct ev_loop *loop, ev_async *watcher, int revents) {
+	egress_consume((egress_t *) watcher->data);
+}
+
+static void egress_break(struct ev_loop *loop, ev_async *watcher, int revents) {
+	ev_break(loop, EVBREAK_ALL);
+}
+
+static void *egress_run(void *arg) {
+	egress_t *egress = (egress_t *) arg;
+	ev_run(egress->loop, 0);
+	return NULL;
+}
+
+int egress_init(egress_t *egress,
+		size_t ring_size,
+		egress_callback_t callback,
+		void *ctx) {
+	egress->callback = callback;
+	egress->callback_context = ctx;
+	egress->running = false;
+	if (spsc_ring_init(&egress->ring, ring_size) != 0) {
+		stats_error_log("egress: failed to allocate a %zd byte ring", ring_size);
+		return 1;
+	}
+	egress->loop = ev_loop_new(EVFLAG_AUTO);
+	if (egress->loop == NULL) {
+		stats_error_log("egress: failed to create event loop");
+		spsc_ring_destroy(&egress->ring);
+		return 1;
+	}
+	ev_async_init(&egress->wakeup_watcher, egress_wakeup);
+	egress->wakeup_watcher.data = egress;
+	ev_async_start(egress->loop, &egress->wakeup_watcher);
+	ev_async_init(&egress->stop_watcher, egress_break);
+	ev_async_start(egress->loop, &egress->stop_watcher);
+	return 0;
+}
+
+int egress_start(egress_t *egress) {
+	sigset_t all_signals, orig_signals;
+
+	// Signals are handled by the main thread
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &orig_signals);
+	int err = pthread_create(&egress->thread, NULL, egress_run, egress);
+	pthread_sigmask(SIG_SETMASK, &orig_signals, NULL);
+	if (err != 0) {
+		stats_error_log("egress: failed to start thread: %s", strerror(err));
+		return 1;
+	}
+	egress->running = true;
+	return 0;
+}
+
+void egress_stop(egress_t *egress) {
+	if (egress->running) {
+		ev_async_send(egress->loop, &egress->stop_watcher);
+		pthread_join(egress->thread, NULL);
+		egress->running = false;
+	}
+	spsc_ring_publish(&egress->ring);
+	egress_consume(egress);
+}
+
+void *egress_reserve(egress_t *egress, size_t len) {
+	// Keep the thread busy while a big batch is still being read
+	if (spsc_ring_unpublished(&egress->ring) >= EGRESS_BATCH_BYTES) {
+		egress_publish(egress);
+	}
+	void *record = spsc_ring_reserve(&egress->ring, len);
+	if (record == NULL) {
+		egress_publish(egress);
+	}
+	return record;
+}
+
+void egress_publish(egress_t *egress) {
+	if (spsc_ring_unpublished(&egress->ring) > 0) {
+		spsc_ring_publish(&egress->ring);
+		ev_async_send(egress->loop, &egress->wakeup_watcher);
+	}
+}
+
+void egress_destroy(egress_t *egress) {
+	ev_async_stop(egress->loop, &egress->wakeup_watcher);
+	ev_async_stop(egress->loop, &egress->stop_watcher);
+	ev_loop_destroy(egress->loop);
+	spsc_ring_destroy(&egress->ring);
+}
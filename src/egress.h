@@ -0,0 +1,55 @@
+// An egress is a thread with an event loop of its own, fed records by
+// one other thread through an SPSC ring. The owner of the egress is the
+// only producer. Whatever runs on the egress loop (backend connections,
+// for statsrelay) is only touched by the egress thread while it runs,
+// and by the owner while it's stopped.
+
+#ifndef STATSRELAY_EGRESS_H
+#define STATSRELAY_EGRESS_H
+
+#include "spscring.h"
+
+#include <ev.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define EGRESS_BATCH_BYTES 65536	// published early once this much is reserved
+
+// Called on the egress thread for every record, in order
+typedef void (*egress_callback_t)(void *ctx, void *record, size_t len);
+
+typedef struct egress {
+	struct ev_loop *loop;
+	spsc_ring_t ring;
+	egress_callback_t callback;
+	void *callback_context;
+	ev_async wakeup_watcher;
+	ev_async stop_watcher;
+	pthread_t thread;
+	bool running;
+} egress_t;
+
+// Returns non-zero if the loop or ring can't be allocated
+int egress_init(egress_t *egress,
+		size_t ring_size,
+		egress_callback_t callback,
+		void *ctx);
+
+int egress_start(egress_t *egress);
+
+// Wait for the thread to exit, then pass whatever is still in the ring
+// to the callback on this thread
+void egress_stop(egress_t *egress);
+
+// Room for a record of len bytes, to be filled in before the next
+// egress_publish, or NULL if the ring is full
+void *egress_reserve(egress_t *egress, size_t len);
+
+// Hand the records reserved so far to the thread
+void egress_publish(egress_t *egress);
+
+// The egress must be stopped
+void egress_destroy(egress_t *egress);
+
+#endif  // STATSRELAY_EGRESS_H
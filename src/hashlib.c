@@ -61,3 +61,19 @@ uint32_t stats_hash(const char *key,
 		    uint32_t output_domain) {
 	return murmur3_32(key, keylen, HASHLIB_SEED) % output_domain;
 }
+
+uint32_t stats_hash_raw(const char *key,
+			uint32_t keylen) {
+	return murmur3_32(key, keylen, HASHLIB_SEED);
+}
+
+uint32_t stats_jump_hash(uint64_t hash,
+			 uint32_t num_buckets) {
+	int64_t b = -1, j = 0;
+	while (j < num_buckets) {
+		b = j;
+		hash = hash * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((double) (1LL << 31) / (double) ((hash >> 33) + 1));
+	}
+	return (uint32_t) b;
+}
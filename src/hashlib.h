@@ -8,4 +8,14 @@ uint32_t stats_hash(const char *key,
 		    uint32_t keylen,
 		    uint32_t output_domain);
 
+// the full 32 bit hash of a key
+uint32_t stats_hash_raw(const char *key,
+			uint32_t keylen);
+
+// Jump Consistent Hash (Lamping & Veach): map a hash to a bucket in
+// [0, num_buckets), such that growing from n to n + 1 buckets only
+// moves 1/(n + 1) of the keys, all of them into the new bucket.
+uint32_t stats_jump_hash(uint64_t hash,
+			 uint32_t num_buckets);
+
 #endif  // STATSRELAY_HASHLIB_H
@@ -10,8 +10,43 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Each backend of a ketama ring gets this many points on the
+// continuum, scaled by its share of the total weight.
+#define HASHRING_POINTS_PER_BACKEND 160
+
+// The continuum has an index on the top bits of the hash, with up to
+// 2^16 entries, so that a lookup only has to search a couple of points.
+#define HASHRING_MAX_INDEX_BITS 16
+
+struct hashring_point {
+	uint32_t hash;
+	uint32_t shard;
+};
+
 struct hashring {
 	list_t backends;
+	enum ring_algorithm algorithm;
+
+	// The name (without the weight) and weight of every shard, which
+	// the ketama continuum is built from.
+	list_t names;
+	uint32_t *weights;
+
+	// The ketama continuum, sorted by hash. It's rebuilt on the next
+	// lookup after a backend has been added.
+	bool points_dirty;
+	size_t num_points;
+	uint32_t *point_hashes;
+	uint32_t *point_shards;
+	uint32_t *point_index;
+	int index_shift;
+
+	// Which shards have a backend that is down, allocated when the
+	// first one goes down
+	enum failover_policy failover;
+	bool *down;
+	size_t num_down;
+
 	void *alloc_data;
 	hashring_alloc_func alloc;
 	hashring_dealloc_func dealloc;
@@ -26,12 +61,240 @@ hashring_t hashring_init(void *alloc_data,
 		return NULL;
 	}
 	ring->backends = statsrelay_list_new();
+	ring->names = statsrelay_list_new();
+	if (ring->backends == NULL || ring->names == NULL) {
+		stats_error_log("failure to malloc() in hashring_init");
+		if (ring->backends != NULL) {
+			statsrelay_list_destroy(ring->backends);
+		}
+		if (ring->names != NULL) {
+			statsrelay_list_destroy(ring->names);
+		}
+		free(ring);
+		return NULL;
+	}
+	ring->algorithm = RING_MODULO;
+	ring->weights = NULL;
+	ring->points_dirty = true;
+	ring->num_points = 0;
+	ring->point_hashes = NULL;
+	ring->point_shards = NULL;
+	ring->point_index = NULL;
+	ring->index_shift = 32;
+	ring->failover = FAILOVER_NONE;
+	ring->down = NULL;
+	ring->num_down = 0;
 	ring->alloc_data = alloc_data;
 	ring->alloc = alloc;
 	ring->dealloc = dealloc;
 	return ring;
 }
 
+void hashring_set_algorithm(hashring_t ring, enum ring_algorithm algorithm) {
+	ring->algorithm = algorithm;
+	ring->points_dirty = true;
+}
+
+void hashring_set_failover(hashring_t ring, enum failover_policy policy) {
+	ring->failover = policy;
+}
+
+bool hashring_set_down(hashring_t ring, const void *backend, bool down) {
+	const size_t ring_size = ring->backends->size;
+	if (ring->down == NULL) {
+		if (!down) {
+			return true;
+		}
+		ring->down = calloc(ring_size, sizeof(bool));
+		if (ring->down == NULL) {
+			stats_error_log("hashring: failed to allocate failover state");
+			return false;
+		}
+	}
+	for (size_t i = 0; i < ring_size; i++) {
+		if (ring->backends->data[i] == backend && ring->down[i] != down) {
+			ring->down[i] = down;
+			if (down) {
+				ring->num_down++;
+			} else {
+				ring->num_down--;
+			}
+		}
+	}
+	return true;
+}
+
+// The shard that takes the keys of a shard that is down: the next one
+// that is up, which is always another backend, as all of the shards of
+// a backend go down together. If every shard is down, the keys stay.
+static uint32_t hashring_failover_shard(const struct hashring *ring, uint32_t index) {
+	const size_t ring_size = ring->backends->size;
+	for (size_t i = 1; i < ring_size; i++) {
+		const uint32_t next = (index + i) % ring_size;
+		if (!ring->down[next]) {
+			return next;
+		}
+	}
+	return index;
+}
+
+static int hashring_compare_points(const void *a, const void *b) {
+	const struct hashring_point *pa = a;
+	const struct hashring_point *pb = b;
+	if (pa->hash != pb->hash) {
+		return pa->hash < pb->hash ? -1 : 1;
+	}
+	return pa->shard < pb->shard ? -1 : pa->shard > pb->shard;
+}
+
+static int hashring_compare_names(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Two shards with the same name would get the same points, and ties
+// always go to the first of them, so the other would never be chosen.
+static bool hashring_unique_names(const struct hashring *ring) {
+	const size_t ring_size = ring->backends->size;
+	if (ring_size < 2) {
+		return true;
+	}
+	char **names = malloc(ring_size * sizeof(char *));
+	if (names == NULL) {
+		stats_error_log("hashring: failed to allocate continuum");
+		return false;
+	}
+	memcpy(names, ring->names->data, ring_size * sizeof(char *));
+	qsort(names, ring_size, sizeof(char *), hashring_compare_names);
+	bool unique = true;
+	for (size_t i = 1; i < ring_size; i++) {
+		if (strcmp(names[i - 1], names[i]) == 0) {
+			stats_error_log("hashring: \"%s\" is in the shard_map more than once, "
+					"give it a weight instead with the ketama ring_algorithm",
+					names[i]);
+			unique = false;
+			break;
+		}
+	}
+	free(names);
+	return unique;
+}
+
+// Build the ketama continuum. Point k of a shard is the hash of
+// "<name>-<k>", so a shard's points only depend on its name and its
+// share of the total weight.
+static bool hashring_build_points(struct hashring *ring) {
+	const size_t ring_size = ring->backends->size;
+	uint64_t total_weight = 0;
+	size_t num_points = 0;
+
+	if (!hashring_unique_names(ring)) {
+		return false;
+	}
+	for (size_t i = 0; i < ring_size; i++) {
+		total_weight += ring->weights[i];
+	}
+	size_t *counts = malloc(ring_size * sizeof(size_t));
+	if (counts == NULL) {
+		stats_error_log("hashring: failed to allocate continuum");
+		return false;
+	}
+	for (size_t i = 0; i < ring_size; i++) {
+		double share = (double) ring->weights[i] / (double) total_weight;
+		counts[i] = (size_t) (share * ring_size * HASHRING_POINTS_PER_BACKEND + 0.5);
+		if (counts[i] == 0) {
+			counts[i] = 1;
+		}
+		num_points += counts[i];
+	}
+
+	int index_bits = 1;
+	while (index_bits < HASHRING_MAX_INDEX_BITS && ((size_t) 1 << index_bits) < num_points) {
+		index_bits++;
+	}
+	const size_t index_size = ((size_t) 1 << index_bits) + 1;
+
+	struct hashring_point *points = malloc(num_points * sizeof(struct hashring_point));
+	uint32_t *hashes = malloc(num_points * sizeof(uint32_t));
+	uint32_t *shards = malloc(num_points * sizeof(uint32_t));
+	uint32_t *index = malloc(index_size * sizeof(uint32_t));
+	if (points == NULL || hashes == NULL || shards == NULL || index == NULL) {
+		stats_error_log("hashring: failed to allocate continuum");
+		free(counts);
+		free(points);
+		free(hashes);
+		free(shards);
+		free(index);
+		return false;
+	}
+
+	size_t n = 0;
+	char point_key[512];
+	for (size_t i = 0; i < ring_size; i++) {
+		const char *name = ring->names->data[i];
+		for (size_t k = 0; k < counts[i]; k++) {
+			int len = snprintf(point_key, sizeof(point_key), "%s-%zd", name, k);
+			if (len < 0 || (size_t) len >= sizeof(point_key)) {
+				len = sizeof(point_key) - 1;
+			}
+			points[n].hash = stats_hash_raw(point_key, len);
+			points[n].shard = i;
+			n++;
+		}
+	}
+	qsort(points, num_points, sizeof(struct hashring_point), hashring_compare_points);
+
+	// Hashes and shards are kept apart so that the binary search only
+	// touches the hashes.
+	for (size_t i = 0; i < num_points; i++) {
+		hashes[i] = points[i].hash;
+		shards[i] = points[i].shard;
+	}
+	free(points);
+	free(counts);
+
+	// index[p] is the first point whose hash has a prefix >= p
+	const int shift = 32 - index_bits;
+	size_t next = 0;
+	for (size_t p = 0; p < index_size; p++) {
+		while (next < num_points && (hashes[next] >> shift) < p) {
+			next++;
+		}
+		index[p] = next;
+	}
+
+	free(ring->point_hashes);
+	free(ring->point_shards);
+	free(ring->point_index);
+	ring->point_hashes = hashes;
+	ring->point_shards = shards;
+	ring->point_index = index;
+	ring->index_shift = shift;
+	ring->num_points = num_points;
+	ring->points_dirty = false;
+	return true;
+}
+
+// The first point at or after hash, wrapping around to the start. If
+// no point in the hash's index bucket qualifies, the answer is the
+// first point of the next bucket, which is where the search ends up.
+static uint32_t hashring_ketama_shard(const struct hashring *ring, uint32_t hash) {
+	const uint32_t prefix = hash >> ring->index_shift;
+	size_t lo = ring->point_index[prefix];
+	size_t hi = ring->point_index[prefix + 1];
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (ring->point_hashes[mid] < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == ring->num_points) {
+		lo = 0;
+	}
+	return ring->point_shards[lo];
+}
+
 hashring_t hashring_load_from_config(struct proto_config *pc,
 				     void *alloc_data,
 				     hashring_alloc_func alloc_func,
@@ -41,38 +304,100 @@ hashring_t hashring_load_from_config(struct proto_config *pc,
 		stats_error_log("failed to hashring_init");
 		return NULL;
 	}
+	hashring_set_algorithm(ring, pc->ring_algorithm);
+	hashring_set_failover(ring, pc->failover);
 	for (size_t i = 0; i < pc->ring->size; i++) {
 		if (!hashring_add(ring, pc->ring->data[i])) {
 			hashring_dealloc(ring);
 			return NULL;
 		}
 	}
+	if (ring->algorithm == RING_KETAMA && !hashring_build_points(ring)) {
+		hashring_dealloc(ring);
+		return NULL;
+	}
 	return ring;
 }
 
 bool hashring_add(hashring_t ring, const char *line) {
+	char *name = NULL;
+	void *obj = NULL;
+	unsigned long weight = 1;
+
 	if (line == NULL) {
 		stats_error_log("cowardly refusing to alloc NULL pointer");
 		goto add_err;
 	}
+
+	// An entry may be followed by a weight, like the lines of a
+	// ketama.servers file: "10.0.1.1:8125 600"
+	const size_t name_len = strcspn(line, " \t");
+	const char *weight_str = line + name_len + strspn(line + name_len, " \t");
+	if (*weight_str != '\0') {
+		char *end;
+		weight = strtoul(weight_str, &end, 10);
+		end += strspn(end, " \t");
+		if (end == weight_str || *end != '\0' || weight == 0 || weight > UINT32_MAX) {
+			stats_error_log("hashring: invalid weight in \"%s\"", line);
+			goto add_err;
+		}
+		if (ring->algorithm != RING_KETAMA) {
+			stats_error_log("hashring: weights can only be used with the ketama ring_algorithm: \"%s\"", line);
+			goto add_err;
+		}
+	}
+	name = strndup(line, name_len);
+	if (name == NULL) {
+		stats_error_log("hashring: failed to copy \"%s\"", line);
+		goto add_err;
+	}
+	uint32_t *weights = realloc(ring->weights, (ring->backends->size + 1) * sizeof(uint32_t));
+	if (weights == NULL) {
+		stats_error_log("hashring: failed to expand weights");
+		goto add_err;
+	}
+	ring->weights = weights;
+	if (ring->down != NULL) {
+		bool *down = realloc(ring->down, (ring->backends->size + 1) * sizeof(bool));
+		if (down == NULL) {
+			stats_error_log("hashring: failed to expand failover state");
+			goto add_err;
+		}
+		down[ring->backends->size] = false;
+		ring->down = down;
+	}
+
 	// allocate an object
-	void *obj = ring->alloc(line, ring->alloc_data);
+	obj = ring->alloc(name, ring->alloc_data);
 	if (obj == NULL) {
 		stats_error_log("hashring: failed to alloc line \"%s\"", line);
 		goto add_err;
 	}
 
-	// grow the list
+	// grow the lists
+	if (statsrelay_list_expand(ring->names) == NULL) {
+		ring->names->size--;
+		stats_error_log("hashring: failed to expand list");
+		goto add_err;
+	}
 	if (statsrelay_list_expand(ring->backends) == NULL) {
+		ring->backends->size--;
+		ring->names->size--;
 		stats_error_log("hashring: failed to expand list");
-		ring->dealloc(obj);
 		goto add_err;
 	}
 
+	ring->names->data[ring->names->size - 1] = name;
+	ring->weights[ring->backends->size - 1] = weight;
 	ring->backends->data[ring->backends->size - 1] = obj;
+	ring->points_dirty = true;
 	return true;
 
 add_err:
+	if (obj != NULL && ring->dealloc != NULL) {
+		ring->dealloc(obj);
+	}
+	free(name);
 	return false;
 }
 
@@ -83,9 +408,23 @@ size_t hashring_size(hashring_t ring) {
 	return ring->backends->size;
 }
 
+void *hashring_get(hashring_t ring, size_t index) {
+	if (ring == NULL || index >= ring->backends->size) {
+		return NULL;
+	}
+	return ring->backends->data[index];
+}
+
 void* hashring_choose(struct hashring *ring,
 		      const char *key,
 		      uint32_t *shard_num) {
+	return hashring_choose_len(ring, key, strlen(key), shard_num);
+}
+
+void* hashring_choose_len(struct hashring *ring,
+			  const char *key,
+			  size_t key_len,
+			  uint32_t *shard_num) {
 	if (ring == NULL || ring->backends == NULL) {
 		return NULL;
 	}
@@ -93,7 +432,24 @@ void* hashring_choose(struct hashring *ring,
 	if (ring_size == 0) {
 		return NULL;
 	}
-	const uint32_t index = stats_hash(key, strlen(key), ring_size);
+	const uint32_t hash = stats_hash_raw(key, key_len);
+	uint32_t index;
+	if (ring->algorithm == RING_KETAMA) {
+		if (ring->points_dirty && !hashring_build_points(ring)) {
+			return NULL;
+		}
+		index = hashring_ketama_shard(ring, hash);
+	} else if (ring->algorithm == RING_JUMP) {
+		index = stats_jump_hash(hash, ring_size);
+	} else if ((ring_size & (ring_size - 1)) == 0) {
+		// same as the modulo, without the division
+		index = hash & (ring_size - 1);
+	} else {
+		index = hash % ring_size;
+	}
+	if (ring->num_down > 0 && ring->down[index] && ring->failover == FAILOVER_NEXT) {
+		index = hashring_failover_shard(ring, index);
+	}
 	if (shard_num != NULL) {
 		*shard_num = index;
 	}
@@ -107,7 +463,7 @@ void hashring_dealloc(struct hashring *ring) {
 	if (ring->backends == NULL) {
 		return;
 	}
-	const size_t ring_size = ring->backends->size;
+	const size_t ring_size = ring->dealloc != NULL ? ring->backends->size : 0;
 	for (size_t i = 0; i < ring_size; i++) {
 		bool need_dealloc = true;
 		for (size_t j = 0; j < i; j++) {
@@ -121,5 +477,11 @@ void hashring_dealloc(struct hashring *ring) {
 		}
 	}
 	statsrelay_list_destroy(ring->backends);
+	statsrelay_list_destroy_full(ring->names);
+	free(ring->weights);
+	free(ring->point_hashes);
+	free(ring->point_shards);
+	free(ring->point_index);
+	free(ring->down);
 	free(ring);
 }
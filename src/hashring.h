@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "./yaml_config.h"
 
@@ -13,12 +14,26 @@ typedef void (*hashring_dealloc_func)(void *);
 struct hashring;
 typedef struct hashring* hashring_t;
 
-// Initialize the hashring with the list of backends.
+// Initialize the hashring with the list of backends. dealloc_func may
+// be NULL if the caller keeps track of (and frees) the backends itself.
 hashring_t hashring_init(void *alloc_data,
 			 hashring_alloc_func alloc_func,
 			 hashring_dealloc_func dealloc_func);
 
 
+// Choose how keys are mapped to shards (RING_MODULO by default)
+void hashring_set_algorithm(hashring_t ring, enum ring_algorithm algorithm);
+
+// Choose what happens to the shards of a backend that is down
+// (FAILOVER_NONE by default)
+void hashring_set_failover(hashring_t ring, enum failover_policy policy);
+
+// Mark every shard of a backend as down, or as up again. With
+// FAILOVER_NEXT, the keys of a shard that is down go to the next shard
+// in the shard map (wrapping around) whose backend is up, until it's
+// marked up again. Returns false if that couldn't be set up.
+bool hashring_set_down(hashring_t ring, const void *backend, bool down);
+
 hashring_t hashring_load_from_config(struct proto_config *pc,
 				     void *alloc_data,
 				     hashring_alloc_func alloc_func,
@@ -31,12 +46,22 @@ bool hashring_add(hashring_t ring, const char *line);
 // The size of the hashring
 size_t hashring_size(hashring_t ring);
 
+// The backend for shard number index
+void *hashring_get(hashring_t ring, size_t index);
+
 // Choose a backend; if shard_num is not NULL, the shard number that
-// was used will be placed into the return value.
+// was used (after any failover) will be placed into the return value.
 void *hashring_choose(hashring_t ring,
 		      const char *key,
 		      uint32_t *shard_num);
 
+// Like hashring_choose, but the key is given as a pointer and a length
+// and doesn't need to be NUL terminated.
+void *hashring_choose_len(hashring_t ring,
+			  const char *key,
+			  size_t key_len,
+			  uint32_t *shard_num);
+
 // Release allocated memory
 void hashring_dealloc(hashring_t ring);
 
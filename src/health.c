@@ -0,0 +1,185 @@
+#include "health.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static void health_probe_resolved(struct ev_loop *loop, ev_async *watcher, int revents);
+static void health_probe_connected(struct ev_loop *loop, ev_io *watcher, int revents);
+static void health_probe_timeout(struct ev_loop *loop, ev_timer *watcher, int revents);
+
+void health_init(health_t *health,
+		 struct ev_loop *loop,
+		 const char *host,
+		 const char *port) {
+	health_probe_t *probe = &health->probe;
+
+	health->down = false;
+	health->probe_failures = 0;
+	health->healthy_checks = 0;
+	health->last_queued = 0;
+	health->last_sent = 0;
+
+	probe->loop = loop;
+	probe->host = host;
+	probe->port = port;
+	probe->request = NULL;
+	probe->sd = -1;
+	probe->running = false;
+	probe->result = PROBE_NONE;
+	ev_async_init(&probe->resolve_watcher, health_probe_resolved);
+	probe->resolve_watcher.data = probe;
+	ev_init(&probe->connect_watcher, health_probe_connected);
+	probe->connect_watcher.data = probe;
+	ev_init(&probe->timeout_watcher, health_probe_timeout);
+	probe->timeout_watcher.data = probe;
+}
+
+bool health_check(health_t *health,
+		  const struct proto_config *config,
+		  unsigned int failures,
+		  uint64_t queued,
+		  uint64_t sent) {
+	health_probe_t *probe = &health->probe;
+	if (probe->result == PROBE_FAILED) {
+		health->probe_failures++;
+	} else if (probe->result == PROBE_OK) {
+		health->probe_failures = 0;
+	}
+	probe->result = PROBE_NONE;
+
+	// A long queue is fine as long as the backend keeps up with more
+	// than half of what comes in, so that the queue grows slower than
+	// it's sent. Once down, the queue has to get well under the limit,
+	// so that the backend doesn't go back and forth around it.
+	bool healthy = failures < config->health_max_failures &&
+		health->probe_failures < config->health_max_failures;
+	if (health->down) {
+		healthy = healthy && queued < config->health_max_queue / 2;
+	} else if (queued >= config->health_max_queue && queued > health->last_queued) {
+		healthy = healthy && queued - health->last_queued < sent - health->last_sent;
+	}
+	health->last_queued = queued;
+	health->last_sent = sent;
+
+	if (!health->down && !healthy) {
+		health->down = true;
+		health->healthy_checks = 0;
+		return true;
+	}
+	if (health->down) {
+		health->healthy_checks = healthy ? health->healthy_checks + 1 : 0;
+		if (health->healthy_checks >= HEALTH_RECOVER_CHECKS) {
+			health->down = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void health_probe_finish(health_probe_t *probe, bool ok) {
+	ev_io_stop(probe->loop, &probe->connect_watcher);
+	ev_timer_stop(probe->loop, &probe->timeout_watcher);
+	ev_async_stop(probe->loop, &probe->resolve_watcher);
+	if (probe->request != NULL) {
+		resolver_cancel(probe->request);
+		probe->request = NULL;
+	}
+	if (probe->sd >= 0) {
+		close(probe->sd);
+		probe->sd = -1;
+	}
+	probe->running = false;
+	probe->result = ok ? PROBE_OK : PROBE_FAILED;
+}
+
+static void health_probe_resolved(struct ev_loop *loop, ev_async *watcher, int revents) {
+	health_probe_t *probe = (health_probe_t *) watcher->data;
+	struct addrinfo *addr;
+	int error;
+
+	if (probe->request == NULL || !resolver_finish(probe->request, &addr, &error)) {
+		return;
+	}
+	probe->request = NULL;
+	if (error != 0) {
+		stats_debug_log("health: failed to resolve %s: %s", probe->host, gai_strerror(error));
+		health_probe_finish(probe, false);
+		return;
+	}
+
+	probe->sd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (probe->sd < 0 ||
+	    fcntl(probe->sd, F_SETFL, fcntl(probe->sd, F_GETFL) | O_NONBLOCK) != 0) {
+		stats_error_log("health: failed to create a probe socket: %s", strerror(errno));
+		resolver_free_addr(addr);
+		health_probe_finish(probe, false);
+		return;
+	}
+	const int ret = connect(probe->sd, addr->ai_addr, addr->ai_addrlen);
+	resolver_free_addr(addr);
+	if (ret == 0) {
+		health_probe_finish(probe, true);
+	} else if (errno == EINPROGRESS) {
+		ev_io_set(&probe->connect_watcher, probe->sd, EV_WRITE);
+		ev_io_start(loop, &probe->connect_watcher);
+	} else {
+		stats_debug_log("health: probe of %s:%s failed: %s",
+				probe->host, probe->port, strerror(errno));
+		health_probe_finish(probe, false);
+	}
+}
+
+static void health_probe_connected(struct ev_loop *loop, ev_io *watcher, int revents) {
+	health_probe_t *probe = (health_probe_t *) watcher->data;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(probe->sd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+		err = errno;
+	}
+	if (err != 0) {
+		stats_debug_log("health: probe of %s:%s failed: %s",
+				probe->host, probe->port, strerror(err));
+	}
+	health_probe_finish(probe, err == 0);
+}
+
+static void health_probe_timeout(struct ev_loop *loop, ev_timer *watcher, int revents) {
+	health_probe_t *probe = (health_probe_t *) watcher->data;
+	stats_debug_log("health: probe of %s:%s timed out", probe->host, probe->port);
+	health_probe_finish(probe, false);
+}
+
+void health_probe_start(health_t *health, double timeout, unsigned int dns_cache_ttl) {
+	health_probe_t *probe = &health->probe;
+	if (probe->running) {
+		health_probe_finish(probe, false);
+		return;
+	}
+	ev_async_start(probe->loop, &probe->resolve_watcher);
+	probe->request = resolver_submit(probe->loop,
+					 &probe->resolve_watcher,
+					 probe->host,
+					 probe->port,
+					 SOCK_STREAM,
+					 dns_cache_ttl);
+	if (probe->request == NULL) {
+		stats_error_log("health: failed to allocate a probe of %s", probe->host);
+		health_probe_finish(probe, false);
+		return;
+	}
+	probe->running = true;
+	ev_timer_set(&probe->timeout_watcher, timeout, 0);
+	ev_timer_start(probe->loop, &probe->timeout_watcher);
+}
+
+void health_destroy(health_t *health) {
+	if (health->probe.running) {
+		health_probe_finish(&health->probe, false);
+	}
+}
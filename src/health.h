@@ -0,0 +1,72 @@
+// Decides whether a backend is down, so that its shards can be failed
+// over to another backend, and when it's back up. A backend is down once
+// its connections fail health_max_failures times in a row, once its
+// queue is over health_max_queue and grows faster than it's sent, or, with
+// health_probe, once that many probe connections in a row have failed.
+// It's up again after HEALTH_RECOVER_CHECKS checks in a row without any
+// of that, with its queue under half of health_max_queue.
+
+#ifndef STATSRELAY_HEALTH_H
+#define STATSRELAY_HEALTH_H
+
+#include "resolver.h"
+#include "yaml_config.h"
+
+#include <ev.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HEALTH_RECOVER_CHECKS 2
+
+enum health_probe_result {
+	PROBE_NONE = 0,		// no probe has finished since the last check
+	PROBE_OK,
+	PROBE_FAILED
+};
+
+// Opens a TCP connection to a backend, and closes it as soon as it's
+// established, without sending anything
+typedef struct {
+	struct ev_loop *loop;
+	const char *host;
+	const char *port;
+	resolver_request_t *request;
+	ev_async resolve_watcher;
+	ev_io connect_watcher;
+	ev_timer timeout_watcher;
+	int sd;
+	bool running;
+	enum health_probe_result result;
+} health_probe_t;
+
+typedef struct {
+	bool down;
+	unsigned int probe_failures;	// in a row
+	unsigned int healthy_checks;	// in a row, while down
+	uint64_t last_queued;
+	uint64_t last_sent;
+	health_probe_t probe;
+} health_t;
+
+// host and port must outlive the health state
+void health_init(health_t *health,
+		 struct ev_loop *loop,
+		 const char *host,
+		 const char *port);
+
+// Judge a backend from its connect failures in a row, the bytes queued
+// for it and the bytes sent to it so far, and the last probe. Returns
+// true if the backend went down or came back up.
+bool health_check(health_t *health,
+		  const struct proto_config *config,
+		  unsigned int failures,
+		  uint64_t queued,
+		  uint64_t sent);
+
+// Start a probe, which has until timeout seconds to connect. A probe
+// that is still running from the last check counts as a failure.
+void health_probe_start(health_t *health, double timeout, unsigned int dns_cache_ttl);
+
+void health_destroy(health_t *health);
+
+#endif  // STATSRELAY_HEALTH_H
@@ -0,0 +1,82 @@
+#include "histogram.h"
+
+#include "counter.h"
+
+#include <string.h>
+#include <time.h>
+
+void histogram_init(histogram_t *histogram) {
+	memset(histogram, 0, sizeof(histogram_t));
+}
+
+static unsigned int histogram_index(uint64_t value) {
+	if (value >= (UINT64_C(1) << HISTOGRAM_MAX_BITS)) {
+		value = (UINT64_C(1) << HISTOGRAM_MAX_BITS) - 1;
+	}
+	if (value < HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+#ifdef __GNUC__
+	const unsigned int msb = 63 - __builtin_clzll(value);
+#else
+	unsigned int msb = HISTOGRAM_SUB_BITS;
+	while (value >> (msb + 1)) {
+		msb++;
+	}
+#endif
+	const unsigned int shift = msb - HISTOGRAM_SUB_BITS;
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+// The largest value that lands in a bucket
+static uint64_t histogram_bucket_max(unsigned int index) {
+	if (index < HISTOGRAM_SUB_BUCKETS) {
+		return index;
+	}
+	const unsigned int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+	const uint64_t sub = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+	return ((sub + 1) << shift) - 1;
+}
+
+void histogram_record(histogram_t *histogram, uint64_t value) {
+	counter_add(&histogram->buckets[histogram_index(value)], 1);
+	counter_add(&histogram->count, 1);
+	counter_add(&histogram->sum, value);
+}
+
+void histogram_merge(histogram_t *dst, const histogram_t *src) {
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		dst->buckets[i] += counter_get(&src->buckets[i]);
+	}
+	dst->count += counter_get(&src->count);
+	dst->sum += counter_get(&src->sum);
+}
+
+uint64_t histogram_percentile(const histogram_t *histogram, double fraction) {
+	uint64_t total = 0;
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		total += histogram->buckets[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	// The rank of the value we're after, counting from 1
+	uint64_t rank = (uint64_t) (fraction * total);
+	if (rank < fraction * total || rank == 0) {
+		rank++;
+	}
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= rank) {
+			return histogram_bucket_max(i);
+		}
+	}
+	return histogram_bucket_max(HISTOGRAM_BUCKETS - 1);
+}
+
+uint64_t histogram_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
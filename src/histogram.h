@@ -0,0 +1,40 @@
+// Fixed size latency histograms in the style of HdrHistogram: every
+// power of two is split into HISTOGRAM_SUB_BUCKETS linear buckets, so
+// any recorded value is known to within about 6%, from a nanosecond up
+// to about 18 minutes, in under 5KB and without any allocation. The
+// buckets are counters (see counter.h), so one thread can record values
+// while others merge the histogram into their own.
+
+#ifndef STATSRELAY_HISTOGRAM_H
+#define STATSRELAY_HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40	// larger values are clamped
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram {
+	uint64_t count;
+	uint64_t sum;		// of every value recorded
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+void histogram_init(histogram_t *histogram);
+
+void histogram_record(histogram_t *histogram, uint64_t value);
+
+// Add every value recorded in src to dst. src may be recorded to by
+// another thread meanwhile.
+void histogram_merge(histogram_t *dst, const histogram_t *src);
+
+// The value below which the given fraction (0.5, 0.99, ...) of the
+// recorded values fall, rounded up to the top of its bucket; 0 if
+// nothing was recorded.
+uint64_t histogram_percentile(const histogram_t *histogram, double fraction);
+
+// Monotonic time in nanoseconds, for timing what goes in a histogram
+uint64_t histogram_now(void);
+
+#endif  // STATSRELAY_HISTOGRAM_H
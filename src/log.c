@@ -1,5 +1,6 @@
 #include "log.h"
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +13,10 @@ static enum statsrelay_log_level g_level;
 static int fmt_buf_size = 0;
 static char *fmt_buf = NULL;
 
+// The format buffer is shared, so with multiple worker threads log
+// calls have to be serialized.
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void stats_log_verbose(bool verbose) {
 	g_verbose = verbose;
 }
@@ -20,9 +25,10 @@ void stats_set_log_level(enum statsrelay_log_level level) {
 	g_level = level;
 }
 
-void stats_vlog(const char *prefix,
-		const char *format,
-		va_list ap) {
+static void stats_vlog_locked(const char *prefix,
+			      bool verbose,
+			      const char *format,
+			      va_list ap) {
 	int fmt_len;
 	char *np;
 	size_t total_written, bw;
@@ -37,7 +43,10 @@ void stats_vlog(const char *prefix,
 	// Keep trying to vsnprintf until we have a sufficiently sized buffer
 	// allocated.
 	while (1) {
-		fmt_len = vsnprintf(fmt_buf, fmt_buf_size, format, ap);
+		va_list ap_copy;
+		va_copy(ap_copy, ap);
+		fmt_len = vsnprintf(fmt_buf, fmt_buf_size, format, ap_copy);
+		va_end(ap_copy);
 
 		if (fmt_len < 0) {
 			return;  // output error (shouldn't happen for vs* functions)
@@ -53,7 +62,7 @@ void stats_vlog(const char *prefix,
 		fmt_buf = np;
 	}
 
-	if (g_verbose == 1) {
+	if (verbose) {
 		if (prefix != NULL) {
 			fprintf(stderr, prefix);
 		}
@@ -85,10 +94,21 @@ void stats_vlog(const char *prefix,
 	return;
 
 alloc_failure:
-	stats_log_end();  // reset everything
+	// reset everything
+	free(fmt_buf);
+	fmt_buf = NULL;
+	fmt_buf_size = 0;
 	return;
 }
 
+void stats_vlog(const char *prefix,
+		const char *format,
+		va_list ap) {
+	pthread_mutex_lock(&log_lock);
+	stats_vlog_locked(prefix, g_verbose, format, ap);
+	pthread_mutex_unlock(&log_lock);
+}
+
 void stats_debug_log(const char *format, ...) {
 	if (g_level <= STATSRELAY_LOG_DEBUG) {
 		va_list args;
@@ -109,18 +129,19 @@ void stats_log(const char *format, ...) {
 
 void stats_error_log(const char *format, ...) {
 	if (g_level <= STATSRELAY_LOG_ERROR) {
-		bool orig_verbose = g_verbose;
-		g_verbose = true;
 		va_list args;
 		va_start(args, format);
-		stats_vlog("ERROR: ", format, args);
+		pthread_mutex_lock(&log_lock);
+		stats_vlog_locked("ERROR: ", true, format, args);
+		pthread_mutex_unlock(&log_lock);
 		va_end(args);
-		g_verbose = orig_verbose;
 	}
 }
 
 void stats_log_end(void) {
+	pthread_mutex_lock(&log_lock);
 	free(fmt_buf);
 	fmt_buf = NULL;
 	fmt_buf_size = 0;
+	pthread_mutex_unlock(&log_lock);
 }
@@ -1,5 +1,6 @@
 #include "config.h"
 #include "protocol.h"
+#include "resolver.h"
 #include "tcpserver.h"
 #include "udpserver.h"
 #include "server.h"
@@ -35,11 +36,20 @@ static void graceful_shutdown(struct ev_loop *loop, ev_signal *w, int revents) {
 	ev_break(loop, EVBREAK_ALL);
 }
 
+static struct config *load_config(const char *filename);
+
 static void reload_config(struct ev_loop *loop, ev_signal *w, int revents) {
 	stats_log("Received SIGHUP, reloading.");
-	if (server != NULL) {
-		stats_server_reload(server);
+	struct config *cfg = load_config(servers.config_file);
+	if (cfg == NULL) {
+		stats_error_log("failed to parse config, keeping the current one");
+		return;
+	}
+	if (!reload_server_collection(&servers, cfg)) {
+		destroy_config(cfg);
+		return;
 	}
+	stats_log("Reloaded %s", servers.config_file);
 }
 
 static char* to_lower(const char *input) {
@@ -146,6 +156,7 @@ int main(int argc, char **argv) {
 		goto success;
 	}
 	bool worked = connect_server_collection(&servers, cfg);
+	cfg = NULL;  // owned by servers now
 	if (!worked) {
 		goto err;
 	}
@@ -166,12 +177,14 @@ int main(int argc, char **argv) {
 success:
 	destroy_server_collection(&servers);
 	destroy_config(cfg);
+	resolver_shutdown();
 	stats_log_end();
 	return 0;
 
 err:
 	destroy_server_collection(&servers);
 	destroy_config(cfg);
+	resolver_shutdown();
 	stats_log_end();
 	return 1;
 }
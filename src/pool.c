@@ -0,0 +1,109 @@
+#include "pool.h"
+
+#include "counter.h"
+
+#include <stdlib.h>
+
+struct pool_object {
+	struct pool_object *next;
+};
+
+void pool_init(pool_t *pool, size_t object_size, size_t max_free) {
+	pool->object_size = object_size;
+	pool->free_list = NULL;
+	pool->num_free = 0;
+	pool->max_free = max_free;
+	pool->hits = 0;
+	pool->misses = 0;
+}
+
+void *pool_get(pool_t *pool) {
+	struct pool_object *object = pool->free_list;
+	if (object != NULL) {
+		pool->free_list = object->next;
+		pool->num_free--;
+		counter_add(&pool->hits, 1);
+		return object;
+	}
+	counter_add(&pool->misses, 1);
+	return malloc(pool->object_size);
+}
+
+void pool_put(pool_t *pool, void *object) {
+	if (pool->num_free >= pool->max_free) {
+		free(object);
+		return;
+	}
+	((struct pool_object *) object)->next = pool->free_list;
+	pool->free_list = object;
+	pool->num_free++;
+}
+
+void pool_destroy(pool_t *pool) {
+	struct pool_object *object, *next;
+	for (object = pool->free_list; object != NULL; object = next) {
+		next = object->next;
+		free(object);
+	}
+	pool->free_list = NULL;
+	pool->num_free = 0;
+}
+
+void bufpool_init(bufpool_t *pool) {
+	for (int i = 0; i < BUFPOOL_CLASSES; i++) {
+		const size_t size = (size_t) BUFPOOL_MIN_SIZE << i;
+		pool_init(&pool->classes[i], size, BUFPOOL_MAX_FREE / size);
+	}
+	pool->misses = 0;
+}
+
+// The free list for buffers of exactly size bytes, or NULL if there is
+// none
+static pool_t *bufpool_class(bufpool_t *pool, size_t size) {
+	for (int i = 0; i < BUFPOOL_CLASSES; i++) {
+		if (pool->classes[i].object_size == size) {
+			return &pool->classes[i];
+		}
+	}
+	return NULL;
+}
+
+void *bufpool_get(bufpool_t *pool, size_t size) {
+	pool_t *class = bufpool_class(pool, size);
+	if (class == NULL) {
+		counter_add(&pool->misses, 1);
+		return malloc(size);
+	}
+	return pool_get(class);
+}
+
+void bufpool_put(bufpool_t *pool, void *buf, size_t size) {
+	pool_t *class = bufpool_class(pool, size);
+	if (class == NULL) {
+		free(buf);
+		return;
+	}
+	pool_put(class, buf);
+}
+
+uint64_t bufpool_hits(const bufpool_t *pool) {
+	uint64_t hits = 0;
+	for (int i = 0; i < BUFPOOL_CLASSES; i++) {
+		hits += counter_get(&pool->classes[i].hits);
+	}
+	return hits;
+}
+
+uint64_t bufpool_misses(const bufpool_t *pool) {
+	uint64_t misses = counter_get(&pool->misses);
+	for (int i = 0; i < BUFPOOL_CLASSES; i++) {
+		misses += counter_get(&pool->classes[i].misses);
+	}
+	return misses;
+}
+
+void bufpool_destroy(bufpool_t *pool) {
+	for (int i = 0; i < BUFPOOL_CLASSES; i++) {
+		pool_destroy(&pool->classes[i]);
+	}
+}
@@ -0,0 +1,58 @@
+// Free lists of fixed size objects, so that the objects that come and go
+// with client connections are reused rather than handed back to the
+// allocator. A buffer pool keeps one such free list for every power of
+// two from BUFPOOL_MIN_SIZE to BUFPOOL_MAX_SIZE; bigger buffers come
+// straight from the allocator. Pools are not thread safe, every worker
+// has pools of its own.
+
+#ifndef STATSRELAY_POOL_H
+#define STATSRELAY_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUFPOOL_MIN_SIZE 4096
+#define BUFPOOL_CLASSES 5		// 4KB to 64KB
+#define BUFPOOL_MAX_SIZE (BUFPOOL_MIN_SIZE << (BUFPOOL_CLASSES - 1))
+#define BUFPOOL_MAX_FREE 1048576	// idle bytes kept for each size
+
+typedef struct pool {
+	size_t object_size;
+	void *free_list;	// linked through the first word of each object
+	size_t num_free;
+	size_t max_free;
+	uint64_t hits;		// objects reused from the free list
+	uint64_t misses;	// objects that had to be allocated
+} pool_t;
+
+typedef struct bufpool {
+	pool_t classes[BUFPOOL_CLASSES];
+	uint64_t misses;	// buffers too big to be pooled
+} bufpool_t;
+
+// Keep at most max_free idle objects around, anything beyond that is
+// freed. Objects must be at least as big as a pointer.
+void pool_init(pool_t *pool, size_t object_size, size_t max_free);
+
+// Returns NULL if memory ran out
+void *pool_get(pool_t *pool);
+
+void pool_put(pool_t *pool, void *object);
+
+void pool_destroy(pool_t *pool);
+
+void bufpool_init(bufpool_t *pool);
+
+// Returns a buffer of size bytes, or NULL if memory ran out
+void *bufpool_get(bufpool_t *pool, size_t size);
+
+// size must be what the buffer was got with
+void bufpool_put(bufpool_t *pool, void *buf, size_t size);
+
+uint64_t bufpool_hits(const bufpool_t *pool);
+
+uint64_t bufpool_misses(const bufpool_t *pool);
+
+void bufpool_destroy(bufpool_t *pool);
+
+#endif  // STATSRELAY_POOL_H
@@ -20,3 +20,7 @@ size_t protocol_parser_carbon(const char *instr, size_t inlen) {
 size_t protocol_parser_statsd(const char *instr, size_t inlen) {
 	return simple_parse(instr, inlen, ':');
 }
+
+char protocol_key_delimiter(protocol_parser_t parser) {
+	return parser == protocol_parser_carbon ? ' ' : ':';
+}
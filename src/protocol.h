@@ -24,4 +24,7 @@ typedef size_t (*protocol_parser_t)(const char *, size_t);
 size_t protocol_parser_carbon(const char *, size_t);
 size_t protocol_parser_statsd(const char *, size_t);
 
+// The character that ends the key, as looked for by a parser
+char protocol_key_delimiter(protocol_parser_t parser);
+
 #endif  // STATSRELAY_PROTOCOL_H
@@ -0,0 +1,462 @@
+#include "report.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+
+enum report_type {
+	REPORT_COUNTER,		// only ever goes up
+	REPORT_GAUGE,
+	REPORT_TIMESTAMP,	// seconds since the epoch
+	REPORT_BOOLEAN
+};
+
+struct report_value {
+	const char *name;
+	enum report_type type;
+	const char *help;
+	size_t offset;
+};
+
+struct report_latency {
+	const char *name;
+	const char *help;
+	size_t offset;
+};
+
+static const struct report_value report_globals[] = {
+	{"bytes_recv_udp", REPORT_COUNTER, "Bytes received over UDP.",
+	 offsetof(stats_snapshot_t, bytes_recv_udp)},
+	{"bytes_recv_tcp", REPORT_COUNTER, "Bytes received over TCP.",
+	 offsetof(stats_snapshot_t, bytes_recv_tcp)},
+	{"udp_wakeups", REPORT_COUNTER, "Times the UDP listeners woke up to read.",
+	 offsetof(stats_snapshot_t, udp_wakeups)},
+	{"udp_datagrams", REPORT_COUNTER, "Datagrams received over UDP.",
+	 offsetof(stats_snapshot_t, udp_datagrams)},
+	{"udp_full_batches", REPORT_COUNTER, "UDP reads that filled a whole batch.",
+	 offsetof(stats_snapshot_t, udp_full_batches)},
+	{"total_connections", REPORT_COUNTER, "TCP connections accepted.",
+	 offsetof(stats_snapshot_t, total_connections)},
+	{"listen_overflows", REPORT_COUNTER, "Connections the kernel dropped for a full accept queue.",
+	 offsetof(stats_snapshot_t, listen_overflows)},
+	{"listen_drops", REPORT_COUNTER, "Connections the kernel dropped before they were accepted.",
+	 offsetof(stats_snapshot_t, listen_drops)},
+	{"last_reload", REPORT_TIMESTAMP, "When the config was last reloaded.",
+	 offsetof(stats_snapshot_t, last_reload)},
+	{"malformed_lines", REPORT_COUNTER, "Lines that failed validation.",
+	 offsetof(stats_snapshot_t, malformed_lines)},
+	{"aggregated_lines", REPORT_COUNTER, "Lines folded into aggregates.",
+	 offsetof(stats_snapshot_t, aggregated_lines)},
+	{"aggregate_lines_out", REPORT_COUNTER, "Lines sent for aggregates.",
+	 offsetof(stats_snapshot_t, aggregate_lines_out)},
+	{"backpressure_pauses", REPORT_COUNTER, "Times a TCP client was paused for a full backend.",
+	 offsetof(stats_snapshot_t, backpressure_pauses)},
+	{"paused_connections", REPORT_GAUGE, "TCP clients paused for a full backend.",
+	 offsetof(stats_snapshot_t, paused_connections)},
+	{"session_pool_hits", REPORT_COUNTER, "Client sessions reused from the pool.",
+	 offsetof(stats_snapshot_t, session_pool_hits)},
+	{"session_pool_misses", REPORT_COUNTER, "Client sessions that had to be allocated.",
+	 offsetof(stats_snapshot_t, session_pool_misses)},
+	{"buffer_pool_hits", REPORT_COUNTER, "Receive buffers reused from the pool.",
+	 offsetof(stats_snapshot_t, buffer_pool_hits)},
+	{"buffer_pool_misses", REPORT_COUNTER, "Receive buffers that had to be allocated.",
+	 offsetof(stats_snapshot_t, buffer_pool_misses)},
+};
+
+static const struct report_latency report_global_latencies[] = {
+	{"recv_to_enqueue", "Time from reading a line to queueing it for a backend.",
+	 offsetof(stats_snapshot_t, recv_to_enqueue)},
+	{"validate", "Time spent validating a line.",
+	 offsetof(stats_snapshot_t, validate_time)},
+	{"hash", "Time spent choosing a line's shard.",
+	 offsetof(stats_snapshot_t, hash_time)},
+	{"enqueue", "Time spent copying a line into a send queue.",
+	 offsetof(stats_snapshot_t, enqueue_time)},
+	{"loop_iteration", "Time each pass of the event loop spends working.",
+	 offsetof(stats_snapshot_t, loop_iteration)},
+};
+
+static const struct report_value report_backend_values[] = {
+	{"bytes_queued", REPORT_COUNTER, "Bytes queued for the backend.",
+	 offsetof(struct stats_backend_snapshot, bytes_queued)},
+	{"bytes_sent", REPORT_COUNTER, "Bytes sent to the backend.",
+	 offsetof(struct stats_backend_snapshot, bytes_sent)},
+	{"relayed_lines", REPORT_COUNTER, "Lines relayed to the backend.",
+	 offsetof(struct stats_backend_snapshot, relayed_lines)},
+	{"dropped_lines", REPORT_COUNTER, "Lines dropped because the backend's queue was full.",
+	 offsetof(struct stats_backend_snapshot, dropped_lines)},
+	{"spooled_bytes", REPORT_GAUGE, "Bytes waiting in the backend's spool.",
+	 offsetof(struct stats_backend_snapshot, spooled_bytes)},
+	{"failing", REPORT_BOOLEAN, "Whether the connection to the backend is failing.",
+	 offsetof(struct stats_backend_snapshot, failing)},
+	{"down", REPORT_BOOLEAN, "Whether the backend is down, and its shards are failed over.",
+	 offsetof(struct stats_backend_snapshot, down)},
+};
+
+static const struct report_latency report_backend_latency = {
+	"queue_residence", "Time a line waits to be sent to the backend.",
+	offsetof(struct stats_backend_snapshot, queue_residence)
+};
+
+#define REPORT_COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+static const struct {
+	const char *label;
+	const char *quantile;
+	size_t offset;
+} report_percentiles[] = {
+	{"p50", "0.5", offsetof(struct stats_latency, p50)},
+	{"p99", "0.99", offsetof(struct stats_latency, p99)},
+	{"p999", "0.999", offsetof(struct stats_latency, p999)},
+};
+
+#define REPORT_FIELD(base, offset, type) (*(const type *) ((const char *) (base) + (offset)))
+
+void report_init(report_t *report,
+		 const stats_snapshot_t *snapshot,
+		 enum report_format format) {
+	report->snapshot = snapshot;
+	report->format = format;
+	report->section = 0;
+	report->backend = 0;
+	report->failed = false;
+}
+
+static void report_printf(report_t *report, buffer_t *buf, const char *format, ...) {
+	va_list args;
+
+	if (report->failed) {
+		return;
+	}
+	va_start(args, format);
+	if (buffer_vprintf(buf, format, args) != 0) {
+		report->failed = true;
+	}
+	va_end(args);
+}
+
+// Write a backend key as a Prometheus label value or a JSON string
+static void report_quote(report_t *report, buffer_t *buf, const char *str) {
+	report_printf(report, buf, "\"");
+	for (const unsigned char *p = (const unsigned char *) str; *p != '\0'; p++) {
+		if (*p == '\\' || *p == '"') {
+			report_printf(report, buf, "\\%c", *p);
+		} else if (*p == '\n') {
+			report_printf(report, buf, "\\n");
+		} else if (*p < 0x20 && report->format == REPORT_JSON) {
+			report_printf(report, buf, "\\u%04x", *p);
+		} else {
+			report_printf(report, buf, "%c", *p);
+		}
+	}
+	report_printf(report, buf, "\"");
+}
+
+// Write backends from where the last write stopped, at least one at a
+// time, until buf is full. Returns true once all of them have been
+// written.
+static bool report_backends(report_t *report,
+			    buffer_t *buf,
+			    size_t limit,
+			    void (*write)(report_t *, buffer_t *, const struct stats_backend_snapshot *)) {
+	const stats_snapshot_t *snapshot = report->snapshot;
+
+	while (report->backend < snapshot->num_backends && !report->failed) {
+		write(report, buf, &snapshot->backends[report->backend++]);
+		if (buffer_datacount(buf) >= limit && report->backend < snapshot->num_backends) {
+			return false;
+		}
+	}
+	report->backend = 0;
+	return true;
+}
+
+static const char *report_status_type(enum report_type type) {
+	switch (type) {
+	case REPORT_TIMESTAMP:
+		return "timestamp";
+	case REPORT_BOOLEAN:
+		return "boolean";
+	default:
+		// Counters have always been called gauges here
+		return "gauge";
+	}
+}
+
+static void report_status_latency(report_t *report,
+				  buffer_t *buf,
+				  const char *scope,
+				  const char *key,
+				  const char *name,
+				  const struct stats_latency *latency) {
+	for (size_t i = 0; i < REPORT_COUNT(report_percentiles); i++) {
+		report_printf(report, buf, "%s%s %s_ns %s %" PRIu64 "\n",
+			      scope, key, name, report_percentiles[i].label,
+			      REPORT_FIELD(latency, report_percentiles[i].offset, uint64_t));
+	}
+}
+
+static void report_status_backend(report_t *report,
+				  buffer_t *buf,
+				  const struct stats_backend_snapshot *backend) {
+	for (size_t i = 0; i < REPORT_COUNT(report_backend_values); i++) {
+		const struct report_value *value = &report_backend_values[i];
+		report_printf(report, buf, "backend:%s %s %s %" PRIu64 "\n",
+			      backend->key, value->name, report_status_type(value->type),
+			      REPORT_FIELD(backend, value->offset, uint64_t));
+	}
+	report_status_latency(report, buf, "backend:", backend->key, report_backend_latency.name,
+			      &REPORT_FIELD(backend, report_backend_latency.offset, struct stats_latency));
+}
+
+static bool report_status(report_t *report, buffer_t *buf, size_t limit) {
+	const stats_snapshot_t *snapshot = report->snapshot;
+
+	switch (report->section) {
+	case 0:
+		for (size_t i = 0; i < REPORT_COUNT(report_globals); i++) {
+			const struct report_value *value = &report_globals[i];
+			report_printf(report, buf, "global %s %s %" PRIu64 "\n",
+				      value->name, report_status_type(value->type),
+				      REPORT_FIELD(snapshot, value->offset, uint64_t));
+		}
+		for (size_t i = 0; i < REPORT_COUNT(report_global_latencies); i++) {
+			const struct report_latency *latency = &report_global_latencies[i];
+			report_status_latency(report, buf, "global", "", latency->name,
+					      &REPORT_FIELD(snapshot, latency->offset, struct stats_latency));
+		}
+		break;
+	case 1:
+		if (!report_backends(report, buf, limit, report_status_backend)) {
+			return false;
+		}
+		break;
+	case 2:
+		report_printf(report, buf, "\n");
+		break;
+	default:
+		return true;
+	}
+	report->section++;
+	return false;
+}
+
+// Prometheus wants counters to end in _total and times in seconds
+static const char *report_prometheus_suffix(enum report_type type) {
+	switch (type) {
+	case REPORT_COUNTER:
+		return "_total";
+	case REPORT_TIMESTAMP:
+		return "_timestamp_seconds";
+	default:
+		return "";
+	}
+}
+
+static void report_prometheus_header(report_t *report,
+				     buffer_t *buf,
+				     const char *prefix,
+				     const struct report_value *value) {
+	const char *suffix = report_prometheus_suffix(value->type);
+	report_printf(report, buf,
+		      "# HELP statsrelay_%s%s%s %s\n"
+		      "# TYPE statsrelay_%s%s%s %s\n",
+		      prefix, value->name, suffix, value->help,
+		      prefix, value->name, suffix,
+		      value->type == REPORT_COUNTER ? "counter" : "gauge");
+}
+
+// A summary, with the backend's key as a label if there is one
+static void report_prometheus_latency(report_t *report,
+				      buffer_t *buf,
+				      const char *name,
+				      const char *backend,
+				      const struct stats_latency *latency) {
+	for (size_t i = 0; i < REPORT_COUNT(report_percentiles); i++) {
+		report_printf(report, buf, "statsrelay_%s_seconds{", name);
+		if (backend != NULL) {
+			report_printf(report, buf, "backend=");
+			report_quote(report, buf, backend);
+			report_printf(report, buf, ",");
+		}
+		report_printf(report, buf, "quantile=\"%s\"} %.9g\n",
+			      report_percentiles[i].quantile,
+			      REPORT_FIELD(latency, report_percentiles[i].offset, uint64_t) / 1e9);
+	}
+	for (int i = 0; i < 2; i++) {
+		report_printf(report, buf, "statsrelay_%s_seconds_%s", name, i == 0 ? "sum" : "count");
+		if (backend != NULL) {
+			report_printf(report, buf, "{backend=");
+			report_quote(report, buf, backend);
+			report_printf(report, buf, "}");
+		}
+		if (i == 0) {
+			report_printf(report, buf, " %.9g\n", latency->sum / 1e9);
+		} else {
+			report_printf(report, buf, " %" PRIu64 "\n", latency->count);
+		}
+	}
+}
+
+static void report_prometheus_backend(report_t *report,
+				      buffer_t *buf,
+				      const struct stats_backend_snapshot *backend) {
+	const size_t section = report->section - 1;
+
+	if (section < REPORT_COUNT(report_backend_values)) {
+		const struct report_value *value = &report_backend_values[section];
+		report_printf(report, buf, "statsrelay_backend_%s%s{backend=",
+			      value->name, report_prometheus_suffix(value->type));
+		report_quote(report, buf, backend->key);
+		report_printf(report, buf, "} %" PRIu64 "\n",
+			      REPORT_FIELD(backend, value->offset, uint64_t));
+	} else {
+		report_prometheus_latency(report, buf, "backend_queue_residence", backend->key,
+					  &REPORT_FIELD(backend, report_backend_latency.offset,
+							struct stats_latency));
+	}
+}
+
+// Every metric is one group of lines, so backends are written out one
+// metric at a time.
+static bool report_prometheus(report_t *report, buffer_t *buf, size_t limit) {
+	const stats_snapshot_t *snapshot = report->snapshot;
+	const size_t num_values = REPORT_COUNT(report_backend_values);
+
+	if (report->section == 0) {
+		for (size_t i = 0; i < REPORT_COUNT(report_globals); i++) {
+			const struct report_value *value = &report_globals[i];
+			report_prometheus_header(report, buf, "", value);
+			report_printf(report, buf, "statsrelay_%s%s %" PRIu64 "\n",
+				      value->name, report_prometheus_suffix(value->type),
+				      REPORT_FIELD(snapshot, value->offset, uint64_t));
+		}
+		for (size_t i = 0; i < REPORT_COUNT(report_global_latencies); i++) {
+			const struct report_latency *latency = &report_global_latencies[i];
+			report_printf(report, buf,
+				      "# HELP statsrelay_%s_seconds %s Sampled.\n"
+				      "# TYPE statsrelay_%s_seconds summary\n",
+				      latency->name, latency->help, latency->name);
+			report_prometheus_latency(report, buf, latency->name, NULL,
+						  &REPORT_FIELD(snapshot, latency->offset,
+								struct stats_latency));
+		}
+	} else if (report->section <= num_values + 1) {
+		if (report->backend == 0) {
+			if (report->section <= num_values) {
+				report_prometheus_header(report, buf, "backend_",
+						       &report_backend_values[report->section - 1]);
+			} else {
+				report_printf(report, buf,
+					      "# HELP statsrelay_backend_%s_seconds %s Sampled.\n"
+					      "# TYPE statsrelay_backend_%s_seconds summary\n",
+					      report_backend_latency.name, report_backend_latency.help,
+					      report_backend_latency.name);
+			}
+		}
+		if (!report_backends(report, buf, limit, report_prometheus_backend)) {
+			return false;
+		}
+	} else {
+		return true;
+	}
+	report->section++;
+	return false;
+}
+
+static void report_json_latency(report_t *report,
+				buffer_t *buf,
+				const char *name,
+				const struct stats_latency *latency) {
+	report_printf(report, buf,
+		      ",\"%s_ns\":{\"count\":%" PRIu64 ",\"sum\":%" PRIu64,
+		      name, latency->count, latency->sum);
+	for (size_t i = 0; i < REPORT_COUNT(report_percentiles); i++) {
+		report_printf(report, buf, ",\"%s\":%" PRIu64,
+			      report_percentiles[i].label,
+			      REPORT_FIELD(latency, report_percentiles[i].offset, uint64_t));
+	}
+	report_printf(report, buf, "}");
+}
+
+// Every value but the first of an object follows a comma
+static void report_json_value(report_t *report,
+			      buffer_t *buf,
+			      const struct report_value *value,
+			      const void *base,
+			      bool first) {
+	const uint64_t number = REPORT_FIELD(base, value->offset, uint64_t);
+	const char *comma = first ? "" : ",";
+	if (value->type == REPORT_BOOLEAN) {
+		report_printf(report, buf, "%s\"%s\":%s", comma, value->name,
+			      number ? "true" : "false");
+	} else {
+		report_printf(report, buf, "%s\"%s\":%" PRIu64, comma, value->name, number);
+	}
+}
+
+static void report_json_backend(report_t *report,
+				buffer_t *buf,
+				const struct stats_backend_snapshot *backend) {
+	// report->backend has already moved on to the next one
+	report_printf(report, buf, "%s{\"key\":", report->backend > 1 ? "," : "");
+	report_quote(report, buf, backend->key);
+	for (size_t i = 0; i < REPORT_COUNT(report_backend_values); i++) {
+		report_json_value(report, buf, &report_backend_values[i], backend, false);
+	}
+	report_json_latency(report, buf, report_backend_latency.name,
+			    &REPORT_FIELD(backend, report_backend_latency.offset, struct stats_latency));
+	report_printf(report, buf, "}");
+}
+
+static bool report_json(report_t *report, buffer_t *buf, size_t limit) {
+	const stats_snapshot_t *snapshot = report->snapshot;
+
+	switch (report->section) {
+	case 0:
+		report_printf(report, buf, "{\"global\":{");
+		for (size_t i = 0; i < REPORT_COUNT(report_globals); i++) {
+			report_json_value(report, buf, &report_globals[i], snapshot, i == 0);
+		}
+		for (size_t i = 0; i < REPORT_COUNT(report_global_latencies); i++) {
+			const struct report_latency *latency = &report_global_latencies[i];
+			report_json_latency(report, buf, latency->name,
+					    &REPORT_FIELD(snapshot, latency->offset, struct stats_latency));
+		}
+		report_printf(report, buf, "},\"backends\":[");
+		break;
+	case 1:
+		if (!report_backends(report, buf, limit, report_json_backend)) {
+			return false;
+		}
+		break;
+	case 2:
+		report_printf(report, buf, "]}\n");
+		break;
+	default:
+		return true;
+	}
+	report->section++;
+	return false;
+}
+
+int report_write(report_t *report, buffer_t *buf, size_t limit) {
+	bool done = false;
+
+	while (!done && !report->failed && buffer_datacount(buf) < limit) {
+		switch (report->format) {
+		case REPORT_STATUS:
+			done = report_status(report, buf, limit);
+			break;
+		case REPORT_PROMETHEUS:
+			done = report_prometheus(report, buf, limit);
+			break;
+		case REPORT_JSON:
+			done = report_json(report, buf, limit);
+			break;
+		}
+	}
+	if (report->failed) {
+		return -1;
+	}
+	return done ? 0 : 1;
+}
@@ -0,0 +1,39 @@
+// Renders a stats snapshot as the text of the status command, in the
+// Prometheus text format, or as JSON. A report can be written out a
+// piece at a time, so that a large one never has to be held in memory
+// all at once.
+
+#ifndef STATSRELAY_REPORT_H
+#define STATSRELAY_REPORT_H
+
+#include "buffer.h"
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum report_format {
+	REPORT_STATUS,		// "<scope> <name> <type> <value>" lines
+	REPORT_PROMETHEUS,	// text exposition format 0.0.4
+	REPORT_JSON
+};
+
+typedef struct report {
+	const stats_snapshot_t *snapshot;
+	enum report_format format;
+	unsigned int section;	// where the next write picks up
+	size_t backend;
+	bool failed;
+} report_t;
+
+void report_init(report_t *report,
+		 const stats_snapshot_t *snapshot,
+		 enum report_format format);
+
+// Append the next part of the report to buf, growing it as needed,
+// until it holds at least limit bytes or the report is complete.
+// Returns 1 if there is more to come, 0 once the report is complete,
+// and -1 if memory ran out.
+int report_write(report_t *report, buffer_t *buf, size_t limit);
+
+#endif  // STATSRELAY_REPORT_H
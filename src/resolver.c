@@ -0,0 +1,324 @@
+#include "resolver.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct resolver_request {
+	char *host;
+	char *port;
+	int socktype;
+	unsigned int ttl;
+	struct ev_loop *loop;
+	ev_async *watcher;
+
+	struct addrinfo *addr;
+	int error;
+	bool in_progress;
+	bool done;
+	bool cancelled;
+	struct resolver_request *next;
+};
+
+struct resolver_cache_entry {
+	char *host;
+	char *port;
+	int socktype;
+	time_t expires;
+	struct addrinfo *addr;
+	struct resolver_cache_entry *next;
+};
+
+// Everything below is protected by resolver_lock
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_cond = PTHREAD_COND_INITIALIZER;
+static resolver_request_t *queue_head = NULL;
+static resolver_request_t *queue_tail = NULL;
+static struct resolver_cache_entry *cache = NULL;
+static int num_threads = 0;
+static int idle_threads = 0;
+static bool stopping = false;
+static resolver_lookup_fn resolver_lookup = getaddrinfo;
+
+// Copy an addrinfo list into memory we own, one allocation per entry
+static struct addrinfo *resolver_copy_addr(const struct addrinfo *addr) {
+	struct addrinfo *head = NULL, **tail = &head;
+
+	for (; addr != NULL; addr = addr->ai_next) {
+		struct addrinfo *copy = malloc(sizeof(struct addrinfo) + addr->ai_addrlen);
+		if (copy == NULL) {
+			resolver_free_addr(head);
+			return NULL;
+		}
+		memcpy(copy, addr, sizeof(struct addrinfo));
+		copy->ai_addr = (struct sockaddr *) (copy + 1);
+		memcpy(copy->ai_addr, addr->ai_addr, addr->ai_addrlen);
+		copy->ai_canonname = NULL;
+		copy->ai_next = NULL;
+		*tail = copy;
+		tail = &copy->ai_next;
+	}
+	return head;
+}
+
+void resolver_free_addr(struct addrinfo *addr) {
+	while (addr != NULL) {
+		struct addrinfo *next = addr->ai_next;
+		free(addr);
+		addr = next;
+	}
+}
+
+static void resolver_free_request(resolver_request_t *request) {
+	resolver_free_addr(request->addr);
+	free(request->host);
+	free(request->port);
+	free(request);
+}
+
+static void resolver_free_entry(struct resolver_cache_entry *entry) {
+	resolver_free_addr(entry->addr);
+	free(entry->host);
+	free(entry->port);
+	free(entry);
+}
+
+// Returns a copy of a cached result, dropping expired entries on the way
+static struct addrinfo *resolver_cache_get(const resolver_request_t *request) {
+	time_t now = time(NULL);
+	struct resolver_cache_entry **entry = &cache;
+
+	while (*entry != NULL) {
+		struct resolver_cache_entry *e = *entry;
+		if (e->expires <= now) {
+			*entry = e->next;
+			resolver_free_entry(e);
+			continue;
+		}
+		if (e->socktype == request->socktype &&
+		    strcmp(e->host, request->host) == 0 &&
+		    strcmp(e->port, request->port) == 0) {
+			return resolver_copy_addr(e->addr);
+		}
+		entry = &e->next;
+	}
+	return NULL;
+}
+
+static void resolver_cache_put(const resolver_request_t *request) {
+	struct resolver_cache_entry *entry = calloc(1, sizeof(struct resolver_cache_entry));
+	if (entry == NULL) {
+		return;
+	}
+	entry->host = strdup(request->host);
+	entry->port = strdup(request->port);
+	entry->addr = resolver_copy_addr(request->addr);
+	if (entry->host == NULL || entry->port == NULL || entry->addr == NULL) {
+		resolver_free_entry(entry);
+		return;
+	}
+	entry->socktype = request->socktype;
+	entry->expires = time(NULL) + request->ttl;
+	entry->next = cache;
+	cache = entry;
+}
+
+// Hand a result back to its loop, or throw it away if nobody wants it
+// any more. Called with the lock held, so resolver_cancel cannot free
+// the watcher while it is being signalled.
+static void resolver_complete(resolver_request_t *request) {
+	request->in_progress = false;
+	if (request->cancelled) {
+		resolver_free_request(request);
+		return;
+	}
+	request->done = true;
+	ev_async_send(request->loop, request->watcher);
+}
+
+static void resolver_lookup_request(resolver_request_t *request) {
+	struct addrinfo hints, *addr;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = request->socktype;
+	hints.ai_flags = AI_PASSIVE;
+
+	resolver_lookup_fn lookup = resolver_lookup;
+	pthread_mutex_unlock(&resolver_lock);
+	int error = lookup(request->host, request->port, &hints, &addr);
+	pthread_mutex_lock(&resolver_lock);
+
+	if (error != 0) {
+		request->error = error;
+		return;
+	}
+	request->addr = resolver_copy_addr(addr);
+	freeaddrinfo(addr);
+	if (request->addr == NULL) {
+		request->error = EAI_MEMORY;
+	} else if (request->ttl > 0) {
+		resolver_cache_put(request);
+	}
+}
+
+static void *resolver_thread(void *arg) {
+	pthread_mutex_lock(&resolver_lock);
+	for (;;) {
+		resolver_request_t *request = queue_head;
+		if (request == NULL) {
+			if (stopping) {
+				break;
+			}
+			idle_threads++;
+			pthread_cond_wait(&resolver_cond, &resolver_lock);
+			idle_threads--;
+			continue;
+		}
+		queue_head = request->next;
+		if (queue_head == NULL) {
+			queue_tail = NULL;
+		}
+		request->next = NULL;
+		request->in_progress = true;
+
+		// An earlier request may have filled the cache since this
+		// one was queued
+		if (request->ttl == 0 || (request->addr = resolver_cache_get(request)) == NULL) {
+			resolver_lookup_request(request);
+		}
+		resolver_complete(request);
+	}
+	num_threads--;
+	pthread_mutex_unlock(&resolver_lock);
+	return NULL;
+}
+
+// Called with the lock held
+static void resolver_wake_thread(void) {
+	pthread_t thread;
+	pthread_attr_t attr;
+	sigset_t all_signals, orig_signals;
+
+	if (idle_threads > 0 || num_threads >= RESOLVER_MAX_THREADS) {
+		pthread_cond_signal(&resolver_cond);
+		return;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	// Signals are handled by the main thread
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &orig_signals);
+	const int err = pthread_create(&thread, &attr, resolver_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &orig_signals, NULL);
+	if (err == 0) {
+		num_threads++;
+	} else {
+		stats_error_log("resolver: failed to start a thread");
+		pthread_cond_signal(&resolver_cond);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+resolver_request_t *resolver_submit(struct ev_loop *loop,
+				    ev_async *watcher,
+				    const char *host,
+				    const char *port,
+				    int socktype,
+				    unsigned int ttl) {
+	resolver_request_t *request = calloc(1, sizeof(resolver_request_t));
+	if (request == NULL) {
+		return NULL;
+	}
+	request->host = strdup(host);
+	request->port = strdup(port);
+	if (request->host == NULL || request->port == NULL) {
+		resolver_free_request(request);
+		return NULL;
+	}
+	request->socktype = socktype;
+	request->ttl = ttl;
+	request->loop = loop;
+	request->watcher = watcher;
+
+	pthread_mutex_lock(&resolver_lock);
+	stopping = false;
+	if (ttl > 0 && (request->addr = resolver_cache_get(request)) != NULL) {
+		resolver_complete(request);
+	} else {
+		if (queue_tail == NULL) {
+			queue_head = request;
+		} else {
+			queue_tail->next = request;
+		}
+		queue_tail = request;
+		resolver_wake_thread();
+		if (num_threads == 0) {
+			// Without a thread nothing will ever answer
+			queue_head = queue_tail = NULL;
+			request->error = EAI_SYSTEM;
+			resolver_complete(request);
+		}
+	}
+	pthread_mutex_unlock(&resolver_lock);
+	return request;
+}
+
+bool resolver_finish(resolver_request_t *request,
+		     struct addrinfo **addr,
+		     int *error) {
+	pthread_mutex_lock(&resolver_lock);
+	bool done = request->done;
+	pthread_mutex_unlock(&resolver_lock);
+	if (!done) {
+		return false;
+	}
+	*addr = request->addr;
+	*error = request->error;
+	request->addr = NULL;
+	resolver_free_request(request);
+	return true;
+}
+
+void resolver_cancel(resolver_request_t *request) {
+	pthread_mutex_lock(&resolver_lock);
+	if (request->in_progress) {
+		request->cancelled = true;
+	} else {
+		if (!request->done) {
+			resolver_request_t **r = &queue_head;
+			queue_tail = NULL;
+			while (*r != NULL) {
+				if (*r == request) {
+					*r = request->next;
+					continue;
+				}
+				queue_tail = *r;
+				r = &(*r)->next;
+			}
+		}
+		resolver_free_request(request);
+	}
+	pthread_mutex_unlock(&resolver_lock);
+}
+
+void resolver_set_lookup(resolver_lookup_fn lookup) {
+	pthread_mutex_lock(&resolver_lock);
+	resolver_lookup = lookup != NULL ? lookup : getaddrinfo;
+	pthread_mutex_unlock(&resolver_lock);
+}
+
+void resolver_shutdown(void) {
+	pthread_mutex_lock(&resolver_lock);
+	while (cache != NULL) {
+		struct resolver_cache_entry *next = cache->next;
+		resolver_free_entry(cache);
+		cache = next;
+	}
+	stopping = true;
+	pthread_cond_broadcast(&resolver_cond);
+	pthread_mutex_unlock(&resolver_lock);
+}
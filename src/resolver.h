@@ -0,0 +1,58 @@
+// Backend addresses are resolved on a small pool of threads, so that a
+// slow or hung DNS server never blocks an event loop. The caller is
+// told that a lookup has finished through an ev_async watcher on its
+// own loop. Results are cached, shared by every loop, for as long as
+// the caller asks for.
+
+#ifndef STATSRELAY_RESOLVER_H
+#define STATSRELAY_RESOLVER_H
+
+#include <netdb.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <ev.h>
+
+#define RESOLVER_MAX_THREADS 4
+
+// Signature of getaddrinfo(3); the result is released with freeaddrinfo
+typedef int (*resolver_lookup_fn)(const char *host,
+				  const char *port,
+				  const struct addrinfo *hints,
+				  struct addrinfo **res);
+
+typedef struct resolver_request resolver_request_t;
+
+// Start resolving host and port. watcher is signalled on loop once the
+// result is ready, and resolver_finish collects it. A cached result no
+// older than ttl seconds is used if there is one, and a new result is
+// cached for ttl seconds (0 disables the cache). Returns NULL if memory
+// could not be allocated.
+resolver_request_t *resolver_submit(struct ev_loop *loop,
+				    ev_async *watcher,
+				    const char *host,
+				    const char *port,
+				    int socktype,
+				    unsigned int ttl);
+
+// Collect a request. Returns false if it has not finished yet.
+// Otherwise the request is freed, and *addr (release it with
+// resolver_free_addr) or *error (a getaddrinfo error code) is set.
+bool resolver_finish(resolver_request_t *request,
+		     struct addrinfo **addr,
+		     int *error);
+
+// Give up on a request that has not been collected; the watcher is not
+// signalled for it after this returns.
+void resolver_cancel(resolver_request_t *request);
+
+void resolver_free_addr(struct addrinfo *addr);
+
+// Replace getaddrinfo, for tests. NULL restores it.
+void resolver_set_lookup(resolver_lookup_fn lookup);
+
+// Drop the cache and let idle threads exit
+void resolver_shutdown(void);
+
+#endif  // STATSRELAY_RESOLVER_H
@@ -0,0 +1,228 @@
+#include "scan.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+#define SCAN_BLOCK 64		// bytes covered by one pair of bit masks
+#define SCAN_NO_KEY SIZE_MAX
+
+struct scan_state {
+	const char *buf;
+	char delimiter;
+	struct scan_line *lines;
+	size_t max_lines;
+	size_t num_lines;
+
+	// The line being scanned
+	size_t line_start;
+	size_t key_end;		// SCAN_NO_KEY until a delimiter is seen
+	unsigned int delimiters;
+};
+
+static int current_impl = -1;	// not picked yet
+
+static inline void scan_delimiters(struct scan_state *s, size_t base, uint64_t delims) {
+	if (delims != 0) {
+		if (s->key_end == SCAN_NO_KEY) {
+			s->key_end = base + __builtin_ctzll(delims);
+		}
+		s->delimiters += __builtin_popcountll(delims);
+	}
+}
+
+// Record the lines that end in a block, given a bit for each newline
+// and each delimiter in the block. Returns false once lines is full.
+static inline bool scan_block(struct scan_state *s,
+			      size_t base,
+			      uint64_t newlines,
+			      uint64_t delims) {
+	while (newlines != 0) {
+		if (s->num_lines == s->max_lines) {
+			return false;
+		}
+		const unsigned int bit = __builtin_ctzll(newlines);
+		const uint64_t before = delims & ((UINT64_C(1) << bit) - 1);
+		scan_delimiters(s, base, before);
+
+		struct scan_line *line = &s->lines[s->num_lines++];
+		line->offset = s->line_start;
+		line->len = base + bit - s->line_start;
+		line->key_len = s->key_end == SCAN_NO_KEY ? 0 : s->key_end - s->line_start;
+		line->delimiters = s->delimiters;
+
+		s->line_start = base + bit + 1;
+		s->key_end = SCAN_NO_KEY;
+		s->delimiters = 0;
+		delims &= ~before;
+		newlines &= newlines - 1;
+	}
+	scan_delimiters(s, base, delims);
+	return true;
+}
+
+// The end of a buffer, shorter than SCAN_BLOCK, a byte at a time
+static bool scan_tail(struct scan_state *s, size_t base, size_t len) {
+	uint64_t newlines = 0, delims = 0;
+	for (size_t i = 0; i < len; i++) {
+		const char c = s->buf[base + i];
+		if (c == '\n') {
+			newlines |= UINT64_C(1) << i;
+		} else if (c == s->delimiter) {
+			delims |= UINT64_C(1) << i;
+		}
+	}
+	return scan_block(s, base, newlines, delims);
+}
+
+// A line at a time, with memchr, which is already vectorized by the C
+// library on most platforms
+static void scan_scalar(struct scan_state *s, size_t len) {
+	while (s->num_lines < s->max_lines) {
+		const char *line = s->buf + s->line_start;
+		const char *newline = memchr(line, '\n', len - s->line_start);
+		if (newline == NULL) {
+			return;
+		}
+		struct scan_line *scanned = &s->lines[s->num_lines++];
+		scanned->offset = s->line_start;
+		scanned->len = newline - line;
+		scanned->key_len = 0;
+		scanned->delimiters = 0;
+		const char *p = memchr(line, s->delimiter, newline - line);
+		if (p != NULL) {
+			scanned->key_len = p - line;
+			do {
+				scanned->delimiters++;
+				p = memchr(p + 1, s->delimiter, newline - p - 1);
+			} while (p != NULL);
+		}
+		s->line_start += scanned->len + 1;
+	}
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static void scan_sse2(struct scan_state *s, size_t len) {
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i delimiter = _mm_set1_epi8(s->delimiter);
+	size_t base;
+
+	for (base = 0; base + SCAN_BLOCK <= len; base += SCAN_BLOCK) {
+		uint64_t newlines = 0, delims = 0;
+		for (int i = 0; i < SCAN_BLOCK / 16; i++) {
+			const __m128i v = _mm_loadu_si128((const __m128i *) (s->buf + base + 16 * i));
+			newlines |= (uint64_t) (unsigned int) _mm_movemask_epi8(
+				_mm_cmpeq_epi8(v, newline)) << (16 * i);
+			delims |= (uint64_t) (unsigned int) _mm_movemask_epi8(
+				_mm_cmpeq_epi8(v, delimiter)) << (16 * i);
+		}
+		if (!scan_block(s, base, newlines, delims)) {
+			return;
+		}
+	}
+	if (base < len) {
+		scan_tail(s, base, len - base);
+	}
+}
+
+__attribute__((target("avx2,popcnt")))
+static void scan_avx2(struct scan_state *s, size_t len) {
+	const __m256i newline = _mm256_set1_epi8('\n');
+	const __m256i delimiter = _mm256_set1_epi8(s->delimiter);
+	size_t base;
+
+	for (base = 0; base + SCAN_BLOCK <= len; base += SCAN_BLOCK) {
+		const __m256i lo = _mm256_loadu_si256((const __m256i *) (s->buf + base));
+		const __m256i hi = _mm256_loadu_si256((const __m256i *) (s->buf + base + 32));
+		const uint64_t newlines =
+			(uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, newline)) |
+			(uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, newline)) << 32;
+		const uint64_t delims =
+			(uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, delimiter)) |
+			(uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, delimiter)) << 32;
+		if (!scan_block(s, base, newlines, delims)) {
+			return;
+		}
+	}
+	if (base < len) {
+		scan_tail(s, base, len - base);
+	}
+}
+#endif
+
+static bool scan_supported(enum scan_impl impl) {
+	switch (impl) {
+	case SCAN_SCALAR:
+		return true;
+#ifdef SCAN_X86
+	case SCAN_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case SCAN_AVX2:
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#endif
+	default:
+		return false;
+	}
+}
+
+enum scan_impl scan_get_impl(void) {
+	int impl = __atomic_load_n(&current_impl, __ATOMIC_RELAXED);
+	if (impl < 0) {
+		impl = SCAN_SCALAR;
+		if (scan_supported(SCAN_AVX2)) {
+			impl = SCAN_AVX2;
+		} else if (scan_supported(SCAN_SSE2)) {
+			impl = SCAN_SSE2;
+		}
+		__atomic_store_n(&current_impl, impl, __ATOMIC_RELAXED);
+	}
+	return (enum scan_impl) impl;
+}
+
+int scan_set_impl(enum scan_impl impl) {
+	if (!scan_supported(impl)) {
+		return 1;
+	}
+	__atomic_store_n(&current_impl, (int) impl, __ATOMIC_RELAXED);
+	return 0;
+}
+
+size_t scan_lines(const char *buf,
+		  size_t len,
+		  char delimiter,
+		  struct scan_line *lines,
+		  size_t max_lines,
+		  size_t *consumed) {
+	struct scan_state s = {
+		.buf = buf,
+		.delimiter = delimiter,
+		.lines = lines,
+		.max_lines = max_lines,
+		.num_lines = 0,
+		.line_start = 0,
+		.key_end = SCAN_NO_KEY,
+		.delimiters = 0
+	};
+
+	switch (scan_get_impl()) {
+#ifdef SCAN_X86
+	case SCAN_AVX2:
+		scan_avx2(&s, len);
+		break;
+	case SCAN_SSE2:
+		scan_sse2(&s, len);
+		break;
+#endif
+	default:
+		scan_scalar(&s, len);
+		break;
+	}
+	*consumed = s.line_start;
+	return s.num_lines;
+}
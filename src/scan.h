@@ -0,0 +1,40 @@
+// Splits a buffer into lines, and finds where each line's key ends, in
+// a single pass over the buffer. On x86 the buffer is compared 32 (AVX2)
+// or 16 (SSE2) bytes at a time, depending on what the CPU supports;
+// elsewhere it's done with memchr.
+
+#ifndef STATSRELAY_SCAN_H
+#define STATSRELAY_SCAN_H
+
+#include <stddef.h>
+
+enum scan_impl {
+	SCAN_SCALAR = 0,
+	SCAN_SSE2,
+	SCAN_AVX2
+};
+
+struct scan_line {
+	size_t offset;			// from the start of the buffer
+	size_t len;			// not counting the newline
+	size_t key_len;			// up to the first delimiter, 0 if there is none
+	unsigned int delimiters;	// how many delimiters the line has
+};
+
+// Index the complete lines at the start of buf, up to max_lines of
+// them. Returns the number of lines found, and sets *consumed to the
+// length of those lines including their newlines.
+size_t scan_lines(const char *buf,
+		  size_t len,
+		  char delimiter,
+		  struct scan_line *lines,
+		  size_t max_lines,
+		  size_t *consumed);
+
+// The implementation used by scan_lines. The best one the CPU supports
+// is picked the first time; tests and benchmarks can pick another one.
+// Returns non-zero if the CPU doesn't support it.
+enum scan_impl scan_get_impl(void);
+int scan_set_impl(enum scan_impl impl);
+
+#endif  // STATSRELAY_SCAN_H
@@ -0,0 +1,170 @@
+#include "selfstats.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SELFSTATS_HOSTNAME_LEN 256
+
+void selfstats_init(selfstats_t *self) {
+	self->prefix = NULL;
+	self->carbon = false;
+	self->last = NULL;
+}
+
+// Dots separate the parts of a name, and the rest would confuse a
+// statsd or carbon parser
+static void selfstats_sanitize(char *name) {
+	for (; *name != '\0'; name++) {
+		if (strchr(".: |/\\\t\n", *name) != NULL) {
+			*name = '_';
+		}
+	}
+}
+
+int selfstats_configure(selfstats_t *self,
+			const char *prefix,
+			const char *hostname,
+			bool carbon) {
+	char host[SELFSTATS_HOSTNAME_LEN];
+
+	if (hostname != NULL) {
+		snprintf(host, sizeof(host), "%s", hostname);
+	} else if (gethostname(host, sizeof(host)) != 0) {
+		strcpy(host, "unknown");
+	}
+	host[sizeof(host) - 1] = '\0';
+	selfstats_sanitize(host);
+
+	const size_t len = strlen(prefix) + strlen(host) + 3;
+	char *full_prefix = malloc(len);
+	if (full_prefix == NULL) {
+		return 1;
+	}
+	if (prefix[0] == '\0') {
+		snprintf(full_prefix, len, "%s.", host);
+	} else {
+		snprintf(full_prefix, len, "%s.%s.", prefix, host);
+	}
+	free(self->prefix);
+	self->prefix = full_prefix;
+	self->carbon = carbon;
+	return 0;
+}
+
+// A counter goes back to zero when its backend is removed and added
+// again by a reload
+static uint64_t selfstats_delta(uint64_t now, uint64_t before) {
+	return now >= before ? now - before : now;
+}
+
+// scope is "" for the relay as a whole, or "backend.<key>."
+static int selfstats_line(selfstats_t *self,
+			  buffer_t *buf,
+			  const char *scope,
+			  const char *name,
+			  uint64_t value,
+			  bool counter,
+			  time_t now) {
+	if (self->carbon) {
+		return buffer_printf(buf, "%s%s%s %" PRIu64 " %" PRId64 "\n",
+				     self->prefix, scope, name, value, (int64_t) now);
+	}
+	return buffer_printf(buf, "%s%s%s:%" PRIu64 "|%s\n",
+			     self->prefix, scope, name, value, counter ? "c" : "g");
+}
+
+// The same backend in the previous snapshot, normally at the same index
+static const struct stats_backend_snapshot *selfstats_previous(const stats_snapshot_t *last,
+							       size_t index,
+							       const char *key) {
+	if (last == NULL) {
+		return NULL;
+	}
+	if (index < last->num_backends && strcmp(last->backends[index].key, key) == 0) {
+		return &last->backends[index];
+	}
+	for (size_t i = 0; i < last->num_backends; i++) {
+		if (strcmp(last->backends[i].key, key) == 0) {
+			return &last->backends[i];
+		}
+	}
+	return NULL;
+}
+
+int selfstats_format(selfstats_t *self,
+		     stats_snapshot_t *snapshot,
+		     time_t now,
+		     buffer_t *buf) {
+	static const struct stats_backend_snapshot none;
+	static const stats_snapshot_t nothing;
+	const stats_snapshot_t *last = self->last != NULL ? self->last : &nothing;
+	uint64_t relayed = 0, dropped = 0, queued = 0, spooled = 0, failing = 0;
+	int err = 0;
+
+	for (size_t i = 0; i < snapshot->num_backends; i++) {
+		const struct stats_backend_snapshot *backend = &snapshot->backends[i];
+		const struct stats_backend_snapshot *previous =
+			selfstats_previous(self->last, i, backend->key);
+		if (previous == NULL) {
+			previous = &none;
+		}
+		const uint64_t backend_relayed = selfstats_delta(backend->relayed_lines,
+								 previous->relayed_lines);
+		const uint64_t backend_dropped = selfstats_delta(backend->dropped_lines,
+								 previous->dropped_lines);
+		relayed += backend_relayed;
+		dropped += backend_dropped;
+		queued += backend->queued_bytes;
+		spooled += backend->spooled_bytes;
+		failing += backend->failing;
+
+		char scope[strlen(backend->key) + sizeof("backend..")];
+		snprintf(scope, sizeof(scope), "backend.%s", backend->key);
+		selfstats_sanitize(scope + strlen("backend."));
+		strcat(scope, ".");
+		err |= selfstats_line(self, buf, scope, "relayed_lines", backend_relayed, true, now);
+		err |= selfstats_line(self, buf, scope, "dropped_lines", backend_dropped, true, now);
+		err |= selfstats_line(self, buf, scope, "queued_bytes", backend->queued_bytes, false, now);
+		err |= selfstats_line(self, buf, scope, "failing", backend->failing, false, now);
+	}
+
+	err |= selfstats_line(self, buf, "", "relayed_lines", relayed, true, now);
+	err |= selfstats_line(self, buf, "", "dropped_lines", dropped, true, now);
+	err |= selfstats_line(self, buf, "", "malformed_lines",
+			      selfstats_delta(snapshot->malformed_lines, last->malformed_lines),
+			      true, now);
+	err |= selfstats_line(self, buf, "", "aggregated_lines",
+			      selfstats_delta(snapshot->aggregated_lines, last->aggregated_lines),
+			      true, now);
+	err |= selfstats_line(self, buf, "", "bytes_recv_udp",
+			      selfstats_delta(snapshot->bytes_recv_udp, last->bytes_recv_udp),
+			      true, now);
+	err |= selfstats_line(self, buf, "", "bytes_recv_tcp",
+			      selfstats_delta(snapshot->bytes_recv_tcp, last->bytes_recv_tcp),
+			      true, now);
+	err |= selfstats_line(self, buf, "", "total_connections",
+			      selfstats_delta(snapshot->total_connections, last->total_connections),
+			      true, now);
+	err |= selfstats_line(self, buf, "", "queued_bytes", queued, false, now);
+	err |= selfstats_line(self, buf, "", "spooled_bytes", spooled, false, now);
+	err |= selfstats_line(self, buf, "", "backends", snapshot->num_backends, false, now);
+	err |= selfstats_line(self, buf, "", "failing_backends", failing, false, now);
+	err |= selfstats_line(self, buf, "", "recv_to_enqueue_p99_ns",
+			      snapshot->recv_to_enqueue.p99, false, now);
+	err |= selfstats_line(self, buf, "", "loop_iteration_p99_ns",
+			      snapshot->loop_iteration.p99, false, now);
+
+	stats_snapshot_destroy(self->last);
+	self->last = snapshot;
+	return err != 0;
+}
+
+void selfstats_destroy(selfstats_t *self) {
+	free(self->prefix);
+	stats_snapshot_destroy(self->last);
+	self->prefix = NULL;
+	self->last = NULL;
+}
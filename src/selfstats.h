@@ -0,0 +1,40 @@
+// Turns statsrelay's own counters into metric lines, so that they can
+// be relayed like any other stats. Every line is named
+// <prefix>.<hostname>.<metric>; counters are sent as the change since
+// the previous call, and gauges as they are.
+
+#ifndef STATSRELAY_SELFSTATS_H
+#define STATSRELAY_SELFSTATS_H
+
+#include "buffer.h"
+#include "stats.h"
+
+#include <stdbool.h>
+#include <time.h>
+
+typedef struct selfstats {
+	char *prefix;			// "<prefix>.<hostname>."
+	bool carbon;			// carbon lines rather than statsd
+	stats_snapshot_t *last;		// NULL before the first call
+} selfstats_t;
+
+void selfstats_init(selfstats_t *self);
+
+// Set the names and format of the lines. A NULL hostname means the
+// name of this machine. Returns non-zero if memory ran out.
+int selfstats_configure(selfstats_t *self,
+			const char *prefix,
+			const char *hostname,
+			bool carbon);
+
+// Append a line per metric to buf. The selfstats takes ownership of the
+// snapshot, and keeps it to work out the next round of counters.
+// Returns non-zero if memory ran out.
+int selfstats_format(selfstats_t *self,
+		     stats_snapshot_t *snapshot,
+		     time_t now,
+		     buffer_t *buf);
+
+void selfstats_destroy(selfstats_t *self);
+
+#endif  // STATSRELAY_SELFSTATS_H
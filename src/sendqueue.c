@@ -0,0 +1,279 @@
+#include "sendqueue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void sendqueue_pool_init(sendqueue_pool_t *pool, size_t max_free) {
+	pool->free_list = NULL;
+	pool->num_free = 0;
+	pool->max_free = max_free;
+}
+
+void sendqueue_pool_destroy(sendqueue_pool_t *pool) {
+	struct sendqueue_chunk *chunk, *next;
+	for (chunk = pool->free_list; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	pool->free_list = NULL;
+	pool->num_free = 0;
+}
+
+static struct sendqueue_chunk *sendqueue_chunk_get(sendqueue_pool_t *pool) {
+	struct sendqueue_chunk *chunk = pool->free_list;
+	if (chunk != NULL) {
+		pool->free_list = chunk->next;
+		pool->num_free--;
+	} else if ((chunk = malloc(sizeof(struct sendqueue_chunk))) == NULL) {
+		return NULL;
+	}
+	chunk->next = NULL;
+	chunk->head = 0;
+	chunk->tail = 0;
+	return chunk;
+}
+
+static void sendqueue_chunk_put(sendqueue_pool_t *pool,
+				struct sendqueue_chunk *chunk) {
+	if (pool->num_free >= pool->max_free) {
+		free(chunk);
+		return;
+	}
+	chunk->next = pool->free_list;
+	pool->free_list = chunk;
+	pool->num_free++;
+}
+
+void sendqueue_init(sendqueue_t *queue, sendqueue_pool_t *pool) {
+	queue->pool = pool;
+	queue->first = NULL;
+	queue->last = NULL;
+	queue->bytes = 0;
+}
+
+size_t sendqueue_datacount(const sendqueue_t *queue) {
+	return queue->bytes;
+}
+
+// Make sure there are at least len bytes of free space after the last
+// chunk (across as many new chunks as needed), so that an append never
+// fails half way through.
+static int sendqueue_reserve(sendqueue_t *queue, size_t len) {
+	struct sendqueue_chunk *chunk;
+	size_t space = 0;
+
+	if (queue->last != NULL) {
+		space = SENDQUEUE_CHUNK_SIZE - queue->last->tail;
+		for (chunk = queue->last->next; chunk != NULL; chunk = chunk->next) {
+			space += SENDQUEUE_CHUNK_SIZE;
+		}
+	}
+	while (space < len) {
+		chunk = sendqueue_chunk_get(queue->pool);
+		if (chunk == NULL) {
+			return 1;
+		}
+		if (queue->last == NULL) {
+			queue->first = chunk;
+			queue->last = chunk;
+		} else {
+			// Spare chunks hang off the last chunk until the
+			// append below fills them in.
+			struct sendqueue_chunk *end = queue->last;
+			while (end->next != NULL) {
+				end = end->next;
+			}
+			end->next = chunk;
+		}
+		space += SENDQUEUE_CHUNK_SIZE;
+	}
+	return 0;
+}
+
+int sendqueue_append(sendqueue_t *queue, const char *data, size_t len) {
+	if (sendqueue_reserve(queue, len) != 0) {
+		return 1;
+	}
+	while (len > 0) {
+		struct sendqueue_chunk *chunk = queue->last;
+		size_t n = SENDQUEUE_CHUNK_SIZE - chunk->tail;
+		if (n == 0) {
+			queue->last = chunk->next;
+			continue;
+		}
+		if (n > len) {
+			n = len;
+		}
+		memcpy(chunk->data + chunk->tail, data, n);
+		chunk->tail += n;
+		queue->bytes += n;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int sendqueue_iov(sendqueue_t *queue, struct iovec *iov, int max_iov) {
+	struct sendqueue_chunk *chunk;
+	int count = 0;
+
+	for (chunk = queue->first; chunk != NULL && count < max_iov; chunk = chunk->next) {
+		if (chunk->tail == chunk->head) {
+			break;
+		}
+		iov[count].iov_base = chunk->data + chunk->head;
+		iov[count].iov_len = chunk->tail - chunk->head;
+		count++;
+		if (chunk == queue->last) {
+			break;
+		}
+	}
+	return count;
+}
+
+void sendqueue_cursor_init(sendqueue_t *queue, struct sendqueue_cursor *cursor) {
+	cursor->chunk = queue->first;
+	cursor->pos = queue->first != NULL ? queue->first->head : 0;
+}
+
+// Returns the offset one past the last sep in data[0..len), or 0
+static size_t sendqueue_last_sep(const char *data, size_t len, char sep) {
+	while (len > 0) {
+		if (data[len - 1] == sep) {
+			return len;
+		}
+		len--;
+	}
+	return 0;
+}
+
+size_t sendqueue_next_records(sendqueue_t *queue,
+			      struct sendqueue_cursor *cursor,
+			      size_t max_len,
+			      char sep,
+			      struct iovec *iov,
+			      int max_iov,
+			      int *iovcnt) {
+	struct sendqueue_chunk *chunk = cursor->chunk;
+	size_t pos = cursor->pos;
+	size_t total = 0;
+	int count = 0;
+
+	// The end of the run so far: the iovec count, the length of the
+	// last iovec, and where that leaves the cursor.
+	int end_count = 0;
+	size_t end_len = 0, end_total = 0;
+	struct sendqueue_chunk *end_chunk = NULL;
+
+	*iovcnt = 0;
+	while (chunk != NULL && count < max_iov) {
+		size_t avail = chunk->tail - pos;
+		if (avail == 0) {
+			if (chunk == queue->last) {
+				break;
+			}
+			chunk = chunk->next;
+			pos = chunk->head;
+			continue;
+		}
+		size_t n = avail;
+		bool oversized = end_count == 0 && total >= max_len;
+		if (!oversized && total + n > max_len) {
+			n = max_len - total;
+		}
+		const char *data = chunk->data + pos;
+		size_t sep_end;
+		if (oversized) {
+			// Nothing fits, so return the first record by itself
+			const char *p = memchr(data, sep, n);
+			sep_end = p != NULL ? (size_t) (p - data) + 1 : 0;
+		} else {
+			sep_end = sendqueue_last_sep(data, n, sep);
+		}
+
+		iov[count].iov_base = (char *) data;
+		iov[count].iov_len = n;
+		count++;
+		if (sep_end > 0) {
+			end_count = count;
+			end_len = sep_end;
+			end_total = total + sep_end;
+			end_chunk = chunk;
+			cursor->pos = pos + sep_end;
+			if (oversized) {
+				break;
+			}
+		}
+		total += n;
+		pos += n;
+		if (!oversized && total >= max_len) {
+			if (end_count > 0) {
+				break;
+			}
+		}
+	}
+
+	if (end_count == 0) {
+		return 0;
+	}
+	iov[end_count - 1].iov_len = end_len;
+	cursor->chunk = end_chunk;
+	*iovcnt = end_count;
+	return end_total;
+}
+
+size_t sendqueue_record_len(const sendqueue_t *queue, char sep) {
+	size_t total = 0;
+
+	for (struct sendqueue_chunk *chunk = queue->first; chunk != NULL; chunk = chunk->next) {
+		const size_t n = chunk->tail - chunk->head;
+		const char *p = memchr(chunk->data + chunk->head, sep, n);
+		if (p != NULL) {
+			return total + (size_t) (p - (chunk->data + chunk->head)) + 1;
+		}
+		total += n;
+		if (chunk == queue->last) {
+			break;
+		}
+	}
+	return 0;
+}
+
+int sendqueue_consume(sendqueue_t *queue, size_t len) {
+	if (len > queue->bytes) {
+		return 1;
+	}
+	queue->bytes -= len;
+	while (len > 0) {
+		struct sendqueue_chunk *chunk = queue->first;
+		size_t n = chunk->tail - chunk->head;
+		if (n > len) {
+			chunk->head += len;
+			return 0;
+		}
+		len -= n;
+		chunk->head = chunk->tail;
+		if (chunk != queue->last) {
+			queue->first = chunk->next;
+			sendqueue_chunk_put(queue->pool, chunk);
+		}
+	}
+	// Once everything has been sent the last chunk can be reused from
+	// the start.
+	if (queue->bytes == 0 && queue->first != NULL) {
+		queue->first->head = 0;
+		queue->first->tail = 0;
+	}
+	return 0;
+}
+
+void sendqueue_destroy(sendqueue_t *queue) {
+	struct sendqueue_chunk *chunk, *next;
+	for (chunk = queue->first; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		sendqueue_chunk_put(queue->pool, chunk);
+	}
+	queue->first = NULL;
+	queue->last = NULL;
+	queue->bytes = 0;
+}
@@ -0,0 +1,92 @@
+// A send queue made of a linked list of fixed size chunks. Appending
+// copies only the new data, no matter how much is already queued, and
+// the queued data is handed to the kernel as an iovec array. Empty
+// chunks are kept on a free list in a pool so that a backed up backend
+// does not cause a stream of malloc/free calls as it drains.
+
+#ifndef STATSRELAY_SENDQUEUE_H
+#define STATSRELAY_SENDQUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define SENDQUEUE_CHUNK_SIZE 16384
+#define SENDQUEUE_POOL_MAX_FREE 256	// 4MB of idle chunks
+
+struct sendqueue_chunk {
+	struct sendqueue_chunk *next;
+	size_t head;	// offset of the first unsent byte
+	size_t tail;	// offset one past the last queued byte
+	char data[SENDQUEUE_CHUNK_SIZE];
+};
+
+// The pool is not thread safe; every queue that uses it must belong to
+// the same event loop.
+typedef struct sendqueue_pool {
+	struct sendqueue_chunk *free_list;
+	size_t num_free;
+	size_t max_free;
+} sendqueue_pool_t;
+
+// A position in a queue, used to walk the queued data without
+// consuming it. A cursor is invalidated by sendqueue_consume.
+struct sendqueue_cursor {
+	struct sendqueue_chunk *chunk;
+	size_t pos;
+};
+
+typedef struct sendqueue {
+	sendqueue_pool_t *pool;
+	struct sendqueue_chunk *first;
+	struct sendqueue_chunk *last;
+	size_t bytes;
+} sendqueue_t;
+
+// Keep at most max_free idle chunks around, anything beyond that is
+// returned to the allocator.
+void sendqueue_pool_init(sendqueue_pool_t *pool, size_t max_free);
+
+void sendqueue_pool_destroy(sendqueue_pool_t *pool);
+
+void sendqueue_init(sendqueue_t *queue, sendqueue_pool_t *pool);
+
+// Returns the number of queued bytes
+size_t sendqueue_datacount(const sendqueue_t *queue);
+
+// Copy len bytes to the end of the queue, returns non-zero if memory
+// could not be allocated (in which case nothing is queued).
+int sendqueue_append(sendqueue_t *queue, const char *data, size_t len);
+
+// Fill in up to max_iov iovecs describing the queued data, starting at
+// the oldest byte. Each iovec covers (part of) one chunk. Returns the
+// number of iovecs used.
+int sendqueue_iov(sendqueue_t *queue, struct iovec *iov, int max_iov);
+
+void sendqueue_cursor_init(sendqueue_t *queue, struct sendqueue_cursor *cursor);
+
+// Describe the longest run of whole records (each ending with sep) of
+// at most max_len bytes, starting at the cursor, and move the cursor
+// past it. A record longer than max_len is returned on its own. Returns
+// the length of the run, or 0 if there is no complete record left or
+// the run would need more than max_iov iovecs.
+size_t sendqueue_next_records(sendqueue_t *queue,
+			      struct sendqueue_cursor *cursor,
+			      size_t max_len,
+			      char sep,
+			      struct iovec *iov,
+			      int max_iov,
+			      int *iovcnt);
+
+// The length of the oldest record, including its sep, or 0 if the queue
+// doesn't hold a complete record
+size_t sendqueue_record_len(const sendqueue_t *queue, char sep);
+
+// Drop len bytes from the front of the queue, returning drained chunks
+// to the pool.
+int sendqueue_consume(sendqueue_t *queue, size_t len);
+
+// Release every chunk back to the pool
+void sendqueue_destroy(sendqueue_t *queue);
+
+#endif  // STATSRELAY_SENDQUEUE_H
@@ -3,56 +3,200 @@
 #include "./log.h"
 
 #include <ev.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 
+// Reloads of the worker threads are handed off to their event loops,
+// and the main thread waits here until all of them are done.
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reload_cond = PTHREAD_COND_INITIALIZER;
+static size_t reloads_pending = 0;
+
 static void init_server(struct server *server) {
 	server->enabled = false;
-	server->server = NULL;
-	server->ts = NULL;
-	server->us = NULL;
+	server->num_workers = 0;
+	server->workers = NULL;
+	server->stats_servers = NULL;
 }
 
-static bool connect_server(struct server *server,
-			   struct proto_config *config,
-			   protocol_parser_t parser,
-			   validate_line_validator_t validator,
-			   const char *name) {
-	if (config->ring->size == 0) {
-		stats_log("%s has no backends, skipping", name);
-		return false;
-	}
+static void *run_worker(void *arg) {
+	struct server_worker *worker = (struct server_worker *) arg;
+	ev_run(worker->loop, 0);
+	return NULL;
+}
 
-	struct ev_loop *loop = ev_default_loop(0);
+static void stop_worker(struct ev_loop *loop, ev_async *watcher, int revents) {
+	ev_break(loop, EVBREAK_ALL);
+}
 
-	server->server = stats_server_create(
-		loop, config, parser, validator);
+static void reload_worker(struct ev_loop *loop, ev_async *watcher, int revents) {
+	struct server_worker *worker = (struct server_worker *) watcher->data;
+	bool failed = stats_server_reload(worker->server, worker->reload_config) != 0;
 
-	server->enabled = true;
+	pthread_mutex_lock(&reload_lock);
+	worker->reload_failed = failed;
+	reloads_pending--;
+	pthread_cond_signal(&reload_cond);
+	pthread_mutex_unlock(&reload_lock);
+}
+
+// bind is a comma separated list of addresses. Each host:port gets a
+// TCP and a UDP listener, unix:/path a unix stream socket and
+// unixgram:/path a unix datagram socket. Every worker has listeners of
+// its own on each host:port, but a unix socket can only be bound once,
+// so only the first worker listens on those.
+static bool bind_worker(struct server_worker *worker, const char *bind, bool first) {
+	char *addresses = strdup(bind);
+	char *save = NULL;
+	bool ok = true;
+
+	if (addresses == NULL) {
+		stats_error_log("failed to allocate bind addresses");
+		return false;
+	}
+	for (char *address = strtok_r(addresses, ", ", &save);
+	     address != NULL && ok;
+	     address = strtok_r(NULL, ", ", &save)) {
+		if (strncmp(address, "unixgram:", 9) == 0) {
+			if (first && udpserver_bind_unix(worker->us, address + 9, stats_udp_recv) != 0) {
+				stats_error_log("unable to bind %s", address);
+				ok = false;
+			}
+		} else if (strncmp(address, "unix:", 5) == 0) {
+			if (first && tcpserver_bind_unix(worker->ts, address + 5, stats_connection,
+							 stats_recv, stats_connection_closed) != 0) {
+				stats_error_log("unable to bind %s", address);
+				ok = false;
+			}
+		} else if (tcpserver_bind(worker->ts, address,
+					  stats_connection, stats_recv, stats_connection_closed) != 0) {
+			stats_error_log("unable to bind tcp %s", address);
+			ok = false;
+		} else if (udpserver_bind(worker->us, address, stats_udp_recv) != 0) {
+			stats_error_log("unable to bind udp %s", address);
+			ok = false;
+		}
+	}
+	free(addresses);
+	return ok;
+}
 
-	if (server->server == NULL) {
+static bool connect_worker(struct server_worker *worker,
+			   struct proto_config *config,
+			   protocol_parser_t parser,
+			   validate_line_validator_t validator,
+			   bool first) {
+	worker->server = stats_server_create(
+		worker->loop, config, parser, validator);
+
+	if (worker->server == NULL) {
 		stats_error_log("main: Unable to create stats_server");
 		return false;
 	}
-	server->ts = tcpserver_create(loop, server->server);
-	if (server->ts == NULL) {
+	worker->ts = tcpserver_create(worker->loop, config, worker->server);
+	if (worker->ts == NULL) {
 		stats_error_log("failed to create tcpserver");
 		return false;
 	}
 
-	server->us = udpserver_create(loop, server->server);
-	if (server->us == NULL) {
+	worker->us = udpserver_create(worker->loop, config, worker->server);
+	if (worker->us == NULL) {
 		stats_error_log("failed to create udpserver");
 		return false;
 	}
 
-	if (tcpserver_bind(server->ts, config->bind, stats_connection, stats_recv) != 0) {
-		stats_error_log("unable to bind tcp %s", config->bind);
+	return bind_worker(worker, config->bind, first);
+}
+
+static bool start_worker(struct server_worker *worker) {
+	sigset_t all_signals, orig_signals;
+
+	ev_async_init(&worker->stop_watcher, stop_worker);
+	ev_async_start(worker->loop, &worker->stop_watcher);
+	ev_async_init(&worker->reload_watcher, reload_worker);
+	worker->reload_watcher.data = worker;
+	ev_async_start(worker->loop, &worker->reload_watcher);
+
+	// Signals are handled by the default loop in the main thread, so
+	// keep them from being delivered to the worker.
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &orig_signals);
+	int err = pthread_create(&worker->thread, NULL, run_worker, worker);
+	pthread_sigmask(SIG_SETMASK, &orig_signals, NULL);
+	if (err != 0) {
+		stats_error_log("failed to start worker thread: %s", strerror(err));
 		return false;
 	}
-	if (udpserver_bind(server->us, config->bind, stats_udp_recv) != 0) {
-		stats_error_log("unable to bind udp %s", config->bind);
+	worker->running = true;
+	return true;
+}
+
+static bool connect_server(struct server *server,
+			   struct proto_config *config,
+			   protocol_parser_t parser,
+			   validate_line_validator_t validator,
+			   const char *name) {
+	if (config->ring->size == 0) {
+		stats_log("%s has no backends, skipping", name);
 		return false;
 	}
+
+	server->enabled = true;
+
+	server->workers = calloc(config->workers, sizeof(struct server_worker));
+	server->stats_servers = calloc(config->workers, sizeof(stats_server_t *));
+	if (server->workers == NULL || server->stats_servers == NULL) {
+		stats_error_log("failed to allocate %s workers", name);
+		return false;
+	}
+
+	for (size_t i = 0; i < config->workers; i++) {
+		struct server_worker *worker = &server->workers[i];
+		if (i == 0) {
+			worker->loop = ev_default_loop(0);
+		} else {
+			worker->loop = ev_loop_new(EVFLAG_AUTO);
+			if (worker->loop == NULL) {
+				stats_error_log("failed to create event loop for %s worker %zd", name, i);
+				return false;
+			}
+		}
+		server->num_workers++;
+
+		if (!connect_worker(worker, config, parser, validator, i == 0)) {
+			return false;
+		}
+		server->stats_servers[i] = worker->server;
+	}
+
+	if (config->admin_bind != NULL) {
+		struct server_worker *worker = &server->workers[0];
+		worker->admin = admin_server_create(worker->loop, worker->server);
+		if (worker->admin == NULL) {
+			stats_error_log("failed to create %s admin server", name);
+			return false;
+		}
+		if (admin_server_bind(worker->admin, config->admin_bind) != 0) {
+			stats_error_log("unable to bind admin %s", config->admin_bind);
+			return false;
+		}
+	}
+
+	if (server->num_workers > 1) {
+		for (size_t i = 0; i < server->num_workers; i++) {
+			stats_server_set_peers(server->workers[i].server,
+					       server->stats_servers,
+					       server->num_workers);
+		}
+		for (size_t i = 1; i < server->num_workers; i++) {
+			if (!start_worker(&server->workers[i])) {
+				return false;
+			}
+		}
+		stats_log("%s: started %zd workers", name, server->num_workers);
+	}
 	return true;
 }
 
@@ -60,21 +204,179 @@ static void destroy_server(struct server *server) {
 	if (!server->enabled) {
 		return;
 	}
-	if (server->ts != NULL) {
-		tcpserver_destroy(server->ts);
+	for (size_t i = 0; i < server->num_workers; i++) {
+		struct server_worker *worker = &server->workers[i];
+		if (worker->running) {
+			ev_async_send(worker->loop, &worker->stop_watcher);
+			pthread_join(worker->thread, NULL);
+			worker->running = false;
+		}
+	}
+	for (size_t i = 0; i < server->num_workers; i++) {
+		struct server_worker *worker = &server->workers[i];
+		admin_server_destroy(worker->admin);
+		if (worker->ts != NULL) {
+			tcpserver_destroy(worker->ts);
+		}
+		if (worker->us != NULL) {
+			udpserver_destroy(worker->us);
+		}
+		if (worker->server != NULL) {
+			stats_server_destroy(worker->server);
+		}
+		if (i > 0 && worker->loop != NULL) {
+			ev_async_stop(worker->loop, &worker->stop_watcher);
+			ev_async_stop(worker->loop, &worker->reload_watcher);
+			ev_loop_destroy(worker->loop);
+		}
+	}
+	free(server->workers);
+	free(server->stats_servers);
+	init_server(server);
+}
+
+// Settings that only take effect when the listeners are created. The
+// new config gets the running values of the ones that are used after
+// startup.
+static void keep_listener_settings(struct proto_config *old_config,
+				   struct proto_config *new_config,
+				   const char *name) {
+	if (strcmp(old_config->bind, new_config->bind) != 0) {
+		stats_error_log("%s: bind changed to %s, restart to apply it",
+				name, new_config->bind);
+	}
+	if ((old_config->admin_bind == NULL) != (new_config->admin_bind == NULL) ||
+	    (old_config->admin_bind != NULL &&
+	     strcmp(old_config->admin_bind, new_config->admin_bind) != 0)) {
+		stats_error_log("%s: admin_bind changed, restart to apply it", name);
+	}
+
+	if (old_config->workers != new_config->workers) {
+		stats_error_log("%s: workers changed to %u, restart to apply it",
+				name, new_config->workers);
+		new_config->workers = old_config->workers;
+	}
+	if (old_config->egress_threads != new_config->egress_threads) {
+		stats_error_log("%s: egress_threads changed to %u, restart to apply it",
+				name, new_config->egress_threads);
+		new_config->egress_threads = old_config->egress_threads;
 	}
-	if (server->us != NULL) {
-		udpserver_destroy(server->us);
+	if (old_config->connections != new_config->connections) {
+		stats_error_log("%s: connections changed to %u, restart to apply it",
+				name, new_config->connections);
+		new_config->connections = old_config->connections;
 	}
-	if (server->server != NULL) {
-		stats_server_destroy(server->server);
+	if (old_config->udp_batch_size != new_config->udp_batch_size) {
+		stats_error_log("%s: udp_batch_size changed to %u, restart to apply it",
+				name, new_config->udp_batch_size);
+		new_config->udp_batch_size = old_config->udp_batch_size;
 	}
 }
 
+// Reload every worker of a server. The first worker runs on this
+// thread; the others reload on their own threads, and this waits for
+// them.
+static bool reload_server(struct server *server, struct proto_config *config) {
+	bool ok = true;
+
+	pthread_mutex_lock(&reload_lock);
+	for (size_t i = 1; i < server->num_workers; i++) {
+		struct server_worker *worker = &server->workers[i];
+		worker->reload_config = config;
+		worker->reload_failed = false;
+		reloads_pending++;
+		ev_async_send(worker->loop, &worker->reload_watcher);
+	}
+	pthread_mutex_unlock(&reload_lock);
+
+	if (stats_server_reload(server->workers[0].server, config) != 0) {
+		ok = false;
+	}
+
+	pthread_mutex_lock(&reload_lock);
+	while (reloads_pending > 0) {
+		pthread_cond_wait(&reload_cond, &reload_lock);
+	}
+	for (size_t i = 1; i < server->num_workers; i++) {
+		if (server->workers[i].reload_failed) {
+			ok = false;
+		}
+	}
+	pthread_mutex_unlock(&reload_lock);
+	return ok;
+}
+
+bool reload_server_collection(struct server_collection *server_collection,
+			      struct config *config) {
+	struct config *old_config = server_collection->config;
+	struct {
+		struct server *server;
+		struct proto_config *old_config;
+		struct proto_config *new_config;
+		const char *name;
+	} protocols[] = {
+		{&server_collection->carbon_server, &old_config->carbon_config, &config->carbon_config, "carbon"},
+		{&server_collection->statsd_server, &old_config->statsd_config, &config->statsd_config, "statsd"}
+	};
+	const size_t num_protocols = sizeof(protocols) / sizeof(protocols[0]);
+
+	for (size_t i = 0; i < num_protocols; i++) {
+		if (!protocols[i].server->enabled) {
+			if (protocols[i].new_config->ring->size > 0) {
+				stats_error_log("%s was not enabled at startup, restart to enable it",
+						protocols[i].name);
+			}
+			continue;
+		}
+		if (protocols[i].new_config->ring->size == 0) {
+			stats_error_log("%s has no backends in the new config, not reloading",
+					protocols[i].name);
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < num_protocols; i++) {
+		if (!protocols[i].server->enabled) {
+			continue;
+		}
+		keep_listener_settings(protocols[i].old_config,
+				       protocols[i].new_config,
+				       protocols[i].name);
+		if (reload_server(protocols[i].server, protocols[i].new_config)) {
+			continue;
+		}
+
+		// Put back the old config everywhere, which also brings back
+		// any backends that started draining.
+		stats_error_log("%s: reload failed, reverting to the previous config",
+				protocols[i].name);
+		bool reverted = true;
+		for (size_t j = 0; j <= i; j++) {
+			if (protocols[j].server->enabled &&
+			    !reload_server(protocols[j].server, protocols[j].old_config)) {
+				reverted = false;
+			}
+		}
+		if (!reverted) {
+			// Some worker is stuck on the new config, so neither
+			// one can be freed.
+			stats_error_log("failed to revert the config, the previous config is leaked");
+			server_collection->config = config;
+			return true;
+		}
+		return false;
+	}
+
+	server_collection->config = config;
+	destroy_config(old_config);
+	return true;
+}
+
 void init_server_collection(struct server_collection *server_collection,
 			    const char *filename) {
 	server_collection->initialized = true;
 	server_collection->config_file = strdup(filename);
+	server_collection->config = NULL;
 	init_server(&server_collection->carbon_server);
 	init_server(&server_collection->statsd_server);
 }
@@ -82,6 +384,7 @@ void init_server_collection(struct server_collection *server_collection,
 bool connect_server_collection(struct server_collection *server_collection,
 			       struct config *config) {
 	bool enabled_any = false;
+	server_collection->config = config;
 	enabled_any |= connect_server(&server_collection->carbon_server,
 				      &config->carbon_config,
 				      protocol_parser_carbon,
@@ -103,6 +406,10 @@ void destroy_server_collection(struct server_collection *server_collection) {
 		free(server_collection->config_file);
 		destroy_server(&server_collection->carbon_server);
 		destroy_server(&server_collection->statsd_server);
+		if (server_collection->config != NULL) {
+			destroy_config(server_collection->config);
+			server_collection->config = NULL;
+		}
 		server_collection->initialized = false;
 	}
 }
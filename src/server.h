@@ -1,23 +1,42 @@
 #ifndef STATSRELAY_SERVER_H
 #define STATSRELAY_SERVER_H
 
+#include "./admin.h"
 #include "./stats.h"
 #include "./tcpserver.h"
 #include "./udpserver.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 
-struct server {
-	bool enabled;
+// A worker owns an event loop along with its own listeners and its own
+// backend connections. The first worker runs on the default loop in
+// the main thread, every other worker gets a thread of its own.
+struct server_worker {
 	stats_server_t *server;
 	tcpserver_t *ts;
 	udpserver_t *us;
+	admin_server_t *admin;		// only on the first worker
 	struct ev_loop *loop;
+	ev_async stop_watcher;
+	ev_async reload_watcher;
+	struct proto_config *reload_config;
+	bool reload_failed;
+	pthread_t thread;
+	bool running;
+};
+
+struct server {
+	bool enabled;
+	size_t num_workers;
+	struct server_worker *workers;
+	stats_server_t **stats_servers;
 };
 
 struct server_collection {
 	bool initialized;
 	char *config_file;
+	struct config *config;
 	struct server statsd_server;
 	struct server carbon_server;
 };
@@ -25,9 +44,16 @@ struct server_collection {
 void init_server_collection(struct server_collection *server_collection,
 			    const char *filename);
 
+// The collection takes ownership of the config
 bool connect_server_collection(struct server_collection *server_collection,
 			       struct config *config);
 
+// Switch every server over to a freshly loaded config, which the
+// collection takes ownership of on success. Returns false (and keeps
+// the old config) if it can't be applied.
+bool reload_server_collection(struct server_collection *server_collection,
+			      struct config *config);
+
 void destroy_server_collection(struct server_collection *server_collection);
 
 #endif  // STATSRELAY_SERVER_H
@@ -0,0 +1,374 @@
+#include "spool.h"
+#include "log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPOOL_SEGMENT_SUFFIX ".seg"
+#define SPOOL_OFFSET_FILE "offset"
+
+static void spool_segment_path(const spool_t *spool, uint64_t seq, char *path, size_t len) {
+	snprintf(path, len, "%s/%016" PRIx64 SPOOL_SEGMENT_SUFFIX, spool->path, seq);
+}
+
+// Parse a segment file name, returns false for anything else
+static bool spool_parse_segment(const char *name, uint64_t *seq) {
+	char *endptr;
+	if (strlen(name) != 16 + strlen(SPOOL_SEGMENT_SUFFIX)) {
+		return false;
+	}
+	*seq = strtoull(name, &endptr, 16);
+	return endptr == name + 16 && strcmp(endptr, SPOOL_SEGMENT_SUFFIX) == 0;
+}
+
+static int spool_mkdir(const char *path) {
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		stats_error_log("spool: unable to create %s: %s", path, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+// Pick the first instance directory not locked by someone else
+static int spool_lock(spool_t *spool, const char *base_dir, const char *name) {
+	char path[PATH_MAX];
+
+	for (int i = 0; i < SPOOL_MAX_INSTANCES; i++) {
+		snprintf(path, sizeof(path), "%s/%s.%d", base_dir, name, i);
+		if (spool_mkdir(path) != 0) {
+			return 1;
+		}
+		size_t len = strlen(path);
+		snprintf(path + len, sizeof(path) - len, "/lock");
+		int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			stats_error_log("spool: unable to open %s: %s", path, strerror(errno));
+			return 1;
+		}
+		if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+			path[len] = '\0';
+			if ((spool->path = strdup(path)) == NULL) {
+				stats_error_log("spool: unable to allocate path");
+				close(fd);
+				return 1;
+			}
+			spool->lock_fd = fd;
+			return 0;
+		}
+		close(fd);
+		if (errno != EWOULDBLOCK) {
+			stats_error_log("spool: unable to lock %s: %s", path, strerror(errno));
+			return 1;
+		}
+	}
+	stats_error_log("spool: all %d spool directories for %s are in use",
+			SPOOL_MAX_INSTANCES, name);
+	return 1;
+}
+
+// Find the segments left behind by a previous run, and how far into the
+// oldest one it got.
+static int spool_recover(spool_t *spool) {
+	char path[PATH_MAX];
+	struct dirent *entry;
+	struct stat st;
+	uint64_t seq, min_seq = UINT64_MAX, max_seq = 0;
+	bool found = false;
+
+	DIR *dir = opendir(spool->path);
+	if (dir == NULL) {
+		stats_error_log("spool: unable to read %s: %s", spool->path, strerror(errno));
+		return 1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (!spool_parse_segment(entry->d_name, &seq)) {
+			continue;
+		}
+		spool_segment_path(spool, seq, path, sizeof(path));
+		if (stat(path, &st) != 0) {
+			continue;
+		}
+		spool->bytes += st.st_size;
+		if (seq < min_seq) {
+			min_seq = seq;
+		}
+		if (seq > max_seq) {
+			max_seq = seq;
+		}
+		found = true;
+	}
+	closedir(dir);
+
+	if (!found) {
+		return 0;
+	}
+	spool->read_seq = min_seq;
+	spool->next_seq = max_seq + 1;
+
+	snprintf(path, sizeof(path), "%s/" SPOOL_OFFSET_FILE, spool->path);
+	FILE *offset_file = fopen(path, "r");
+	if (offset_file != NULL) {
+		uint64_t offset;
+		if (fscanf(offset_file, "%" SCNu64 " %" SCNu64, &seq, &offset) == 2 &&
+		    seq == spool->read_seq && offset <= spool->bytes) {
+			spool->read_offset = offset;
+			spool->bytes -= offset;
+		}
+		fclose(offset_file);
+		unlink(path);
+	}
+	stats_log("spool: recovered %" PRIu64 " bytes in %s", spool->bytes, spool->path);
+	return 0;
+}
+
+int spool_open(spool_t *spool,
+	       const char *base_dir,
+	       const char *name,
+	       uint64_t max_bytes,
+	       size_t segment_size) {
+	spool->path = NULL;
+	spool->lock_fd = -1;
+	spool->read_seq = 0;
+	spool->next_seq = 0;
+	spool->read_fd = -1;
+	spool->read_offset = 0;
+	spool->write_fd = -1;
+	spool->write_size = 0;
+	spool->write_buf = NULL;
+	spool->write_buf_len = 0;
+	spool->segment_size = segment_size;
+	spool->bytes = 0;
+	spool->max_bytes = max_bytes;
+
+	if (spool_mkdir(base_dir) != 0 || spool_lock(spool, base_dir, name) != 0) {
+		return 1;
+	}
+	if (spool_recover(spool) != 0) {
+		spool_close(spool);
+		return 1;
+	}
+	return 0;
+}
+
+uint64_t spool_datacount(const spool_t *spool) {
+	return spool->bytes;
+}
+
+// Everything has been read back, remove the segments
+static void spool_reset(spool_t *spool) {
+	char path[PATH_MAX];
+
+	if (spool->read_fd >= 0) {
+		close(spool->read_fd);
+		spool->read_fd = -1;
+	}
+	if (spool->write_fd >= 0) {
+		close(spool->write_fd);
+		spool->write_fd = -1;
+	}
+	for (; spool->read_seq < spool->next_seq; spool->read_seq++) {
+		spool_segment_path(spool, spool->read_seq, path, sizeof(path));
+		unlink(path);
+	}
+	spool->read_offset = 0;
+	spool->write_size = 0;
+	spool->write_buf_len = 0;
+	spool->bytes = 0;
+}
+
+// Write len bytes to the end of the newest segment, creating it if need
+// be. The bytes are already counted in write_size.
+static int spool_write(spool_t *spool, const char *data, size_t len) {
+	char path[PATH_MAX];
+
+	if (spool->write_fd < 0) {
+		spool_segment_path(spool, spool->next_seq, path, sizeof(path));
+		spool->write_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+		if (spool->write_fd < 0) {
+			stats_error_log("spool: unable to create %s: %s", path, strerror(errno));
+			return 2;
+		}
+		spool->next_seq++;
+	}
+
+	size_t written = 0;
+	while (written < len) {
+		ssize_t n = write(spool->write_fd, data + written, len - written);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			stats_error_log("spool: write to %s failed: %s", spool->path, strerror(errno));
+			// Don't leave half a line behind
+			if (ftruncate(spool->write_fd, spool->write_size - len) != 0) {
+				close(spool->write_fd);
+				spool->write_fd = -1;
+			}
+			return 2;
+		}
+		written += n;
+	}
+	return 0;
+}
+
+int spool_flush(spool_t *spool) {
+	const size_t len = spool->write_buf_len;
+
+	if (len == 0) {
+		return 0;
+	}
+	spool->write_buf_len = 0;
+	if (spool_write(spool, spool->write_buf, len) != 0) {
+		stats_error_log("spool: dropped %zd buffered bytes", len);
+		spool->write_size -= len;
+		spool->bytes -= len;
+		return 2;
+	}
+	return 0;
+}
+
+int spool_append(spool_t *spool, const char *data, size_t len) {
+	if (spool->bytes + len > spool->max_bytes) {
+		return 1;
+	}
+	if (spool->write_size > 0 && spool->write_size + len > spool->segment_size) {
+		if (spool_flush(spool) != 0) {
+			return 2;
+		}
+		if (spool->write_fd >= 0) {
+			close(spool->write_fd);
+			spool->write_fd = -1;
+		}
+		spool->write_size = 0;
+	}
+	if (spool->write_buf_len + len > SPOOL_WRITE_SIZE && spool_flush(spool) != 0) {
+		return 2;
+	}
+
+	if (len > SPOOL_WRITE_SIZE) {
+		// Too big to buffer
+		spool->write_size += len;
+		if (spool_write(spool, data, len) != 0) {
+			spool->write_size -= len;
+			return 2;
+		}
+	} else {
+		if (spool->write_buf == NULL &&
+		    (spool->write_buf = malloc(SPOOL_WRITE_SIZE)) == NULL) {
+			stats_error_log("spool: unable to allocate a write buffer");
+			return 2;
+		}
+		memcpy(spool->write_buf + spool->write_buf_len, data, len);
+		spool->write_buf_len += len;
+		spool->write_size += len;
+	}
+	spool->bytes += len;
+	return 0;
+}
+
+ssize_t spool_read(spool_t *spool, char *buf, size_t len) {
+	char path[PATH_MAX];
+
+	// Lines that can't be written are dropped, the rest can be read
+	spool_flush(spool);
+	while (spool->bytes > 0 && spool->read_seq < spool->next_seq) {
+		if (spool->read_fd < 0) {
+			spool_segment_path(spool, spool->read_seq, path, sizeof(path));
+			spool->read_fd = open(path, O_RDONLY | O_CLOEXEC);
+			if (spool->read_fd < 0) {
+				if (errno == ENOENT) {
+					spool->read_seq++;
+					spool->read_offset = 0;
+					continue;
+				}
+				stats_error_log("spool: unable to open %s: %s", path, strerror(errno));
+				return -1;
+			}
+		}
+
+		ssize_t n = pread(spool->read_fd, buf, len, spool->read_offset);
+		if (n < 0) {
+			stats_error_log("spool: read from %s failed: %s", spool->path, strerror(errno));
+			return -1;
+		}
+		if (n == 0) {
+			if (spool->read_seq + 1 == spool->next_seq) {
+				break;
+			}
+			close(spool->read_fd);
+			spool->read_fd = -1;
+			spool_segment_path(spool, spool->read_seq, path, sizeof(path));
+			unlink(path);
+			spool->read_seq++;
+			spool->read_offset = 0;
+			continue;
+		}
+
+		size_t taken = n;
+		while (taken > 0 && buf[taken - 1] != '\n') {
+			taken--;
+		}
+		if (taken == 0) {
+			if ((size_t) n < len || len >= SPOOL_READ_SIZE) {
+				// The segment ends without a newline, or the line
+				// is too long to ever fit
+				taken = n;
+			} else {
+				return 0;
+			}
+		}
+		spool->read_offset += taken;
+		spool->bytes = taken < spool->bytes ? spool->bytes - taken : 0;
+		if (spool->bytes == 0) {
+			spool_reset(spool);
+		}
+		return taken;
+	}
+
+	if (spool->bytes > 0) {
+		stats_error_log("spool: %s is missing %" PRIu64 " bytes", spool->path, spool->bytes);
+	}
+	spool_reset(spool);
+	return 0;
+}
+
+void spool_close(spool_t *spool) {
+	char path[PATH_MAX];
+
+	spool_flush(spool);
+	if (spool->path != NULL && spool->bytes > 0 && spool->read_offset > 0) {
+		snprintf(path, sizeof(path), "%s/" SPOOL_OFFSET_FILE, spool->path);
+		FILE *offset_file = fopen(path, "w");
+		if (offset_file != NULL) {
+			fprintf(offset_file, "%" PRIu64 " %" PRIu64 "\n",
+				spool->read_seq, (uint64_t) spool->read_offset);
+			fclose(offset_file);
+		}
+	}
+	if (spool->read_fd >= 0) {
+		close(spool->read_fd);
+		spool->read_fd = -1;
+	}
+	if (spool->write_fd >= 0) {
+		close(spool->write_fd);
+		spool->write_fd = -1;
+	}
+	if (spool->lock_fd >= 0) {
+		close(spool->lock_fd);
+		spool->lock_fd = -1;
+	}
+	free(spool->write_buf);
+	spool->write_buf = NULL;
+	free(spool->path);
+	spool->path = NULL;
+}
@@ -0,0 +1,70 @@
+// An on-disk overflow queue for a backend. Lines are appended to
+// numbered segment files in a directory of their own and read back in
+// the same order; a segment is unlinked once it has been replayed.
+// Appended lines are buffered in memory and written out in batches, so
+// spooling doesn't cost a system call per line.
+// Segments left over from a previous run are picked up when the spool
+// is opened, so an outage that spans a restart does not lose data.
+
+#ifndef STATSRELAY_SPOOL_H
+#define STATSRELAY_SPOOL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SPOOL_SEGMENT_SIZE 16777216	// 16MB
+#define SPOOL_READ_SIZE 65536
+#define SPOOL_WRITE_SIZE 1048576	// appended bytes buffered before a write
+#define SPOOL_MAX_INSTANCES 256
+
+typedef struct spool {
+	char *path;		// directory holding the segments
+	int lock_fd;
+	uint64_t read_seq;	// oldest segment
+	uint64_t next_seq;	// sequence number of the next new segment
+	int read_fd;
+	off_t read_offset;
+	int write_fd;
+	size_t write_size;	// of the newest segment, including the buffer
+	char *write_buf;	// allocated on the first append
+	size_t write_buf_len;
+	size_t segment_size;
+	uint64_t bytes;		// bytes written but not yet read back
+	uint64_t max_bytes;
+} spool_t;
+
+// Open (creating if needed) the spool called name under base_dir. Each
+// open spool holds an flock on its directory, so several workers
+// relaying to the same backend get directories of their own
+// (name.0, name.1, ...). Returns non-zero on failure.
+int spool_open(spool_t *spool,
+	       const char *base_dir,
+	       const char *name,
+	       uint64_t max_bytes,
+	       size_t segment_size);
+
+// Returns the number of bytes waiting to be read
+uint64_t spool_datacount(const spool_t *spool);
+
+// Append len bytes, which should be one or more whole lines. They are
+// only written once SPOOL_WRITE_SIZE bytes are buffered, or by
+// spool_flush, spool_read or spool_close. Returns 0 on success, 1 if the
+// spool would grow past max_bytes and 2 on an I/O error; nothing is
+// appended in either failure case.
+int spool_append(spool_t *spool, const char *data, size_t len);
+
+// Write out the buffered lines. If that fails they are dropped from the
+// spool, and 2 is returned.
+int spool_flush(spool_t *spool);
+
+// Read up to len bytes of whole lines into buf and drop them from the
+// spool. Returns the number of bytes read, 0 if not even one line fits
+// in len bytes, or -1 on an I/O error. A line longer than
+// SPOOL_READ_SIZE is returned in pieces.
+ssize_t spool_read(spool_t *spool, char *buf, size_t len);
+
+// Close the spool, leaving any unread segments (and the buffered lines)
+// on disk
+void spool_close(spool_t *spool);
+
+#endif  // STATSRELAY_SPOOL_H
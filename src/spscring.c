@@ -0,0 +1,97 @@
+#include "spscring.h"
+
+#include <stdlib.h>
+
+// Every record starts with its length. This length means that the rest
+// of the ring was too short for the next record, which starts over at
+// the beginning.
+#define SPSC_RING_WRAP UINT64_MAX
+
+static size_t spsc_ring_record_size(size_t len) {
+	return sizeof(uint64_t) + ((len + 7) & ~(size_t) 7);
+}
+
+int spsc_ring_init(spsc_ring_t *ring, size_t size) {
+	size_t rounded = 64;
+	while (rounded < size) {
+		rounded *= 2;
+	}
+	ring->data = malloc(rounded);
+	if (ring->data == NULL) {
+		return 1;
+	}
+	ring->size = rounded;
+	ring->tail = 0;
+	ring->cached_head = 0;
+	ring->published_tail = 0;
+	ring->published_head = 0;
+	ring->head = 0;
+	ring->cached_tail = 0;
+	ring->peeked = 0;
+	return 0;
+}
+
+void *spsc_ring_reserve(spsc_ring_t *ring, size_t len) {
+	const size_t need = spsc_ring_record_size(len);
+	const size_t offset = ring->tail & (ring->size - 1);
+	const size_t skip = offset + need > ring->size ? ring->size - offset : 0;
+
+	if (need > ring->size / 2) {
+		return NULL;
+	}
+	if (ring->tail + skip + need - ring->cached_head > ring->size) {
+		ring->cached_head = __atomic_load_n(&ring->published_head, __ATOMIC_ACQUIRE);
+		if (ring->tail + skip + need - ring->cached_head > ring->size) {
+			return NULL;
+		}
+	}
+	if (skip > 0) {
+		*(uint64_t *) (ring->data + offset) = SPSC_RING_WRAP;
+		ring->tail += skip;
+	}
+	char *record = ring->data + (ring->tail & (ring->size - 1));
+	*(uint64_t *) record = len;
+	ring->tail += need;
+	return record + sizeof(uint64_t);
+}
+
+size_t spsc_ring_unpublished(const spsc_ring_t *ring) {
+	return ring->tail - ring->published_tail;
+}
+
+void spsc_ring_publish(spsc_ring_t *ring) {
+	__atomic_store_n(&ring->published_tail, ring->tail, __ATOMIC_RELEASE);
+}
+
+void *spsc_ring_peek(spsc_ring_t *ring, size_t *len) {
+	while (1) {
+		if (ring->head == ring->cached_tail) {
+			// Give back everything read so far before looking
+			// for more
+			__atomic_store_n(&ring->published_head, ring->head, __ATOMIC_RELEASE);
+			ring->cached_tail = __atomic_load_n(&ring->published_tail, __ATOMIC_ACQUIRE);
+			if (ring->head == ring->cached_tail) {
+				return NULL;
+			}
+		}
+		const size_t offset = ring->head & (ring->size - 1);
+		const uint64_t record_len = *(uint64_t *) (ring->data + offset);
+		if (record_len == SPSC_RING_WRAP) {
+			ring->head += ring->size - offset;
+			continue;
+		}
+		*len = record_len;
+		ring->peeked = spsc_ring_record_size(record_len);
+		return ring->data + offset + sizeof(uint64_t);
+	}
+}
+
+void spsc_ring_consume(spsc_ring_t *ring) {
+	ring->head += ring->peeked;
+	ring->peeked = 0;
+}
+
+void spsc_ring_destroy(spsc_ring_t *ring) {
+	free(ring->data);
+	ring->data = NULL;
+}
@@ -0,0 +1,66 @@
+// A lock-free ring of variable length records, for exactly one producer
+// thread and one consumer thread. The producer reserves and fills in
+// records, and hands them over in batches with spsc_ring_publish; the
+// consumer gives space back each time it catches up with what has been
+// published. The two sides keep their positions on cache lines of their
+// own, so they only share a line when a batch changes hands.
+
+#ifndef STATSRELAY_SPSCRING_H
+#define STATSRELAY_SPSCRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPSC_RING_CACHE_LINE 64
+
+typedef struct spsc_ring {
+	char *data;
+	size_t size;			// a power of two
+
+	// Only used by the producer
+	char pad0[SPSC_RING_CACHE_LINE];
+	uint64_t tail;			// end of the records reserved so far
+	uint64_t cached_head;		// published_head when last read
+
+	// Written by the producer, read by the consumer
+	char pad1[SPSC_RING_CACHE_LINE];
+	uint64_t published_tail;
+
+	// Written by the consumer, read by the producer
+	char pad2[SPSC_RING_CACHE_LINE];
+	uint64_t published_head;
+
+	// Only used by the consumer
+	char pad3[SPSC_RING_CACHE_LINE];
+	uint64_t head;			// start of the next record
+	uint64_t cached_tail;		// published_tail when last read
+	size_t peeked;			// space taken by the record being read
+	char pad4[SPSC_RING_CACHE_LINE];
+} spsc_ring_t;
+
+// size is rounded up to a power of two. Returns non-zero if memory ran
+// out.
+int spsc_ring_init(spsc_ring_t *ring, size_t size);
+
+// Producer: room for a record of len bytes, aligned for any field of up
+// to 8 bytes, or NULL if the ring is too full (or the record is larger
+// than half of the ring). The consumer doesn't see it until the next
+// spsc_ring_publish.
+void *spsc_ring_reserve(spsc_ring_t *ring, size_t len);
+
+// Producer: bytes reserved since the last spsc_ring_publish
+size_t spsc_ring_unpublished(const spsc_ring_t *ring);
+
+// Producer: hand every reserved record over to the consumer
+void spsc_ring_publish(spsc_ring_t *ring);
+
+// Consumer: the oldest published record and its length, or NULL if
+// there is none. The record stays valid until spsc_ring_consume.
+void *spsc_ring_peek(spsc_ring_t *ring, size_t *len);
+
+// Consumer: done with the record returned by spsc_ring_peek
+void spsc_ring_consume(spsc_ring_t *ring);
+
+void spsc_ring_destroy(spsc_ring_t *ring);
+
+#endif  // STATSRELAY_SPSCRING_H
@@ -6,54 +6,227 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
 
+#include "./aggregate.h"
+#include "./egress.h"
+#include "./hashlib.h"
 #include "./hashring.h"
+#include "./health.h"
+#include "./histogram.h"
 #include "./buffer.h"
+#include "./counter.h"
 #include "./log.h"
+#include "./pool.h"
+#include "./report.h"
+#include "./scan.h"
+#include "./selfstats.h"
 #include "./stats.h"
 #include "./tcpclient.h"
+#include "./tcpserver.h"
 #include "./validate.h"
 
-#define MAX_UDP_LENGTH 65536
+#define STATS_DRAIN_INTERVAL 1.0
+#define STATS_DRAIN_TIMEOUT 60	// seconds
+#define STATS_SAMPLE_EVERY 64	// lines between latency samples
+#define STATS_MAX_MARKERS 16
+#define STATS_SCAN_LINES 256	// lines indexed per pass over a buffer
+#define STATS_EGRESS_RING 8388608	// bytes of lines waiting for each egress thread
+#define STATS_SESSION_POOL_MAX_FREE 1024
+#define STATS_RESUME_INTERVAL 0.01	// seconds between checks of paused sessions
+#define STATS_LINE_BLOCKED 3	// a line waits for room in a full backend
+
+// A sampled line that is waiting in a backend's send queue: it has been
+// sent once bytes_sent reaches offset.
+struct stats_marker {
+	uint64_t offset;
+	uint64_t queued_at;
+};
 
+// A thread that owns the connections to a share of the backends, when
+// pipelined. The worker parses and hashes lines, and hands them over
+// through the egress ring.
 typedef struct {
-	tcpclient_t client;
+	egress_t egress;
+	sendqueue_pool_t send_pool;
+	bool full;			// the ring was full, and that was logged
+} stats_egress_t;
+
+typedef struct stats_backend stats_backend_t;
+typedef struct stats_session stats_session_t;
+typedef struct stats_counters stats_counters_t;
+
+// The counters of a backend on one worker, which the snapshot of any
+// worker reads. Each of them is only changed by the thread that sends
+// to the backend, apart from ring_dropped_lines and down, which the
+// worker changes. A worker keeps these until it's destroyed, even once
+// the backend is gone, so that a snapshot never reads freed memory; a
+// backend that comes back carries on with the same counters.
+struct stats_counters {
 	char *key;
 	uint64_t bytes_queued;
 	uint64_t bytes_sent;
+	uint64_t queued_bytes;		// in memory or spooled, not yet sent
+	uint64_t spooled_bytes;
 	uint64_t relayed_lines;
 	uint64_t dropped_lines;
-	int failing;
-} stats_backend_t;
+	uint64_t ring_dropped_lines;	// as the egress ring was full
+	uint64_t failing;		// 0 or 1
+	uint64_t down;			// 0 or 1
+	histogram_t queue_residence;
+	stats_counters_t *next;		// set with a release store
+};
+
+// One of the connections to a backend. All of the lines for a key go
+// over the same stream, so that they arrive in the order they were
+// received, while the streams themselves are sent in parallel.
+typedef struct {
+	tcpclient_t client;
+	stats_backend_t *backend;
+	uint64_t bytes_queued;
+	uint64_t bytes_sent;
+	uint64_t queued;		// as last added to the counters
+	uint64_t spooled;		// as last added to the counters
+	uint64_t failures;		// connects that failed in a row, a counter
+	struct stats_marker markers[STATS_MAX_MARKERS];
+	unsigned int first_marker;
+	unsigned int num_markers;
+} stats_stream_t;
+
+struct stats_backend {
+	stats_stream_t *streams;
+	size_t num_streams;
+	stats_egress_t *egress;		// NULL unless pipelined
+	char *key;
+	stats_counters_t *counters;
+	bool in_ring;
+	time_t drain_deadline;
+	aggregate_t *aggregate;		// NULL until a line is folded
+	health_t health;		// checked while failover is on
+};
 
+// The counters and histograms of a worker are read by the snapshots of
+// the other workers, so they are only changed through counter.h.
 struct stats_server_t {
 	struct ev_loop *loop;
 
 	uint64_t bytes_recv_udp;
 	uint64_t bytes_recv_tcp;
+	uint64_t udp_wakeups;
+	uint64_t udp_datagrams;
+	uint64_t udp_full_batches;
 	uint64_t total_connections;
 	uint64_t malformed_lines;
-	time_t last_reload;
+	uint64_t aggregated_lines;
+	uint64_t aggregate_lines_out;
+	uint64_t backpressure_pauses;
+	uint64_t last_reload;		// seconds since the epoch
+
+	// Latency of the stages a line goes through, in nanoseconds. Only
+	// every STATS_SAMPLE_EVERY'th line is timed.
+	unsigned int sample_countdown;
+	uint64_t recv_time;
+	histogram_t recv_to_enqueue;
+	histogram_t validate_time;
+	histogram_t hash_time;
+	histogram_t enqueue_time;
+
+	// How long each iteration of the event loop spends working, from
+	// waking up to going back to sleep
+	ev_check loop_wakeup_watcher;
+	ev_prepare loop_sleep_watcher;
+	uint64_t loop_wakeup;
+	histogram_t loop_iteration;
 
 	struct proto_config *config;
+	sendqueue_pool_t send_pool;
+
+	// Client sessions and their receive buffers, which are handed back
+	// to the pool whenever they are drained
+	pool_t session_pool;
+	bufpool_t buffer_pool;
+
+	// TCP sessions paused by backpressure, until the stream that each
+	// of them waits on has drained
+	stats_session_t *paused;
+	uint64_t num_paused;
+	ev_timer resume_watcher;
 	size_t num_backends;
 	stats_backend_t **backend_list;
 
+	// The counters of every backend this worker has had. Other workers
+	// walk the list, so it's only ever appended to.
+	stats_counters_t *counters;
+	stats_counters_t *last_counters;
+
+	// Backends that were dropped from the shard map by a reload, kept
+	// around until their send queue has been flushed.
+	size_t num_draining;
+	stats_backend_t **draining_list;
+	ev_timer drain_watcher;
+
+	// Flushes the per-backend aggregates
+	ev_timer aggregate_watcher;
+
+	// Checks the health of the backends, with failover
+	ev_timer health_watcher;
+
+	// Relays statsrelay's own metrics; only the first worker does this
+	ev_timer self_metrics_watcher;
+	selfstats_t selfstats;
+
+	// With egress_threads, backends are spread over the egress threads
+	// in turn. Counters of a backend are then updated by its egress
+	// thread, apart from ring_dropped_lines and down.
+	size_t num_egress;
+	stats_egress_t *egress;
+	size_t next_egress;
+
 	hashring_t ring;
 	protocol_parser_t parser;
+	char key_delimiter;
 	validate_line_validator_t validator;
+
+	// All of the servers for this protocol when running with
+	// multiple workers (including this one), so that the status
+	// command can report totals. Only their counters are read.
+	stats_server_t **peers;
+	size_t num_peers;
 };
 
-typedef struct {
+struct stats_session {
 	stats_server_t *server;
+	tcpsession_t *handle;
 	buffer_t buffer;
 	int sd;
-} stats_session_t;
+	stats_stream_t *waiting_on;	// while paused
+	bool held;			// lines from before a pause are still buffered
+	stats_session_t *next_paused;
+};
+
+// Keep the queued_bytes and spooled_bytes counters up to date with the
+// depth the stream's client published, on the thread that sends to the
+// stream. Bytes the client dropped come off here too.
+static void stats_count_depth(stats_stream_t *stream) {
+	stats_counters_t *counters = stream->backend->counters;
+	const uint64_t queued = tcpclient_queued(&stream->client);
+	const uint64_t spooled = tcpclient_spooled(&stream->client);
+	if (queued != stream->queued) {
+		counter_set(&counters->queued_bytes,
+			    counters->queued_bytes - stream->queued + queued);
+		stream->queued = queued;
+	}
+	if (spooled != stream->spooled) {
+		counter_set(&counters->spooled_bytes,
+			    counters->spooled_bytes - stream->spooled + spooled);
+		stream->spooled = spooled;
+	}
+}
 
 // callback after bytes are sent
 static int stats_sent(void *tcpclient,
@@ -61,11 +234,72 @@ static int stats_sent(void *tcpclient,
 		      void *context,
 		      char *data,
 		      size_t len) {
-	stats_backend_t *backend = (stats_backend_t *) context;
-	backend->bytes_sent += len;
+	stats_stream_t *stream = (stats_stream_t *) context;
+	stats_counters_t *counters = stream->backend->counters;
+	stream->bytes_sent += len;
+	counter_add(&counters->bytes_sent, len);
+	stats_count_depth(stream);
+	if (stream->num_markers > 0 &&
+	    stream->markers[stream->first_marker].offset <= stream->bytes_sent) {
+		const uint64_t now = histogram_now();
+		do {
+			histogram_record(&counters->queue_residence,
+					 now - stream->markers[stream->first_marker].queued_at);
+			stream->first_marker = (stream->first_marker + 1) % STATS_MAX_MARKERS;
+			stream->num_markers--;
+		} while (stream->num_markers > 0 &&
+			 stream->markers[stream->first_marker].offset <= stream->bytes_sent);
+	}
 	return 0;
 }
 
+// Remember when the last byte queued so far was queued, to time how
+// long it waits to be sent.
+static void stats_mark_queued(stats_stream_t *stream, uint64_t now) {
+	if (stream->num_markers == STATS_MAX_MARKERS) {
+		return;
+	}
+	struct stats_marker *marker = &stream->markers[
+		(stream->first_marker + stream->num_markers) % STATS_MAX_MARKERS];
+	marker->offset = stream->bytes_queued;
+	marker->queued_at = now;
+	stream->num_markers++;
+}
+
+static int stats_connected(void *tcpclient,
+			   enum tcpclient_event event,
+			   void *context,
+			   char *data,
+			   size_t len) {
+	counter_set(&((stats_stream_t *) context)->failures, 0);
+	return 0;
+}
+
+static int stats_connect_failed(void *tcpclient,
+				enum tcpclient_event event,
+				void *context,
+				char *data,
+				size_t len) {
+	stats_stream_t *stream = (stats_stream_t *) context;
+	counter_add(&stream->failures, 1);
+	stats_count_depth(stream);
+	return 0;
+}
+
+// The stream that the lines for a key go over. The shard was picked
+// from the same hash, by default from its remainder modulo the number
+// of shards, so the stream is picked from its high bits instead. That
+// spreads the keys of a shard over all of its streams.
+static stats_stream_t *stats_backend_stream(stats_backend_t *backend,
+					    const char *key,
+					    size_t key_len) {
+	if (backend->num_streams == 1) {
+		return &backend->streams[0];
+	}
+	const uint64_t hash = stats_hash_raw(key, key_len);
+	return &backend->streams[(hash * backend->num_streams) >> 32];
+}
+
 // Add a backend to the backend list.
 static int add_backend(stats_server_t *server, stats_backend_t *backend) {
 	stats_backend_t **new_backends = realloc(
@@ -84,7 +318,7 @@ static int add_backend(stats_server_t *server, stats_backend_t *backend) {
 // backends in the file which should be fine for any reasonable
 // configuration (say, less than 10,000 backend statsite or carbon
 // servers). Also note that while this is linear, it only happens
-// during statsrelay initialization, not when running.
+// during statsrelay initialization and reloads, not when running.
 static stats_backend_t *find_backend(stats_server_t *server, const char *key) {
 	for (size_t i = 0; i < server->num_backends; i++) {
 		stats_backend_t *backend = server->backend_list[i];
@@ -95,6 +329,64 @@ static stats_backend_t *find_backend(stats_server_t *server, const char *key) {
 	return NULL;
 }
 
+// Take a backend back off of the draining list, if it's on there.
+static stats_backend_t *undrain_backend(stats_server_t *server, const char *key) {
+	for (size_t i = 0; i < server->num_draining; i++) {
+		stats_backend_t *backend = server->draining_list[i];
+		if (strcmp(backend->key, key) == 0) {
+			server->draining_list[i] = server->draining_list[--server->num_draining];
+			if (add_backend(server, backend) != 0) {
+				server->draining_list[server->num_draining++] = backend;
+				return NULL;
+			}
+			stats_log("stats: backend %s is back in the shard map", backend->key);
+			return backend;
+		}
+	}
+	return NULL;
+}
+
+// The counters for a backend key, added to the list if this worker has
+// never had that backend before
+static stats_counters_t *stats_backend_counters(stats_server_t *server, const char *key) {
+	stats_counters_t *counters;
+	for (counters = server->counters; counters != NULL; counters = counters->next) {
+		if (strcmp(counters->key, key) == 0) {
+			counter_set(&counters->failing, 0);
+			counter_set(&counters->down, 0);
+			return counters;
+		}
+	}
+
+	counters = calloc(1, sizeof(stats_counters_t));
+	if (counters == NULL) {
+		return NULL;
+	}
+	counters->key = strdup(key);
+	if (counters->key == NULL) {
+		free(counters);
+		return NULL;
+	}
+	histogram_init(&counters->queue_residence);
+	__atomic_store_n(server->last_counters == NULL ?
+			 &server->counters : &server->last_counters->next,
+			 counters, __ATOMIC_RELEASE);
+	server->last_counters = counters;
+	return counters;
+}
+
+// The other workers must be stopped
+static void stats_destroy_counters(stats_server_t *server) {
+	stats_counters_t *counters, *next;
+	for (counters = server->counters; counters != NULL; counters = next) {
+		next = counters->next;
+		free(counters->key);
+		free(counters);
+	}
+	server->counters = NULL;
+	server->last_counters = NULL;
+}
+
 // Make a backend, returning it from the backend list if it's already
 // been created.
 static void* make_backend(const char *host_and_port, void *data) {
@@ -149,6 +441,9 @@ static void* make_backend(const char *host_and_port, void *data) {
 	// Find the key in our list of backends
 	stats_server_t *server = (stats_server_t *) data;
 	backend = find_backend(server, full_key);
+	if (backend == NULL) {
+		backend = undrain_backend(server, full_key);
+	}
 	if (backend != NULL) {
 		free(host);
 		free(port);
@@ -161,29 +456,64 @@ static void* make_backend(const char *host_and_port, void *data) {
 		stats_log("stats: alloc error creating backend");
 		goto make_err;
 	}
-
-	if (tcpclient_init(&backend->client,
-			   server->loop,
-			   backend,
-			   server->config,
-			   host,
-			   port,
-			   protocol)) {
-		stats_log("stats: failed to tcpclient_init");
+	backend->num_streams = 0;
+	backend->counters = stats_backend_counters(server, full_key);
+	if (backend->counters == NULL) {
+		stats_log("stats: alloc error creating backend");
 		goto make_err;
 	}
-
-	if (tcpclient_connect(&backend->client)) {
-		stats_log("stats: failed to connect tcpclient");
+	backend->streams = calloc(server->config->connections, sizeof(stats_stream_t));
+	if (backend->streams == NULL) {
+		stats_log("stats: alloc error creating backend");
 		goto make_err;
 	}
-	backend->bytes_queued = 0;
-	backend->bytes_sent = 0;
-	backend->relayed_lines = 0;
-	backend->dropped_lines = 0;
-	backend->failing = 0;
+
+	struct ev_loop *loop = server->loop;
+	sendqueue_pool_t *send_pool = &server->send_pool;
+	backend->egress = NULL;
+	if (server->num_egress > 0) {
+		backend->egress = &server->egress[server->next_egress++ % server->num_egress];
+		loop = backend->egress->egress.loop;
+		send_pool = &backend->egress->send_pool;
+	}
+	while (backend->num_streams < server->config->connections) {
+		stats_stream_t *stream = &backend->streams[backend->num_streams];
+		if (tcpclient_init(&stream->client,
+				   loop,
+				   stream,
+				   server->config,
+				   send_pool,
+				   host,
+				   port,
+				   protocol)) {
+			stats_log("stats: failed to tcpclient_init");
+			goto make_err;
+		}
+		backend->num_streams++;
+		stream->backend = backend;
+		stream->bytes_queued = 0;
+		stream->bytes_sent = 0;
+		stream->queued = 0;
+		stream->spooled = 0;
+		stream->failures = 0;
+		stream->first_marker = 0;
+		stream->num_markers = 0;
+		tcpclient_set_sent_callback(&stream->client, stats_sent);
+		tcpclient_set_connect_callback(&stream->client, stats_connected);
+		tcpclient_set_error_callback(&stream->client, stats_connect_failed);
+		if (tcpclient_connect(&stream->client)) {
+			stats_log("stats: failed to connect tcpclient");
+			goto make_err;
+		}
+	}
+	backend->in_ring = false;
+	backend->drain_deadline = 0;
+	backend->aggregate = NULL;
+	health_init(&backend->health,
+		    server->loop,
+		    backend->streams[0].client.host,
+		    backend->streams[0].client.port);
 	backend->key = full_key;
-	tcpclient_set_sent_callback(&backend->client, stats_sent);
 	add_backend(server, backend);
 	stats_debug_log("initialized new backend %s", backend->key);
 
@@ -193,6 +523,13 @@ static void* make_backend(const char *host_and_port, void *data) {
 	return backend;
 
 make_err:
+	if (backend != NULL) {
+		for (size_t i = 0; i < backend->num_streams; i++) {
+			tcpclient_destroy(&backend->streams[i].client, 1);
+		}
+		free(backend->streams);
+		free(backend);
+	}
 	free(host);
 	free(port);
 	free(protocol);
@@ -207,10 +544,394 @@ static void kill_backend(void *data) {
 		stats_debug_log("killing backend %s", backend->key);
 		free(backend->key);
 	}
-	tcpclient_destroy(&backend->client, 1);
+	health_destroy(&backend->health);
+	for (size_t i = 0; i < backend->num_streams; i++) {
+		stats_stream_t *stream = &backend->streams[i];
+		tcpclient_destroy(&stream->client, 1);
+		counter_set(&backend->counters->queued_bytes,
+			    backend->counters->queued_bytes - stream->queued);
+		counter_set(&backend->counters->spooled_bytes,
+			    backend->counters->spooled_bytes - stream->spooled);
+	}
+	free(backend->streams);
+	if (backend->aggregate != NULL) {
+		aggregate_destroy(backend->aggregate);
+		free(backend->aggregate);
+	}
 	free(backend);
 }
 
+// Queue a line, including its newline, on one of a backend's streams
+static int stats_backend_send(stats_stream_t *stream, const char *line, size_t len) {
+	stats_backend_t *backend = stream->backend;
+	stats_counters_t *counters = backend->counters;
+	const int ret = tcpclient_sendall(&stream->client, line, len);
+	stats_count_depth(stream);
+	if (ret != 0) {
+		counter_add(&counters->dropped_lines, 1);
+		if (counters->failing == 0) {
+			stats_log("stats: Error sending to backend %s", backend->key);
+			counter_set(&counters->failing, 1);
+		}
+		return 2;
+	} else if (counters->failing != 0) {
+		counter_set(&counters->failing, 0);
+	}
+
+	stream->bytes_queued += len;
+	counter_add(&counters->bytes_queued, len);
+	counter_add(&counters->relayed_lines, 1);
+	return 0;
+}
+
+// A line on its way to an egress thread
+struct stats_egress_line {
+	stats_stream_t *stream;
+	uint64_t queued_at;		// 0 unless the line is timed
+	char line[];
+};
+
+// Called on the egress thread for every line handed over by the worker
+static void stats_egress_send(void *ctx, void *record, size_t len) {
+	struct stats_egress_line *egress_line = (struct stats_egress_line *) record;
+	stats_stream_t *stream = egress_line->stream;
+	const size_t line_len = len - offsetof(struct stats_egress_line, line);
+
+	if (stats_backend_send(stream, egress_line->line, line_len) == 0 &&
+	    egress_line->queued_at != 0) {
+		stats_mark_queued(stream, egress_line->queued_at);
+	}
+}
+
+// Queue a line, including its newline, for a backend, on the stream
+// for its key. When pipelined, the line is handed to the backend's
+// egress thread instead, and a timed line is marked as queued from the
+// moment it's handed over. Otherwise a timed line is marked as queued
+// right away. If wait_for is set, a line for a stream that is full
+// isn't dropped; wait_for is set to the stream instead and
+// STATS_LINE_BLOCKED returned. With egress threads, the stream is full
+// as of the last time its thread published the depth, and a full ring
+// blocks too.
+static int stats_backend_queue(stats_backend_t *backend,
+			       const char *line,
+			       size_t len,
+			       size_t key_len,
+			       bool timed,
+			       stats_stream_t **wait_for) {
+	stats_stream_t *stream = stats_backend_stream(backend, line, key_len);
+	stats_egress_t *egress = backend->egress;
+	if (wait_for != NULL && tcpclient_full(&stream->client, len)) {
+		*wait_for = stream;
+		return STATS_LINE_BLOCKED;
+	}
+	if (egress == NULL) {
+		const int ret = stats_backend_send(stream, line, len);
+		if (timed && ret == 0) {
+			stats_mark_queued(stream, histogram_now());
+		}
+		return ret;
+	}
+
+	struct stats_egress_line *record = egress_reserve(
+		&egress->egress, offsetof(struct stats_egress_line, line) + len);
+	if (record == NULL && wait_for != NULL) {
+		*wait_for = stream;
+		return STATS_LINE_BLOCKED;
+	}
+	if (record == NULL) {
+		counter_add(&backend->counters->ring_dropped_lines, 1);
+		if (!egress->full) {
+			stats_error_log("stats: egress ring is full, dropping lines for backend %s",
+					backend->key);
+			egress->full = true;
+		}
+		return 2;
+	}
+	egress->full = false;
+	record->stream = stream;
+	record->queued_at = timed ? histogram_now() : 0;
+	memcpy(record->line, line, len);
+	return 0;
+}
+
+// Aggregated lines are statsd lines, with the key up to the first ':'
+static void stats_aggregate_emit(void *ctx, const char *line, size_t len) {
+	const char *colon = memchr(line, ':', len);
+	stats_backend_queue((stats_backend_t *) ctx, line, len,
+			    colon == NULL ? len : (size_t) (colon - line), false, NULL);
+}
+
+static void stats_flush_backend(stats_server_t *server, stats_backend_t *backend) {
+	if (backend->aggregate != NULL) {
+		counter_add(&server->aggregate_lines_out, aggregate_flush(
+				    backend->aggregate, stats_aggregate_emit, backend));
+	}
+}
+
+static void stats_aggregate_tick(struct ev_loop *loop, ev_timer *watcher, int revents) {
+	stats_server_t *server = (stats_server_t *) watcher->data;
+	for (size_t i = 0; i < server->num_backends; i++) {
+		stats_flush_backend(server, server->backend_list[i]);
+	}
+}
+
+// Only statsd lines can be aggregated
+static bool stats_aggregating(const stats_server_t *server) {
+	return server->config->aggregate_interval_ms > 0 &&
+		server->parser == protocol_parser_statsd;
+}
+
+// Start, retime or stop the flush timer to match the config
+static void stats_update_aggregation(stats_server_t *server) {
+	ev_timer_stop(server->loop, &server->aggregate_watcher);
+	if (stats_aggregating(server)) {
+		const double interval = server->config->aggregate_interval_ms / 1000.0;
+		ev_timer_set(&server->aggregate_watcher, interval, interval);
+		ev_timer_start(server->loop, &server->aggregate_watcher);
+	} else {
+		stats_aggregate_tick(server->loop, &server->aggregate_watcher, 0);
+	}
+}
+
+// Bytes still waiting to go out, in memory or spooled to disk. This may
+// be called while the egress thread runs.
+static size_t backend_queued(stats_backend_t *backend) {
+	size_t queued = 0;
+	for (size_t i = 0; i < backend->num_streams; i++) {
+		queued += tcpclient_queued(&backend->streams[i].client);
+	}
+	return queued;
+}
+
+// Backends are only created, reconfigured and destroyed while their
+// egress threads are stopped. Stopping also sends whatever is left in
+// the egress rings.
+static void stats_stop_egress(stats_server_t *server) {
+	for (size_t i = 0; i < server->num_egress; i++) {
+		egress_stop(&server->egress[i].egress);
+	}
+}
+
+static void stats_start_egress(stats_server_t *server) {
+	for (size_t i = 0; i < server->num_egress; i++) {
+		if (!server->egress[i].egress.running &&
+		    egress_start(&server->egress[i].egress) != 0) {
+			stats_error_log("stats: egress thread %zd is not running", i);
+		}
+	}
+}
+
+// Destroy a backend that's done draining. Only the egress thread that
+// owns it is stopped meanwhile.
+static void stats_kill_drained(stats_backend_t *backend) {
+	stats_egress_t *egress = backend->egress;
+	if (egress != NULL) {
+		egress_stop(&egress->egress);
+	}
+	kill_backend(backend);
+	if (egress != NULL && egress_start(&egress->egress) != 0) {
+		stats_error_log("stats: egress thread is not running");
+	}
+}
+
+// The queues are read while the egress threads run
+static void stats_drain_tick(struct ev_loop *loop, ev_timer *watcher, int revents) {
+	stats_server_t *server = (stats_server_t *) watcher->data;
+	time_t now = time(NULL);
+	size_t kept = 0;
+
+	for (size_t i = 0; i < server->num_draining; i++) {
+		stats_backend_t *backend = server->draining_list[i];
+		size_t queued = backend_queued(backend);
+		if (queued == 0) {
+			stats_log("stats: finished draining backend %s", backend->key);
+			stats_kill_drained(backend);
+		} else if (now >= backend->drain_deadline) {
+			stats_error_log("stats: timed out draining backend %s, dropping %zd queued bytes",
+					backend->key, queued);
+			stats_kill_drained(backend);
+		} else {
+			server->draining_list[kept++] = backend;
+		}
+	}
+	server->num_draining = kept;
+	if (kept == 0) {
+		ev_timer_stop(server->loop, &server->drain_watcher);
+	}
+}
+
+static void stats_resume_sessions(stats_server_t *server, bool all, const stats_backend_t *down);
+
+// Move a backend's shards to other backends while it's down, and back
+// once it's up
+static void stats_failover(stats_server_t *server, stats_backend_t *backend) {
+	counter_set(&backend->counters->down, backend->health.down);
+	if (!hashring_set_down(server->ring, backend, backend->health.down)) {
+		return;
+	}
+	if (backend->health.down) {
+		stats_error_log("stats: backend %s is down, failing its shards over", backend->key);
+		stats_resume_sessions(server, false, backend);
+	} else {
+		stats_log("stats: backend %s is back up, taking its shards back", backend->key);
+	}
+}
+
+static void stats_health_tick(struct ev_loop *loop, ev_timer *watcher, int revents) {
+	stats_server_t *server = (stats_server_t *) watcher->data;
+	struct proto_config *config = server->config;
+
+	for (size_t i = 0; i < server->num_backends; i++) {
+		stats_backend_t *backend = server->backend_list[i];
+		uint64_t failures = 0;
+		for (size_t j = 0; j < backend->num_streams; j++) {
+			const uint64_t stream_failures = counter_get(&backend->streams[j].failures);
+			if (stream_failures > failures) {
+				failures = stream_failures;
+			}
+		}
+		if (health_check(&backend->health, config, failures, backend_queued(backend),
+				 counter_get(&backend->counters->bytes_sent))) {
+			stats_failover(server, backend);
+		}
+		if (config->health_probe &&
+		    backend->streams[0].client.socktype == SOCK_STREAM) {
+			health_probe_start(&backend->health,
+					   config->health_check_interval_ms / 2000.0,
+					   config->dns_cache_ttl);
+		}
+	}
+}
+
+// Start, retime or stop the health checks to match the config. Without
+// failover, every backend keeps its shards.
+static void stats_update_health(stats_server_t *server) {
+	ev_timer_stop(server->loop, &server->health_watcher);
+	if (server->config->failover != FAILOVER_NONE) {
+		const double interval = server->config->health_check_interval_ms / 1000.0;
+		ev_timer_set(&server->health_watcher, interval, interval);
+		ev_timer_start(server->loop, &server->health_watcher);
+		return;
+	}
+	for (size_t i = 0; i < server->num_backends; i++) {
+		stats_backend_t *backend = server->backend_list[i];
+		if (backend->health.down) {
+			health_destroy(&backend->health);
+			health_init(&backend->health,
+				    server->loop,
+				    backend->streams[0].client.host,
+				    backend->streams[0].client.port);
+			stats_failover(server, backend);
+		}
+	}
+}
+
+// Stop using a backend, flushing whatever it still has queued first.
+// Its egress thread must be stopped.
+static void drain_backend(stats_server_t *server, stats_backend_t *backend) {
+	stats_flush_backend(server, backend);
+	if (backend->egress != NULL) {
+		egress_stop(&backend->egress->egress);
+	}
+	size_t queued = backend_queued(backend);
+	if (queued == 0) {
+		kill_backend(backend);
+		return;
+	}
+	stats_backend_t **new_list = realloc(
+		server->draining_list, sizeof(stats_backend_t *) * (server->num_draining + 1));
+	if (new_list == NULL) {
+		stats_error_log("stats: failed to drain backend %s, dropping %zd queued bytes",
+				backend->key, queued);
+		kill_backend(backend);
+		return;
+	}
+	stats_log("stats: draining %zd queued bytes for removed backend %s", queued, backend->key);
+	backend->drain_deadline = time(NULL) + STATS_DRAIN_TIMEOUT;
+	server->draining_list = new_list;
+	server->draining_list[server->num_draining++] = backend;
+	if (!ev_is_active(&server->drain_watcher)) {
+		ev_timer_start(server->loop, &server->drain_watcher);
+	}
+}
+
+// Drain every backend which the current ring doesn't use.
+static void prune_backends(stats_server_t *server) {
+	const size_t ring_size = hashring_size(server->ring);
+	size_t kept = 0;
+
+	for (size_t i = 0; i < server->num_backends; i++) {
+		server->backend_list[i]->in_ring = false;
+	}
+	for (size_t i = 0; i < ring_size; i++) {
+		stats_backend_t *backend = hashring_get(server->ring, i);
+		backend->in_ring = true;
+	}
+	for (size_t i = 0; i < server->num_backends; i++) {
+		stats_backend_t *backend = server->backend_list[i];
+		if (backend->in_ring) {
+			server->backend_list[kept++] = backend;
+		} else {
+			drain_backend(server, backend);
+		}
+	}
+	server->num_backends = kept;
+}
+
+static void stats_loop_wakeup(struct ev_loop *loop, ev_check *watcher, int revents) {
+	stats_server_t *server = (stats_server_t *) watcher->data;
+	server->loop_wakeup = histogram_now();
+}
+
+// Lines for the egress threads are handed over once per iteration, or
+// sooner if a lot of them pile up
+static void stats_loop_sleep(struct ev_loop *loop, ev_prepare *watcher, int revents) {
+	stats_server_t *server = (stats_server_t *) watcher->data;
+	for (size_t i = 0; i < server->num_egress; i++) {
+		egress_publish(&server->egress[i].egress);
+	}
+	if (server->loop_wakeup != 0) {
+		histogram_record(&server->loop_iteration, histogram_now() - server->loop_wakeup);
+	}
+}
+
+static void stats_update_self_metrics(stats_server_t *server);
+void stats_send_statistics(stats_session_t *session);
+static void stats_self_metrics_tick(struct ev_loop *loop, ev_timer *watcher, int revents);
+static void stats_resume_tick(struct ev_loop *loop, ev_timer *watcher, int revents);
+
+static int stats_init_egress(stats_server_t *server, unsigned int num_egress) {
+	if (num_egress == 0) {
+		return 0;
+	}
+	server->egress = calloc(num_egress, sizeof(stats_egress_t));
+	if (server->egress == NULL) {
+		stats_error_log("stats: failed to allocate egress threads");
+		return 1;
+	}
+	for (unsigned int i = 0; i < num_egress; i++) {
+		stats_egress_t *egress = &server->egress[i];
+		if (egress_init(&egress->egress, STATS_EGRESS_RING, stats_egress_send, NULL) != 0) {
+			return 1;
+		}
+		sendqueue_pool_init(&egress->send_pool, SENDQUEUE_POOL_MAX_FREE);
+		egress->full = false;
+		server->num_egress++;
+	}
+	return 0;
+}
+
+// The egress threads must be stopped, and their backends destroyed
+static void stats_destroy_egress(stats_server_t *server) {
+	for (size_t i = 0; i < server->num_egress; i++) {
+		egress_destroy(&server->egress[i].egress);
+		sendqueue_pool_destroy(&server->egress[i].send_pool);
+	}
+	free(server->egress);
+	server->egress = NULL;
+	server->num_egress = 0;
+}
+
 stats_server_t *stats_server_create(struct ev_loop *loop,
 				    struct proto_config *config,
 				    protocol_parser_t parser,
@@ -225,22 +946,90 @@ stats_server_t *stats_server_create(struct ev_loop *loop,
 	server->loop = loop;
 	server->num_backends = 0;
 	server->backend_list = NULL;
+	server->counters = NULL;
+	server->last_counters = NULL;
+	server->num_egress = 0;
+	server->egress = NULL;
+	server->next_egress = 0;
+	server->ring = NULL;
+	server->num_draining = 0;
+	server->draining_list = NULL;
+	ev_timer_init(&server->drain_watcher,
+		      stats_drain_tick,
+		      STATS_DRAIN_INTERVAL,
+		      STATS_DRAIN_INTERVAL);
+	server->drain_watcher.data = server;
+	ev_timer_init(&server->aggregate_watcher, stats_aggregate_tick, 0, 0);
+	server->aggregate_watcher.data = server;
+	ev_timer_init(&server->health_watcher, stats_health_tick, 0, 0);
+	server->health_watcher.data = server;
+	ev_timer_init(&server->self_metrics_watcher, stats_self_metrics_tick, 0, 0);
+	server->self_metrics_watcher.data = server;
+	selfstats_init(&server->selfstats);
+	server->sample_countdown = STATS_SAMPLE_EVERY;
+	server->recv_time = 0;
+	histogram_init(&server->recv_to_enqueue);
+	histogram_init(&server->validate_time);
+	histogram_init(&server->hash_time);
+	histogram_init(&server->enqueue_time);
+	histogram_init(&server->loop_iteration);
+	server->loop_wakeup = 0;
 	server->config = config;
+	sendqueue_pool_init(&server->send_pool, SENDQUEUE_POOL_MAX_FREE);
+	pool_init(&server->session_pool, sizeof(stats_session_t), STATS_SESSION_POOL_MAX_FREE);
+	bufpool_init(&server->buffer_pool);
+	server->paused = NULL;
+	server->num_paused = 0;
+	ev_init(&server->resume_watcher, stats_resume_tick);
+	server->resume_watcher.data = server;
+	if (stats_init_egress(server, config->egress_threads) != 0) {
+		goto server_create_err;
+	}
+
+	// The backends are owned by backend_list rather than the ring, so
+	// that a reload can move them from one ring to the next.
 	server->ring = hashring_load_from_config(
-		config, server, make_backend, kill_backend);
+		config, server, make_backend, NULL);
 	if (server->ring == NULL) {
 		stats_error_log("hashring_load_from_config failed");
 		goto server_create_err;
 	}
+	for (size_t i = 0; i < server->num_egress; i++) {
+		if (egress_start(&server->egress[i].egress) != 0) {
+			goto server_create_err;
+		}
+	}
 
 	server->bytes_recv_udp = 0;
 	server->bytes_recv_tcp = 0;
+	server->udp_wakeups = 0;
+	server->udp_datagrams = 0;
+	server->udp_full_batches = 0;
 	server->malformed_lines = 0;
+	server->aggregated_lines = 0;
+	server->aggregate_lines_out = 0;
+	server->backpressure_pauses = 0;
 	server->total_connections = 0;
 	server->last_reload = 0;
 
 	server->parser = parser;
+	server->key_delimiter = protocol_key_delimiter(parser);
 	server->validator = validator;
+	server->peers = NULL;
+	server->num_peers = 0;
+	stats_update_aggregation(server);
+	stats_update_health(server);
+	stats_update_self_metrics(server);
+
+	// These don't keep the loop alive
+	ev_check_init(&server->loop_wakeup_watcher, stats_loop_wakeup);
+	server->loop_wakeup_watcher.data = server;
+	ev_check_start(loop, &server->loop_wakeup_watcher);
+	ev_unref(loop);
+	ev_prepare_init(&server->loop_sleep_watcher, stats_loop_sleep);
+	server->loop_sleep_watcher.data = server;
+	ev_prepare_start(loop, &server->loop_sleep_watcher);
+	ev_unref(loop);
 
 	stats_debug_log("initialized server with %d backends, hashring size = %d",
 			server->num_backends, hashring_size(server->ring));
@@ -249,7 +1038,17 @@ stats_server_t *stats_server_create(struct ev_loop *loop,
 
 server_create_err:
 	if (server != NULL) {
+		stats_stop_egress(server);
 		hashring_dealloc(server->ring);
+		for (size_t i = 0; i < server->num_backends; i++) {
+			kill_backend(server->backend_list[i]);
+		}
+		stats_destroy_egress(server);
+		free(server->backend_list);
+		stats_destroy_counters(server);
+		sendqueue_pool_destroy(&server->send_pool);
+		pool_destroy(&server->session_pool);
+		bufpool_destroy(&server->buffer_pool);
 		free(server);
 	}
 	return NULL;
@@ -259,151 +1058,431 @@ size_t stats_num_backends(stats_server_t *server) {
 	return server->num_backends;
 }
 
-void stats_server_reload(stats_server_t *server) {
-	hashring_dealloc(server->ring);
+void stats_server_set_peers(stats_server_t *server,
+			    stats_server_t **peers,
+			    size_t num_peers) {
+	server->peers = peers;
+	server->num_peers = num_peers;
+	stats_update_self_metrics(server);
+}
 
-	free(server->backend_list);
-	server->num_backends = 0;
-	server->backend_list = NULL;
+static void set_streams_config(stats_backend_t *backend, struct proto_config *config) {
+	for (size_t i = 0; i < backend->num_streams; i++) {
+		tcpclient_set_config(&backend->streams[i].client, config);
+	}
+}
+
+static void set_backend_config(stats_server_t *server, struct proto_config *config) {
+	for (size_t i = 0; i < server->num_backends; i++) {
+		set_streams_config(server->backend_list[i], config);
+	}
+	for (size_t i = 0; i < server->num_draining; i++) {
+		set_streams_config(server->draining_list[i], config);
+	}
+}
 
-	server->last_reload = time(NULL);
+int stats_server_reload(stats_server_t *server, struct proto_config *config) {
+	struct proto_config *old_config = server->config;
+	const size_t old_num_backends = server->num_backends;
 
-	// FIXME
+	// Paused sessions wait on streams that may be going away, so they
+	// try again with the new shard map
+	stats_resume_sessions(server, true, NULL);
+	stats_stop_egress(server);
+
+	// Backends that are in the new shard map as well as the old one
+	// are found by make_backend and carried over as they are, with
+	// their connection and send queue.
+	server->config = config;
+	hashring_t ring = hashring_load_from_config(
+		config, server, make_backend, NULL);
+	if (ring == NULL) {
+		stats_error_log("stats: failed to load the new shard map, keeping the old one");
+		server->config = old_config;
+		prune_backends(server);
+		set_backend_config(server, old_config);
+		stats_start_egress(server);
+		return 1;
+	}
+	hashring_dealloc(server->ring);
+	server->ring = ring;
+	set_backend_config(server, config);
+
+	// Backends that are down stay down in the new ring
+	for (size_t i = 0; i < server->num_backends; i++) {
+		stats_backend_t *backend = server->backend_list[i];
+		if (backend->health.down) {
+			hashring_set_down(ring, backend, true);
+		}
+	}
+	const size_t added = server->num_backends - old_num_backends;
+	prune_backends(server);
+	stats_start_egress(server);
+	stats_update_aggregation(server);
+	stats_update_health(server);
+	stats_update_self_metrics(server);
+
+	counter_set(&server->last_reload, time(NULL));
+	stats_log("stats: reloaded shard map with %zd backends (%zd new, %zd draining)",
+		  server->num_backends, added, server->num_draining);
+	return 0;
 }
 
-void *stats_connection(int sd, void *ctx) {
+void *stats_connection(int sd, void *ctx, tcpsession_t *handle) {
+	stats_server_t *server = (stats_server_t *) ctx;
 	stats_session_t *session;
 
 	stats_debug_log("stats: accepted client connection on fd %d", sd);
-	session = (stats_session_t *) malloc(sizeof(stats_session_t));
+	session = (stats_session_t *) pool_get(&server->session_pool);
 	if (session == NULL) {
 		stats_log("stats: Unable to allocate memory");
 		return NULL;
 	}
 
-	if (buffer_init(&session->buffer) != 0) {
-		stats_log("stats: Unable to initialize buffer");
-		free(session);
-		return NULL;
-	}
-
-	session->server = (stats_server_t *) ctx;
-	session->server->total_connections++;
+	// The buffer takes its memory from the pool on the first read
+	buffer_init_pooled(&session->buffer, &server->buffer_pool);
+	session->server = server;
+	counter_add(&server->total_connections, 1);
+	session->handle = handle;
 	session->sd = sd;
+	session->waiting_on = NULL;
+	session->held = false;
 	return (void *) session;
 }
 
-static int stats_relay_line(const char *line, size_t len, stats_server_t *ss) {
+// Relay a single line, as found by scan_lines. The line is a slice of
+// the receive buffer and is not NUL terminated, but it is followed by
+// its '\n' so that the line and its newline can be queued in one go.
+// wait_for is passed on to stats_backend_queue.
+static int stats_relay_line(const char *line,
+			    const struct scan_line *scanned,
+			    stats_server_t *ss,
+			    stats_stream_t **wait_for) {
+	const size_t len = scanned->len;
+	uint64_t start = 0, now;
+	const bool sampled = --ss->sample_countdown == 0;
+	if (sampled) {
+		ss->sample_countdown = STATS_SAMPLE_EVERY;
+		start = histogram_now();
+	}
+
 	if (ss->config->enable_validation && ss->validator != NULL) {
-		if (ss->validator(line, len) != 0) {
+		// The scan already counted the spaces in a carbon line
+		const int invalid = ss->validator == validate_carbon ?
+			validate_carbon_spaces(line, len, scanned->delimiters) :
+			ss->validator(line, len);
+		if (invalid != 0) {
 			return 1;
 		}
 	}
+	if (sampled) {
+		now = histogram_now();
+		histogram_record(&ss->validate_time, now - start);
+		start = now;
+	}
 
-	static char key_buffer[8192];
-	size_t key_len = ss->parser(line, len);
+	const size_t key_len = scanned->key_len;
 	if (key_len == 0) {
-		ss->malformed_lines++;
-		stats_log("stats: failed to find key: \"%s\"", line);
+		counter_add(&ss->malformed_lines, 1);
+		stats_log("stats: failed to find key: \"%.*s\"", (int) len, line);
 		return 1;
 	}
-	memcpy(key_buffer, line, key_len);
-	key_buffer[key_len] = '\0';
 
-	stats_backend_t *backend = hashring_choose(ss->ring, key_buffer, NULL);
+	stats_backend_t *backend = hashring_choose_len(ss->ring, line, key_len, NULL);
 
 	if (backend == NULL) {
 		return 1;
 	}
+	if (sampled) {
+		now = histogram_now();
+		histogram_record(&ss->hash_time, now - start);
+		start = now;
+	}
 
-	if (tcpclient_sendall(&backend->client, line, len + 1) != 0) {
-		backend->dropped_lines++;
-		if (backend->failing == 0) {
-			stats_log("stats: Error sending to backend %s", backend->key);
-			backend->failing = 1;
+	if (stats_aggregating(ss)) {
+		if (backend->aggregate == NULL) {
+			backend->aggregate = malloc(sizeof(aggregate_t));
+			if (backend->aggregate != NULL && aggregate_init(backend->aggregate) != 0) {
+				free(backend->aggregate);
+				backend->aggregate = NULL;
+			}
+		}
+		// Lines that can't be folded are sent as they are
+		if (backend->aggregate != NULL &&
+		    aggregate_add(backend->aggregate, line, len) == 0) {
+			counter_add(&ss->aggregated_lines, 1);
+			return 0;
 		}
-		return 2;
-	} else {
-		backend->failing = 0;
 	}
 
-	backend->bytes_queued += len + 1;
-	backend->relayed_lines++;
+	int ret = stats_backend_queue(backend, line, len + 1, key_len, sampled, wait_for);
+	if (sampled && ret == 0) {
+		now = histogram_now();
+		histogram_record(&ss->enqueue_time, now - start);
+		histogram_record(&ss->recv_to_enqueue, now - ss->recv_time);
+	}
+	return ret;
+}
 
-	return 0;
+static void stats_summarize(struct stats_latency *latency, const histogram_t *histogram) {
+	latency->count = histogram->count;
+	latency->sum = histogram->sum;
+	latency->p50 = histogram_percentile(histogram, 0.5);
+	latency->p99 = histogram_percentile(histogram, 0.99);
+	latency->p999 = histogram_percentile(histogram, 0.999);
 }
 
-void stats_send_statistics(stats_session_t *session) {
-	stats_backend_t *backend;
-	ssize_t bytes_sent;
+// The counters of other workers are read while those threads are
+// running, so nothing but counters is read from them.
+static void stats_server_totals(stats_server_t **peers,
+				size_t num_peers,
+				stats_snapshot_t *snapshot) {
+	histogram_t recv_to_enqueue, validate_time, hash_time, enqueue_time, loop_iteration;
+
+	histogram_init(&recv_to_enqueue);
+	histogram_init(&validate_time);
+	histogram_init(&hash_time);
+	histogram_init(&enqueue_time);
+	histogram_init(&loop_iteration);
+	for (size_t i = 0; i < num_peers; i++) {
+		stats_server_t *peer = peers[i];
+		snapshot->bytes_recv_udp += counter_get(&peer->bytes_recv_udp);
+		snapshot->bytes_recv_tcp += counter_get(&peer->bytes_recv_tcp);
+		snapshot->udp_wakeups += counter_get(&peer->udp_wakeups);
+		snapshot->udp_datagrams += counter_get(&peer->udp_datagrams);
+		snapshot->udp_full_batches += counter_get(&peer->udp_full_batches);
+		snapshot->total_connections += counter_get(&peer->total_connections);
+		snapshot->malformed_lines += counter_get(&peer->malformed_lines);
+		snapshot->aggregated_lines += counter_get(&peer->aggregated_lines);
+		snapshot->aggregate_lines_out += counter_get(&peer->aggregate_lines_out);
+		snapshot->backpressure_pauses += counter_get(&peer->backpressure_pauses);
+		snapshot->paused_connections += counter_get(&peer->num_paused);
+		snapshot->session_pool_hits += counter_get(&peer->session_pool.hits);
+		snapshot->session_pool_misses += counter_get(&peer->session_pool.misses);
+		snapshot->buffer_pool_hits += bufpool_hits(&peer->buffer_pool);
+		snapshot->buffer_pool_misses += bufpool_misses(&peer->buffer_pool);
+		histogram_merge(&recv_to_enqueue, &peer->recv_to_enqueue);
+		histogram_merge(&validate_time, &peer->validate_time);
+		histogram_merge(&hash_time, &peer->hash_time);
+		histogram_merge(&enqueue_time, &peer->enqueue_time);
+		histogram_merge(&loop_iteration, &peer->loop_iteration);
+		const uint64_t last_reload = counter_get(&peer->last_reload);
+		if (last_reload > snapshot->last_reload) {
+			snapshot->last_reload = last_reload;
+		}
+	}
+	stats_summarize(&snapshot->recv_to_enqueue, &recv_to_enqueue);
+	stats_summarize(&snapshot->validate_time, &validate_time);
+	stats_summarize(&snapshot->hash_time, &hash_time);
+	stats_summarize(&snapshot->enqueue_time, &enqueue_time);
+	stats_summarize(&snapshot->loop_iteration, &loop_iteration);
+}
 
-	// TODO: this only needs to be allocated once, not every time we send
-	// statistics
-	buffer_t *response = create_buffer(MAX_UDP_LENGTH);
-	if (response == NULL) {
-		stats_log("failed to allocate send_statistics buffer");
-		return;
+// Find the counters for a key on another worker. Every worker builds
+// its backends from the same config, so they're normally the ones after
+// those found last time, in *hint; fall back to a search otherwise.
+static stats_counters_t *stats_peer_counters(stats_server_t *peer,
+					     stats_counters_t **hint,
+					     const char *key) {
+	stats_counters_t *counters = *hint;
+	if (counters == NULL || strcmp(counters->key, key) != 0) {
+		counters = __atomic_load_n(&peer->counters, __ATOMIC_ACQUIRE);
+		while (counters != NULL && strcmp(counters->key, key) != 0) {
+			counters = __atomic_load_n(&counters->next, __ATOMIC_ACQUIRE);
+		}
+		if (counters == NULL) {
+			return NULL;
+		}
 	}
+	*hint = __atomic_load_n(&counters->next, __ATOMIC_ACQUIRE);
+	return counters;
+}
 
-	buffer_produced(response,
-		snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-		"global bytes_recv_udp gauge %" PRIu64 "\n",
-		session->server->bytes_recv_udp));
+static void stats_backend_totals(stats_server_t *server,
+				 stats_server_t **peers,
+				 size_t num_peers,
+				 stats_backend_t *backend,
+				 stats_counters_t **hints,
+				 struct stats_backend_snapshot *totals) {
+	histogram_t queue_residence;
+
+	histogram_init(&queue_residence);
+	for (size_t i = 0; i < num_peers; i++) {
+		stats_counters_t *counters = peers[i] == server ? backend->counters :
+			stats_peer_counters(peers[i], &hints[i], backend->key);
+		if (counters == NULL) {
+			continue;
+		}
+		totals->bytes_queued += counter_get(&counters->bytes_queued);
+		totals->bytes_sent += counter_get(&counters->bytes_sent);
+		totals->queued_bytes += counter_get(&counters->queued_bytes);
+		totals->spooled_bytes += counter_get(&counters->spooled_bytes);
+		totals->relayed_lines += counter_get(&counters->relayed_lines);
+		totals->dropped_lines += counter_get(&counters->dropped_lines) +
+			counter_get(&counters->ring_dropped_lines);
+		histogram_merge(&queue_residence, &counters->queue_residence);
+		totals->failing |= counter_get(&counters->failing);
+		totals->down |= counter_get(&counters->down);
+	}
+	stats_summarize(&totals->queue_residence, &queue_residence);
+}
 
-	buffer_produced(response,
-		snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-		"global bytes_recv_tcp gauge %" PRIu64 "\n",
-		session->server->bytes_recv_tcp));
+stats_snapshot_t *stats_server_snapshot(stats_server_t *server) {
+	stats_server_t **peers = server->peers;
+	size_t num_peers = server->num_peers;
+	if (peers == NULL) {
+		peers = &server;
+		num_peers = 1;
+	}
 
-	buffer_produced(response,
-		snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-		"global total_connections gauge %" PRIu64 "\n",
-		session->server->total_connections));
+	stats_snapshot_t *snapshot = calloc(1, sizeof(stats_snapshot_t));
+	if (snapshot == NULL) {
+		return NULL;
+	}
+	snapshot->backends = calloc(server->num_backends + 1, sizeof(struct stats_backend_snapshot));
+	if (snapshot->backends == NULL) {
+		free(snapshot);
+		return NULL;
+	}
+	stats_counters_t **hints = calloc(num_peers, sizeof(stats_counters_t *));
+	if (hints == NULL) {
+		stats_snapshot_destroy(snapshot);
+		return NULL;
+	}
+	stats_server_totals(peers, num_peers, snapshot);
+	tcpserver_listen_drops(&snapshot->listen_overflows, &snapshot->listen_drops);
+	for (size_t i = 0; i < server->num_backends; i++) {
+		struct stats_backend_snapshot *backend = &snapshot->backends[i];
+		backend->key = strdup(server->backend_list[i]->key);
+		if (backend->key == NULL) {
+			free(hints);
+			stats_snapshot_destroy(snapshot);
+			return NULL;
+		}
+		snapshot->num_backends++;
+		stats_backend_totals(server, peers, num_peers, server->backend_list[i],
+				     hints, backend);
+	}
+	free(hints);
+	return snapshot;
+}
 
-	buffer_produced(response,
-		snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-		"global last_reload timestamp %" PRIu64 "\n",
-		session->server->last_reload));
+void stats_snapshot_destroy(stats_snapshot_t *snapshot) {
+	if (snapshot == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < snapshot->num_backends; i++) {
+		free(snapshot->backends[i].key);
+	}
+	free(snapshot->backends);
+	free(snapshot);
+}
 
-	buffer_produced(response,
-		snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-		"global malformed_lines gauge %" PRIu64 "\n",
-		session->server->malformed_lines));
+// Relay the complete lines at the start of buf, up to the first one
+// that can't be relayed, and set *consumed to the length of the lines
+// relayed. A "status" line from a session is answered with the status
+// report. Returns non-zero if a line couldn't be relayed, and
+// STATS_LINE_BLOCKED if a session has to wait for a full backend.
+static int stats_relay_lines(stats_server_t *ss,
+			     stats_session_t *session,
+			     const char *buf,
+			     size_t len,
+			     size_t *consumed) {
+	struct scan_line lines[STATS_SCAN_LINES];
+	size_t done = 0;
+	size_t num_lines, scanned;
+	int ret;
+
+	// Only TCP clients can be held back
+	stats_stream_t **wait_for = NULL;
+	if (session != NULL && ss->config->overflow_policy == OVERFLOW_BACKPRESSURE) {
+		wait_for = &session->waiting_on;
+	}
 
-	for (size_t i = 0; i < session->server->num_backends; i++) {
-		backend = session->server->backend_list[i];
+	do {
+		num_lines = scan_lines(buf + done, len - done, ss->key_delimiter,
+				       lines, STATS_SCAN_LINES, &scanned);
+		for (size_t i = 0; i < num_lines; i++) {
+			const char *line = buf + done + lines[i].offset;
+			if (session != NULL && lines[i].len == 6 && memcmp(line, "status", 6) == 0) {
+				stats_send_statistics(session);
+			} else if ((ret = stats_relay_line(line, &lines[i], ss, wait_for)) != 0) {
+				*consumed = done + lines[i].offset;
+				return ret;
+			}
+		}
+		done += scanned;
+	} while (num_lines == STATS_SCAN_LINES);
+	*consumed = done;
+	return 0;
+}
 
-		buffer_produced(response,
-			snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-			"backend:%s bytes_queued gauge %" PRIu64 "\n",
-			backend->key, backend->bytes_queued));
+// Relay every line of a buffer as if it had been received
+static void stats_relay_buffer(stats_server_t *server, buffer_t *buf) {
+	size_t consumed;
 
-		buffer_produced(response,
-			snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-			"backend:%s bytes_sent gauge %" PRIu64 "\n",
-			backend->key, backend->bytes_sent));
+	server->recv_time = histogram_now();
+	stats_relay_lines(server, NULL, buffer_head(buf), buffer_datacount(buf), &consumed);
+}
 
-		buffer_produced(response,
-			snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-			"backend:%s relayed_lines gauge %" PRIu64 "\n",
-			backend->key, backend->relayed_lines));
+static void stats_self_metrics_tick(struct ev_loop *loop, ev_timer *watcher, int revents) {
+	stats_server_t *server = (stats_server_t *) watcher->data;
+	buffer_t lines;
 
-		buffer_produced(response,
-			snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-			"backend:%s dropped_lines gauge %" PRIu64 "\n",
-			backend->key, backend->dropped_lines));
+	stats_snapshot_t *snapshot = stats_server_snapshot(server);
+	if (snapshot == NULL || buffer_init(&lines) != 0) {
+		stats_error_log("stats: failed to allocate self metrics");
+		stats_snapshot_destroy(snapshot);
+		return;
+	}
+	if (selfstats_format(&server->selfstats, snapshot, time(NULL), &lines) != 0) {
+		stats_error_log("stats: failed to allocate self metrics");
+	}
+	stats_relay_buffer(server, &lines);
+	buffer_destroy(&lines);
+}
 
-		buffer_produced(response,
-			snprintf((char *)buffer_tail(response), buffer_spacecount(response),
-			"backend:%s failing boolean %i\n",
-			backend->key, backend->failing));
+// Workers report the totals of all of them, so only the first one sends
+// self metrics
+static void stats_update_self_metrics(stats_server_t *server) {
+	struct proto_config *config = server->config;
+
+	ev_timer_stop(server->loop, &server->self_metrics_watcher);
+	if (config->self_metrics_interval_ms == 0 ||
+	    (server->peers != NULL && server->peers[0] != server)) {
+		return;
 	}
+	if (selfstats_configure(&server->selfstats,
+				config->self_metrics_prefix,
+				config->self_metrics_hostname,
+				server->parser == protocol_parser_carbon) != 0) {
+		stats_error_log("stats: failed to configure self metrics");
+		return;
+	}
+	const double interval = config->self_metrics_interval_ms / 1000.0;
+	ev_timer_set(&server->self_metrics_watcher, interval, interval);
+	ev_timer_start(server->loop, &server->self_metrics_watcher);
+}
 
-	buffer_produced(response,
-		snprintf((char *)buffer_tail(response), buffer_spacecount(response), "\n"));
+void stats_send_statistics(stats_session_t *session) {
+	report_t report;
+	buffer_t response;
+	ssize_t bytes_sent;
 
-	while (buffer_datacount(response) > 0) {
-		bytes_sent = send(session->sd, buffer_head(response), buffer_datacount(response), 0);
+	stats_snapshot_t *snapshot = stats_server_snapshot(session->server);
+	if (snapshot == NULL || buffer_init(&response) != 0) {
+		stats_log("failed to allocate send_statistics buffer");
+		stats_snapshot_destroy(snapshot);
+		return;
+	}
+	report_init(&report, snapshot, REPORT_STATUS);
+	if (report_write(&report, &response, SIZE_MAX) != 0) {
+		stats_log("stats: Unable to build status response");
+		goto done;
+	}
+
+	while (buffer_datacount(&response) > 0) {
+		bytes_sent = send(session->sd, buffer_head(&response), buffer_datacount(&response), 0);
 		if (bytes_sent < 0) {
 			stats_log("stats: Error sending status response: %s", strerror(errno));
 			break;
@@ -414,45 +1493,87 @@ void stats_send_statistics(stats_session_t *session) {
 			break;
 		}
 
-		buffer_consume(response, bytes_sent);
+		buffer_consume(&response, bytes_sent);
 	}
-	delete_buffer(response);
-}
 
-static int stats_process_lines(stats_session_t *session) {
-	char *head, *tail;
-	size_t len;
-
-	static char line_buffer[MAX_UDP_LENGTH + 2];
+done:
+	buffer_destroy(&response);
+	stats_snapshot_destroy(snapshot);
+}
 
-	while (1) {
-		size_t datasize = buffer_datacount(&session->buffer);
-		if (datasize == 0) {
-			break;
-		}
-		head = (char *)buffer_head(&session->buffer);
-		tail = memchr(head, '\n', datasize);
-		if (tail == NULL) {
-			break;
-		}
-		len = tail - head;
-		memcpy(line_buffer, head, len);
-		memcpy(line_buffer + len, "\n\0", 2);
+// Stop reading from a session until the stream it waits on has
+// drained. Its client then has to wait, as the socket buffers fill up.
+static void stats_session_pause(stats_session_t *session) {
+	stats_server_t *server = session->server;
+
+	tcpsession_pause(session->handle);
+	session->held = true;
+	session->next_paused = server->paused;
+	server->paused = session;
+	counter_add(&server->num_paused, 1);
+	counter_add(&server->backpressure_pauses, 1);
+	if (!ev_is_active(&server->resume_watcher)) {
+		ev_timer_set(&server->resume_watcher, STATS_RESUME_INTERVAL, STATS_RESUME_INTERVAL);
+		ev_timer_start(server->loop, &server->resume_watcher);
+	}
+}
 
-		if (len == 6 && strcmp(line_buffer, "status\n") == 0) {
-			stats_send_statistics(session);
-		} else if (stats_relay_line(line_buffer, len, session->server) != 0) {
-			return 1;
+// Resume the paused sessions whose stream has drained, or all of them.
+// The sessions waiting on a backend that just went down are resumed as
+// well, as its queue won't drain while its shards have gone elsewhere.
+static void stats_resume_sessions(stats_server_t *server, bool all, const stats_backend_t *down) {
+	stats_session_t **link = &server->paused;
+	while (*link != NULL) {
+		stats_session_t *session = *link;
+		if (all || session->waiting_on->backend == down ||
+		    tcpclient_drained(&session->waiting_on->client)) {
+			*link = session->next_paused;
+			counter_set(&server->num_paused, server->num_paused - 1);
+			session->waiting_on = NULL;
+			tcpsession_resume(session->handle);
+		} else {
+			link = &session->next_paused;
 		}
-		buffer_consume(&session->buffer, len + 1);	// Add 1 to include the '\n'
 	}
+	if (server->paused == NULL) {
+		ev_timer_stop(server->loop, &server->resume_watcher);
+	}
+}
 
-	return 0;
+static void stats_resume_tick(struct ev_loop *loop, ev_timer *watcher, int revents) {
+	stats_resume_sessions((stats_server_t *) watcher->data, false, NULL);
 }
 
-void stats_session_destroy(stats_session_t *session) {
+// Returns non-zero if the session has to be closed
+static int stats_process_lines(stats_session_t *session) {
+	size_t consumed;
+	const int ret = stats_relay_lines(session->server,
+					  session,
+					  buffer_head(&session->buffer),
+					  buffer_datacount(&session->buffer),
+					  &consumed);
+	buffer_consume(&session->buffer, consumed);
+	if (ret == STATS_LINE_BLOCKED) {
+		stats_session_pause(session);
+		return 0;
+	}
+	return ret;
+}
+
+void stats_connection_closed(void *ctx) {
+	stats_session_t *session = (stats_session_t *) ctx;
+	stats_server_t *server = session->server;
+
+	if (session->waiting_on != NULL) {
+		stats_session_t **link = &server->paused;
+		while (*link != session) {
+			link = &(*link)->next_paused;
+		}
+		*link = session->next_paused;
+		counter_set(&server->num_paused, server->num_paused - 1);
+	}
 	buffer_destroy(&session->buffer);
-	free(session);
+	pool_put(&server->session_pool, session);
 }
 
 int stats_recv(int sd, void *data, void *ctx) {
@@ -461,6 +1582,18 @@ int stats_recv(int sd, void *data, void *ctx) {
 	ssize_t bytes_read;
 	size_t space;
 
+	// The lines held back by a pause go before anything new is read
+	if (session->held) {
+		session->held = false;
+		if (stats_process_lines(session) != 0) {
+			stats_log("stats: Invalid line processed, closing connection");
+			goto stats_recv_err;
+		}
+		if (session->held) {
+			return 0;
+		}
+	}
+
 	// First we try to realign the buffer (memmove so that head
 	// and ptr match) If that fails, we double the size of the
 	// buffer
@@ -478,7 +1611,10 @@ int stats_recv(int sd, void *data, void *ctx) {
 	}
 
 	bytes_read = recv(sd, buffer_tail(&session->buffer), space, 0);
-	if (bytes_read < 0) {
+	if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		// resumed, with nothing new to read
+		goto stats_recv_done;
+	} else if (bytes_read < 0) {
 		stats_log("stats: Error receiving from socket: %s", strerror(errno));
 		goto stats_recv_err;
 	} else if (bytes_read == 0) {
@@ -488,7 +1624,8 @@ int stats_recv(int sd, void *data, void *ctx) {
 		stats_debug_log("stats: received %zd bytes from tcp client fd %d", bytes_read, sd);
 	}
 
-	session->server->bytes_recv_tcp += bytes_read;
+	counter_add(&session->server->bytes_recv_tcp, bytes_read);
+	session->server->recv_time = histogram_now();
 
 	if (buffer_produced(&session->buffer, bytes_read) != 0) {
 		stats_log("stats: Unable to produce buffer by %i bytes, aborting", bytes_read);
@@ -500,69 +1637,84 @@ int stats_recv(int sd, void *data, void *ctx) {
 		goto stats_recv_err;
 	}
 
+stats_recv_done:
+	// Idle clients don't hold on to a buffer
+	buffer_release(&session->buffer);
 	return 0;
 
 stats_recv_err:
-	stats_session_destroy(session);
 	return 1;
 }
 
-// TODO: refactor this whole method to share more code with the tcp receiver:
-//  * this shouldn't have to allocate a new buffer -- it should be on the ss
-//  * the line processing stuff should use stats_process_lines()
-int stats_udp_recv(int sd, void *data) {
-	stats_server_t *ss = (stats_server_t *)data;
-	ssize_t bytes_read;
-	char *head, *tail;
-
-	static char buffer[MAX_UDP_LENGTH];
-	static char line_buffer[MAX_UDP_LENGTH + 2];
-
-	bytes_read = read(sd, buffer, MAX_UDP_LENGTH);
+static int stats_udp_process(stats_server_t *ss, int sd, char *buffer, size_t bytes_read) {
+	size_t consumed;
 
 	if (bytes_read == 0) {
 		stats_error_log("stats: Unexpectedly received zero-length UDP payload.");
-		goto udp_recv_err;
-	} else if (bytes_read < 0) {
-		if (errno == EAGAIN) {
-			stats_error_log("stats: interrupted during recvfrom");
-			goto udp_recv_err;
-		} else {
-			stats_error_log("stats: Error calling recvfrom: %s", strerror(errno));
-			goto udp_recv_err;
-		}
-	} else {
-		stats_debug_log("stats: received %zd bytes from udp fd %d", bytes_read, sd);
+		return 1;
 	}
+	stats_debug_log("stats: received %zd bytes from udp fd %d", bytes_read, sd);
 
-	ss->bytes_recv_udp += bytes_read;
+	counter_add(&ss->bytes_recv_udp, bytes_read);
 
-	size_t line_len;
-	size_t offset = 0;
-	while (offset < bytes_read) {
-		head = (char *) buffer + offset;
-		if ((tail = memchr(head, '\n', bytes_read - offset)) == NULL) {
-			tail = buffer + bytes_read;
-		}
+	// The udpserver leaves a spare byte after every datagram, so a
+	// final line without a trailing newline can be terminated in
+	// place and relayed like all of the others.
+	size_t len = bytes_read;
+	if (buffer[len - 1] != '\n') {
+		buffer[len++] = '\n';
+	}
+	return stats_relay_lines(ss, NULL, buffer, len, &consumed);
+}
 
-		line_len = tail - head;
-		memcpy(line_buffer, head, line_len);
-		memcpy(line_buffer + line_len, "\n\0", 2);
+int stats_udp_recv(int sd, void *data, struct iovec *dgrams, unsigned int count) {
+	stats_server_t *ss = (stats_server_t *)data;
+	int ret = 0;
 
-		if (stats_relay_line(line_buffer, line_len, ss) != 0) {
-			goto udp_recv_err;
-		}
-		offset += line_len + 1;
+	ss->recv_time = histogram_now();
+	counter_add(&ss->udp_wakeups, 1);
+	counter_add(&ss->udp_datagrams, count);
+	if (count > 1 && count == ss->config->udp_batch_size) {
+		counter_add(&ss->udp_full_batches, 1);
 	}
-	return 0;
 
-udp_recv_err:
-	return 1;
+	// A bad line only aborts the rest of its own datagram, the
+	// remainder of the batch is still relayed.
+	for (unsigned int i = 0; i < count; i++) {
+		if (stats_udp_process(ss, sd, dgrams[i].iov_base, dgrams[i].iov_len) != 0) {
+			ret = 1;
+		}
+	}
+	return ret;
 }
 
 void stats_server_destroy(stats_server_t *server) {
+	ev_ref(server->loop);
+	ev_check_stop(server->loop, &server->loop_wakeup_watcher);
+	ev_ref(server->loop);
+	ev_prepare_stop(server->loop, &server->loop_sleep_watcher);
+	ev_timer_stop(server->loop, &server->drain_watcher);
+	ev_timer_stop(server->loop, &server->aggregate_watcher);
+	ev_timer_stop(server->loop, &server->health_watcher);
+	ev_timer_stop(server->loop, &server->self_metrics_watcher);
+	ev_timer_stop(server->loop, &server->resume_watcher);
+	selfstats_destroy(&server->selfstats);
+	stats_stop_egress(server);
 	hashring_dealloc(server->ring);
+	for (size_t i = 0; i < server->num_backends; i++) {
+		kill_backend(server->backend_list[i]);
+	}
+	for (size_t i = 0; i < server->num_draining; i++) {
+		kill_backend(server->draining_list[i]);
+	}
+	stats_destroy_egress(server);
 	free(server->backend_list);
+	free(server->draining_list);
 	server->num_backends = 0;
+	server->num_draining = 0;
+	stats_destroy_counters(server);
+	sendqueue_pool_destroy(&server->send_pool);
+	pool_destroy(&server->session_pool);
+	bufpool_destroy(&server->buffer_pool);
 	free(server);
 }
@@ -2,32 +2,108 @@
 #define STATSRELAY_STATS_H
 
 #include <ev.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "protocol.h"
 #include "validate.h"
 #include "yaml_config.h"
 
 typedef struct stats_server_t stats_server_t;
+struct tcpsession_t;
+
+// Percentiles of a latency histogram, in nanoseconds
+struct stats_latency {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+};
+
+struct stats_backend_snapshot {
+	char *key;
+	uint64_t bytes_queued;
+	uint64_t bytes_sent;
+	uint64_t relayed_lines;
+	uint64_t dropped_lines;
+	uint64_t queued_bytes;		// waiting to go out, in memory or spooled
+	uint64_t spooled_bytes;
+	uint64_t failing;		// 0 or 1
+	uint64_t down;			// 0 or 1, its shards are failed over
+	struct stats_latency queue_residence;
+};
+
+// The counters of every worker for a protocol, summed up at one point
+// in time. Everything is a plain copy, so a snapshot can outlive a
+// reload.
+typedef struct stats_snapshot {
+	uint64_t bytes_recv_udp;
+	uint64_t bytes_recv_tcp;
+	uint64_t udp_wakeups;
+	uint64_t udp_datagrams;
+	uint64_t udp_full_batches;
+	uint64_t total_connections;
+	uint64_t listen_overflows;	// counted by the kernel, for every listener
+	uint64_t listen_drops;
+	uint64_t last_reload;		// seconds since the epoch
+	uint64_t malformed_lines;
+	uint64_t aggregated_lines;
+	uint64_t aggregate_lines_out;
+	uint64_t backpressure_pauses;
+	uint64_t paused_connections;
+	uint64_t session_pool_hits;
+	uint64_t session_pool_misses;
+	uint64_t buffer_pool_hits;
+	uint64_t buffer_pool_misses;
+	struct stats_latency recv_to_enqueue;
+	struct stats_latency validate_time;
+	struct stats_latency hash_time;
+	struct stats_latency enqueue_time;
+	struct stats_latency loop_iteration;
+	size_t num_backends;
+	struct stats_backend_snapshot *backends;
+} stats_snapshot_t;
 
 stats_server_t *stats_server_create(
 	struct ev_loop *loop,
 	struct proto_config *config,
 	protocol_parser_t parser,
 	validate_line_validator_t validator);
-	stats_server_t *server;
 
 size_t stats_num_backends(stats_server_t *server);
 
-void stats_server_reload(stats_server_t *server);
+// Tell a server about every server for the same protocol (including
+// itself) when running multiple workers, so that the status command
+// reports the sum of all of their counters.
+void stats_server_set_peers(stats_server_t *server,
+			    stats_server_t **peers,
+			    size_t num_peers);
+
+// Switch to a new config. Backends that are still in the shard map keep
+// their connection and queued data, new ones are connected, and removed
+// ones are destroyed once their send queue has drained. Returns non-zero
+// (and keeps using the old config) if the new shard map can't be loaded.
+int stats_server_reload(stats_server_t *server, struct proto_config *config);
 
 void stats_server_destroy(stats_server_t *server);
 
-// ctx is a (void *) cast of the stats_server_t instance.
-void *stats_connection(int sd, void *ctx);
+// Returns NULL if memory ran out
+stats_snapshot_t *stats_server_snapshot(stats_server_t *server);
+
+void stats_snapshot_destroy(stats_snapshot_t *snapshot);
+
+// ctx is a (void *) cast of the stats_server_t instance, and handle
+// is the tcpserver's session, used to pause it for backpressure.
+void *stats_connection(int sd, void *ctx, struct tcpsession_t *handle);
 
 int stats_recv(int sd, void *data, void *ctx);
 
-int stats_udp_recv(int sd, void *data);
+// Release a session once its client connection has been closed
+void stats_connection_closed(void *ctx);
+
+// Relay every line in a batch of datagrams read by the udpserver.
+int stats_udp_recv(int sd, void *data, struct iovec *dgrams, unsigned int count);
 
 #endif  // STATSRELAY_STATS_H
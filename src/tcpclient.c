@@ -1,16 +1,19 @@
 #include "tcpclient.h"
-#include "buffer.h"
+#include "counter.h"
 #include "log.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <time.h>
@@ -18,10 +21,14 @@
 
 #include <ev.h>
 
-#define DEFAULT_BUFFER_SIZE (1<<16)
+#ifdef MSG_NOSIGNAL
+#define TCPCLIENT_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define TCPCLIENT_SEND_FLAGS 0
+#endif
 
 static const char *tcpclient_state_name[] = {
-	"INIT", "CONNECTING", "BACKOFF", "CONNECTED", "TERMINATED"
+	"INIT", "RESOLVING", "CONNECTING", "BACKOFF", "CONNECTED", "TERMINATED"
 };
 
 static int tcpclient_default_callback(void *tc, enum tcpclient_event event, void *context, char *data, size_t len) {
@@ -40,6 +47,36 @@ static void tcpclient_set_state(tcpclient_t *client, enum tcpclient_state state)
 	client->state = state;
 }
 
+// Retry after a random delay of up to backoff_min_ms, which doubles
+// with every failure in a row up to backoff_max_ms. The randomness
+// spreads out the reconnects of every relay once a backend comes back.
+static void tcpclient_backoff(tcpclient_t *client) {
+	const uint64_t max_ms = client->config->backoff_max_ms;
+	uint64_t ceiling_ms = client->config->backoff_min_ms;
+	for (int i = 0; i < client->retry_count && ceiling_ms < max_ms; i++) {
+		ceiling_ms *= 2;
+	}
+	if (ceiling_ms > max_ms) {
+		ceiling_ms = max_ms;
+	}
+	const uint64_t delay_ms = (uint64_t) rand_r(&client->jitter_seed) % (ceiling_ms + 1);
+	if (client->retry_count < INT_MAX) {
+		client->retry_count++;
+	}
+	tcpclient_set_state(client, STATE_BACKOFF);
+	ev_timer_stop(client->loop, &client->retry_watcher);
+	ev_timer_set(&client->retry_watcher, delay_ms / 1000.0, 0);
+	ev_timer_start(client->loop, &client->retry_watcher);
+}
+
+static void tcpclient_retry(struct ev_loop *loop, struct ev_timer *watcher, int events) {
+	tcpclient_t *client = (tcpclient_t *)watcher->data;
+	if (client->state == STATE_BACKOFF) {
+		tcpclient_set_state(client, STATE_INIT);
+		tcpclient_connect(client);
+	}
+}
+
 static void tcpclient_connect_timeout(struct ev_loop *loop, struct ev_timer *watcher, int events) {
 	tcpclient_t *client = (tcpclient_t *)watcher->data;
 	if (client->connect_watcher.started) {
@@ -49,15 +86,62 @@ static void tcpclient_connect_timeout(struct ev_loop *loop, struct ev_timer *wat
 
 	close(client->sd);
 	stats_error_log("tcpclient[%s]: Connection timeout", client->name);
-	client->last_error = time(NULL);
-	tcpclient_set_state(client, STATE_BACKOFF);
+	tcpclient_backoff(client);
 	client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
 }
 
+static void tcpclient_flush_timeout(struct ev_loop *loop, struct ev_timer *watcher, int events);
+static void tcpclient_resolved(struct ev_loop *loop, struct ev_async *watcher, int events);
+static void tcpclient_replay_spool(struct ev_loop *loop, struct ev_timer *watcher, int events);
+
+static void tcpclient_start_replay(tcpclient_t *client) {
+	if (!ev_is_active(&client->replay_watcher)) {
+		client->replay_credit = 0;
+		ev_timer_set(&client->replay_watcher,
+			     TCPCLIENT_REPLAY_INTERVAL,
+			     TCPCLIENT_REPLAY_INTERVAL);
+		ev_timer_start(client->loop, &client->replay_watcher);
+	}
+}
+
+// To be called whenever the send queue or the spool changes
+static void tcpclient_publish_depth(tcpclient_t *client) {
+	counter_set(&client->queued_bytes, sendqueue_datacount(&client->send_queue));
+	counter_set(&client->spooled_bytes,
+		    client->spool_enabled ? spool_datacount(&client->spool) : 0);
+}
+
+// Each backend spools to a directory named after host, port and protocol
+static void tcpclient_open_spool(tcpclient_t *client) {
+	char name[TCPCLIENT_NAME_LEN];
+
+	snprintf(name, sizeof(name), "%s_%s_%s", client->host, client->port, client->protocol);
+	for (char *p = name; *p != '\0'; p++) {
+		if (!isalnum((unsigned char) *p) && *p != '.' && *p != '-') {
+			*p = '_';
+		}
+	}
+	if (spool_open(&client->spool,
+		       client->config->spool_dir,
+		       name,
+		       client->config->spool_max_bytes,
+		       SPOOL_SEGMENT_SIZE) != 0) {
+		stats_error_log("tcpclient[%s:%s]: Unable to open spool, spooling is disabled",
+				client->host, client->port);
+		return;
+	}
+	client->spool_enabled = true;
+	tcpclient_publish_depth(client);
+	if (spool_datacount(&client->spool) > 0) {
+		tcpclient_start_replay(client);
+	}
+}
+
 int tcpclient_init(tcpclient_t *client,
 		   struct ev_loop *loop,
 		   void *callback_context,
 		   struct proto_config *config,
+		   sendqueue_pool_t *pool,
 		   char *host,
 		   char *port,
 		   char *protocol) {
@@ -67,7 +151,11 @@ int tcpclient_init(tcpclient_t *client,
 	client->loop = loop;
 	client->sd = -1;
 	client->addr = NULL;
-	client->last_error = 0;
+	client->resolve_request = NULL;
+	client->just_resolved = false;
+	client->retry_count = 0;
+	client->jitter_seed = (unsigned int) time(NULL) ^ (unsigned int) getpid() ^
+		(unsigned int) (uintptr_t) client;
 	client->failing = 0;
 	client->config = config;
 	client->socktype = SOCK_DGRAM;
@@ -116,6 +204,14 @@ int tcpclient_init(tcpclient_t *client,
 		strncpy(client->protocol, protocol, len);
 	}
 
+	// We only know about tcp and udp, so if we get something unexpected just
+	// default to tcp
+	if (strncmp(client->protocol, "udp", 3) == 0) {
+		client->socktype = SOCK_DGRAM;
+	} else {
+		client->socktype = SOCK_STREAM;
+	}
+
 	strncpy(client->name, "UNRESOLVED", TCPCLIENT_NAME_LEN);
 
 	client->callback_connect = &tcpclient_default_callback;
@@ -123,12 +219,33 @@ int tcpclient_init(tcpclient_t *client,
 	client->callback_recv = &tcpclient_default_callback;
 	client->callback_error = &tcpclient_default_callback;
 	client->callback_context = callback_context;
-	buffer_init(&client->send_queue);
-	buffer_newsize(&client->send_queue, DEFAULT_BUFFER_SIZE);
+	sendqueue_init(&client->send_queue, pool);
+	client->queued_bytes = 0;
+	client->spooled_bytes = 0;
 	ev_timer_init(&client->timeout_watcher,
 		      tcpclient_connect_timeout,
 		      TCPCLIENT_CONNECT_TIMEOUT,
 		      0);
+	ev_timer_init(&client->retry_watcher, tcpclient_retry, 0, 0);
+	client->retry_watcher.data = client;
+	ev_timer_init(&client->flush_watcher,
+		      tcpclient_flush_timeout,
+		      config->udp_flush_interval_ms / 1000.0,
+		      0);
+	client->flush_watcher.data = client;
+	ev_async_init(&client->resolve_watcher, tcpclient_resolved);
+	client->resolve_watcher.data = client;
+	ev_async_start(loop, &client->resolve_watcher);
+	ev_timer_init(&client->replay_watcher,
+		      tcpclient_replay_spool,
+		      TCPCLIENT_REPLAY_INTERVAL,
+		      TCPCLIENT_REPLAY_INTERVAL);
+	client->replay_watcher.data = client;
+	client->replay_credit = 0;
+	client->spool_enabled = false;
+	if (config->spool_dir != NULL) {
+		tcpclient_open_spool(client);
+	}
 
 	client->connect_watcher.started = false;
 	client->read_watcher.started = false;
@@ -140,6 +257,18 @@ void tcpclient_set_sent_callback(tcpclient_t *client, tcpclient_callback callbac
 	client->callback_sent = callback;
 }
 
+void tcpclient_set_connect_callback(tcpclient_t *client, tcpclient_callback callback) {
+	client->callback_connect = callback;
+}
+
+void tcpclient_set_error_callback(tcpclient_t *client, tcpclient_callback callback) {
+	client->callback_error = callback;
+}
+
+void tcpclient_set_config(tcpclient_t *client, struct proto_config *config) {
+	client->config = config;
+}
+
 static void tcpclient_read_event(struct ev_loop *loop, struct ev_io *watcher, int events) {
 	tcpclient_t *client = (tcpclient_t *)watcher->data;
 	ssize_t len;
@@ -167,8 +296,7 @@ static void tcpclient_read_event(struct ev_loop *loop, struct ev_io *watcher, in
 		}
 		close(client->sd);
 		free(buf);
-		tcpclient_set_state(client, STATE_BACKOFF);
-		client->last_error = time(NULL);
+		tcpclient_backoff(client);
 		client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
 		return;
 	}
@@ -179,8 +307,7 @@ static void tcpclient_read_event(struct ev_loop *loop, struct ev_io *watcher, in
 		ev_io_stop(client->loop, &client->write_watcher.watcher);
 		close(client->sd);
 		free(buf);
-		tcpclient_set_state(client, STATE_INIT);
-		client->last_error = time(NULL);
+		tcpclient_backoff(client);
 		client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
 		return;
 	}
@@ -189,37 +316,194 @@ static void tcpclient_read_event(struct ev_loop *loop, struct ev_io *watcher, in
 }
 
 
+static void tcpclient_send_failed(tcpclient_t *client) {
+	stats_error_log("tcpclient[%s]: Error from send: %s", client->name, strerror(errno));
+	ev_io_stop(client->loop, &client->write_watcher.watcher);
+	ev_io_stop(client->loop, &client->read_watcher.watcher);
+	client->write_watcher.started = false;
+	client->read_watcher.started = false;
+	tcpclient_backoff(client);
+	close(client->sd);
+	client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
+}
+
+static void tcpclient_start_flush_timer(tcpclient_t *client) {
+	if (!ev_is_active(&client->flush_watcher)) {
+		ev_timer_set(&client->flush_watcher,
+			     client->config->udp_flush_interval_ms / 1000.0,
+			     0);
+		ev_timer_start(client->loop, &client->flush_watcher);
+	}
+}
+
+// Send count datagrams, returns how many were sent or -1 if the first
+// one failed.
+static int tcpclient_sendmmsg(int sd, struct msghdr *msgs, int count) {
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr mmsgs[TCPCLIENT_DGRAM_BATCH];
+	for (int i = 0; i < count; i++) {
+		mmsgs[i].msg_hdr = msgs[i];
+		mmsgs[i].msg_len = 0;
+	}
+	return sendmmsg(sd, mmsgs, count, TCPCLIENT_SEND_FLAGS);
+#else
+	int sent;
+	for (sent = 0; sent < count; sent++) {
+		if (sendmsg(sd, &msgs[sent], TCPCLIENT_SEND_FLAGS) < 0) {
+			return sent > 0 ? sent : -1;
+		}
+	}
+	return sent;
+#endif
+}
+
+// Pack whole lines into datagrams of up to udp_max_payload bytes and
+// send them in batches. Unless flush is set, a final datagram that still
+// has room is held back for the flush timer so more lines can join it.
+static void tcpclient_write_datagrams(tcpclient_t *client, bool flush) {
+	sendqueue_t *sendq = &client->send_queue;
+	size_t max_payload = client->config->udp_max_payload;
+	struct sendqueue_cursor cursor;
+	struct iovec iov[TCPCLIENT_DGRAM_BATCH][TCPCLIENT_DGRAM_IOV];
+	struct msghdr msgs[TCPCLIENT_DGRAM_BATCH];
+	size_t lens[TCPCLIENT_DGRAM_BATCH];
+	bool blocked = false;
+
+	while (!blocked) {
+		size_t queued = sendqueue_datacount(sendq);
+		size_t batched = 0;
+		size_t dropped = 0;
+		int count = 0;
+
+		sendqueue_cursor_init(sendq, &cursor);
+		while (count < TCPCLIENT_DGRAM_BATCH && batched < queued) {
+			int iovcnt;
+			size_t len = sendqueue_next_records(sendq, &cursor, max_payload, '\n',
+							    iov[count], TCPCLIENT_DGRAM_IOV, &iovcnt);
+			if (len == 0) {
+				// Either the rest is a partial line, or the first
+				// line spans more chunks than a datagram has
+				// iovecs; only such a line is dropped.
+				if (count == 0 && (dropped = sendqueue_record_len(sendq, '\n')) > 0) {
+					stats_error_log("tcpclient[%s]: Line too long to send, dropping %zd bytes",
+							client->name, dropped);
+					sendqueue_consume(sendq, dropped);
+				}
+				break;
+			}
+			if (!flush && batched + len == queued && len < max_payload) {
+				break;
+			}
+			memset(&msgs[count], 0, sizeof(struct msghdr));
+			msgs[count].msg_iov = iov[count];
+			msgs[count].msg_iovlen = iovcnt;
+			lens[count] = len;
+			batched += len;
+			count++;
+		}
+		if (count == 0) {
+			if (dropped > 0) {
+				continue;
+			}
+			break;
+		}
+
+		int sent = tcpclient_sendmmsg(client->sd, msgs, count);
+		stats_debug_log("tcpclient: sent %d of %d datagrams to backend client %s via fd %d",
+				sent, count, client->name, client->sd);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				blocked = true;
+				break;
+			}
+			if (errno == EMSGSIZE) {
+				stats_error_log("tcpclient[%s]: Dropping %zd byte datagram: %s",
+						client->name, lens[0], strerror(errno));
+				sendqueue_consume(sendq, lens[0]);
+				continue;
+			}
+			tcpclient_publish_depth(client);
+			tcpclient_send_failed(client);
+			return;
+		}
+		size_t sent_len = 0;
+		for (int i = 0; i < sent; i++) {
+			sent_len += lens[i];
+		}
+		client->callback_sent(client, EVENT_SENT, client->callback_context, NULL, sent_len);
+		sendqueue_consume(sendq, sent_len);
+		if (sent < count) {
+			blocked = true;
+		}
+	}
+
+	tcpclient_publish_depth(client);
+	size_t qsize = sendqueue_datacount(sendq);
+	if (client->failing && !client->spool_enabled &&
+	    qsize < client->config->max_send_queue) {
+		stats_log("tcpclient[%s]: client recovered from full queue, send queue is now %zd bytes",
+			  client->name,
+			  qsize);
+		client->failing = 0;
+	}
+	if (blocked) {
+		client->write_watcher.started = true;
+		ev_io_start(client->loop, &client->write_watcher.watcher);
+		return;
+	}
+	if (client->write_watcher.started) {
+		ev_io_stop(client->loop, &client->write_watcher.watcher);
+		client->write_watcher.started = false;
+	}
+	if (qsize > 0) {
+		tcpclient_start_flush_timer(client);
+	}
+}
+
+static void tcpclient_flush_timeout(struct ev_loop *loop, struct ev_timer *watcher, int events) {
+	tcpclient_t *client = (tcpclient_t *)watcher->data;
+	if (client->state == STATE_CONNECTED) {
+		tcpclient_write_datagrams(client, true);
+	}
+}
+
 static void tcpclient_write_event(struct ev_loop *loop, struct ev_io *watcher, int events) {
 	tcpclient_t *client = (tcpclient_t *)watcher->data;
-	buffer_t *sendq;
+	sendqueue_t *sendq;
+	struct iovec iov[TCPCLIENT_SEND_IOV];
+	struct msghdr msg;
 
 	if (!(events & EV_WRITE)) {
 		return;
 	}
 
+	if (client->socktype == SOCK_DGRAM) {
+		tcpclient_write_datagrams(client, client->config->udp_flush_interval_ms == 0);
+		return;
+	}
+
 	sendq = &client->send_queue;
-	ssize_t buf_len = buffer_datacount(sendq);
+	size_t buf_len = sendqueue_datacount(sendq);
 	if (buf_len > 0) {
-		ssize_t send_len = send(client->sd, sendq->head, buf_len, 0);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = sendqueue_iov(sendq, iov, TCPCLIENT_SEND_IOV);
+		ssize_t send_len = sendmsg(client->sd, &msg, TCPCLIENT_SEND_FLAGS);
 		stats_debug_log("tcpclient: sent %zd of %zd bytes to backend client %s via fd %d",
 				send_len, buf_len, client->name, client->sd);
 		if (send_len < 0) {
-			stats_error_log("tcpclient[%s]: Error from send: %s", client->name, strerror(errno));
-			ev_io_stop(client->loop, &client->write_watcher.watcher);
-			ev_io_stop(client->loop, &client->read_watcher.watcher);
-			client->last_error = time(NULL);
-			tcpclient_set_state(client, STATE_BACKOFF);
-			close(client->sd);
-			client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
+			tcpclient_send_failed(client);
 			return;
 		} else {
-			client->callback_sent(client, EVENT_SENT, client->callback_context, sendq->head, (size_t) send_len);
-			if (buffer_consume(sendq, send_len) != 0) {
+			client->callback_sent(client, EVENT_SENT, client->callback_context, NULL, (size_t) send_len);
+			if (sendqueue_consume(sendq, send_len) != 0) {
 				stats_error_log("tcpclient[%s]: Unable to consume send queue", client->name);
 				return;
 			}
-			size_t qsize = buffer_datacount(&client->send_queue);
-			if (client->failing && qsize < client->config->max_send_queue) {
+			tcpclient_publish_depth(client);
+			size_t qsize = sendqueue_datacount(sendq);
+			if (client->failing && !client->spool_enabled &&
+			    qsize < client->config->max_send_queue) {
 				stats_log("tcpclient[%s]: client recovered from full queue, send queue is now %zd bytes",
 					  client->name,
 					  qsize);
@@ -255,12 +539,13 @@ static void tcpclient_connected(struct ev_loop *loop, struct ev_io *watcher, int
 	if ((events & EV_ERROR) || err) {
 		stats_error_log("tcpclient[%s]: Connect failed: %s", client->name, strerror(err));
 		close(client->sd);
-		client->last_error = time(NULL);
-		tcpclient_set_state(client, STATE_BACKOFF);
+		tcpclient_backoff(client);
+		client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
 		return;
 	}
 
 	tcpclient_set_state(client, STATE_CONNECTED);
+	client->retry_count = 0;
 
 	// Setup events for recv
 	client->read_watcher.started = true;
@@ -276,63 +561,82 @@ static void tcpclient_connected(struct ev_loop *loop, struct ev_io *watcher, int
 	client->callback_connect(client, EVENT_CONNECTED, client->callback_context, NULL, 0);
 }
 
+// Look the backend up on a resolver thread; tcpclient_resolved picks
+// the result up and carries on connecting.
+static int tcpclient_resolve(tcpclient_t *client) {
+	client->resolve_request = resolver_submit(client->loop,
+						  &client->resolve_watcher,
+						  client->host,
+						  client->port,
+						  client->socktype,
+						  client->config->dns_cache_ttl);
+	if (client->resolve_request == NULL) {
+		stats_error_log("tcpclient[%s]: Unable to allocate memory for address lookup", client->name);
+		tcpclient_backoff(client);
+		client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
+		return 3;
+	}
+	tcpclient_set_state(client, STATE_RESOLVING);
+	return 0;
+}
+
+static void tcpclient_resolved(struct ev_loop *loop, struct ev_async *watcher, int events) {
+	tcpclient_t *client = (tcpclient_t *)watcher->data;
+	struct addrinfo *addr;
+	int error;
+
+	if (client->resolve_request == NULL ||
+	    !resolver_finish(client->resolve_request, &addr, &error)) {
+		return;
+	}
+	client->resolve_request = NULL;
+
+	if (error != 0) {
+		stats_error_log("tcpclient: Error resolving backend address %s: %s", client->host, gai_strerror(error));
+		tcpclient_backoff(client);
+		client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
+		return;
+	}
+	client->addr = addr;
+	client->just_resolved = true;
+	snprintf(client->name, TCPCLIENT_NAME_LEN, "%s/%s/%s", client->host, client->port, client->protocol);
+	tcpclient_set_state(client, STATE_INIT);
+	tcpclient_connect(client);
+}
+
 int tcpclient_connect(tcpclient_t *client) {
-	struct addrinfo hints;
 	struct addrinfo *addr;
 	int sd;
 
-	if (client->state == STATE_CONNECTED || client->state == STATE_CONNECTING) {
+	if (client->state == STATE_CONNECTED ||
+	    client->state == STATE_CONNECTING ||
+	    client->state == STATE_RESOLVING) {
 		// Already connected, do nothing
 		return 1;
 	}
 
 	if (client->state == STATE_BACKOFF) {
-		// If backoff timer has expired, change to STATE_INIT and call recursively
-		if ((time(NULL) - client->last_error) > TCPCLIENT_RETRY_TIMEOUT) {
-			tcpclient_set_state(client, STATE_INIT);
-			return tcpclient_connect(client);
-		} else {
-			return 2;
-		}
+		// The retry timer reconnects
+		return 2;
 	}
 
 	if (client->state == STATE_INIT) {
-		// Resolve address, create socket, set nonblocking, setup callbacks, fire connect
-		if (client->config->always_resolve_dns == true && client->addr != NULL) {
-			freeaddrinfo(client->addr);
+		// Create socket, set nonblocking, setup callbacks, fire connect;
+		// resolve the address first if need be
+		if (client->config->always_resolve_dns == true &&
+		    client->addr != NULL && !client->just_resolved) {
+			resolver_free_addr(client->addr);
 			client->addr = NULL;
 		}
-
 		if (client->addr == NULL) {
-			// We only know about tcp and udp, so if we get something unexpected just
-			// default to tcp
-			if (strncmp(client->protocol, "udp", 3) == 0) {
-				client->socktype = SOCK_DGRAM;
-			} else {
-				client->socktype = SOCK_STREAM;
-			}
-			memset(&hints, 0, sizeof(hints));
-			hints.ai_family = AF_UNSPEC;
-			hints.ai_socktype = client->socktype;
-			hints.ai_flags = AI_PASSIVE;
-
-			if (getaddrinfo(client->host, client->port, &hints, &addr) != 0) {
-				stats_error_log("tcpclient: Error resolving backend address %s: %s", client->host, gai_strerror(errno));
-				client->last_error = time(NULL);
-				tcpclient_set_state(client, STATE_BACKOFF);
-				client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
-				return 3;
-			}
-			client->addr = addr;
-			snprintf(client->name, TCPCLIENT_NAME_LEN, "%s/%s/%s", client->host, client->port, client->protocol);
-		} else {
-			addr = client->addr;
+			return tcpclient_resolve(client);
 		}
+		client->just_resolved = false;
+		addr = client->addr;
 
 		if ((sd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0) {
 			stats_error_log("tcpclient[%s]: Unable to create socket: %s", client->name, strerror(errno));
-			client->last_error = time(NULL);
-			tcpclient_set_state(client, STATE_BACKOFF);
+			tcpclient_backoff(client);
 			client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
 			return 4;
 		}
@@ -351,8 +655,7 @@ int tcpclient_connect(tcpclient_t *client) {
 
 		if (fcntl(sd, F_SETFL, (fcntl(sd, F_GETFL) | O_NONBLOCK)) != 0) {
 			stats_error_log("tcpclient[%s]: Unable to set socket to non-blocking: %s", client->name, strerror(errno));
-			client->last_error = time(NULL);
-			tcpclient_set_state(client, STATE_BACKOFF);
+			tcpclient_backoff(client);
 			close(sd);
 			client->callback_error(client, EVENT_ERROR, client->callback_context, NULL, 0);
 			return 5;
@@ -368,8 +671,7 @@ int tcpclient_connect(tcpclient_t *client) {
 
 		if (connect(sd, addr->ai_addr, addr->ai_addrlen) != 0 && errno != EINPROGRESS) {
 			stats_error_log("tcpclient[%s]: Unable to connect: %s", client->name, strerror(errno));
-			client->last_error = time(NULL);
-			tcpclient_set_state(client, STATE_BACKOFF);
+			tcpclient_backoff(client);
 			ev_timer_stop(client->loop, &client->timeout_watcher);
 			ev_io_stop(client->loop, &client->connect_watcher.watcher);
 			close(sd);
@@ -385,48 +687,164 @@ int tcpclient_connect(tcpclient_t *client) {
 	return 7;
 }
 
-int tcpclient_sendall(tcpclient_t *client, const char *buf, size_t len) {
-	buffer_t *sendq = &client->send_queue;
-
-	if (client->addr == NULL) {
-		stats_error_log("tcpclient[%s]: Cannot send before connect!", client->name);
-		return 1;
+static void tcpclient_start_write(tcpclient_t *client) {
+	if (client->state != STATE_CONNECTED) {
+		return;
+	}
+	if (client->socktype == SOCK_DGRAM &&
+	    client->config->udp_flush_interval_ms > 0 &&
+	    sendqueue_datacount(&client->send_queue) < client->config->udp_max_payload) {
+		// Wait for more lines to fill the datagram
+		tcpclient_start_flush_timer(client);
 	} else {
-		// Does nothing if we're already connected, triggers a
-		// reconnect if backoff has expired.
-		tcpclient_connect(client);
+		client->write_watcher.started = true;
+		ev_io_start(client->loop, &client->write_watcher.watcher);
+	}
+}
+
+// The in-memory queue never grows past this while spooling is enabled
+static uint64_t tcpclient_spool_watermark(const tcpclient_t *client) {
+	if (client->config->spool_high_watermark < client->config->max_send_queue) {
+		return client->config->spool_high_watermark;
 	}
+	return client->config->max_send_queue;
+}
 
-	if (buffer_datacount(&client->send_queue) >= client->config->max_send_queue) {
+static int tcpclient_spool_append(tcpclient_t *client, const char *buf, size_t len) {
+	int ret = spool_append(&client->spool, buf, len);
+	tcpclient_publish_depth(client);
+	if (ret != 0) {
 		if (client->failing == 0) {
-			stats_error_log("tcpclient[%s]: send queue for %s client is full (at %zd bytes, max is %" PRIu64 " bytes), dropping data",
-					client->name,
-					tcpclient_state_name[client->state],
-					buffer_datacount(&client->send_queue),
-					client->config->max_send_queue);
+			if (ret == 1) {
+				stats_error_log("tcpclient[%s]: spool for %s client is full (at %" PRIu64 " bytes, max is %" PRIu64 " bytes), dropping data",
+						client->name,
+						tcpclient_state_name[client->state],
+						spool_datacount(&client->spool),
+						client->spool.max_bytes);
+			} else {
+				stats_error_log("tcpclient[%s]: Unable to write to spool, dropping data", client->name);
+			}
 			client->failing = 1;
 		}
 		return 2;
 	}
-	if (buffer_spacecount(sendq) < len) {
-		if (buffer_realign(sendq) != 0) {
-			stats_error_log("tcpclient[%s]: Unable to realign send queue", client->name);
-			return 3;
+	tcpclient_start_replay(client);
+	return 0;
+}
+
+// Move spooled lines back into the send queue ahead of anything newer,
+// at no more than spool_replay_rate bytes per second so that a backend
+// that just came back is not flooded.
+static void tcpclient_replay_spool(struct ev_loop *loop, struct ev_timer *watcher, int events) {
+	tcpclient_t *client = (tcpclient_t *)watcher->data;
+	sendqueue_t *sendq = &client->send_queue;
+	uint64_t watermark = tcpclient_spool_watermark(client);
+	uint64_t per_tick = client->config->spool_replay_rate * TCPCLIENT_REPLAY_INTERVAL;
+	uint64_t max_credit = per_tick > SPOOL_READ_SIZE ? per_tick : SPOOL_READ_SIZE;
+	char buf[SPOOL_READ_SIZE];
+	bool replayed = false;
+
+	// Appended lines are written out at least once per tick, even while
+	// the backend is down
+	spool_flush(&client->spool);
+	tcpclient_publish_depth(client);
+	if (spool_datacount(&client->spool) == 0) {
+		ev_timer_stop(loop, watcher);
+		return;
+	}
+	if (client->state != STATE_CONNECTED) {
+		return;
+	}
+
+	// Unused credit carries over (up to a limit), so that lines longer
+	// than one tick's worth still make it through.
+	client->replay_credit += per_tick > 0 ? per_tick : 1;
+	if (client->replay_credit > max_credit) {
+		client->replay_credit = max_credit;
+	}
+	while (client->replay_credit > 0 && sendqueue_datacount(sendq) < watermark) {
+		size_t len = client->replay_credit < sizeof(buf) ? client->replay_credit : sizeof(buf);
+		ssize_t bytes_read = spool_read(&client->spool, buf, len);
+		if (bytes_read <= 0) {
+			break;
 		}
+		if (sendqueue_append(sendq, buf, bytes_read) != 0) {
+			stats_error_log("tcpclient[%s]: Unable to allocate memory for spooled data, dropping %zd bytes",
+					client->name, bytes_read);
+			break;
+		}
+		client->replay_credit -= bytes_read;
+		replayed = true;
 	}
-	while (buffer_spacecount(sendq) < len) {
-		if (buffer_expand(sendq) != 0) {
-			stats_error_log("tcpclient[%s]: Unable to allocate additional memory for send queue, dropping data", client->name);
-			return 4;
+	tcpclient_publish_depth(client);
+
+	if (replayed) {
+		if (client->failing) {
+			stats_log("tcpclient[%s]: spool has room again, %" PRIu64 " bytes spooled",
+				  client->name, spool_datacount(&client->spool));
+			client->failing = 0;
 		}
+		tcpclient_start_write(client);
 	}
-	memcpy(buffer_tail(sendq), buf, len);
-	buffer_produced(sendq, len);
+	if (spool_datacount(&client->spool) == 0) {
+		stats_log("tcpclient[%s]: spool replayed", client->name);
+		ev_timer_stop(loop, watcher);
+	}
+}
 
-	if (client->state == STATE_CONNECTED) {
-		client->write_watcher.started = true;
-		ev_io_start(client->loop, &client->write_watcher.watcher);
+uint64_t tcpclient_spooled(tcpclient_t *client) {
+	return counter_get(&client->spooled_bytes);
+}
+
+uint64_t tcpclient_queued(tcpclient_t *client) {
+	return counter_get(&client->queued_bytes) + counter_get(&client->spooled_bytes);
+}
+
+bool tcpclient_full(tcpclient_t *client, size_t len) {
+	if (client->spool_enabled) {
+		return counter_get(&client->spooled_bytes) + len > client->spool.max_bytes;
+	}
+	return counter_get(&client->queued_bytes) >= client->config->max_send_queue;
+}
+
+bool tcpclient_drained(tcpclient_t *client) {
+	if (client->spool_enabled) {
+		return counter_get(&client->spooled_bytes) < client->spool.max_bytes / 2;
+	}
+	return counter_get(&client->queued_bytes) < client->config->max_send_queue / 2;
+}
+
+int tcpclient_sendall(tcpclient_t *client, const char *buf, size_t len) {
+	sendqueue_t *sendq = &client->send_queue;
+
+	// Lines are queued whatever the state; reconnecting after a failure
+	// is up to the retry timer.
+	// Once anything is spooled, newer lines go behind it to keep them in
+	// order.
+	if (client->spool_enabled &&
+	    (spool_datacount(&client->spool) > 0 ||
+	     sendqueue_datacount(sendq) >= tcpclient_spool_watermark(client))) {
+		return tcpclient_spool_append(client, buf, len);
+	}
+
+	if (sendqueue_datacount(sendq) >= client->config->max_send_queue) {
+		if (client->failing == 0) {
+			stats_error_log("tcpclient[%s]: send queue for %s client is full (at %zd bytes, max is %" PRIu64 " bytes), dropping data",
+					client->name,
+					tcpclient_state_name[client->state],
+					sendqueue_datacount(sendq),
+					client->config->max_send_queue);
+			client->failing = 1;
+		}
+		return 2;
+	}
+	if (sendqueue_append(sendq, buf, len) != 0) {
+		stats_error_log("tcpclient[%s]: Unable to allocate additional memory for send queue, dropping data", client->name);
+		return 4;
 	}
+	tcpclient_publish_depth(client);
+
+	tcpclient_start_write(client);
 	return 0;
 }
 
@@ -435,6 +853,14 @@ void tcpclient_destroy(tcpclient_t *client, int drop_queue) {
 		return;
 	}
 	ev_timer_stop(client->loop, &client->timeout_watcher);
+	ev_timer_stop(client->loop, &client->retry_watcher);
+	ev_timer_stop(client->loop, &client->flush_watcher);
+	ev_timer_stop(client->loop, &client->replay_watcher);
+	ev_async_stop(client->loop, &client->resolve_watcher);
+	if (client->resolve_request != NULL) {
+		resolver_cancel(client->resolve_request);
+		client->resolve_request = NULL;
+	}
 	if (client->connect_watcher.started) {
 		stats_debug_log("tcpclient_destroy: stopping connect watcher");
 		ev_io_stop(client->loop, &client->connect_watcher.watcher);
@@ -453,9 +879,14 @@ void tcpclient_destroy(tcpclient_t *client, int drop_queue) {
 		stats_debug_log("closing client->sd %d", client->sd);
 	close(client->sd);
 	if (client->addr != NULL) {
-		freeaddrinfo(client->addr);
+		resolver_free_addr(client->addr);
+	}
+	sendqueue_destroy(&client->send_queue);
+	if (client->spool_enabled) {
+		spool_close(&client->spool);
+		client->spool_enabled = false;
 	}
-	buffer_destroy(&client->send_queue);
+	tcpclient_publish_depth(client);
 
 	free(client->host);
 	free(client->port);
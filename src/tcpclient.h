@@ -5,7 +5,9 @@
 #define STATSRELAY_TCPCLIENT_H
 
 #include "config.h"
-#include "buffer.h"
+#include "resolver.h"
+#include "sendqueue.h"
+#include "spool.h"
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -16,10 +18,13 @@
 #include "yaml_config.h"
 
 #define TCPCLIENT_CONNECT_TIMEOUT 2.0
-#define TCPCLIENT_RETRY_TIMEOUT 1
 #define TCPCLIENT_RECV_BUFFER 65536
 #define TCPCLIENT_SEND_QUEUE 134217728	// 128MB
 #define TCPCLIENT_NAME_LEN 256
+#define TCPCLIENT_SEND_IOV 64
+#define TCPCLIENT_DGRAM_BATCH 64
+#define TCPCLIENT_DGRAM_IOV 8
+#define TCPCLIENT_REPLAY_INTERVAL 0.1
 
 enum tcpclient_event {
 	EVENT_CONNECTED,
@@ -30,6 +35,7 @@ enum tcpclient_event {
 
 enum tcpclient_state {
 	STATE_INIT = 0,
+	STATE_RESOLVING,
 	STATE_CONNECTING,
 	STATE_BACKOFF,
 	STATE_CONNECTED,
@@ -38,7 +44,7 @@ enum tcpclient_state {
 
 // data has different meaning depending on the event...
 // EVENT_CONNECTED data = NULL
-// EVENT_SENT data = pointer to buffer passed to tcpclient_sendall
+// EVENT_SENT data = NULL, len = number of bytes written to the socket
 // EVENT_RECV data = received data (must be free'd manually)
 // EVENT_ERROR data = string describing the error
 typedef int (*tcpclient_callback)(void *, enum tcpclient_event, void *, char *, size_t);
@@ -57,16 +63,30 @@ typedef struct tcpclient_t {
 
 	struct ev_loop *loop;
 	ev_timer timeout_watcher;
+	ev_timer retry_watcher;
+	ev_timer flush_watcher;
+	ev_timer replay_watcher;
+	ev_async resolve_watcher;
 	io_watcher_t connect_watcher;
 	io_watcher_t read_watcher;
 	io_watcher_t write_watcher;
 
 	char name[TCPCLIENT_NAME_LEN];
 	struct addrinfo *addr;
-	buffer_t send_queue;
+	resolver_request_t *resolve_request;
+	bool just_resolved;
+	sendqueue_t send_queue;
+	spool_t spool;
+	bool spool_enabled;
+
+	// The depth of the send queue and the spool, as counters (see
+	// counter.h) for threads other than the one the client runs on
+	uint64_t queued_bytes;
+	uint64_t spooled_bytes;
+	uint64_t replay_credit;
 	enum tcpclient_state state;
-	time_t last_error;
-	int retry_count;
+	int retry_count;		// connects that failed in a row
+	unsigned int jitter_seed;
 	int failing;
 	int sd;
 	int socktype;
@@ -82,6 +102,7 @@ int tcpclient_init(tcpclient_t *client,
 		   struct ev_loop *loop,
 		   void *callback_connect,
 		   struct proto_config *config,
+		   sendqueue_pool_t *pool,
 		   char *host,
 		   char *port,
 		   char *protocol);
@@ -89,8 +110,34 @@ int tcpclient_init(tcpclient_t *client,
 void tcpclient_set_sent_callback(tcpclient_t *client,
 				 tcpclient_callback callback);
 
+// Called once connected, and whenever the connection fails or is lost
+void tcpclient_set_connect_callback(tcpclient_t *client,
+				    tcpclient_callback callback);
+void tcpclient_set_error_callback(tcpclient_t *client,
+				  tcpclient_callback callback);
+
+// Point the client at a new (reloaded) config
+void tcpclient_set_config(tcpclient_t *client,
+			  struct proto_config *config);
+
 int tcpclient_connect(tcpclient_t *client);
 
+// These may be called from any thread, while the client runs on
+// another one
+
+// Bytes spooled to disk and not yet replayed
+uint64_t tcpclient_spooled(tcpclient_t *client);
+
+// Bytes waiting to go out, in memory or spooled to disk
+uint64_t tcpclient_queued(tcpclient_t *client);
+
+// Whether tcpclient_sendall would drop len more bytes, as the send queue
+// (or the spool, when spooling) is full
+bool tcpclient_full(tcpclient_t *client, size_t len);
+
+// Whether the send queue (or the spool) is under half of its limit
+bool tcpclient_drained(tcpclient_t *client);
+
 int tcpclient_sendall(tcpclient_t *client,
 		      const char *buf,
 		      size_t len);
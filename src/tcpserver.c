@@ -1,9 +1,14 @@
 #include "tcpserver.h"
 #include "log.h"
+#include "pool.h"
+#include "unixsock.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -17,72 +22,150 @@
 #include <ev.h>
 
 #define MAX_TCP_HANDLERS 32
-#define LISTEN_BACKLOG 128
+#define ACCEPT_BATCH 64		// connections accepted per wakeup
+#define NETSTAT_PATH "/proc/net/netstat"
+#define TCPSESSION_POOL_MAX_FREE 1024
 
 typedef struct tcplistener_t tcplistener_t;
-typedef struct tcpsession_t tcpsession_t;
 
 // tcpserver_t represents an event loop bound to multiple sockets
 struct tcpserver_t {
 	struct ev_loop *loop;
 	tcplistener_t *listeners[MAX_TCP_HANDLERS];
 	int listeners_len;
+	bool reuseport;
 	void *data;
+	int backlog;
+	int defer_accept;		// seconds, 0 to accept right away
+	mode_t unix_mode;
+	unsigned int max_connections;	// per listener, 0 for no limit
+	ev_tstamp idle_timeout;		// 0 keeps idle connections open
+	pool_t sessions;
+
+	// Every open session, from the one that was active longest ago to
+	// the one that was active last, so that idle sessions can be found
+	// from the front without a timer of their own
+	tcpsession_t *oldest;
+	tcpsession_t *newest;
+	ev_timer reap_watcher;
 };
 
 // tcplistener_t represents a socket listening on a port
 struct tcplistener_t {
 	struct ev_loop *loop;
+	tcpserver_t *server;
 	int sd;
 	struct ev_io *watcher;
 	void *data;
-	void *(*cb_conn)(int, void *);
+	void *(*cb_conn)(int, void *, tcpsession_t *);
 	int (*cb_recv)(int, void *, void *);
+	void (*cb_close)(void *);
+	unsigned int num_sessions;
+	bool full;			// max_connections was reached, and that was logged
+	char *path;			// of a unix socket, NULL for TCP
 };
 
 // tcpsession_t represents a client connection to the server
 struct tcpsession_t {
 	struct ev_loop *loop;
+	tcplistener_t *listener;
 	int sd;
-	struct ev_io *watcher;
+	struct ev_io watcher;
 	void *data;
 	int (*cb_recv)(int, void *, void *);
 	struct sockaddr_storage client_addr;
 	void *ctx;
 	void (*ctx_dealloc)(void *);
+	ev_tstamp last_active;
+	bool paused;
+	tcpsession_t *prev;		// active before this one
+	tcpsession_t *next;		// active after this one
 };
 
+static void tcpsession_link(tcpserver_t *server, tcpsession_t *session) {
+	session->prev = server->newest;
+	session->next = NULL;
+	if (server->newest != NULL) {
+		server->newest->next = session;
+	} else {
+		server->oldest = session;
+	}
+	server->newest = session;
+}
+
+static void tcpsession_unlink(tcpserver_t *server, tcpsession_t *session) {
+	if (session->prev != NULL) {
+		session->prev->next = session->next;
+	} else {
+		server->oldest = session->next;
+	}
+	if (session->next != NULL) {
+		session->next->prev = session->prev;
+	} else {
+		server->newest = session->prev;
+	}
+}
+
 static tcpsession_t *tcpsession_create(tcplistener_t *listener) {
 	tcpsession_t *session;
 
-	session = malloc(sizeof(tcpsession_t));
+	session = pool_get(&listener->server->sessions);
 	if (session == NULL) {
 		return NULL;
 	}
 
-	session->watcher = malloc(sizeof(struct ev_io));
-	if (session->watcher == NULL) {
-		free(session);
-		return NULL;
-	}
-
 	session->loop = listener->loop;
+	session->listener = listener;
 	session->data = listener->data;
 	session->sd = -1;
 	session->cb_recv = listener->cb_recv;
-	session->watcher->data = (void *)session;
+	session->watcher.data = (void *)session;
 	session->ctx = NULL;
-	session->ctx_dealloc = NULL;
+	session->ctx_dealloc = listener->cb_close;
+	session->paused = false;
 	return session;
 }
 
+// Close a session that was accepted, and hand it back to the pool
 static void tcpsession_destroy(tcpsession_t *session) {
-	if (session->sd > 0) {
-		close(session->sd);
+	tcplistener_t *listener = session->listener;
+
+	ev_io_stop(session->loop, &session->watcher);
+	close(session->sd);
+	if (session->ctx != NULL && session->ctx_dealloc != NULL) {
+		session->ctx_dealloc(session->ctx);
+	}
+	tcpsession_unlink(listener->server, session);
+	listener->num_sessions--;
+	listener->full = false;
+	pool_put(&listener->server->sessions, session);
+}
+
+// Close the sessions that have been idle for idle_timeout, and wait
+// until the next one will have been
+static void tcpserver_reap_callback(struct ev_loop *loop,
+				    struct ev_timer *watcher,
+				    int revents) {
+	tcpserver_t *server = (tcpserver_t *) watcher->data;
+	const ev_tstamp now = ev_now(loop);
+
+	while (server->oldest != NULL &&
+	       server->oldest->last_active + server->idle_timeout <= now) {
+		tcpsession_t *session = server->oldest;
+		if (session->paused) {
+			tcpsession_unlink(server, session);
+			tcpsession_link(server, session);
+			session->last_active = now;
+			continue;
+		}
+		stats_debug_log("tcpserver: closing idle client connection, client fd = %d",
+				session->sd);
+		tcpsession_destroy(session);
+	}
+	if (server->oldest != NULL) {
+		ev_timer_set(watcher, server->oldest->last_active + server->idle_timeout - now, 0);
+		ev_timer_start(loop, watcher);
 	}
-	ev_io_stop(session->loop, session->watcher);
-	free(session->watcher);
-	free(session);
 }
 
 // Called every time the session socket is readable (data available)
@@ -115,68 +198,158 @@ static void tcpsession_recv_callback(struct ev_loop *loop,
 		tcpsession_destroy(session);
 		return;
 	}
+
+	tcpserver_t *server = session->listener->server;
+	if (server->idle_timeout > 0 && session != server->newest) {
+		tcpsession_unlink(server, session);
+		tcpsession_link(server, session);
+	}
+	session->last_active = ev_now(loop);
 }
 
-// Called every time the server socket is readable (new connection to be accepted)
-// if you don't consume it, it'll get called again very quickly
-static void tcplistener_accept_callback(struct ev_loop *loop,
-					struct ev_io *watcher,
-					int revents) {
-	stats_debug_log("in tcplistener_accept_callback");
+// Accept a single connection. Returns non-zero once there are none left
+// to accept, or accepting failed.
+static int tcplistener_accept(struct ev_loop *loop, tcplistener_t *listener) {
 	socklen_t sin_size;
-	tcplistener_t *listener;
+	tcpserver_t *server = listener->server;
 	tcpsession_t *session;
-	int err;
 
-	if (revents & EV_ERROR) {
-		// ev(3) says this is an error of "unspecified" type, so
-		// that's bloody useful.
-		stats_error_log("tcplistener: libev server socket error");
-		return;
-	}
-
-	listener = (tcplistener_t *) watcher->data;
 	session = tcpsession_create(listener);
 	if (session == NULL) {
 		stats_error_log("tcplistener: Unable to allocate tcpsession, not calling accept()");
-		return;
+		return 1;
 	}
 
 	sin_size = sizeof(session->client_addr);
-	session->sd = accept(watcher->fd, (struct sockaddr *)&session->client_addr, &sin_size);
-	stats_debug_log("tcpserver: accepted new tcp client connection, client fd = %d, tcp server fd = %d", session->sd, watcher->fd);
+#ifdef HAVE_ACCEPT4
+	session->sd = accept4(listener->sd, (struct sockaddr *)&session->client_addr, &sin_size,
+			      SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	session->sd = accept(listener->sd, (struct sockaddr *)&session->client_addr, &sin_size);
+#endif
 	if (session->sd < 0) {
-		stats_error_log("tcplistener: Error accepting connection: %s", strerror(errno));
-		return;
+		const int accept_errno = errno;
+		pool_put(&server->sessions, session);
+		if (accept_errno == ECONNABORTED) {
+			// the client was gone before it could be accepted
+			return 0;
+		}
+		if (accept_errno != EAGAIN && accept_errno != EWOULDBLOCK) {
+			stats_error_log("tcplistener: Error accepting connection: %s", strerror(accept_errno));
+		}
+		return 1;
+	}
+	stats_debug_log("tcpserver: accepted new tcp client connection, client fd = %d, tcp server fd = %d",
+			session->sd, listener->sd);
+
+	// Over the limit, connections are closed as soon as they're
+	// accepted, so that clients find out rather than wait in the backlog
+	if (server->max_connections > 0 && listener->num_sessions >= server->max_connections) {
+		if (!listener->full) {
+			stats_error_log("tcplistener: %u client connections open on fd %d, closing new ones",
+					listener->num_sessions, listener->sd);
+			listener->full = true;
+		}
+		goto reject;
 	}
 
-	err = fcntl(session->sd, F_SETFL, (fcntl(session->sd, F_GETFL) | O_NONBLOCK));
-	if (err != 0) {
+#ifndef HAVE_ACCEPT4
+	if (fcntl(session->sd, F_SETFL, (fcntl(session->sd, F_GETFL) | O_NONBLOCK)) != 0 ||
+	    fcntl(session->sd, F_SETFD, FD_CLOEXEC) != 0) {
 		stats_error_log("tcplistener: Error setting socket to non-blocking: %s", strerror(errno));
+		goto reject;
+	}
+#endif
+
+	session->ctx = listener->cb_conn(session->sd, session->data, session);
+	if (session->ctx == NULL) {
+		goto reject;
+	}
+
+	listener->num_sessions++;
+	session->last_active = ev_now(loop);
+	tcpsession_link(server, session);
+	ev_io_init(&session->watcher, tcpsession_recv_callback, session->sd, EV_READ);
+	ev_io_start(loop, &session->watcher);
+	if (server->idle_timeout > 0 && !ev_is_active(&server->reap_watcher)) {
+		ev_timer_set(&server->reap_watcher, server->idle_timeout, 0);
+		ev_timer_start(loop, &server->reap_watcher);
+	}
+	return 0;
+
+reject:
+	close(session->sd);
+	pool_put(&server->sessions, session);
+	return 0;
+}
+
+// Called every time the server socket is readable (new connections to be
+// accepted). Up to ACCEPT_BATCH connections are accepted at a time, so
+// that a burst of them empties the backlog quickly but doesn't keep the
+// loop from serving the clients that are already connected.
+static void tcplistener_accept_callback(struct ev_loop *loop,
+					struct ev_io *watcher,
+					int revents) {
+	if (revents & EV_ERROR) {
+		// ev(3) says this is an error of "unspecified" type, so
+		// that's bloody useful.
+		stats_error_log("tcplistener: libev server socket error");
 		return;
 	}
 
-	session->ctx = listener->cb_conn(session->sd, session->data);
+	tcplistener_t *listener = (tcplistener_t *) watcher->data;
+	for (int i = 0; i < ACCEPT_BATCH; i++) {
+		if (tcplistener_accept(loop, listener) != 0) {
+			break;
+		}
+	}
+}
 
-	ev_io_init(session->watcher, tcpsession_recv_callback, session->sd, EV_READ);
-	ev_io_start(loop, session->watcher);
+
+void tcpsession_pause(tcpsession_t *session) {
+	ev_io_stop(session->loop, &session->watcher);
+	session->paused = true;
 }
 
+void tcpsession_resume(tcpsession_t *session) {
+	session->paused = false;
+	ev_io_start(session->loop, &session->watcher);
+	ev_feed_event(session->loop, &session->watcher, EV_READ);
+}
 
-tcpserver_t *tcpserver_create(struct ev_loop *loop, void *data) {
+tcpserver_t *tcpserver_create(struct ev_loop *loop,
+			      struct proto_config *config,
+			      void *data) {
 	tcpserver_t *server;
 	server = (tcpserver_t *) malloc(sizeof(tcpserver_t));
-	server->loop = ev_default_loop(0);
+	if (server == NULL) {
+		return NULL;
+	}
+	server->loop = loop;
 	server->listeners_len = 0;
+	// every worker binds its own listener to the same address
+	server->reuseport = config->workers > 1;
 	server->data = data;
+	server->backlog = config->listen_backlog;
+	// the kernel counts it in seconds
+	server->defer_accept = (config->tcp_defer_accept_ms + 999) / 1000;
+	server->unix_mode = config->unix_socket_mode;
+	server->max_connections = config->max_client_connections;
+	server->idle_timeout = config->client_idle_timeout_ms / 1000.0;
+	pool_init(&server->sessions, sizeof(tcpsession_t), TCPSESSION_POOL_MAX_FREE);
+	server->oldest = NULL;
+	server->newest = NULL;
+	ev_init(&server->reap_watcher, tcpserver_reap_callback);
+	server->reap_watcher.data = server;
 	return server;
 }
 
 
 static tcplistener_t *tcplistener_create(tcpserver_t *server,
 					 struct addrinfo *addr,
-					 void *(*cb_conn)(int, void *),
-					 int (*cb_recv)(int, void *, void *)) {
+					 void *(*cb_conn)(int, void *, tcpsession_t *),
+					 int (*cb_recv)(int, void *, void *),
+					 void (*cb_close)(void *)) {
 	tcplistener_t *listener;
 	char addr_string[INET6_ADDRSTRLEN];
 	void *ip;
@@ -186,9 +359,14 @@ static tcplistener_t *tcplistener_create(tcpserver_t *server,
 
 	listener = malloc(sizeof(tcplistener_t));
 	listener->loop = server->loop;
+	listener->server = server;
 	listener->data = server->data;
 	listener->cb_conn = cb_conn;
 	listener->cb_recv = cb_recv;
+	listener->cb_close = cb_close;
+	listener->num_sessions = 0;
+	listener->full = false;
+	listener->path = NULL;
 	listener->sd = socket(
 				addr->ai_family,
 				addr->ai_socktype,
@@ -223,6 +401,17 @@ static tcplistener_t *tcplistener_create(tcpserver_t *server,
 		return NULL;
 	}
 
+#ifdef SO_REUSEPORT
+	if (server->reuseport) {
+		err = setsockopt(listener->sd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+		if (err != 0) {
+			stats_error_log("tcplistener: Error setting SO_REUSEPORT on %s[:%i]: %s", addr_string, port, strerror(errno));
+			free(listener);
+			return NULL;
+		}
+	}
+#endif
+
 	err = fcntl(listener->sd, F_SETFL, (fcntl(listener->sd, F_GETFL) | O_NONBLOCK));
 	if (err != 0) {
 		stats_error_log("tcplistener: Error setting socket to non-blocking for %s[:%i]: %s", addr_string, port, strerror(errno));
@@ -237,7 +426,19 @@ static tcplistener_t *tcplistener_create(tcpserver_t *server,
 		return NULL;
 	}
 
-	err = listen(listener->sd, LISTEN_BACKLOG);
+#ifdef TCP_DEFER_ACCEPT
+	if (server->defer_accept > 0) {
+		err = setsockopt(listener->sd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+				 &server->defer_accept, sizeof(int));
+		if (err != 0) {
+			stats_error_log("tcplistener: Error setting TCP_DEFER_ACCEPT on %s[:%i]: %s", addr_string, port, strerror(errno));
+			free(listener);
+			return NULL;
+		}
+	}
+#endif
+
+	err = listen(listener->sd, server->backlog);
 	if (err != 0) {
 		stats_error_log("tcplistener: Error listening to socket %s[:%i]: %s", addr_string, port, strerror(errno));
 		free(listener);
@@ -260,14 +461,71 @@ static void tcplistener_destroy(tcpserver_t *server, tcplistener_t *listener) {
 		ev_io_stop(server->loop, listener->watcher);
 		free(listener->watcher);
 	}
+	if (listener->path != NULL) {
+		unixsock_close(listener->sd, listener->path);
+		free(listener->path);
+	}
 	free(listener);
 }
 
+int tcpserver_bind_unix(tcpserver_t *server,
+			const char *path,
+			void *(*cb_conn)(int, void *, tcpsession_t *),
+			int (*cb_recv)(int, void *, void *),
+			void (*cb_close)(void *)) {
+	if (server->listeners_len >= MAX_TCP_HANDLERS) {
+		stats_error_log("tcpserver: Unable to create more than %i TCP listeners", MAX_TCP_HANDLERS);
+		return 1;
+	}
+	tcplistener_t *listener = calloc(1, sizeof(tcplistener_t));
+	if (listener == NULL) {
+		stats_error_log("tcpserver: Unable to allocate listener");
+		return 1;
+	}
+	listener->loop = server->loop;
+	listener->server = server;
+	listener->data = server->data;
+	listener->cb_conn = cb_conn;
+	listener->cb_recv = cb_recv;
+	listener->cb_close = cb_close;
+	listener->path = strdup(path);
+	if (listener->path == NULL) {
+		stats_error_log("tcpserver: strdup(3) failed");
+		free(listener);
+		return 1;
+	}
+	listener->sd = unixsock_bind(path, SOCK_STREAM, server->unix_mode);
+	if (listener->sd < 0) {
+		free(listener->path);
+		free(listener);
+		return 1;
+	}
+	listener->watcher = malloc(sizeof(struct ev_io));
+	if (listener->watcher == NULL) {
+		stats_error_log("tcpserver: Unable to allocate listener");
+		tcplistener_destroy(server, listener);
+		return 1;
+	}
+	listener->watcher->data = (void *) listener;
+	ev_io_init(listener->watcher, tcplistener_accept_callback, listener->sd, EV_READ);
+	if (listen(listener->sd, server->backlog) != 0) {
+		stats_error_log("tcplistener: Error listening to socket %s: %s", path, strerror(errno));
+		tcplistener_destroy(server, listener);
+		return 1;
+	}
+	stats_log("tcpserver: Listening on frontend unix:%s, fd = %d", path, listener->sd);
+	server->listeners[server->listeners_len] = listener;
+	server->listeners_len++;
+	ev_io_start(server->loop, listener->watcher);
+	return 0;
+}
+
 
 int tcpserver_bind(tcpserver_t *server,
 		   const char *address_and_port,
-		   void *(*cb_conn)(int, void *),
-		   int (*cb_recv)(int, void *, void *)) {
+		   void *(*cb_conn)(int, void *, tcpsession_t *),
+		   int (*cb_recv)(int, void *, void *),
+		   void (*cb_close)(void *)) {
 	tcplistener_t *listener;
 	struct addrinfo hints;
 	struct addrinfo *addrs, *p;
@@ -307,7 +565,7 @@ int tcpserver_bind(tcpserver_t *server,
 			freeaddrinfo(addrs);
 			return 1;
 		}
-		listener = tcplistener_create(server, p, cb_conn, cb_recv);
+		listener = tcplistener_create(server, p, cb_conn, cb_recv, cb_close);
 		if (listener == NULL) {
 			continue;
 		}
@@ -322,8 +580,51 @@ int tcpserver_bind(tcpserver_t *server,
 }
 
 void tcpserver_destroy(tcpserver_t *server) {
+	while (server->oldest != NULL) {
+		tcpsession_destroy(server->oldest);
+	}
+	ev_timer_stop(server->loop, &server->reap_watcher);
 	for (int i = 0; i < server->listeners_len; i++) {
 		tcplistener_destroy(server, server->listeners[i]);
 	}
+	pool_destroy(&server->sessions);
 	free(server);
 }
+
+// /proc/net/netstat has a line of counter names followed by a line of
+// their values for every group of counters
+int tcpserver_listen_drops(uint64_t *overflows, uint64_t *drops) {
+	char *names = NULL, *values = NULL;
+	size_t names_size = 0, values_size = 0;
+	int found = 0;
+
+	FILE *netstat = fopen(NETSTAT_PATH, "r");
+	if (netstat == NULL) {
+		return 1;
+	}
+	while (found < 2 &&
+	       getline(&names, &names_size, netstat) > 0 &&
+	       getline(&values, &values_size, netstat) > 0) {
+		if (strncmp(names, "TcpExt:", 7) != 0) {
+			continue;
+		}
+		char *name_save, *value_save;
+		char *name = strtok_r(names, " \n", &name_save);
+		char *value = strtok_r(values, " \n", &value_save);
+		while (name != NULL && value != NULL) {
+			if (strcmp(name, "ListenOverflows") == 0) {
+				*overflows = strtoull(value, NULL, 10);
+				found++;
+			} else if (strcmp(name, "ListenDrops") == 0) {
+				*drops = strtoull(value, NULL, 10);
+				found++;
+			}
+			name = strtok_r(NULL, " \n", &name_save);
+			value = strtok_r(NULL, " \n", &value_save);
+		}
+	}
+	free(names);
+	free(values);
+	fclose(netstat);
+	return found < 2;
+}
@@ -2,19 +2,51 @@
 #define TCPSERVER_H
 
 #include "config.h"
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <ev.h>
 
+#include "yaml_config.h"
+
 typedef struct tcpserver_t tcpserver_t;
+typedef struct tcpsession_t tcpsession_t;
+
+tcpserver_t *tcpserver_create(struct ev_loop *loop,
+			      struct proto_config *config,
+			      void *data);
 
-tcpserver_t *tcpserver_create(struct ev_loop *loop, void *data);
+// cb_conn returns the context of a new connection (NULL closes it
+// again), which is passed to cb_recv and, once the connection is
+// closed, to cb_close. A non-zero return from cb_recv closes it.
 int tcpserver_bind(tcpserver_t *server,
 		   const char *address_and_port,
-		   void *(*cb_conn)(int, void *),
-		   int (*cb_recv)(int, void *, void *));
+		   void *(*cb_conn)(int, void *, tcpsession_t *),
+		   int (*cb_recv)(int, void *, void *),
+		   void (*cb_close)(void *));
+
+// Listen on a unix domain stream socket at path, with the same
+// callbacks as tcpserver_bind
+int tcpserver_bind_unix(tcpserver_t *server,
+			const char *path,
+			void *(*cb_conn)(int, void *, tcpsession_t *),
+			int (*cb_recv)(int, void *, void *),
+			void (*cb_close)(void *));
+
+// Stop reading from a client. A paused client is never idle.
+void tcpsession_pause(tcpsession_t *session);
+
+// Start reading from a paused client again. cb_recv is called on the
+// next loop iteration whether or not anything new has arrived.
+void tcpsession_resume(tcpsession_t *session);
 void tcpserver_destroy(tcpserver_t *server);
 
+// The kernel's counts, for the whole network namespace, of connections
+// dropped because a listener's accept queue was full (overflows) and
+// of every connection dropped before it could be accepted (drops).
+// Returns non-zero if they aren't available.
+int tcpserver_listen_drops(uint64_t *overflows, uint64_t *drops);
+
 
 #endif
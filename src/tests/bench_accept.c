@@ -0,0 +1,152 @@
+// Benchmark for admitting a storm of connections. Clients connect in
+// bursts while the event loop gets a short turn between them, the way a
+// busy relay would, and the time until every connection has been
+// accepted is measured for a small and a large listen backlog. SYNs the
+// kernel drops for a full accept queue are only retried after a second,
+// which shows up both in the time taken and in the listen_overflows.
+
+#include "../log.h"
+#include "../tcpserver.h"
+#include "../yaml_config.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <ev.h>
+
+#define CONNECTIONS 4000
+#define BURST 256
+#define DEADLINE 10.0
+
+static void *count_connection(int sd, void *data, tcpsession_t *session) {
+	unsigned int *accepted = (unsigned int *) data;
+	(*accepted)++;
+	return data;
+}
+
+static int close_connection(int sd, void *data, void *ctx) {
+	return 1;
+}
+
+static void wake_up(struct ev_loop *loop, ev_timer *watcher, int revents) {
+}
+
+static int choose_port(void) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int sd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (sd < 0 || bind(sd, (struct sockaddr *) &addr, len) != 0 ||
+	    getsockname(sd, (struct sockaddr *) &addr, &len) != 0) {
+		perror("bind()");
+		exit(1);
+	}
+	close(sd);
+	return ntohs(addr.sin_port);
+}
+
+static int run(struct ev_loop *loop, unsigned int backlog, unsigned int count) {
+	struct proto_config config;
+	struct sockaddr_in addr;
+	struct timeval t0, t1, total;
+	char bind_address[32];
+	unsigned int accepted = 0;
+	uint64_t overflows0 = 0, overflows1 = 0, drops = 0;
+	ev_timer timer;
+
+	int *clients = calloc(count, sizeof(int));
+	if (clients == NULL) {
+		perror("calloc()");
+		return 1;
+	}
+	memset(&config, 0, sizeof(config));
+	config.workers = 1;
+	config.listen_backlog = backlog;
+	const int port = choose_port();
+	snprintf(bind_address, sizeof(bind_address), "127.0.0.1:%d", port);
+	tcpserver_t *server = tcpserver_create(loop, &config, &accepted);
+	if (server == NULL ||
+	    tcpserver_bind(server, bind_address, count_connection, close_connection, NULL) != 0) {
+		fprintf(stderr, "failed to listen on %s\n", bind_address);
+		return 1;
+	}
+	ev_timer_init(&timer, wake_up, 0.05, 0.05);
+	ev_timer_start(loop, &timer);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	tcpserver_listen_drops(&overflows0, &drops);
+	gettimeofday(&t0, NULL);
+	for (unsigned int i = 0; i < count; i++) {
+		clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+		if (clients[i] < 0) {
+			perror("socket()");
+			return 1;
+		}
+		fcntl(clients[i], F_SETFL, fcntl(clients[i], F_GETFL) | O_NONBLOCK);
+		if (connect(clients[i], (struct sockaddr *) &addr, sizeof(addr)) != 0 &&
+		    errno != EINPROGRESS) {
+			perror("connect()");
+			return 1;
+		}
+		if ((i + 1) % BURST == 0) {
+			ev_run(loop, EVRUN_NOWAIT);
+		}
+	}
+	double seconds = 0;
+	while (accepted < count && seconds < DEADLINE) {
+		ev_run(loop, EVRUN_ONCE);
+		gettimeofday(&t1, NULL);
+		timersub(&t1, &t0, &total);
+		seconds = total.tv_sec + total.tv_usec / 1000000.0;
+	}
+	tcpserver_listen_drops(&overflows1, &drops);
+
+	printf("backlog %5u: %u of %u connections accepted in %.3f seconds = %.0f connections/sec, %" PRIu64 " listen overflows\n",
+	       backlog, accepted, count, seconds, accepted / seconds, overflows1 - overflows0);
+
+	ev_timer_stop(loop, &timer);
+	for (unsigned int i = 0; i < count; i++) {
+		close(clients[i]);
+	}
+	tcpserver_destroy(server);
+	free(clients);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct rlimit limit;
+	unsigned int count = CONNECTIONS;
+
+	// every connection takes a descriptor on both ends
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+		getrlimit(RLIMIT_NOFILE, &limit);
+		if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < 2 * count + 64) {
+			count = (limit.rlim_cur - 64) / 2;
+		}
+	}
+
+	stats_set_log_level(STATSRELAY_LOG_ERROR);
+	struct ev_loop *loop = ev_default_loop(0);
+	if (run(loop, 128, count) != 0 || run(loop, 4096, count) != 0) {
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,86 @@
+// Microbenchmark for hashring_choose_len with each of the ring
+// algorithms, on a ring of backends with equal weights.
+
+#include "../hashring.h"
+#include "../log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define NUM_KEYS 100000
+#define ROUNDS 50
+
+static void *my_strdup(const char *str, void *data) {
+	return strdup(str);
+}
+
+static void run(const char *name,
+		enum ring_algorithm algorithm,
+		size_t num_backends,
+		char **keys,
+		size_t *key_lens) {
+	struct timeval t0, t1, total;
+	char backend[64];
+	uint32_t shard, checksum = 0;
+
+	hashring_t ring = hashring_init(NULL, my_strdup, free);
+	hashring_set_algorithm(ring, algorithm);
+	for (size_t i = 0; i < num_backends; i++) {
+		snprintf(backend, sizeof(backend), "10.0.%zd.%zd:8125", i / 250, i % 250);
+		if (!hashring_add(ring, backend)) {
+			fprintf(stderr, "failed to add %s\n", backend);
+			exit(1);
+		}
+	}
+	// the first lookup builds the ketama continuum
+	hashring_choose_len(ring, keys[0], key_lens[0], &shard);
+
+	gettimeofday(&t0, NULL);
+	for (int round = 0; round < ROUNDS; round++) {
+		for (size_t i = 0; i < NUM_KEYS; i++) {
+			hashring_choose_len(ring, keys[i], key_lens[i], &shard);
+			checksum += shard;
+		}
+	}
+	gettimeofday(&t1, NULL);
+	hashring_dealloc(ring);
+
+	timersub(&t1, &t0, &total);
+	double seconds = total.tv_sec + total.tv_usec / 1000000.0;
+	printf("%-7s %5zd backends: %6.1f ns/lookup (checksum %u)\n",
+	       name, num_backends, seconds * 1e9 / ((double) NUM_KEYS * ROUNDS), checksum);
+}
+
+int main(int argc, char **argv) {
+	static const size_t sizes[] = {7, 64, 1000};
+	char **keys = calloc(NUM_KEYS, sizeof(char *));
+	size_t *key_lens = calloc(NUM_KEYS, sizeof(size_t));
+	char buf[128];
+
+	if (keys == NULL || key_lens == NULL) {
+		perror("calloc()");
+		return 1;
+	}
+	stats_set_log_level(STATSRELAY_LOG_ERROR);
+	for (size_t i = 0; i < NUM_KEYS; i++) {
+		int len = snprintf(buf, sizeof(buf), "service%zd.host%03zd.requests.latency_p%zd",
+				   i % 13, i % 500, i);
+		keys[i] = strdup(buf);
+		key_lens[i] = len;
+	}
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		run("modulo", RING_MODULO, sizes[s], keys, key_lens);
+		run("jump", RING_JUMP, sizes[s], keys, key_lens);
+		run("ketama", RING_KETAMA, sizes[s], keys, key_lens);
+	}
+
+	for (size_t i = 0; i < NUM_KEYS; i++) {
+		free(keys[i]);
+	}
+	free(keys);
+	free(key_lens);
+	return 0;
+}
@@ -0,0 +1,115 @@
+// Microbenchmark for scan_lines. This compares each implementation
+// against splitting lines and finding keys with memchr, as statsrelay
+// used to, on datagrams packed with short statsd lines.
+
+#include "../scan.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DATAGRAMS 10000
+#define DATAGRAM_SIZE 1432
+#define ROUNDS 200
+#define MAX_LINES 256
+
+struct datagram {
+	char data[DATAGRAM_SIZE];
+	size_t len;
+};
+
+static uint32_t next_random(uint32_t *state) {
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+static void build_corpus(struct datagram *corpus, size_t count) {
+	static const char *metrics[] = {
+		"api.requests", "db.query_time", "cache.hits", "geo.lookups", "q"
+	};
+	uint32_t state = 42;
+	char line[64];
+
+	for (size_t i = 0; i < count; i++) {
+		corpus[i].len = 0;
+		while (1) {
+			int len = snprintf(line, sizeof(line), "%s.%u:%u|c\n",
+					   metrics[next_random(&state) % 5],
+					   next_random(&state) % 100,
+					   next_random(&state) % 10);
+			if (corpus[i].len + len > DATAGRAM_SIZE) {
+				break;
+			}
+			memcpy(corpus[i].data + corpus[i].len, line, len);
+			corpus[i].len += len;
+		}
+	}
+}
+
+static size_t memchr_lines(const char *buf, size_t len, char delimiter,
+			   struct scan_line *lines, size_t max_lines, size_t *consumed) {
+	size_t num_lines = 0, offset = 0;
+	while (num_lines < max_lines) {
+		const char *newline = memchr(buf + offset, '\n', len - offset);
+		if (newline == NULL) {
+			break;
+		}
+		struct scan_line *line = &lines[num_lines++];
+		const char *key = memchr(buf + offset, delimiter, newline - (buf + offset));
+		line->offset = offset;
+		line->len = newline - (buf + offset);
+		line->key_len = key == NULL ? 0 : key - (buf + offset);
+		offset += line->len + 1;
+	}
+	*consumed = offset;
+	return num_lines;
+}
+
+static double run(const char *name,
+		  size_t (*scan)(const char *, size_t, char, struct scan_line *, size_t, size_t *),
+		  struct datagram *corpus,
+		  size_t count) {
+	static struct scan_line lines[MAX_LINES];
+	struct timeval t0, t1, total;
+	size_t num_lines = 0, key_bytes = 0, consumed;
+
+	gettimeofday(&t0, NULL);
+	for (int round = 0; round < ROUNDS; round++) {
+		for (size_t i = 0; i < count; i++) {
+			const size_t n = scan(corpus[i].data, corpus[i].len, ':',
+					      lines, MAX_LINES, &consumed);
+			num_lines += n;
+			key_bytes += lines[n - 1].key_len;
+		}
+	}
+	gettimeofday(&t1, NULL);
+
+	timersub(&t1, &t0, &total);
+	double seconds = total.tv_sec + total.tv_usec / 1000000.0;
+	double rate = num_lines / seconds;
+	printf("%-8s %zd lines in %.3f seconds = %.0f lines/sec (%zd)\n",
+	       name, num_lines, seconds, rate, key_bytes);
+	return rate;
+}
+
+int main(int argc, char **argv) {
+	static const char *names[] = {"scalar", "sse2", "avx2"};
+	struct datagram *corpus = calloc(DATAGRAMS, sizeof(struct datagram));
+	if (corpus == NULL) {
+		perror("calloc()");
+		return 1;
+	}
+	build_corpus(corpus, DATAGRAMS);
+
+	double baseline = run("memchr", memchr_lines, corpus, DATAGRAMS);
+	for (int impl = SCAN_SCALAR; impl <= SCAN_AVX2; impl++) {
+		if (scan_set_impl((enum scan_impl) impl) == 0) {
+			double rate = run(names[impl], scan_lines, corpus, DATAGRAMS);
+			printf("speedup: %.2fx\n", rate / baseline);
+		}
+	}
+	free(corpus);
+	return 0;
+}
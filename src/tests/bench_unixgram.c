@@ -0,0 +1,164 @@
+// Benchmark for datagram ingest over loopback UDP and over a unix domain
+// datagram socket. A sender thread writes small statsd datagrams as fast
+// as it can while a udpserver reads them, and the rate at which they're
+// received is compared, with the listener read through libev and
+// through io_uring. A UDP sender never waits, so what the reader can't
+// keep up with is lost; a unixgram sender blocks instead.
+
+#include "../log.h"
+#include "../udpserver.h"
+#include "../uring.h"
+#include "../yaml_config.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <ev.h>
+
+#define DATAGRAMS 1000000
+#define BATCH_SIZE 32
+#define PAYLOAD "bench.requests.count:1|c\n"
+#define UNIX_PATH "/tmp/statsrelay-bench.sock"
+
+struct bench {
+	int sd;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	unsigned int received;
+	unsigned int received_at_last_tick;
+	struct timeval first, last;
+	pthread_mutex_t lock;
+	bool sent;
+};
+
+static int count_datagrams(int sd, void *data, struct iovec *iovecs, unsigned int count) {
+	struct bench *bench = (struct bench *) data;
+	if (bench->received == 0) {
+		gettimeofday(&bench->first, NULL);
+	}
+	bench->received += count;
+	gettimeofday(&bench->last, NULL);
+	return 0;
+}
+
+static void *send_datagrams(void *data) {
+	struct bench *bench = (struct bench *) data;
+	for (int i = 0; i < DATAGRAMS; i++) {
+		sendto(bench->sd, PAYLOAD, strlen(PAYLOAD), 0,
+		       (struct sockaddr *) &bench->addr, bench->addr_len);
+	}
+	pthread_mutex_lock(&bench->lock);
+	bench->sent = true;
+	pthread_mutex_unlock(&bench->lock);
+	return NULL;
+}
+
+// Stop once everything was sent and nothing more has come in for a tick
+static void check_done(struct ev_loop *loop, ev_timer *watcher, int revents) {
+	struct bench *bench = (struct bench *) watcher->data;
+	pthread_mutex_lock(&bench->lock);
+	const bool sent = bench->sent;
+	pthread_mutex_unlock(&bench->lock);
+	if (sent && bench->received == bench->received_at_last_tick) {
+		ev_break(loop, EVBREAK_ONE);
+	}
+	bench->received_at_last_tick = bench->received;
+}
+
+static double run(const char *name, struct ev_loop *loop, const char *bind_address, bool unix_socket,
+		  enum io_engine engine) {
+	struct proto_config config;
+	struct bench bench;
+	struct timeval total;
+	pthread_t sender;
+	ev_timer timer;
+
+	memset(&config, 0, sizeof(config));
+	config.workers = 1;
+	config.udp_batch_size = BATCH_SIZE;
+	config.unix_socket_mode = 0600;
+	config.unix_recv_buffer = 8388608;
+	config.io_engine = engine;
+	memset(&bench, 0, sizeof(bench));
+	pthread_mutex_init(&bench.lock, NULL);
+
+	udpserver_t *server = udpserver_create(loop, &config, &bench);
+	if (server == NULL) {
+		fprintf(stderr, "failed to create udpserver\n");
+		exit(1);
+	}
+	if (unix_socket) {
+		struct sockaddr_un *addr = (struct sockaddr_un *) &bench.addr;
+		if (udpserver_bind_unix(server, bind_address, count_datagrams) != 0) {
+			fprintf(stderr, "failed to listen on %s\n", bind_address);
+			exit(1);
+		}
+		addr->sun_family = AF_UNIX;
+		strcpy(addr->sun_path, bind_address);
+		bench.addr_len = sizeof(struct sockaddr_un);
+		bench.sd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	} else {
+		struct sockaddr_in *addr = (struct sockaddr_in *) &bench.addr;
+		socklen_t len = sizeof(struct sockaddr_in);
+		char address[32];
+		int sd = socket(AF_INET, SOCK_DGRAM, 0);
+		addr->sin_family = AF_INET;
+		addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(sd, (struct sockaddr *) addr, len) != 0 ||
+		    getsockname(sd, (struct sockaddr *) addr, &len) != 0) {
+			perror("bind()");
+			exit(1);
+		}
+		close(sd);
+		snprintf(address, sizeof(address), "127.0.0.1:%d", ntohs(addr->sin_port));
+		if (udpserver_bind(server, address, count_datagrams) != 0) {
+			fprintf(stderr, "failed to listen on %s\n", address);
+			exit(1);
+		}
+		bench.addr_len = len;
+		bench.sd = socket(AF_INET, SOCK_DGRAM, 0);
+	}
+
+	ev_timer_init(&timer, check_done, 0.1, 0.1);
+	timer.data = &bench;
+	ev_timer_start(loop, &timer);
+	pthread_create(&sender, NULL, send_datagrams, &bench);
+	ev_run(loop, 0);
+	pthread_join(sender, NULL);
+	ev_timer_stop(loop, &timer);
+
+	timersub(&bench.last, &bench.first, &total);
+	double seconds = total.tv_sec + total.tv_usec / 1000000.0;
+	double rate = bench.received / seconds;
+	printf("%-18s %u of %d datagrams received in %.3f seconds = %.0f datagrams/sec\n",
+	       name, bench.received, DATAGRAMS, seconds, rate);
+
+	close(bench.sd);
+	udpserver_destroy(server);
+	pthread_mutex_destroy(&bench.lock);
+	return rate;
+}
+
+int main(int argc, char **argv) {
+	stats_set_log_level(STATSRELAY_LOG_ERROR);
+	struct ev_loop *loop = ev_default_loop(0);
+
+	double baseline = run("udp", loop, NULL, false, IO_ENGINE_LIBEV);
+	double rate = run("unixgram", loop, UNIX_PATH, true, IO_ENGINE_LIBEV);
+	printf("speedup: %.2fx\n", rate / baseline);
+	if (uring_supported()) {
+		rate = run("udp, io_uring", loop, NULL, false, IO_ENGINE_IO_URING);
+		printf("speedup: %.2fx\n", rate / baseline);
+		rate = run("unixgram, io_uring", loop, UNIX_PATH, true, IO_ENGINE_IO_URING);
+		printf("speedup: %.2fx\n", rate / baseline);
+	}
+	return 0;
+}
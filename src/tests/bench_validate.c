@@ -0,0 +1,198 @@
+// Microbenchmark for validate_statsd. This compares the current
+// validator against a copy of the original implementation, which
+// strndup'd every line and used strtod, on a corpus of typical statsd
+// lines.
+
+#include "../log.h"
+#include "../validate.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define CORPUS_LINES 100000
+#define ROUNDS 20
+
+static char *valid_stat_types[6] = {
+	"c",
+	"ms",
+	"kv",
+	"g",
+	"h",
+	"s"
+};
+static size_t valid_stat_types_len = 6;
+
+static int legacy_validate_statsd(const char *line, size_t len) {
+	size_t plen;
+	char c;
+	int i, valid;
+
+	char *line_copy = strndup(line, len);
+	char *start, *end;
+	char *err;
+
+	start = line_copy;
+	plen = len;
+	end = memchr(start, ':', plen);
+	if (end == NULL) {
+		goto statsd_err;
+	}
+	if ((end - start) < 1) {
+		goto statsd_err;
+	}
+
+	start = end + 1;
+	plen = len - (start - line_copy);
+
+	c = end[0];
+	end[0] = '\0';
+	if ((strtod(start, &err) == 0.0) && (err == start)) {
+		goto statsd_err;
+	}
+	end[0] = c;
+
+	end = memchr(start, '|', plen);
+	if (end == NULL) {
+		goto statsd_err;
+	}
+
+	start = end + 1;
+	plen = len - (start - line_copy);
+
+	end = memchr(start, '|', plen);
+	if (end != NULL) {
+		c = end[0];
+		end[0] = '\0';
+		plen = end - start;
+	}
+
+	valid = 0;
+	for (i = 0; i < valid_stat_types_len; i++) {
+		if (strlen(valid_stat_types[i]) != plen) {
+			continue;
+		}
+		if (strncmp(start, valid_stat_types[i], plen) == 0) {
+			valid = 1;
+			break;
+		}
+	}
+	if (valid == 0) {
+		goto statsd_err;
+	}
+
+	if (end != NULL) {
+		end[0] = c;
+		if ((len - (end - line_copy) > 1) && (end[1] == '@')) {
+			start = end + 2;
+			plen = len - (start - line_copy);
+			if (plen == 0) {
+				goto statsd_err;
+			}
+			if ((strtod(start, &err) == 0.0) && err == start) {
+				goto statsd_err;
+			}
+		} else {
+			goto statsd_err;
+		}
+	}
+
+	free(line_copy);
+	return 0;
+
+statsd_err:
+	free(line_copy);
+	return 1;
+}
+
+struct line {
+	char *data;
+	size_t len;
+};
+
+static uint32_t next_random(uint32_t *state) {
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+// Build lines that look like what application hosts emit: dotted
+// metric names, mostly counters and timers, some with sample rates.
+static void build_corpus(struct line *corpus, size_t count) {
+	static const char *services[] = {
+		"api", "dispatch", "payments", "geo", "search", "users"
+	};
+	static const char *metrics[] = {
+		"requests", "errors", "latency", "queue_depth", "cache.hits",
+		"cache.misses", "db.query_time", "active_sessions"
+	};
+	static const char *suffixes[] = {
+		"|c", "|c|@0.1", "|ms", "|ms|@0.25", "|g", "|h", "|s"
+	};
+	uint32_t state = 42;
+	char buf[256];
+
+	for (size_t i = 0; i < count; i++) {
+		uint32_t r = next_random(&state);
+		const char *suffix = suffixes[r % 7];
+		int len;
+		if (suffix[1] == 'm' || suffix[1] == 'h') {
+			len = snprintf(buf, sizeof(buf), "%s.host%03u.%s:%u.%03u%s",
+				       services[r % 6], next_random(&state) % 500,
+				       metrics[next_random(&state) % 8],
+				       next_random(&state) % 2000,
+				       next_random(&state) % 1000, suffix);
+		} else {
+			len = snprintf(buf, sizeof(buf), "%s.host%03u.%s:%u%s",
+				       services[r % 6], next_random(&state) % 500,
+				       metrics[next_random(&state) % 8],
+				       next_random(&state) % 100, suffix);
+		}
+		corpus[i].data = strdup(buf);
+		corpus[i].len = (size_t) len;
+	}
+}
+
+static double run(const char *name,
+		  int (*validator)(const char *, size_t),
+		  struct line *corpus,
+		  size_t count) {
+	struct timeval t0, t1, total;
+	size_t invalid = 0;
+
+	gettimeofday(&t0, NULL);
+	for (int round = 0; round < ROUNDS; round++) {
+		for (size_t i = 0; i < count; i++) {
+			invalid += validator(corpus[i].data, corpus[i].len);
+		}
+	}
+	gettimeofday(&t1, NULL);
+
+	timersub(&t1, &t0, &total);
+	double seconds = total.tv_sec + total.tv_usec / 1000000.0;
+	double rate = (count * ROUNDS) / seconds;
+	printf("%-8s %zd lines in %.3f seconds = %.0f lines/sec (%zd invalid)\n",
+	       name, count * ROUNDS, seconds, rate, invalid);
+	return rate;
+}
+
+int main(int argc, char **argv) {
+	struct line *corpus = calloc(CORPUS_LINES, sizeof(struct line));
+	if (corpus == NULL) {
+		perror("calloc()");
+		return 1;
+	}
+	stats_set_log_level(STATSRELAY_LOG_ERROR);
+	build_corpus(corpus, CORPUS_LINES);
+
+	double legacy = run("legacy", legacy_validate_statsd, corpus, CORPUS_LINES);
+	double current = run("current", validate_statsd, corpus, CORPUS_LINES);
+	printf("speedup: %.2fx\n", current / legacy);
+
+	for (size_t i = 0; i < CORPUS_LINES; i++) {
+		free(corpus[i].data);
+	}
+	free(corpus);
+	return 0;
+}
@@ -0,0 +1,106 @@
+#include "../aggregate.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static char output[1 << 20];
+static size_t output_len;
+
+static void collect(void *ctx, const char *line, size_t len) {
+	assert(output_len + len < sizeof(output));
+	memcpy(output + output_len, line, len);
+	output_len += len;
+	output[output_len] = '\0';
+	(*(int *) ctx)++;
+}
+
+static int add(aggregate_t *agg, const char *line) {
+	return aggregate_add(agg, line, strlen(line));
+}
+
+// Flush and check that exactly the expected lines came out, in any order
+static void expect(aggregate_t *agg, const char **lines, size_t count) {
+	int emitted = 0;
+	output_len = 0;
+	output[0] = '\0';
+	assert(aggregate_flush(agg, collect, &emitted) == count);
+	assert((size_t) emitted == count);
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++) {
+		char line[256];
+		snprintf(line, sizeof(line), "%s\n", lines[i]);
+		assert(strstr(output, line) != NULL);
+		total += strlen(line);
+	}
+	assert(total == output_len);
+	assert(aggregate_count(agg) == 0);
+}
+
+int main(int argc, char **argv) {
+	aggregate_t agg;
+	assert(aggregate_init(&agg) == 0);
+
+	// counters are summed, correcting for the sample rate
+	assert(add(&agg, "foo:1|c") == 0);
+	assert(add(&agg, "foo:2|c") == 0);
+	assert(add(&agg, "foo:1|c|@0.1") == 0);
+	assert(add(&agg, "bar:1.5|c") == 0);
+	assert(aggregate_count(&agg) == 2);
+	const char *counters[] = {"foo:13|c", "bar:1.5|c"};
+	expect(&agg, counters, 2);
+
+	// gauges keep the last value, and apply relative updates to it
+	assert(add(&agg, "g1:5|g") == 0);
+	assert(add(&agg, "g1:7|g") == 0);
+	assert(add(&agg, "g2:+3|g") == 0);
+	assert(add(&agg, "g2:-1|g") == 0);
+	assert(add(&agg, "g3:5|g") == 0);
+	assert(add(&agg, "g3:-2|g") == 0);
+	assert(add(&agg, "g4:1|g") == 0);
+	assert(add(&agg, "g4:-3|g") == 0);
+	const char *gauges[] = {"g1:7|g", "g2:+2|g", "g3:3|g", "g4:0|g", "g4:-2|g"};
+	expect(&agg, gauges, 5);
+
+	// the same name with a different type is a different key
+	assert(add(&agg, "same:1|c") == 0);
+	assert(add(&agg, "same:1|g") == 0);
+	const char *types[] = {"same:1|c", "same:1|g"};
+	expect(&agg, types, 2);
+
+	// everything else is left alone
+	assert(add(&agg, "timer:1|ms") == 1);
+	assert(add(&agg, "set:1|s") == 1);
+	assert(add(&agg, "tagged:1|c|#env:prod") == 1);
+	assert(add(&agg, "gauge:1|g|@0.5") == 1);
+	assert(add(&agg, "rate:1|c|@2") == 1);
+	assert(add(&agg, "bad:one|c") == 1);
+	assert(add(&agg, "nan:nan|c") == 1);
+	assert(add(&agg, "nokey") == 1);
+	assert(add(&agg, ":1|c") == 1);
+	assert(aggregate_count(&agg) == 0);
+	expect(&agg, NULL, 0);
+
+	// lots of keys grow the table, and it shrinks again once they're gone
+	for (int round = 0; round < 3; round++) {
+		for (int i = 0; i < 10000; i++) {
+			char line[64];
+			snprintf(line, sizeof(line), "key%d:%d|c", i, round + 1);
+			assert(add(&agg, line) == 0);
+		}
+	}
+	assert(aggregate_count(&agg) == 10000);
+	assert(agg.capacity >= 16384);
+	int emitted = 0;
+	output_len = 0;
+	assert(aggregate_flush(&agg, collect, &emitted) == 10000);
+	assert(strstr(output, "key9999:6|c\n") != NULL);
+	size_t big = agg.capacity;
+	assert(add(&agg, "one:1|c") == 0);
+	const char *one[] = {"one:1|c"};
+	expect(&agg, one, 1);
+	assert(agg.capacity < big);
+
+	aggregate_destroy(&agg);
+	return 0;
+}
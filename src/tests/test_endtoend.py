@@ -1,6 +1,10 @@
 #!/usr/bin/env python
 
 import contextlib
+import json
+import os
+import select
+import shutil
 import signal
 import socket
 import subprocess
@@ -28,6 +32,8 @@ class TestCase(unittest.TestCase):
     def setUp(self):
         super(TestCase, self).setUp()
         self.tcp_cork = 'false'
+        self.spool_dir = None
+        self.unix_dir = None
         self.proc = None
 
     def tearDown(self):
@@ -55,20 +61,36 @@ class TestCase(unittest.TestCase):
     def recv_status(self, fd):
         return fd.recv(65536)
 
+    def recv_lines(self, fds, count):
+        """Read count lines in all from any of fds, by fd."""
+        received = dict((fd, []) for fd in fds)
+        buffers = dict((fd, '') for fd in fds)
+        deadline = time.time() + 2
+        while sum(len(lines) for lines in received.values()) < count:
+            self.assertLess(time.time(), deadline)
+            readable, _, _ = select.select(fds, [], [], 0.1)
+            for fd in readable:
+                buffers[fd] += fd.recv(65536)
+                while '\n' in buffers[fd]:
+                    line, buffers[fd] = buffers[fd].split('\n', 1)
+                    received[fd].append(line)
+        return received
+
     @contextlib.contextmanager
-    def generate_config(self, mode):
+    def generate_config(self, mode, config_path=None):
         if mode.lower() == 'tcp':
             sock_type = socket.SOCK_STREAM
-            config_path = 'tests/statsrelay.yaml'
+            config_path = config_path or 'tests/statsrelay.yaml'
         elif mode.lower() == 'udp':
             sock_type = socket.SOCK_DGRAM
-            config_path = 'tests/statsrelay_udp.yaml'
+            config_path = config_path or 'tests/statsrelay_udp.yaml'
         else:
             raise ValueError()
 
         try:
             self.bind_carbon_port = self.choose_port(sock_type)
             self.bind_statsd_port = self.choose_port(sock_type)
+            self.bind_admin_port = self.choose_port(socket.SOCK_STREAM)
 
             self.carbon_listener = socket.socket(socket.AF_INET, sock_type)
             self.carbon_listener.bind(('127.0.0.1', 0))
@@ -81,8 +103,8 @@ class TestCase(unittest.TestCase):
             self.statsd_port = self.statsd_listener.getsockname()[1]
 
             if mode.lower() == 'tcp':
-                self.carbon_listener.listen(1)
-                self.statsd_listener.listen(1)
+                self.carbon_listener.listen(8)
+                self.statsd_listener.listen(8)
 
             new_config = tempfile.NamedTemporaryFile()
             with open(config_path) as config_file:
@@ -90,9 +112,12 @@ class TestCase(unittest.TestCase):
             for var, replacement in [
                     ('BIND_CARBON_PORT', self.bind_carbon_port),
                     ('BIND_STATSD_PORT', self.bind_statsd_port),
+                    ('BIND_ADMIN_PORT', self.bind_admin_port),
                     ('SEND_CARBON_PORT', self.carbon_port),
                     ('SEND_STATSD_PORT', self.statsd_port),
-                    ('TCP_CORK', self.tcp_cork)]:
+                    ('TCP_CORK', self.tcp_cork),
+                    ('SPOOL_DIR', self.spool_dir),
+                    ('UNIX_DIR', self.unix_dir)]:
                 data = data.replace(var, str(replacement))
             new_config.write(data)
             new_config.flush()
@@ -221,9 +246,14 @@ class StatsdTestCase(TestCase):
             sender.close()
 
             backends = defaultdict(dict)
+            global_stats = {}
             for line in status.split('\n'):
                 if not line:
                     break
+                if line.startswith('global '):
+                    _, key, valuetype, value = line.split(' ', 3)
+                    global_stats[key] = int(value)
+                    continue
                 if not line.startswith('backend:'):
                     continue
                 backend, key, valuetype, value = line.split(' ', 3)
@@ -234,6 +264,9 @@ class StatsdTestCase(TestCase):
             self.assertEqual(backends[key]['dropped_lines'], 0)
             self.assertEqual(backends[key]['bytes_queued'],
                              backends[key]['bytes_sent'])
+            self.assertEqual(global_stats['udp_datagrams'], 4)
+            self.assertGreater(global_stats['udp_wakeups'], 0)
+            self.assertLessEqual(global_stats['udp_wakeups'], 4)
 
     def test_tcp_cork(self):
         if not sys.platform.startswith('linux'):
@@ -272,6 +305,146 @@ class StatsdTestCase(TestCase):
             elapsed = time.time() - t0
             self.assertLess(elapsed, cork_time / 2)
 
+    def test_udp_multiline_datagram(self):
+        with self.generate_config('udp') as config_path:
+            self.launch_process(config_path)
+            sender = self.connect('udp', self.bind_statsd_port)
+            # the last line of a datagram doesn't need a trailing newline
+            sender.sendall('multi1:1|c\nmulti2:2|c')
+            fd = self.statsd_listener
+            received = ''
+            while received.count('\n') < 2:
+                received += fd.recv(1024)
+            self.assertEqual(sorted(received.splitlines()),
+                             ['multi1:1|c', 'multi2:2|c'])
+
+    def test_udp_backend_packing(self):
+        with self.generate_config(
+                'udp', 'tests/statsrelay_udp_batch.yaml') as config_path:
+            self.launch_process(config_path)
+            sender = self.connect('tcp', self.bind_statsd_port)
+            lines = ['packed%02d:1|c' % (i,) for i in range(30)]
+            sender.sendall(''.join(line + '\n' for line in lines))
+            fd = self.statsd_listener
+            datagrams = []
+            while sum(d.count('\n') for d in datagrams) < len(lines):
+                datagrams.append(fd.recv(65536))
+            sender.close()
+            # lines are packed up to udp_max_payload without being split
+            for datagram in datagrams:
+                self.assertLessEqual(len(datagram), 100)
+                self.assertTrue(datagram.endswith('\n'))
+            self.assertLess(len(datagrams), 10)
+            self.assertEqual(''.join(datagrams).splitlines(), lines)
+
+    def test_udp_backend_drops_only_long_line(self):
+        with self.generate_config(
+                'udp', 'tests/statsrelay_udp_batch.yaml') as config_path:
+            self.launch_process(config_path)
+            sender = self.connect('tcp', self.bind_statsd_port)
+            # too many chunks for one datagram, let alone udp_max_payload
+            long_line = 'long' + 'x' * 200000 + ':1|c'
+            sender.sendall('before:1|c\n' + long_line + '\nafter:1|c\n')
+            fd = self.statsd_listener
+            received = ''
+            while received.count('\n') < 2:
+                received += fd.recv(65536)
+            sender.close()
+            self.assertEqual(sorted(received.splitlines()),
+                             ['after:1|c', 'before:1|c'])
+
+    def test_aggregation(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_aggregate.yaml') as config_path:
+            self.launch_process(config_path)
+            fd, addr = self.statsd_listener.accept()
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall('hits:1|c\n' * 100)
+            sender.sendall('hits:1|c|@0.5\n')
+            sender.sendall('temp:20|g\ntemp:25|g\n')
+            sender.sendall('latency:12|ms\n')
+            self.check_recv(fd, 'latency:12|ms\n')
+            time.sleep(0.3)
+            lines = sorted(fd.recv(1024).splitlines())
+            self.assertEqual(lines, ['hits:102|c', 'temp:25|g'])
+
+            sender.sendall('status\n')
+            status = self.recv_status(sender)
+            sender.close()
+            fd.close()
+            self.assertIn('global aggregated_lines gauge 103\n', status)
+            self.assertIn('global aggregate_lines_out gauge 2\n', status)
+
+    def test_self_metrics(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_selfstats.yaml') as config_path:
+            self.launch_process(config_path)
+            fd, addr = self.statsd_listener.accept()
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall('hits:1|c\n' * 5)
+            sender.close()
+
+            # read until a whole round of self metrics follows the lines
+            data = ''
+            deadline = time.time() + 2
+            while ('relay.test-host.loop_iteration_p99_ns:' not in
+                   data[data.rfind('hits:1|c\n'):]):
+                self.assertLess(time.time(), deadline)
+                data += fd.recv(65536)
+            fd.close()
+            lines = data.splitlines()
+            self.assertEqual(lines.count('hits:1|c'), 5)
+            self.assertIn('relay.test-host.backends:1|g', lines)
+            self.assertIn('relay.test-host.failing_backends:0|g', lines)
+            relayed = [int(line.split(':')[1].split('|')[0]) for line in lines
+                       if line.startswith('relay.test-host.relayed_lines:')]
+            # counters are sent as the change since the previous round, and
+            # each round counts the self metrics sent by the one before
+            per_round = len(set(line.split(':')[0] for line in lines
+                                if line.startswith('relay.test-host.')))
+            self.assertLessEqual(relayed[0], 5)
+            for value in relayed[1:]:
+                self.assertIn(value, (per_round, per_round + 5))
+            self.assertTrue(any(
+                line.startswith('relay.test-host.backend.127_0_0_1_%d_tcp.relayed_lines:'
+                                % self.statsd_port) for line in lines))
+
+    def test_latency_histograms(self):
+        with self.generate_config('tcp') as config_path:
+            self.launch_process(config_path)
+            fd, addr = self.statsd_listener.accept()
+            sender = self.connect('tcp', self.bind_statsd_port)
+            lines = ''.join('latency%d:1|c\n' % (i,) for i in range(640))
+            sender.sendall(lines)
+            received = ''
+            while len(received) < len(lines):
+                received += fd.recv(65536)
+            time.sleep(0.1)
+            sender.sendall('status\n')
+            status = self.recv_status(sender)
+            sender.close()
+            fd.close()
+
+            percentiles = defaultdict(dict)
+            for line in status.split('\n'):
+                if not line:
+                    break
+                scope, key, valuetype, value = line.split(' ', 3)
+                if valuetype in ('p50', 'p99', 'p999'):
+                    percentiles[scope, key][valuetype] = int(value)
+
+            backend = 'backend:127.0.0.1:%d:tcp' % (self.statsd_port,)
+            for name in [('global', 'recv_to_enqueue_ns'),
+                         ('global', 'validate_ns'),
+                         ('global', 'hash_ns'),
+                         ('global', 'enqueue_ns'),
+                         ('global', 'loop_iteration_ns'),
+                         (backend, 'queue_residence_ns')]:
+                values = percentiles[name]
+                self.assertGreater(values['p50'], 0, name)
+                self.assertLessEqual(values['p50'], values['p99'])
+                self.assertLessEqual(values['p99'], values['p999'])
+
     def test_invalid_line_for_pull_request_35(self):
         with self.generate_config('udp') as config_path:
             self.launch_process(config_path)
@@ -283,6 +456,786 @@ class StatsdTestCase(TestCase):
             self.assert_(self.proc.returncode is None)
 
 
+class WorkersTestCase(TestCase):
+
+    def test_status_sums_workers(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_workers.yaml') as config_path:
+            self.launch_process(config_path)
+
+            senders = []
+            for i in range(8):
+                sender = self.connect('tcp', self.bind_statsd_port)
+                sender.sendall('worker%d:1|c\n' % (i,) * 10)
+                senders.append(sender)
+            udp_sender = self.connect('udp', self.bind_statsd_port)
+            for i in range(5):
+                udp_sender.sendall('udp%d:1|c\n' % (i,))
+            udp_sender.close()
+            time.sleep(0.5)
+
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall('status\n')
+            status = self.recv_status(sender)
+            sender.close()
+            for s in senders:
+                s.close()
+
+            global_stats = {}
+            relayed_lines = 0
+            for line in status.split('\n'):
+                if not line:
+                    break
+                name, key, valuetype, value = line.split(' ', 3)
+                if name == 'global':
+                    global_stats[key] = int(value)
+                elif key == 'relayed_lines':
+                    relayed_lines += int(value)
+
+            self.assertEqual(relayed_lines, 85)
+            self.assertEqual(global_stats['total_connections'], 9)
+            self.assertEqual(global_stats['udp_datagrams'], 5)
+
+    def test_self_metrics_across_reloads(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_workers.yaml') as config_path:
+            with open(config_path) as config_file:
+                data = config_file.read()
+            head = data[:data.rindex('  shard_map:\n')]
+
+            def write_config(ports):
+                with open(config_path, 'w') as config_file:
+                    config_file.write(head)
+                    config_file.write('  self_metrics_interval_ms: 10\n'
+                                      '  self_metrics_prefix: relay\n'
+                                      '  self_metrics_hostname: test-host\n'
+                                      '  shard_map:\n')
+                    for i, port in enumerate(ports):
+                        config_file.write('    %d: 127.0.0.1:%d\n' % (i, port))
+
+            write_config([self.statsd_port] * 4)
+            self.launch_process(config_path)
+            fds = [self.statsd_listener.accept()[0] for worker in range(4)]
+
+            # the first worker reports the totals of all of them while
+            # every worker adds and removes backends
+            for i in range(20):
+                if i % 2 == 0:
+                    write_config([self.statsd_port] * 2 + [
+                        self.choose_port(socket.SOCK_STREAM) for j in range(2)])
+                else:
+                    write_config([self.statsd_port] * 4)
+                self.reload_process(self.proc)
+                sender = self.connect('tcp', self.bind_statsd_port)
+                sender.sendall('status\n')
+                self.assertTrue(self.recv_status(sender).startswith('global '))
+                sender.close()
+            self.assertIsNone(self.proc.poll())
+
+            for fd in fds:
+                fd.setblocking(0)
+                try:
+                    while fd.recv(65536):
+                        pass
+                except socket.error:
+                    pass
+            data = ''
+            deadline = time.time() + 2
+            while 'relay.test-host.backends:1|g\n' not in data:
+                self.assertLess(time.time(), deadline)
+                readable, _, _ = select.select(fds, [], [], 0.1)
+                for fd in readable:
+                    data += fd.recv(65536)
+            for fd in fds:
+                fd.close()
+
+
+class PipelinedTestCase(TestCase):
+    """Test sending from egress threads."""
+
+    NUM_BACKENDS = 4
+
+    def test_lines_reach_every_backend(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_pipelined.yaml') as config_path:
+            listeners = [self.statsd_listener]
+            for i in range(1, self.NUM_BACKENDS):
+                listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                listener.bind(('127.0.0.1', 0))
+                listener.listen(8)
+                listener.settimeout(SOCKET_TIMEOUT)
+                listeners.append(listener)
+            try:
+                with open(config_path, 'a') as config_file:
+                    for i, listener in enumerate(listeners[1:], 1):
+                        config_file.write('    %d: 127.0.0.1:%d\n' % (
+                            i, listener.getsockname()[1]))
+                self.launch_process(config_path)
+
+                # both workers connect to every backend
+                fds = []
+                for listener in listeners:
+                    for worker in range(2):
+                        fd, addr = listener.accept()
+                        fds.append(fd)
+
+                sent = ['pipelined.%d:1|c' % (i,) for i in range(200)]
+                sender = self.connect('tcp', self.bind_statsd_port)
+                sender.sendall(''.join(line + '\n' for line in sent[:100]))
+                udp_sender = self.connect('udp', self.bind_statsd_port)
+                for line in sent[100:]:
+                    udp_sender.sendall(line + '\n')
+                received = self.recv_lines(fds, 200)
+                self.assertEqual(sorted(sum(received.values(), [])), sorted(sent))
+
+                # a reload stops and restarts the egress threads
+                self.reload_process(self.proc)
+                sender.sendall('after:1|c\n')
+                received = self.recv_lines(fds, 1)
+                self.assertEqual(sum(received.values(), []), ['after:1|c'])
+
+                sender.sendall('status\n')
+                status = self.recv_status(sender)
+                sender.close()
+                udp_sender.close()
+                relayed_lines = 0
+                for line in status.split('\n'):
+                    if line.startswith('backend:'):
+                        backend, key, valuetype, value = line.split(' ', 3)
+                        if key == 'relayed_lines':
+                            relayed_lines += int(value)
+                        elif key == 'dropped_lines':
+                            self.assertEqual(int(value), 0)
+                self.assertEqual(relayed_lines, 201)
+                for fd in fds:
+                    fd.close()
+            finally:
+                for listener in listeners[1:]:
+                    listener.close()
+
+    def test_reload_drains_removed_backend(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_pipelined.yaml') as config_path:
+            removed_port = self.choose_port(socket.SOCK_STREAM)
+            with open(config_path, 'a') as config_file:
+                config_file.write('    1: 127.0.0.1:%d\n' % (removed_port,))
+                config_file.write('  backoff_min_ms: 100\n')
+                config_file.write('  backoff_max_ms: 100\n')
+            self.launch_process(config_path)
+            fds = [self.statsd_listener.accept()[0] for worker in range(2)]
+
+            # lines for the removed backend wait in its queue until it
+            # comes up, and it's destroyed once they've been sent. Only
+            # the worker that got the connection has any queued.
+            sent = ['drain.%d:1|c' % (i,) for i in range(100)]
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall(''.join(line + '\n' for line in sent))
+            time.sleep(0.2)
+            with open(config_path) as config_file:
+                data = config_file.read()
+            with open(config_path, 'w') as config_file:
+                config_file.write(data.replace(
+                    '    1: 127.0.0.1:%d\n' % (removed_port,), ''))
+            self.reload_process(self.proc)
+
+            removed = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            try:
+                removed.bind(('127.0.0.1', removed_port))
+                removed.listen(8)
+                removed.settimeout(3)
+                removed_fd, addr = removed.accept()
+                received = self.recv_lines(fds + [removed_fd], 100)
+                self.assertEqual(sorted(sum(received.values(), [])), sorted(sent))
+                removed_fd.settimeout(3)
+                self.assertEqual(removed_fd.recv(1024), '')
+                removed_fd.close()
+
+                # the other egress threads kept running
+                sender.sendall('after:1|c\n')
+                received = self.recv_lines(fds, 1)
+                self.assertEqual(sum(received.values(), []), ['after:1|c'])
+                sender.close()
+                for fd in fds:
+                    fd.close()
+            finally:
+                removed.close()
+
+
+class UringTestCase(TestCase):
+    """Test reading UDP listeners through io_uring (or libev, where the
+    kernel doesn't support it)."""
+
+    def test_udp_listener(self):
+        with self.generate_config(
+                'udp', 'tests/statsrelay_uring.yaml') as config_path:
+            self.launch_process(config_path)
+            sender = self.connect('udp', self.bind_statsd_port)
+            for i in range(50):
+                sender.sendall('uring.%d:1|c\nuring.%d:2|c' % (i, i))
+            sender.close()
+
+            fd = self.statsd_listener
+            expected = set()
+            for i in range(50):
+                expected.update(['uring.%d:1|c' % i, 'uring.%d:2|c' % i])
+            received = ''
+            while received.count('\n') < len(expected):
+                received += fd.recv(65536)
+            self.assertEqual(set(received.splitlines()), expected)
+
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall('status\n')
+            status = self.recv_status(sender)
+            sender.close()
+            self.assertIn('global udp_datagrams gauge 50\n', status)
+
+
+class ConnectionsTestCase(TestCase):
+    """Test spreading a backend's lines over several connections."""
+
+    NUM_CONNECTIONS = 4
+
+    def test_keys_stay_on_one_connection(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_connections.yaml') as config_path:
+            self.launch_process(config_path)
+            fds = []
+            for i in range(self.NUM_CONNECTIONS):
+                fd, addr = self.statsd_listener.accept()
+                fds.append(fd)
+
+            sent = ['conn.%d:%d|c' % (i % 20, i) for i in range(400)]
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall(''.join(line + '\n' for line in sent))
+
+            received = dict((fd, []) for fd in fds)
+            buffers = dict((fd, '') for fd in fds)
+            deadline = time.time() + 2
+            while sum(len(lines) for lines in received.values()) < len(sent):
+                self.assertLess(time.time(), deadline)
+                readable, _, _ = select.select(fds, [], [], 0.1)
+                for fd in readable:
+                    buffers[fd] += fd.recv(65536)
+                    while '\n' in buffers[fd]:
+                        line, buffers[fd] = buffers[fd].split('\n', 1)
+                        received[fd].append(line)
+            sender.close()
+
+            # every key is on one connection, in the order it was sent,
+            # and the keys are spread over more than one connection
+            used = 0
+            for fd in fds:
+                keys = set(line.split(':')[0] for line in received[fd])
+                expected = [line for line in sent if line.split(':')[0] in keys]
+                self.assertEqual(received[fd], expected)
+                used += 1 if received[fd] else 0
+                fd.close()
+            self.assertGreater(used, 1)
+
+
+class ClientLimitsTestCase(TestCase):
+    """Test the connection cap and idle timeout for clients."""
+
+    def test_cap_and_idle_timeout(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_client_limits.yaml') as config_path:
+            self.launch_process(config_path)
+            fd, addr = self.statsd_listener.accept()
+            fd.settimeout(SOCKET_TIMEOUT)
+            active = self.connect('tcp', self.bind_statsd_port)
+            idle = self.connect('tcp', self.bind_statsd_port)
+            time.sleep(0.1)
+
+            # a third client is over the cap, and is closed straight away
+            rejected = self.connect('tcp', self.bind_statsd_port)
+            self.assertEqual(rejected.recv(1024), '')
+            rejected.close()
+
+            # the idle client is closed, the active one is kept
+            for i in range(10):
+                active.sendall('active:%d|c\n' % i)
+                self.check_recv(fd, 'active:%d|c\n' % i)
+                time.sleep(0.1)
+            self.assertEqual(idle.recv(1024), '')
+            idle.close()
+
+            # which makes room for another one, that reuses its session
+            status = self.connect('tcp', self.bind_statsd_port)
+            status.sendall('status\n')
+            output = self.recv_status(status)
+            self.assertIn('global session_pool_hits gauge 1\n', output)
+            self.assertIn('global session_pool_misses gauge 2\n', output)
+            status.close()
+            active.close()
+            fd.close()
+
+
+class AcceptTestCase(TestCase):
+    """Test accepting a burst of clients."""
+
+    def test_connection_storm(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_accept.yaml') as config_path:
+            self.launch_process(config_path)
+            fd, addr = self.statsd_listener.accept()
+            fd.settimeout(SOCKET_TIMEOUT)
+            clients = []
+            for i in range(200):
+                client = self.connect('tcp', self.bind_statsd_port)
+                client.sendall('storm.%d:1|c\n' % i)
+                clients.append(client)
+
+            expected = set('storm.%d:1|c' % i for i in range(200))
+            received = ''
+            while received.count('\n') < len(expected):
+                data = fd.recv(65536)
+                self.assertNotEqual(data, '')
+                received += data
+            self.assertEqual(set(received.splitlines()), expected)
+
+            status = self.connect('tcp', self.bind_statsd_port)
+            status.sendall('status\n')
+            output = self.recv_status(status)
+            self.assertIn('global total_connections gauge 201\n', output)
+            self.assertIn('global listen_overflows gauge', output)
+            status.close()
+            for client in clients:
+                client.close()
+            fd.close()
+
+
+class BackpressureTestCase(TestCase):
+    """Test pausing a client while its backend is down."""
+
+    def test_pause_until_backend_is_back(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_backpressure.yaml') as config_path:
+            # nothing listens on the backend's port, so its queue fills up
+            self.statsd_listener.close()
+            self.launch_process(config_path)
+            lines = ['backpressure.%d:1|c\n' % i for i in range(2000)]
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall(''.join(lines))
+            time.sleep(0.2)
+
+            status = self.connect('tcp', self.bind_statsd_port)
+            status.sendall('status\n')
+            output = self.recv_status(status)
+            status.close()
+            self.assertIn('global paused_connections gauge 1\n', output)
+            self.assertNotIn('global backpressure_pauses gauge 0\n', output)
+
+            # once the backend is back, every line arrives, in order
+            listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            listener.bind(('127.0.0.1', self.statsd_port))
+            listener.listen(8)
+            listener.settimeout(2)
+            try:
+                fd, addr = listener.accept()
+                fd.settimeout(SOCKET_TIMEOUT)
+                expected = ''.join(lines)
+                received = ''
+                while len(received) < len(expected):
+                    data = fd.recv(65536)
+                    self.assertNotEqual(data, '')
+                    received += data
+                self.assertEqual(received, expected)
+                fd.close()
+            finally:
+                listener.close()
+            sender.close()
+
+
+class FailoverTestCase(TestCase):
+    """Test failing the shards of a backend that is down over."""
+
+    def backend_down(self, port):
+        sender = self.connect('tcp', self.bind_statsd_port)
+        sender.sendall('status\n')
+        status = self.recv_status(sender)
+        sender.close()
+        return 'backend:127.0.0.1:%d:tcp down boolean 1\n' % (port,) in status
+
+    def test_shards_move_back_and_forth(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_failover.yaml') as config_path:
+            # bound but not listening, so connections are refused
+            down = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            down.bind(('127.0.0.1', 0))
+            down.settimeout(SOCKET_TIMEOUT)
+            down_port = down.getsockname()[1]
+            try:
+                with open(config_path, 'a') as config_file:
+                    config_file.write('    0: 127.0.0.1:%d\n' % (down_port,))
+                    config_file.write('    1: 127.0.0.1:%d\n' % (self.statsd_port,))
+                self.launch_process(config_path)
+                up, addr = self.statsd_listener.accept()
+                deadline = time.time() + 2
+                while not self.backend_down(down_port):
+                    self.assertLess(time.time(), deadline)
+                    time.sleep(0.1)
+
+                sent = ['failover.%d:1|c' % (i,) for i in range(20)]
+                sender = self.connect('tcp', self.bind_statsd_port)
+                sender.sendall(''.join(line + '\n' for line in sent))
+                received = self.recv_lines([up], len(sent))
+                self.assertEqual(received[up], sent)
+
+                # once it's back, the backend gets its shards back
+                down.listen(8)
+                back, addr = down.accept()
+                deadline = time.time() + 5
+                while self.backend_down(down_port):
+                    self.assertLess(time.time(), deadline)
+                    time.sleep(0.1)
+                sender.sendall(''.join(line + '\n' for line in sent))
+                received = self.recv_lines([up, back], len(sent))
+                self.assertGreater(len(received[back]), 0)
+                self.assertEqual(sorted(received[up] + received[back]), sorted(sent))
+                sender.close()
+                up.close()
+                back.close()
+            finally:
+                down.close()
+
+    def test_paused_client_resumes_on_failover(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_failover.yaml') as config_path:
+            down = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            down.bind(('127.0.0.1', 0))
+            down_port = down.getsockname()[1]
+            try:
+                with open(config_path) as config_file:
+                    data = config_file.read()
+                with open(config_path, 'w') as config_file:
+                    config_file.write(data.replace(
+                        '  health_check_interval_ms: 200\n',
+                        '  health_check_interval_ms: 1000\n'
+                        '  max_send_queue: 4096\n'
+                        '  overflow_policy: backpressure\n'))
+                    config_file.write('    0: 127.0.0.1:%d\n' % (down_port,))
+                    config_file.write('    1: 127.0.0.1:%d\n' % (self.statsd_port,))
+                self.launch_process(config_path)
+                up, addr = self.statsd_listener.accept()
+
+                # the client is paused on the full queue of the backend
+                # before the first health check finds that it's down
+                sent = ['failover.%d:1|c' % (i,) for i in range(2000)]
+                sender = self.connect('tcp', self.bind_statsd_port)
+                sender.sendall(''.join(line + '\n' for line in sent))
+                self.assertFalse(self.backend_down(down_port))
+
+                # its lines then go to the backend that took the shards,
+                # apart from those already queued for the one that's down
+                sender.sendall('last:1|c\n')
+                data = ''
+                deadline = time.time() + 3
+                while not data.endswith('last:1|c\n'):
+                    self.assertLess(time.time(), deadline)
+                    up.settimeout(deadline - time.time())
+                    data += up.recv(65536)
+                self.assertTrue(self.backend_down(down_port))
+                self.assertGreater(len(data.splitlines()), len(sent) / 2)
+                sender.close()
+                up.close()
+            finally:
+                down.close()
+
+
+class ReloadTestCase(TestCase):
+
+    def rewrite_config(self, config_path, old_port, new_port):
+        with open(config_path) as config_file:
+            data = config_file.read()
+        data = data.replace('127.0.0.1:%d\n' % (old_port,),
+                            '127.0.0.1:%d\n' % (new_port,))
+        with open(config_path, 'w') as config_file:
+            config_file.write(data)
+
+    def status(self):
+        sender = self.connect('tcp', self.bind_statsd_port)
+        sender.sendall('status\n')
+        status = self.recv_status(sender)
+        sender.close()
+        return status
+
+    def test_reload_keeps_connections(self):
+        with self.generate_config('tcp') as config_path:
+            self.launch_process(config_path)
+            fd, addr = self.statsd_listener.accept()
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall('before:1|c\n')
+            self.check_recv(fd, 'before:1|c\n')
+
+            self.reload_process(self.proc)
+            sender.sendall('after:1|c\n')
+            self.check_recv(fd, 'after:1|c\n')
+            sender.close()
+
+            # the backend connection was carried over, not reopened
+            self.statsd_listener.settimeout(0.2)
+            self.assertRaises(socket.timeout, self.statsd_listener.accept)
+            self.assertNotIn('last_reload timestamp 0\n', self.status())
+
+    def test_reload_moves_backends(self):
+        with self.generate_config('tcp') as config_path:
+            self.launch_process(config_path)
+            fd, addr = self.statsd_listener.accept()
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall('before:1|c\n')
+            self.check_recv(fd, 'before:1|c\n')
+
+            new_listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            new_listener.bind(('127.0.0.1', 0))
+            new_listener.listen(8)
+            new_listener.settimeout(SOCKET_TIMEOUT)
+            try:
+                new_port = new_listener.getsockname()[1]
+                self.rewrite_config(config_path, self.statsd_port, new_port)
+                self.reload_process(self.proc)
+
+                sender.sendall('after:1|c\n')
+                new_fd, addr = new_listener.accept()
+                self.check_recv(new_fd, 'after:1|c\n')
+                sender.close()
+
+                # the removed backend had nothing queued, so it was
+                # closed straight away
+                self.check_recv(fd, '')
+                self.assertIn(
+                    'backend:127.0.0.1:%d:tcp relayed_lines' % (new_port,),
+                    self.status())
+            finally:
+                new_listener.close()
+
+    def test_reload_bad_config(self):
+        with self.generate_config('tcp') as config_path:
+            self.launch_process(config_path)
+            fd, addr = self.statsd_listener.accept()
+            with open(config_path, 'w') as config_file:
+                config_file.write('statsd: [\n')
+            self.reload_process(self.proc)
+            self.assertIsNone(self.proc.poll())
+
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall('still:1|c\n')
+            self.check_recv(fd, 'still:1|c\n')
+            sender.close()
+
+
+class UnixSocketTestCase(TestCase):
+    """Test listening on unix domain sockets."""
+
+    def setUp(self):
+        super(UnixSocketTestCase, self).setUp()
+        self.unix_dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        super(UnixSocketTestCase, self).tearDown()
+        shutil.rmtree(self.unix_dir)
+
+    def test_stream_and_datagram(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_unix.yaml') as config_path:
+            stream_path = os.path.join(self.unix_dir, 'statsd.sock')
+            dgram_path = os.path.join(self.unix_dir, 'statsd.dgram')
+            # a socket left behind by an earlier run is replaced
+            stale = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+            stale.bind(dgram_path)
+            stale.close()
+
+            self.launch_process(config_path)
+            fd, addr = self.statsd_listener.accept()
+            fd.settimeout(SOCKET_TIMEOUT)
+            self.assertEqual(os.stat(stream_path).st_mode & 0777, 0600)
+
+            stream = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            stream.settimeout(SOCKET_TIMEOUT)
+            stream.connect(stream_path)
+            stream.sendall('unix.stream:1|c\n')
+            self.check_recv(fd, 'unix.stream:1|c\n')
+
+            dgram = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+            dgram.sendto('unix.dgram:1|c', dgram_path)
+            self.check_recv(fd, 'unix.dgram:1|c\n')
+            dgram.close()
+
+            # the TCP listener is still there
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall('tcp.stream:1|c\n')
+            self.check_recv(fd, 'tcp.stream:1|c\n')
+            sender.close()
+
+            stream.sendall('status\n')
+            output = self.recv_status(stream)
+            self.assertIn('global total_connections gauge 2\n', output)
+            stream.close()
+
+            # the sockets are removed on exit
+            self.proc.terminate()
+            self.proc.wait()
+            self.assertFalse(os.path.exists(stream_path))
+            self.assertFalse(os.path.exists(dgram_path))
+            fd.close()
+
+
+class SpoolTestCase(TestCase):
+
+    def setUp(self):
+        super(SpoolTestCase, self).setUp()
+        self.spool_dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        super(SpoolTestCase, self).tearDown()
+        shutil.rmtree(self.spool_dir)
+
+    def test_spool_replays_after_outage(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_spool.yaml') as config_path:
+            # The backend stays down until something listens again
+            self.statsd_listener.close()
+            self.launch_process(config_path)
+
+            sender = self.connect('tcp', self.bind_statsd_port)
+            lines = ''.join('spool.%d:%d|c\n' % (i, i) for i in range(500))
+            sender.sendall(lines)
+            time.sleep(0.2)
+            sender.sendall('status\n')
+            status = self.recv_status(sender)
+            self.assertRegexpMatches(status, r'spooled_bytes gauge [1-9]')
+            self.assertTrue(os.listdir(self.spool_dir))
+
+            listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            listener.bind(('127.0.0.1', self.statsd_port))
+            listener.listen(8)
+            listener.settimeout(5)
+            fd, addr = listener.accept()
+            fd.settimeout(SOCKET_TIMEOUT)
+            received = ''
+            while len(received) < len(lines):
+                received += fd.recv(65536)
+            fd.close()
+            listener.close()
+            sender.close()
+            self.assertEqual(received, lines)
+
+
+class AdminTestCase(TestCase):
+    """Test the HTTP stats listener."""
+
+    # Enough backends that a report is much bigger than one 64KB chunk
+    NUM_BACKENDS = 300
+
+    def http_get(self, path, method='GET'):
+        sock = self.connect('tcp', self.bind_admin_port)
+        sock.sendall('%s %s HTTP/1.1\r\nHost: localhost\r\n\r\n' % (method, path))
+        response = ''
+        while True:
+            data = sock.recv(65536)
+            if not data:
+                break
+            response += data
+        sock.close()
+        header, body = response.split('\r\n\r\n', 1)
+        return header.split('\r\n'), body
+
+    def test_metrics_and_json(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_admin.yaml') as config_path:
+            with open(config_path, 'a') as config_file:
+                for i in range(1, self.NUM_BACKENDS):
+                    config_file.write('    %d: 127.0.0.2:%d\n' % (i, 20000 + i))
+            self.launch_process(config_path)
+
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall(''.join('admin.%d:1|c\n' % i for i in range(50)))
+            time.sleep(0.2)
+            sender.close()
+
+            header, body = self.http_get('/metrics')
+            self.assertEqual(header[0], 'HTTP/1.1 200 OK')
+            self.assertIn('Content-Type: text/plain; version=0.0.4; charset=utf-8', header)
+            self.assertGreater(len(body), 65536)
+            self.assertIn('# TYPE statsrelay_bytes_recv_tcp_total counter\n', body)
+            relayed = {}
+            for line in body.splitlines():
+                if line.startswith('statsrelay_backend_relayed_lines_total{'):
+                    labels, value = line.rsplit(' ', 1)
+                    relayed[labels] = int(value)
+            self.assertEqual(len(relayed), self.NUM_BACKENDS)
+            self.assertEqual(sum(relayed.values()), 50)
+
+            header, body = self.http_get('/stats.json?pretty=0')
+            self.assertEqual(header[0], 'HTTP/1.1 200 OK')
+            self.assertIn('Content-Type: application/json', header)
+            stats = json.loads(body)
+            self.assertEqual(stats['global']['bytes_recv_tcp'],
+                             sum(len('admin.%d:1|c\n' % i) for i in range(50)))
+            self.assertEqual(len(stats['backends']), self.NUM_BACKENDS)
+            self.assertEqual(sum(b['relayed_lines'] for b in stats['backends']), 50)
+            self.assertIn('p99', stats['backends'][0]['queue_residence_ns'])
+
+            header, body = self.http_get('/metrics', method='HEAD')
+            self.assertEqual(header[0], 'HTTP/1.1 200 OK')
+            self.assertEqual(body, '')
+            header, body = self.http_get('/nope')
+            self.assertEqual(header[0], 'HTTP/1.1 404 Not Found')
+            header, body = self.http_get('/metrics', method='POST')
+            self.assertEqual(header[0], 'HTTP/1.1 405 Method Not Allowed')
+
+            # the data port still answers the status command
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall('status\n')
+            self.assertTrue(self.recv_status(sender).startswith('global '))
+            sender.close()
+
+    def test_metrics_during_reloads(self):
+        with self.generate_config(
+                'tcp', 'tests/statsrelay_admin.yaml') as config_path:
+            with open(config_path) as config_file:
+                data = config_file.read().replace(
+                    '  validate: true\n', '  validate: true\n  workers: 2\n')
+
+            def write_config(first_port):
+                with open(config_path, 'w') as config_file:
+                    config_file.write(data)
+                    for i in range(1, 50):
+                        config_file.write('    %d: 127.0.0.2:%d\n' % (i, first_port + i))
+
+            def relayed_lines():
+                header, body = self.http_get('/metrics')
+                self.assertEqual(header[0], 'HTTP/1.1 200 OK')
+                relayed = {}
+                for line in body.splitlines():
+                    if line.startswith('statsrelay_backend_relayed_lines_total{'):
+                        labels, value = line.rsplit(' ', 1)
+                        relayed[labels] = int(value)
+                return relayed
+
+            write_config(20000)
+            self.launch_process(config_path)
+            sender = self.connect('tcp', self.bind_statsd_port)
+            sender.sendall(''.join('admin.%d:1|c\n' % i for i in range(50)))
+            time.sleep(0.2)
+            sender.close()
+
+            # scrapes on the first worker while both workers swap most of
+            # their backends
+            for i in range(20):
+                write_config(21000 if i % 2 == 0 else 20000)
+                self.reload_process(self.proc)
+                for j in range(5):
+                    relayed_lines()
+            self.assertIsNone(self.proc.poll())
+
+            # backends that come back carry on with the same counters
+            relayed = relayed_lines()
+            self.assertEqual(len(relayed), 50)
+            self.assertEqual(sum(relayed.values()), 50)
+
+
 class CarbonTestCase(TestCase):
 
     def run_checks(self, fd, proto):
@@ -339,14 +1292,17 @@ class CarbonTestCase(TestCase):
 
 class StathasherTests(unittest.TestCase):
 
-    def get_foo(self, config):
+    def get_key(self, config, key):
         proc = subprocess.Popen(['./stathasher', '-c', config],
                                 stdin=subprocess.PIPE,
                                 stdout=subprocess.PIPE)
-        proc.stdin.write('foo\n')
+        proc.stdin.write(key + '\n')
         line = proc.stdout.readline()
         return line
 
+    def get_foo(self, config):
+        return self.get_key(config, 'foo')
+
     def test_stathasher(self):
         line = self.get_foo('tests/stathasher.yaml')
         self.assertEqual(line, 'key=foo carbon=127.0.0.1:2001 carbon_shard=1 statsd=127.0.0.1:3001 statsd_shard=1\n')  # noqa
@@ -363,6 +1319,17 @@ class StathasherTests(unittest.TestCase):
         line = self.get_foo('tests/stathasher_just_statsd.yaml')
         self.assertEqual(line, 'key=foo statsd=127.0.0.1:3001 statsd_shard=1\n')
 
+    def test_stathasher_jump(self):
+        # statsd uses jump hashing, carbon the default modulo
+        line = self.get_key('tests/stathasher_jump.yaml', 'bar')
+        self.assertEqual(line, 'key=bar carbon=127.0.0.1:2001 carbon_shard=1 statsd=127.0.0.1:3003 statsd_shard=3\n')  # noqa
+
+    def test_stathasher_ketama(self):
+        line = self.get_key('tests/stathasher_ketama.yaml', 'foo')
+        self.assertEqual(line, 'key=foo statsd=127.0.0.1:3003 statsd_shard=3\n')
+        line = self.get_key('tests/stathasher_ketama.yaml', 'bar')
+        self.assertEqual(line, 'key=bar statsd=127.0.0.1:3000 statsd_shard=0\n')
+
 
 def main():
     unittest.main()
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "../hashlib.h"
@@ -9,5 +10,28 @@ int main(int argc, char **argv) {
 	assert(stats_hash("banana", strlen("banana"), UINT32_MAX) == 558421143l);
 	assert(stats_hash("orange", strlen("orange"), UINT32_MAX) == 2279140812l);
 	assert(stats_hash("lemon", strlen("lemon"), UINT32_MAX) == 4183924513l);
+
+	assert(stats_hash_raw("apple", strlen("apple")) == 2699884538l);
+	assert(stats_hash_raw("lemon", strlen("lemon")) % 7 ==
+	       stats_hash("lemon", strlen("lemon"), 7));
+
+	// values from the reference implementation
+	assert(stats_jump_hash(0, 1) == 0);
+	assert(stats_jump_hash(1, 10) == 6);
+	assert(stats_jump_hash(0xdeadbeef, 1000) == 285);
+	assert(stats_jump_hash(2699884538l, 16) == 12);
+	assert(stats_jump_hash(12345678901234ll, 100000) == 79397);
+
+	// growing the number of buckets only moves keys to the new bucket
+	for (uint32_t key = 0; key < 10000; key++) {
+		uint64_t hash = key * 2654435761u;
+		uint32_t prev = stats_jump_hash(hash, 1);
+		assert(prev == 0);
+		for (uint32_t buckets = 2; buckets <= 64; buckets++) {
+			uint32_t next = stats_jump_hash(hash, buckets);
+			assert(next == prev || next == buckets - 1);
+			prev = next;
+		}
+	}
 	return 0;
 }
@@ -36,6 +36,35 @@ static hashring_t create_ring(const char *filename) {
 	return ring;
 }
 
+// Load a ketama.servers style file (server and weight on each line,
+// with # comments) into a ketama ring.
+static hashring_t create_ketama_ring(const char *filename, const char *skip) {
+	hashring_t ring = hashring_init(NULL, my_strdup, free);
+	assert(ring != NULL);
+	hashring_set_algorithm(ring, RING_KETAMA);
+
+	FILE *fp = fopen(filename, "r");
+	assert(fp != NULL);
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t read;
+	while ((read = getline(&line, &len, fp)) != -1) {
+		if (line[0] == '#') {
+			continue;
+		}
+		if (read > 0 && line[read - 1] == '\n') {
+			line[read - 1] = '\0';
+		}
+		if (skip != NULL && strncmp(line, skip, strlen(skip)) == 0) {
+			continue;
+		}
+		assert(hashring_add(ring, line));
+	}
+	fclose(fp);
+	free(line);
+	return ring;
+}
+
 // Test the hashring.  Note that when the hash space is expanded in
 // hashring1 -> hashring2, we are checking explicitly that apple and
 // orange do not move to new nodes.
@@ -53,6 +82,16 @@ int main(int argc, char **argv) {
 	assert(i == 0);
 	assert(strcmp(hashring_choose(ring, "lemon", &i), "127.0.0.1:9000") == 0);
 	assert(i == 1);
+
+	// keys that are slices of a longer line hash the same way
+	assert(strcmp(hashring_choose_len(ring, "apple:1|c\n", 5, &i), "127.0.0.1:9001") == 0);
+	assert(i == 2);
+	assert(strcmp(hashring_choose_len(ring, "banana 1 2\n", 6, &i), "127.0.0.1:9001") == 0);
+	assert(i == 3);
+
+	assert(hashring_size(ring) == 4);
+	assert(strcmp(hashring_get(ring, 2), "127.0.0.1:9001") == 0);
+	assert(hashring_get(ring, 4) == NULL);
 	hashring_dealloc(ring);
 
 	ring = create_ring("tests/hashring2.txt");
@@ -66,5 +105,124 @@ int main(int argc, char **argv) {
 	assert(i == 1);
 	hashring_dealloc(ring);
 
+	// with jump hashing, growing the ring only moves keys onto the
+	// new shards
+	hashring_t ring1 = hashring_init(NULL, my_strdup, free);
+	hashring_t ring2 = hashring_init(NULL, my_strdup, free);
+	hashring_set_algorithm(ring1, RING_JUMP);
+	hashring_set_algorithm(ring2, RING_JUMP);
+	char key[32];
+	for (int k = 0; k < 6; k++) {
+		snprintf(key, sizeof(key), "127.0.0.1:%d", 9000 + k);
+		if (k < 4) {
+			assert(hashring_add(ring1, key));
+		}
+		assert(hashring_add(ring2, key));
+	}
+	uint32_t j, moved = 0;
+	for (int k = 0; k < 1000; k++) {
+		snprintf(key, sizeof(key), "key.%d", k);
+		hashring_choose(ring1, key, &i);
+		hashring_choose(ring2, key, &j);
+		assert(i < 4);
+		if (i != j) {
+			assert(j >= 4);
+			moved++;
+		}
+	}
+	assert(moved > 0 && moved < 1000);
+	hashring_dealloc(ring1);
+	hashring_dealloc(ring2);
+
+	// weights are only allowed on a ketama ring
+	ring = hashring_init(NULL, my_strdup, free);
+	assert(!hashring_add(ring, "127.0.0.1:9000 100"));
+	hashring_set_algorithm(ring, RING_KETAMA);
+	assert(!hashring_add(ring, "127.0.0.1:9000 zero"));
+	assert(!hashring_add(ring, "127.0.0.1:9000 0"));
+	assert(hashring_add(ring, "127.0.0.1:9000 100"));
+	assert(strcmp(hashring_get(ring, 0), "127.0.0.1:9000") == 0);
+	hashring_dealloc(ring);
+
+	// a ketama ring can't have the same backend twice, as both would
+	// get the same points
+	ring = hashring_init(NULL, my_strdup, free);
+	hashring_set_algorithm(ring, RING_KETAMA);
+	assert(hashring_add(ring, "127.0.0.1:9000"));
+	assert(hashring_add(ring, "127.0.0.1:9001"));
+	assert(hashring_add(ring, "127.0.0.1:9000 2"));
+	assert(hashring_choose(ring, "apple", &i) == NULL);
+	hashring_dealloc(ring);
+
+	// keys are spread in proportion to the weights in ketama.servers
+	static const uint32_t weights[] = {600, 300, 200, 350, 1000, 800, 950, 100};
+	const uint32_t total_weight = 4300;
+	const int num_keys = 200000;
+	uint32_t *shards = calloc(num_keys, sizeof(uint32_t));
+	uint32_t counts[8] = {0};
+	assert(shards != NULL);
+	ring = create_ketama_ring("../test/ketama.servers", NULL);
+	assert(hashring_size(ring) == 8);
+	for (int k = 0; k < num_keys; k++) {
+		snprintf(key, sizeof(key), "stat.%d", k);
+		char *choice = hashring_choose(ring, key, &shards[k]);
+		assert(choice != NULL);
+		assert(strcmp(choice, hashring_get(ring, shards[k])) == 0);
+		counts[shards[k]]++;
+	}
+	for (int b = 0; b < 8; b++) {
+		double expected = (double) num_keys * weights[b] / total_weight;
+		assert(counts[b] > expected * 0.8);
+		assert(counts[b] < expected * 1.2);
+	}
+	hashring_dealloc(ring);
+
+	// removing a server mostly moves the keys that were on it; the
+	// other servers get a few more points each, which only takes a
+	// small share of keys from their neighbours
+	ring = create_ketama_ring("../test/ketama.servers", "10.0.1.5:");
+	assert(hashring_size(ring) == 7);
+	moved = 0;
+	for (int k = 0; k < num_keys; k++) {
+		snprintf(key, sizeof(key), "stat.%d", k);
+		char *choice = hashring_choose(ring, key, &i);
+		if (shards[k] != 4) {
+			char expected[32];
+			snprintf(expected, sizeof(expected), "10.0.1.%d:8125", shards[k] + 1);
+			moved += strcmp(choice, expected) != 0;
+		}
+	}
+	assert(moved < num_keys / 10);
+	hashring_dealloc(ring);
+	free(shards);
+
+	// the shards of a backend that is down go to the next shard that
+	// is up, and come back once it's up again
+	ring = create_ring("tests/hashring2.txt");
+	void *orange = hashring_choose(ring, "orange", &i);
+	assert(i == 0);
+	assert(hashring_set_down(ring, orange, true));
+	assert(hashring_choose(ring, "orange", &i) == orange);
+	hashring_set_failover(ring, FAILOVER_NEXT);
+	assert(hashring_choose(ring, "orange", &i) == hashring_get(ring, 1));
+	assert(i == 1);
+	assert(hashring_set_down(ring, hashring_get(ring, 1), true));
+	assert(hashring_choose(ring, "orange", &i) == hashring_get(ring, 2));
+	assert(i == 2);
+	assert(strcmp(hashring_choose(ring, "apple", &i), "127.0.0.1:9001") == 0);
+	assert(i == 2);
+	assert(hashring_set_down(ring, hashring_get(ring, 2), true));
+	assert(hashring_set_down(ring, hashring_get(ring, 3), true));
+	assert(hashring_choose(ring, "orange", &i) == orange);
+	assert(i == 0);
+	for (uint32_t k = 0; k < 4; k++) {
+		assert(hashring_set_down(ring, hashring_get(ring, k), false));
+	}
+	assert(hashring_choose(ring, "orange", &i) == orange);
+	assert(i == 0);
+	assert(hashring_add(ring, "127.0.0.1:9004"));
+	assert(hashring_choose(ring, "orange", &i) != NULL);
+	hashring_dealloc(ring);
+
 	return 0;
 }
@@ -0,0 +1,90 @@
+#include "../health.h"
+
+#include <assert.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <ev.h>
+
+// Run the loop until the probe has finished
+static enum health_probe_result probe(struct ev_loop *loop, health_t *health) {
+	health_probe_start(health, 2.0, 0);
+	while (health->probe.running) {
+		ev_run(loop, EVRUN_ONCE);
+	}
+	return health->probe.result;
+}
+
+int main(int argc, char **argv) {
+	struct ev_loop *loop = ev_default_loop(0);
+	struct proto_config config;
+	health_t health;
+
+	config.health_max_failures = 3;
+	config.health_max_queue = 1000;
+	health_init(&health, loop, "127.0.0.1", "1");
+
+	// connect failures in a row
+	assert(!health_check(&health, &config, 2, 0, 0));
+	assert(!health.down);
+	assert(health_check(&health, &config, 3, 0, 0));
+	assert(health.down);
+	assert(!health_check(&health, &config, 0, 0, 0));
+	assert(health.down);
+	assert(health_check(&health, &config, 0, 0, 0));
+	assert(!health.down);
+
+	// a long queue is fine while most of it is sent, but not once it
+	// grows faster than it's sent; it then has to get under half of
+	// the limit
+	assert(!health_check(&health, &config, 0, 900, 0));
+	assert(!health_check(&health, &config, 0, 1200, 400));
+	assert(!health_check(&health, &config, 0, 1100, 600));
+	assert(health_check(&health, &config, 0, 1300, 700));
+	assert(health.down);
+	assert(!health_check(&health, &config, 0, 800, 1200));
+	assert(!health_check(&health, &config, 0, 400, 1600));
+	assert(health_check(&health, &config, 0, 300, 1700));
+	assert(!health.down);
+	assert(health_check(&health, &config, 0, 1300, 1700));
+	assert(!health_check(&health, &config, 3, 0, 3000));
+	assert(!health_check(&health, &config, 0, 0, 3000));
+	assert(health_check(&health, &config, 0, 0, 3000));
+	health_destroy(&health);
+
+	// probes connect to a listener, and fail on a closed port
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+	assert(listen(listener, 8) == 0);
+	assert(getsockname(listener, (struct sockaddr *) &addr, &addr_len) == 0);
+	char port[16];
+	snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+
+	health_init(&health, loop, "127.0.0.1", port);
+	assert(probe(loop, &health) == PROBE_OK);
+	close(listener);
+	for (int i = 0; i < 2; i++) {
+		assert(probe(loop, &health) == PROBE_FAILED);
+		assert(!health_check(&health, &config, 0, 0, 0));
+	}
+	assert(probe(loop, &health) == PROBE_FAILED);
+	assert(health_check(&health, &config, 0, 0, 0));
+	assert(health.down);
+
+	// a probe that is still running at the next check has failed
+	health_probe_start(&health, 2.0, 0);
+	assert(health.probe.running);
+	health_probe_start(&health, 2.0, 0);
+	assert(!health.probe.running);
+	assert(health.probe.result == PROBE_FAILED);
+	health_destroy(&health);
+	return 0;
+}
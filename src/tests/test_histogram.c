@@ -0,0 +1,64 @@
+#include "../histogram.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+int main(int argc, char **argv) {
+	histogram_t h, other;
+
+	histogram_init(&h);
+	assert(histogram_percentile(&h, 0.5) == 0);
+
+	// any value is reported to within one sub-bucket
+	for (uint64_t v = 0; v < 200000; v += 7) {
+		histogram_init(&h);
+		histogram_record(&h, v);
+		uint64_t reported = histogram_percentile(&h, 0.99);
+		assert(reported >= v);
+		assert(reported - v <= v / HISTOGRAM_SUB_BUCKETS);
+	}
+	for (uint64_t v = 1; v < (UINT64_C(1) << HISTOGRAM_MAX_BITS); v *= 3) {
+		histogram_init(&h);
+		histogram_record(&h, v);
+		uint64_t reported = histogram_percentile(&h, 0.5);
+		assert(reported >= v);
+		assert(reported - v <= v / HISTOGRAM_SUB_BUCKETS);
+	}
+
+	// huge values are clamped rather than lost
+	histogram_init(&h);
+	histogram_record(&h, UINT64_MAX);
+	assert(h.count == 1);
+	assert(histogram_percentile(&h, 0.5) == (UINT64_C(1) << HISTOGRAM_MAX_BITS) - 1);
+
+	// percentiles of 1..10000
+	histogram_init(&h);
+	for (uint64_t v = 1; v <= 10000; v++) {
+		histogram_record(&h, v);
+	}
+	assert(h.count == 10000);
+	assert(h.sum == 50005000);
+	uint64_t p50 = histogram_percentile(&h, 0.5);
+	uint64_t p99 = histogram_percentile(&h, 0.99);
+	uint64_t p999 = histogram_percentile(&h, 0.999);
+	assert(p50 >= 5000 && p50 <= 5000 + 5000 / HISTOGRAM_SUB_BUCKETS);
+	assert(p99 >= 9900 && p99 <= 9900 + 9900 / HISTOGRAM_SUB_BUCKETS);
+	assert(p999 >= 9990 && p999 <= 9990 + 9990 / HISTOGRAM_SUB_BUCKETS);
+	assert(histogram_percentile(&h, 1.0) >= 10000);
+
+	// a merge is the same as recording everything in one histogram
+	histogram_init(&other);
+	for (uint64_t v = 0; v < 10000; v++) {
+		histogram_record(&other, 1000000);
+	}
+	histogram_merge(&h, &other);
+	assert(h.count == 20000);
+	assert(histogram_percentile(&h, 0.25) <= 5000 + 5000 / HISTOGRAM_SUB_BUCKETS);
+	assert(histogram_percentile(&h, 0.75) >= 1000000);
+
+	// the clock moves forward
+	uint64_t start = histogram_now();
+	assert(start > 0);
+	assert(histogram_now() >= start);
+	return 0;
+}
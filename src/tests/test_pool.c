@@ -0,0 +1,72 @@
+#include "../buffer.h"
+#include "../pool.h"
+
+#include <assert.h>
+#include <string.h>
+
+int main(int argc, char **argv) {
+	pool_t pool;
+	bufpool_t bufpool;
+	buffer_t buf;
+
+	// freed objects are reused, up to max_free of them
+	pool_init(&pool, 64, 1);
+	void *a = pool_get(&pool);
+	void *b = pool_get(&pool);
+	assert(a != NULL && b != NULL);
+	assert(pool.hits == 0 && pool.misses == 2);
+	pool_put(&pool, a);
+	pool_put(&pool, b);
+	assert(pool.num_free == 1);
+	assert(pool_get(&pool) == a);
+	assert(pool.hits == 1 && pool.misses == 2);
+	pool_put(&pool, a);
+	pool_destroy(&pool);
+
+	// buffers are pooled by size, and too big ones are not
+	bufpool_init(&bufpool);
+	void *small = bufpool_get(&bufpool, BUFPOOL_MIN_SIZE);
+	bufpool_put(&bufpool, small, BUFPOOL_MIN_SIZE);
+	void *medium = bufpool_get(&bufpool, BUFPOOL_MIN_SIZE * 2);
+	assert(medium != NULL && medium != small);
+	assert(bufpool_get(&bufpool, BUFPOOL_MIN_SIZE) == small);
+	assert(bufpool_hits(&bufpool) == 1 && bufpool_misses(&bufpool) == 2);
+	void *big = bufpool_get(&bufpool, BUFPOOL_MAX_SIZE * 2);
+	bufpool_put(&bufpool, big, BUFPOOL_MAX_SIZE * 2);
+	big = bufpool_get(&bufpool, BUFPOOL_MAX_SIZE * 2);
+	assert(big != NULL);
+	assert(bufpool_hits(&bufpool) == 1 && bufpool_misses(&bufpool) == 4);
+	// everything goes back, and only the pooled sizes are kept
+	bufpool_put(&bufpool, small, BUFPOOL_MIN_SIZE);
+	bufpool_put(&bufpool, medium, BUFPOOL_MIN_SIZE * 2);
+	bufpool_put(&bufpool, big, BUFPOOL_MAX_SIZE * 2);
+	assert(bufpool.classes[0].num_free == 1 && bufpool.classes[1].num_free == 1);
+	bufpool_destroy(&bufpool);
+	assert(bufpool.classes[0].num_free == 0 && bufpool.classes[1].num_free == 0);
+
+	// a pooled buffer takes memory as it's needed, moves up a size as
+	// it grows, and hands its memory back once it's drained
+	bufpool_init(&bufpool);
+	assert(buffer_init_pooled(&buf, &bufpool) == 0);
+	assert(buffer_spacecount(&buf) == 0);
+	assert(buffer_expand(&buf) == 0);
+	assert(buf.size == BUFPOOL_MIN_SIZE);
+	assert(buffer_set(&buf, "foo\n", 4) == 0);
+	assert(buffer_expand(&buf) == 0);
+	assert(buf.size == BUFPOOL_MIN_SIZE * 2);
+	assert(memcmp(buffer_head(&buf), "foo\n", 4) == 0);
+	assert(bufpool.classes[0].num_free == 1);
+	buffer_release(&buf);
+	assert(buf.size == BUFPOOL_MIN_SIZE * 2);
+	buffer_consume(&buf, 4);
+	buffer_release(&buf);
+	assert(buf.ptr == NULL && buf.size == 0);
+	assert(bufpool.classes[1].num_free == 1);
+	assert(buffer_expand(&buf) == 0);
+	assert(bufpool.classes[0].num_free == 0);
+	assert(bufpool_hits(&bufpool) == 1);
+	buffer_destroy(&buf);
+	assert(bufpool.classes[0].num_free == 1);
+	bufpool_destroy(&bufpool);
+	return 0;
+}
@@ -0,0 +1,144 @@
+#include "../report.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char output[1 << 16];
+
+// Render a whole report in one go
+static const char *render(const stats_snapshot_t *snapshot, enum report_format format) {
+	report_t report;
+	buffer_t buf;
+
+	assert(buffer_init(&buf) == 0);
+	report_init(&report, snapshot, format);
+	assert(report_write(&report, &buf, SIZE_MAX) == 0);
+	assert(buffer_datacount(&buf) < sizeof(output));
+	memcpy(output, buffer_head(&buf), buffer_datacount(&buf));
+	output[buffer_datacount(&buf)] = '\0';
+	buffer_destroy(&buf);
+	return output;
+}
+
+// Render a report a few bytes at a time, draining the buffer in between,
+// and check that it comes out the same as in one go
+static void check_chunked(const stats_snapshot_t *snapshot, enum report_format format) {
+	static char chunked[sizeof(output)];
+	size_t len = 0;
+	report_t report;
+	buffer_t buf;
+	int more;
+
+	assert(buffer_init(&buf) == 0);
+	report_init(&report, snapshot, format);
+	do {
+		more = report_write(&report, &buf, 16);
+		assert(more >= 0);
+		assert(len + buffer_datacount(&buf) < sizeof(chunked));
+		memcpy(chunked + len, buffer_head(&buf), buffer_datacount(&buf));
+		len += buffer_datacount(&buf);
+		buffer_consume(&buf, buffer_datacount(&buf));
+		buffer_realign(&buf);
+	} while (more == 1);
+	chunked[len] = '\0';
+	buffer_destroy(&buf);
+	assert(strcmp(chunked, render(snapshot, format)) == 0);
+}
+
+static const char *find(const char *haystack, const char *needle) {
+	const char *found = strstr(haystack, needle);
+	if (found == NULL) {
+		fprintf(stderr, "missing: %s\n", needle);
+		abort();
+	}
+	return found;
+}
+
+int main(int argc, char **argv) {
+	struct stats_backend_snapshot backends[2];
+	stats_snapshot_t snapshot;
+	const char *text;
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	memset(backends, 0, sizeof(backends));
+	snapshot.bytes_recv_udp = 1;
+	snapshot.bytes_recv_tcp = 2;
+	snapshot.last_reload = 1500000000;
+	snapshot.aggregated_lines = 30;
+	snapshot.aggregate_lines_out = 10;
+	snapshot.recv_to_enqueue.count = 4;
+	snapshot.recv_to_enqueue.sum = 6000;
+	snapshot.recv_to_enqueue.p50 = 1000;
+	snapshot.recv_to_enqueue.p99 = 2500;
+	snapshot.recv_to_enqueue.p999 = 2500;
+	backends[0].key = "127.0.0.1:8127:tcp";
+	backends[0].bytes_queued = 20;
+	backends[0].bytes_sent = 10;
+	backends[0].relayed_lines = 2;
+	backends[0].failing = 1;
+	backends[0].queue_residence.count = 1;
+	backends[0].queue_residence.p50 = 500;
+	backends[1].key = "odd\"key\\";
+	backends[1].bytes_sent = 7;
+	snapshot.num_backends = 2;
+	snapshot.backends = backends;
+
+	// the status command's output is unchanged
+	text = render(&snapshot, REPORT_STATUS);
+	assert(strncmp(text, "global bytes_recv_udp gauge 1\n", 30) == 0);
+	find(text, "global bytes_recv_tcp gauge 2\n");
+	find(text, "global last_reload timestamp 1500000000\n");
+	find(text, "global recv_to_enqueue_ns p50 1000\n");
+	find(text, "global recv_to_enqueue_ns p99 2500\n");
+	find(text, "global loop_iteration_ns p999 0\n");
+	find(text, "backend:127.0.0.1:8127:tcp bytes_queued gauge 20\n");
+	find(text, "backend:127.0.0.1:8127:tcp failing boolean 1\n");
+	find(text, "backend:127.0.0.1:8127:tcp queue_residence_ns p50 500\n");
+	find(text, "backend:odd\"key\\ bytes_sent gauge 7\n");
+	assert(strcmp(text + strlen(text) - 2, "\n\n") == 0);
+	assert(strstr(text, "\n\n") == text + strlen(text) - 2);
+	check_chunked(&snapshot, REPORT_STATUS);
+
+	// Prometheus: counters end in _total, times are in seconds, and
+	// each metric is one group
+	text = render(&snapshot, REPORT_PROMETHEUS);
+	find(text, "# TYPE statsrelay_bytes_recv_udp_total counter\nstatsrelay_bytes_recv_udp_total 1\n");
+	find(text, "# TYPE statsrelay_last_reload_timestamp_seconds gauge\n"
+		   "statsrelay_last_reload_timestamp_seconds 1500000000\n");
+	find(text, "# TYPE statsrelay_recv_to_enqueue_seconds summary\n"
+		   "statsrelay_recv_to_enqueue_seconds{quantile=\"0.5\"} 1e-06\n"
+		   "statsrelay_recv_to_enqueue_seconds{quantile=\"0.99\"} 2.5e-06\n"
+		   "statsrelay_recv_to_enqueue_seconds{quantile=\"0.999\"} 2.5e-06\n"
+		   "statsrelay_recv_to_enqueue_seconds_sum 6e-06\n"
+		   "statsrelay_recv_to_enqueue_seconds_count 4\n");
+	find(text, "# TYPE statsrelay_backend_bytes_sent_total counter\n"
+		   "statsrelay_backend_bytes_sent_total{backend=\"127.0.0.1:8127:tcp\"} 10\n"
+		   "statsrelay_backend_bytes_sent_total{backend=\"odd\\\"key\\\\\"} 7\n");
+	find(text, "# TYPE statsrelay_backend_spooled_bytes gauge\n");
+	find(text, "statsrelay_backend_failing{backend=\"127.0.0.1:8127:tcp\"} 1\n");
+	find(text, "statsrelay_backend_queue_residence_seconds{backend=\"127.0.0.1:8127:tcp\",quantile=\"0.5\"} 5e-07\n");
+	find(text, "statsrelay_backend_queue_residence_seconds_count{backend=\"odd\\\"key\\\\\"} 0\n");
+	check_chunked(&snapshot, REPORT_PROMETHEUS);
+
+	// JSON
+	text = render(&snapshot, REPORT_JSON);
+	assert(strncmp(text, "{\"global\":{\"bytes_recv_udp\":1,", 30) == 0);
+	find(text, "\"recv_to_enqueue_ns\":{\"count\":4,\"sum\":6000,\"p50\":1000,\"p99\":2500,\"p999\":2500}");
+	find(text, "},\"backends\":[{\"key\":\"127.0.0.1:8127:tcp\",\"bytes_queued\":20,");
+	find(text, "\"failing\":true,");
+	find(text, "},{\"key\":\"odd\\\"key\\\\\",");
+	find(text, "\"failing\":false,");
+	assert(strcmp(text + strlen(text) - 4, "}]}\n") == 0);
+	check_chunked(&snapshot, REPORT_JSON);
+
+	// no backends at all
+	snapshot.num_backends = 0;
+	text = render(&snapshot, REPORT_JSON);
+	find(text, "\"backends\":[]}\n");
+	text = render(&snapshot, REPORT_STATUS);
+	assert(strstr(text, "backend:") == NULL);
+	check_chunked(&snapshot, REPORT_PROMETHEUS);
+	return 0;
+}
@@ -0,0 +1,142 @@
+#include "../resolver.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <ev.h>
+
+// Stands in for a DNS server: "slow" takes 300ms to answer, "fail"
+// does not exist, and everything else is 127.0.0.1.
+static pthread_mutex_t stub_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stub_lookups = 0;
+
+static int stub_lookup(const char *host,
+		       const char *port,
+		       const struct addrinfo *hints,
+		       struct addrinfo **res) {
+	pthread_mutex_lock(&stub_lock);
+	stub_lookups++;
+	pthread_mutex_unlock(&stub_lock);
+
+	if (strcmp(host, "slow") == 0) {
+		struct timespec delay = {0, 300 * 1000 * 1000};
+		nanosleep(&delay, NULL);
+	} else if (strcmp(host, "fail") == 0) {
+		return EAI_NONAME;
+	}
+	struct addrinfo numeric = *hints;
+	numeric.ai_flags |= AI_NUMERICHOST;
+	return getaddrinfo("127.0.0.1", port, &numeric, res);
+}
+
+static int get_lookups(void) {
+	pthread_mutex_lock(&stub_lock);
+	int lookups = stub_lookups;
+	pthread_mutex_unlock(&stub_lock);
+	return lookups;
+}
+
+static resolver_request_t *request;
+static struct addrinfo *result;
+static int result_error;
+static int completions;
+
+static void resolved(struct ev_loop *loop, ev_async *watcher, int revents) {
+	if (request != NULL && resolver_finish(request, &result, &result_error)) {
+		request = NULL;
+		completions++;
+		ev_break(loop, EVBREAK_ALL);
+	}
+}
+
+// Ticks every 10ms while the loop runs, recording the longest gap
+static ev_tstamp last_tick, max_gap;
+
+static void tick(struct ev_loop *loop, ev_timer *watcher, int revents) {
+	ev_tstamp now = ev_time();
+	if (now - last_tick > max_gap) {
+		max_gap = now - last_tick;
+	}
+	last_tick = now;
+}
+
+static void timeout(struct ev_loop *loop, ev_timer *watcher, int revents) {
+	ev_break(loop, EVBREAK_ALL);
+}
+
+static void resolve(struct ev_loop *loop, ev_async *watcher, const char *host, unsigned int ttl) {
+	request = resolver_submit(loop, watcher, host, "8125", SOCK_STREAM, ttl);
+	assert(request != NULL);
+	ev_run(loop, 0);
+}
+
+int main(int argc, char **argv) {
+	struct ev_loop *loop = ev_loop_new(0);
+	ev_async watcher;
+	ev_timer ticker, limit;
+
+	resolver_set_lookup(stub_lookup);
+	ev_async_init(&watcher, resolved);
+	ev_async_start(loop, &watcher);
+	ev_timer_init(&limit, timeout, 5.0, 0);
+	ev_timer_start(loop, &limit);
+
+	// the loop keeps running while a lookup hangs
+	ev_timer_init(&ticker, tick, 0.01, 0.01);
+	ev_timer_start(loop, &ticker);
+	last_tick = ev_time();
+	max_gap = 0;
+	ev_tstamp start = ev_time();
+	resolve(loop, &watcher, "slow", 60);
+	ev_timer_stop(loop, &ticker);
+	assert(completions == 1);
+	assert(ev_time() - start >= 0.25);
+	assert(max_gap < 0.1);
+	assert(result_error == 0);
+	assert(result != NULL);
+	assert(result->ai_socktype == SOCK_STREAM);
+	assert(result->ai_addr->sa_family == AF_INET);
+	resolver_free_addr(result);
+	assert(get_lookups() == 1);
+
+	// a second lookup is answered from the cache
+	start = ev_time();
+	resolve(loop, &watcher, "slow", 60);
+	assert(completions == 2);
+	assert(ev_time() - start < 0.1);
+	assert(result != NULL);
+	resolver_free_addr(result);
+	assert(get_lookups() == 1);
+
+	// unless the caller does not want cached results
+	resolve(loop, &watcher, "slow", 0);
+	assert(completions == 3);
+	resolver_free_addr(result);
+	assert(get_lookups() == 2);
+
+	// failures are reported, and not cached
+	resolve(loop, &watcher, "fail", 60);
+	assert(result_error == EAI_NONAME);
+	assert(result == NULL);
+	resolve(loop, &watcher, "fail", 60);
+	assert(get_lookups() == 4);
+
+	// a cancelled request never signals its watcher
+	request = resolver_submit(loop, &watcher, "other", "8125", SOCK_STREAM, 0);
+	resolver_request_t *slow = resolver_submit(loop, &watcher, "slow", "8126", SOCK_STREAM, 0);
+	resolver_cancel(slow);
+	ev_run(loop, 0);
+	assert(completions == 6);
+	resolver_free_addr(result);
+	ev_timer_set(&limit, 0.5, 0);
+	ev_timer_start(loop, &limit);
+	ev_run(loop, 0);
+	assert(completions == 6);
+
+	resolver_shutdown();
+	ev_async_stop(loop, &watcher);
+	ev_loop_destroy(loop);
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include "../scan.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_LINES 4096
+
+static uint32_t next_random(uint32_t *state) {
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+// What scan_lines should find, a line at a time with memchr
+static size_t reference(const char *buf, size_t len, char delimiter,
+			struct scan_line *lines, size_t max_lines, size_t *consumed) {
+	size_t num_lines = 0, offset = 0;
+	while (num_lines < max_lines) {
+		const char *newline = memchr(buf + offset, '\n', len - offset);
+		if (newline == NULL) {
+			break;
+		}
+		struct scan_line *line = &lines[num_lines++];
+		line->offset = offset;
+		line->len = newline - (buf + offset);
+		line->key_len = 0;
+		line->delimiters = 0;
+		for (size_t i = 0; i < line->len; i++) {
+			if (buf[offset + i] == delimiter) {
+				if (line->delimiters++ == 0) {
+					line->key_len = i;
+				}
+			}
+		}
+		offset += line->len + 1;
+	}
+	*consumed = offset;
+	return num_lines;
+}
+
+static void compare(const char *buf, size_t len, char delimiter, size_t max_lines) {
+	static struct scan_line expected[MAX_LINES], actual[MAX_LINES];
+	size_t expected_consumed, actual_consumed;
+
+	const size_t expected_lines = reference(buf, len, delimiter, expected,
+						max_lines, &expected_consumed);
+	const size_t actual_lines = scan_lines(buf, len, delimiter, actual,
+					       max_lines, &actual_consumed);
+	assert(actual_lines == expected_lines);
+	assert(actual_consumed == expected_consumed);
+	for (size_t i = 0; i < expected_lines; i++) {
+		assert(actual[i].offset == expected[i].offset);
+		assert(actual[i].len == expected[i].len);
+		assert(actual[i].key_len == expected[i].key_len);
+		assert(actual[i].delimiters == expected[i].delimiters);
+	}
+}
+
+static void test_impl(enum scan_impl impl) {
+	static char buf[65536];
+	struct scan_line lines[4];
+	size_t consumed;
+	uint32_t state = 1;
+
+	if (scan_set_impl(impl) != 0) {
+		printf("implementation %d isn't supported here\n", impl);
+		return;
+	}
+	assert(scan_get_impl() == impl);
+
+	strcpy(buf, "foo.bar:1|c\nbaz:2|g\n:3|c\nnokey\npartial:4");
+	assert(scan_lines(buf, strlen(buf), ':', lines, 4, &consumed) == 4);
+	assert(consumed == strlen(buf) - strlen("partial:4"));
+	assert(lines[0].offset == 0 && lines[0].len == 11 && lines[0].key_len == 7);
+	assert(lines[1].offset == 12 && lines[1].len == 7 && lines[1].key_len == 3);
+	assert(lines[2].key_len == 0 && lines[2].delimiters == 1);
+	assert(lines[3].key_len == 0 && lines[3].delimiters == 0);
+
+	// stops once lines is full, right after the last line
+	assert(scan_lines(buf, strlen(buf), ':', lines, 2, &consumed) == 2);
+	assert(consumed == 20);
+	assert(scan_lines(buf, 0, ':', lines, 4, &consumed) == 0 && consumed == 0);
+
+	strcpy(buf, "a.b.c 1 1500000000\nd 2\n");
+	assert(scan_lines(buf, strlen(buf), ' ', lines, 4, &consumed) == 2);
+	assert(lines[0].key_len == 5 && lines[0].delimiters == 2);
+	assert(lines[1].key_len == 1 && lines[1].delimiters == 1);
+
+	// random buffers made mostly of newlines and delimiters, so that
+	// lines start and end everywhere within the blocks
+	for (int round = 0; round < 2000; round++) {
+		const size_t len = next_random(&state) % 600;
+		const unsigned int density = 2 + next_random(&state) % 40;
+		for (size_t i = 0; i < len; i++) {
+			const uint32_t r = next_random(&state) % density;
+			buf[i] = r == 0 ? '\n' : r == 1 ? ':' : 'a' + r % 26;
+		}
+		compare(buf, len, ':', MAX_LINES);
+		compare(buf, len, ':', 1 + next_random(&state) % 8);
+		compare(buf, len, 'a', MAX_LINES);
+	}
+
+	// long lines, and a lot of short ones
+	memset(buf, 'x', sizeof(buf));
+	buf[40000] = ':';
+	buf[sizeof(buf) - 1] = '\n';
+	compare(buf, sizeof(buf), ':', MAX_LINES);
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		buf[i] = i % 16 == 15 ? '\n' : i % 16 == 3 ? ':' : 'k';
+	}
+	compare(buf, sizeof(buf), ':', MAX_LINES);
+}
+
+int main(int argc, char **argv) {
+	const enum scan_impl best = scan_get_impl();
+
+	test_impl(SCAN_SCALAR);
+	test_impl(SCAN_SSE2);
+	test_impl(SCAN_AVX2);
+	assert(scan_set_impl(best) == 0);
+	return 0;
+}
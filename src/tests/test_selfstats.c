@@ -0,0 +1,123 @@
+#include "../selfstats.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static stats_snapshot_t *make_snapshot(size_t num_backends) {
+	stats_snapshot_t *snapshot = calloc(1, sizeof(stats_snapshot_t));
+	assert(snapshot != NULL);
+	snapshot->backends = calloc(num_backends + 1, sizeof(struct stats_backend_snapshot));
+	assert(snapshot->backends != NULL);
+	snapshot->num_backends = num_backends;
+	for (size_t i = 0; i < num_backends; i++) {
+		char key[64];
+		snprintf(key, sizeof(key), "10.0.0.%zu:8125:tcp", i + 1);
+		snapshot->backends[i].key = strdup(key);
+	}
+	return snapshot;
+}
+
+static const char *format(selfstats_t *self, stats_snapshot_t *snapshot) {
+	static char output[4096];
+	buffer_t buf;
+
+	assert(buffer_init(&buf) == 0);
+	assert(selfstats_format(self, snapshot, 1500000000, &buf) == 0);
+	assert(buffer_datacount(&buf) < sizeof(output));
+	memcpy(output, buffer_head(&buf), buffer_datacount(&buf));
+	output[buffer_datacount(&buf)] = '\0';
+	buffer_destroy(&buf);
+	return output;
+}
+
+static void expect(const char *output, const char *line) {
+	if (strstr(output, line) == NULL) {
+		fprintf(stderr, "missing \"%s\" in:\n%s", line, output);
+		abort();
+	}
+}
+
+int main(int argc, char **argv) {
+	selfstats_t self;
+	const char *output;
+
+	selfstats_init(&self);
+	assert(selfstats_configure(&self, "ops.relay", "web-1.example.com", false) == 0);
+
+	// the first round counts everything since startup
+	stats_snapshot_t *snapshot = make_snapshot(2);
+	snapshot->malformed_lines = 3;
+	snapshot->bytes_recv_tcp = 100;
+	snapshot->recv_to_enqueue.p99 = 4095;
+	snapshot->backends[0].relayed_lines = 10;
+	snapshot->backends[0].bytes_queued = 500;
+	snapshot->backends[0].bytes_sent = 200;
+	snapshot->backends[0].queued_bytes = 300;
+	snapshot->backends[1].relayed_lines = 5;
+	snapshot->backends[1].dropped_lines = 2;
+	snapshot->backends[1].failing = 1;
+	output = format(&self, snapshot);
+	expect(output, "ops.relay.web-1_example_com.relayed_lines:15|c\n");
+	expect(output, "ops.relay.web-1_example_com.dropped_lines:2|c\n");
+	expect(output, "ops.relay.web-1_example_com.malformed_lines:3|c\n");
+	expect(output, "ops.relay.web-1_example_com.bytes_recv_tcp:100|c\n");
+	expect(output, "ops.relay.web-1_example_com.queued_bytes:300|g\n");
+	expect(output, "ops.relay.web-1_example_com.backends:2|g\n");
+	expect(output, "ops.relay.web-1_example_com.failing_backends:1|g\n");
+	expect(output, "ops.relay.web-1_example_com.recv_to_enqueue_p99_ns:4095|g\n");
+	expect(output, "ops.relay.web-1_example_com.backend.10_0_0_1_8125_tcp.relayed_lines:10|c\n");
+	expect(output, "ops.relay.web-1_example_com.backend.10_0_0_1_8125_tcp.queued_bytes:300|g\n");
+	expect(output, "ops.relay.web-1_example_com.backend.10_0_0_2_8125_tcp.failing:1|g\n");
+
+	// after that, counters are the change since the last round, and
+	// backends are matched up by key even if they move around
+	snapshot = make_snapshot(3);
+	snapshot->malformed_lines = 4;
+	snapshot->bytes_recv_tcp = 100;
+	free(snapshot->backends[0].key);
+	snapshot->backends[0].key = strdup("10.0.0.2:8125:tcp");
+	snapshot->backends[0].relayed_lines = 8;
+	snapshot->backends[0].dropped_lines = 2;
+	free(snapshot->backends[1].key);
+	snapshot->backends[1].key = strdup("10.0.0.1:8125:tcp");
+	snapshot->backends[1].relayed_lines = 11;
+	snapshot->backends[1].bytes_sent = 50;
+	snapshot->backends[2].relayed_lines = 7;
+	output = format(&self, snapshot);
+	expect(output, "ops.relay.web-1_example_com.relayed_lines:11|c\n");
+	expect(output, "ops.relay.web-1_example_com.dropped_lines:0|c\n");
+	expect(output, "ops.relay.web-1_example_com.malformed_lines:1|c\n");
+	expect(output, "ops.relay.web-1_example_com.bytes_recv_tcp:0|c\n");
+	expect(output, "ops.relay.web-1_example_com.backend.10_0_0_2_8125_tcp.relayed_lines:3|c\n");
+	expect(output, "ops.relay.web-1_example_com.backend.10_0_0_1_8125_tcp.relayed_lines:1|c\n");
+	expect(output, "ops.relay.web-1_example_com.backend.10_0_0_3_8125_tcp.relayed_lines:7|c\n");
+	// the queue depth is published as is, not worked out from the
+	// byte counters
+	expect(output, "ops.relay.web-1_example_com.backend.10_0_0_1_8125_tcp.queued_bytes:0|g\n");
+
+	// a counter that went backwards belongs to a backend that was
+	// removed and added again
+	snapshot = make_snapshot(1);
+	snapshot->backends[0].relayed_lines = 2;
+	output = format(&self, snapshot);
+	expect(output, "backend.10_0_0_1_8125_tcp.relayed_lines:2|c\n");
+
+	// carbon lines carry a timestamp
+	assert(selfstats_configure(&self, "", "host", true) == 0);
+	snapshot = make_snapshot(1);
+	snapshot->backends[0].relayed_lines = 5;
+	output = format(&self, snapshot);
+	expect(output, "host.relayed_lines 3 1500000000\n");
+	expect(output, "host.backend.10_0_0_1_8125_tcp.queued_bytes 0 1500000000\n");
+	assert(strstr(output, "|") == NULL);
+
+	// without a hostname, this machine's name is used
+	assert(selfstats_configure(&self, "statsrelay", NULL, false) == 0);
+	assert(strncmp(self.prefix, "statsrelay.", 11) == 0);
+	assert(strlen(self.prefix) > strlen("statsrelay.."));
+
+	selfstats_destroy(&self);
+	return 0;
+}
@@ -0,0 +1,140 @@
+#include "../sendqueue.h"
+
+#include <assert.h>
+#include <string.h>
+
+// Copy everything described by the iovecs into out
+static size_t gather(sendqueue_t *q, int max_iov, char *out) {
+	struct iovec iov[16];
+	size_t total = 0;
+	int n = sendqueue_iov(q, iov, max_iov);
+	for (int i = 0; i < n; i++) {
+		memcpy(out + total, iov[i].iov_base, iov[i].iov_len);
+		total += iov[i].iov_len;
+	}
+	return total;
+}
+
+static char data[SENDQUEUE_CHUNK_SIZE * 3];
+static char out[SENDQUEUE_CHUNK_SIZE * 3];
+
+int main(int argc, char **argv) {
+	sendqueue_pool_t pool;
+	sendqueue_t q;
+	struct iovec iov[16];
+
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = 'a' + (i % 26);
+	}
+
+	sendqueue_pool_init(&pool, 2);
+	sendqueue_init(&q, &pool);
+	assert(sendqueue_datacount(&q) == 0);
+	assert(sendqueue_iov(&q, iov, 16) == 0);
+
+	// small appends share a chunk
+	assert(sendqueue_append(&q, "foo\n", 4) == 0);
+	assert(sendqueue_append(&q, "bar\n", 4) == 0);
+	assert(sendqueue_datacount(&q) == 8);
+	assert(sendqueue_iov(&q, iov, 16) == 1);
+	assert(iov[0].iov_len == 8);
+	assert(memcmp(iov[0].iov_base, "foo\nbar\n", 8) == 0);
+
+	// partial consume
+	assert(sendqueue_consume(&q, 3) == 0);
+	assert(gather(&q, 16, out) == 5);
+	assert(memcmp(out, "\nbar\n", 5) == 0);
+	assert(sendqueue_consume(&q, 6) != 0);
+	assert(sendqueue_consume(&q, 5) == 0);
+	assert(sendqueue_datacount(&q) == 0);
+
+	// an append spanning several chunks
+	size_t big = SENDQUEUE_CHUNK_SIZE * 2 + 100;
+	assert(sendqueue_append(&q, data, big) == 0);
+	assert(sendqueue_datacount(&q) == big);
+	assert(sendqueue_iov(&q, iov, 16) == 3);
+	assert(gather(&q, 16, out) == big);
+	assert(memcmp(out, data, big) == 0);
+	assert(sendqueue_iov(&q, iov, 2) == 2);
+	assert(gather(&q, 2, out) == SENDQUEUE_CHUNK_SIZE * 2);
+
+	// consuming across chunk boundaries returns them to the pool
+	assert(sendqueue_consume(&q, SENDQUEUE_CHUNK_SIZE + 10) == 0);
+	assert(pool.num_free == 1);
+	assert(gather(&q, 16, out) == big - SENDQUEUE_CHUNK_SIZE - 10);
+	assert(memcmp(out, data + SENDQUEUE_CHUNK_SIZE + 10, big - SENDQUEUE_CHUNK_SIZE - 10) == 0);
+	assert(sendqueue_consume(&q, big - SENDQUEUE_CHUNK_SIZE - 10) == 0);
+	assert(sendqueue_datacount(&q) == 0);
+	assert(pool.num_free == 2);
+
+	// whole records are packed up to max_len, across chunks
+	struct sendqueue_cursor cursor;
+	int iovcnt;
+	char line[100];
+	memset(line, 'x', sizeof(line));
+	line[sizeof(line) - 1] = '\n';
+	for (int i = 0; i < 200; i++) {
+		assert(sendqueue_append(&q, line, sizeof(line)) == 0);
+	}
+	assert(sendqueue_iov(&q, iov, 16) == 2);
+	sendqueue_cursor_init(&q, &cursor);
+	size_t total = 0;
+	int packets = 0;
+	for (;;) {
+		size_t len = sendqueue_next_records(&q, &cursor, 1432, '\n', iov, 16, &iovcnt);
+		if (len == 0) {
+			break;
+		}
+		assert(len == 1400 || (total + len == 20000 && len % 100 == 0));
+		size_t iov_len = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			iov_len += iov[i].iov_len;
+		}
+		assert(iov_len == len);
+		assert(((char *) iov[iovcnt - 1].iov_base)[iov[iovcnt - 1].iov_len - 1] == '\n');
+		total += len;
+		packets++;
+	}
+	assert(total == 20000);
+	assert(packets == 15);
+	assert(sendqueue_consume(&q, 20000) == 0);
+
+	// a record longer than max_len comes back by itself
+	assert(sendqueue_append(&q, "a\n", 2) == 0);
+	assert(sendqueue_append(&q, data, 2000) == 0);
+	assert(sendqueue_append(&q, "\nb\n", 3) == 0);
+	sendqueue_cursor_init(&q, &cursor);
+	assert(sendqueue_next_records(&q, &cursor, 100, '\n', iov, 16, &iovcnt) == 2);
+	assert(sendqueue_next_records(&q, &cursor, 100, '\n', iov, 16, &iovcnt) == 2001);
+	assert(sendqueue_next_records(&q, &cursor, 100, '\n', iov, 16, &iovcnt) == 2);
+	assert(memcmp(iov[0].iov_base, "b\n", 2) == 0);
+	assert(sendqueue_next_records(&q, &cursor, 100, '\n', iov, 16, &iovcnt) == 0);
+
+	// a partial record is never returned
+	assert(sendqueue_append(&q, "c", 1) == 0);
+	sendqueue_cursor_init(&q, &cursor);
+	assert(sendqueue_next_records(&q, &cursor, 10000, '\n', iov, 16, &iovcnt) == 2005);
+	assert(sendqueue_next_records(&q, &cursor, 10000, '\n', iov, 16, &iovcnt) == 0);
+
+	// the oldest record, even one spanning several chunks, can be
+	// measured so that it can be dropped by itself
+	assert(sendqueue_record_len(&q, '\n') == 2);
+	assert(sendqueue_consume(&q, 2) == 0);
+	assert(sendqueue_record_len(&q, '\n') == 2001);
+	assert(sendqueue_consume(&q, 2003) == 0);
+	assert(sendqueue_record_len(&q, '\n') == 0);
+	assert(sendqueue_consume(&q, 1) == 0);
+	for (int i = 0; i < 3; i++) {
+		assert(sendqueue_append(&q, data, sizeof(data)) == 0);
+	}
+	assert(sendqueue_append(&q, "\nd\n", 3) == 0);
+	assert(sendqueue_record_len(&q, '\n') == 3 * sizeof(data) + 1);
+
+	// the pool keeps at most max_free idle chunks
+	sendqueue_destroy(&q);
+	assert(sendqueue_datacount(&q) == 0);
+	assert(pool.num_free == 2);
+	sendqueue_pool_destroy(&pool);
+	assert(pool.num_free == 0);
+	return 0;
+}
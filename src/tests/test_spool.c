@@ -0,0 +1,118 @@
+#include "../spool.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Read everything left in the spool, len bytes at a time
+static size_t drain(spool_t *spool, size_t len, char *out) {
+	size_t total = 0;
+	ssize_t n;
+	while ((n = spool_read(spool, out + total, len)) > 0) {
+		total += n;
+	}
+	assert(n == 0);
+	return total;
+}
+
+int main(int argc, char **argv) {
+	char base[] = "/tmp/test_spool.XXXXXX";
+	char expected[256], out[SPOOL_READ_SIZE];
+	char cmd[64];
+	spool_t spool, other;
+	struct stat st;
+
+	assert(mkdtemp(base) != NULL);
+
+	assert(spool_open(&spool, base, "backend", 1024, 16) == 0);
+	assert(spool_datacount(&spool) == 0);
+	assert(spool_read(&spool, out, sizeof(out)) == 0);
+
+	// lines come back in order, and only whole lines
+	assert(spool_append(&spool, "foo\n", 4) == 0);
+	assert(spool_append(&spool, "hello\n", 6) == 0);
+	assert(spool_datacount(&spool) == 10);
+	assert(spool_read(&spool, out, 6) == 4);
+	assert(memcmp(out, "foo\n", 4) == 0);
+	assert(spool_read(&spool, out, 3) == 0);
+	assert(spool_read(&spool, out, 6) == 6);
+	assert(memcmp(out, "hello\n", 6) == 0);
+	assert(spool_datacount(&spool) == 0);
+
+	// several segments
+	expected[0] = '\0';
+	for (int i = 0; i < 10; i++) {
+		char line[16];
+		int len = snprintf(line, sizeof(line), "line%d\n", i);
+		assert(spool_append(&spool, line, len) == 0);
+		strcat(expected, line);
+	}
+	assert(spool_datacount(&spool) == strlen(expected));
+	assert(spool.next_seq - spool.read_seq > 1);
+	assert(drain(&spool, 10, out) == strlen(expected));
+	assert(memcmp(out, expected, strlen(expected)) == 0);
+	assert(spool.read_seq == spool.next_seq);
+
+	// a second spool for the same backend gets its own directory
+	assert(spool_open(&other, base, "backend", 1024, 16) == 0);
+	assert(strcmp(spool.path, other.path) != 0);
+	spool_close(&other);
+
+	// max_bytes is enforced
+	spool_close(&spool);
+	assert(spool_open(&spool, base, "full", 20, 1024) == 0);
+	assert(spool_append(&spool, "1234567\n", 8) == 0);
+	assert(spool_append(&spool, "1234567\n", 8) == 0);
+	assert(spool_append(&spool, "1234567\n", 8) == 1);
+	assert(spool_datacount(&spool) == 16);
+	spool_close(&spool);
+
+	// unread lines survive a close, including a partly read segment
+	assert(spool_open(&spool, base, "backend", 1024, 16) == 0);
+	assert(spool_append(&spool, "one\ntwo\n", 8) == 0);
+	assert(spool_append(&spool, "three\n", 6) == 0);
+	assert(spool_append(&spool, "four\n", 5) == 0);
+	assert(spool_read(&spool, out, 4) == 4);
+	spool_close(&spool);
+	assert(spool_open(&spool, base, "backend", 1024, 16) == 0);
+	assert(spool_datacount(&spool) == 15);
+	assert(drain(&spool, sizeof(out), out) == 15);
+	assert(memcmp(out, "two\nthree\nfour\n", 15) == 0);
+	spool_close(&spool);
+
+	// appends are buffered until a flush, a read or a close, or until
+	// SPOOL_WRITE_SIZE bytes are waiting
+	assert(spool_open(&spool, base, "buffered", 4 * SPOOL_WRITE_SIZE, SPOOL_SEGMENT_SIZE) == 0);
+	assert(spool_append(&spool, "foo\n", 4) == 0);
+	assert(spool_append(&spool, "bar\n", 4) == 0);
+	assert(spool.write_fd < 0 && spool.next_seq == 0);
+	assert(spool_datacount(&spool) == 8);
+	assert(spool_flush(&spool) == 0);
+	assert(spool.next_seq == 1 && spool.write_buf_len == 0);
+	assert(fstat(spool.write_fd, &st) == 0 && st.st_size == 8);
+	assert(spool_append(&spool, "baz\n", 4) == 0);
+	assert(spool_read(&spool, out, sizeof(out)) == 12);
+	assert(memcmp(out, "foo\nbar\nbaz\n", 12) == 0);
+	char *big = malloc(SPOOL_WRITE_SIZE);
+	assert(big != NULL);
+	memset(big, 'x', SPOOL_WRITE_SIZE - 1);
+	big[SPOOL_WRITE_SIZE - 1] = '\n';
+	assert(spool_append(&spool, "foo\n", 4) == 0);
+	assert(spool_append(&spool, big, SPOOL_WRITE_SIZE) == 0);
+	assert(spool.write_buf_len == SPOOL_WRITE_SIZE);
+	assert(fstat(spool.write_fd, &st) == 0 && st.st_size == 4);
+	assert(spool_append(&spool, "bar\n", 4) == 0);
+	assert(spool.write_buf_len == 4);
+	assert(fstat(spool.write_fd, &st) == 0 && st.st_size == SPOOL_WRITE_SIZE + 4);
+	free(big);
+	spool_close(&spool);
+	assert(spool_open(&spool, base, "buffered", 4 * SPOOL_WRITE_SIZE, SPOOL_SEGMENT_SIZE) == 0);
+	assert(spool_datacount(&spool) == SPOOL_WRITE_SIZE + 8);
+	spool_close(&spool);
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", base);
+	assert(system(cmd) == 0);
+	return 0;
+}
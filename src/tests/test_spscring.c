@@ -0,0 +1,113 @@
+#include "../spscring.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define NUM_RECORDS 1000000
+
+// Record i holds i, followed by i % 61 bytes of (char) i
+static size_t record_len(uint64_t i) {
+	return sizeof(uint64_t) + i % 61;
+}
+
+static void fill(char *record, uint64_t i) {
+	memcpy(record, &i, sizeof(i));
+	memset(record + sizeof(i), (char) i, i % 61);
+}
+
+static void check(const char *record, size_t len, uint64_t i) {
+	uint64_t value;
+	assert(len == record_len(i));
+	memcpy(&value, record, sizeof(value));
+	assert(value == i);
+	for (size_t j = sizeof(i); j < len; j++) {
+		assert(record[j] == (char) i);
+	}
+}
+
+static void *produce(void *arg) {
+	spsc_ring_t *ring = (spsc_ring_t *) arg;
+	for (uint64_t i = 0; i < NUM_RECORDS; i++) {
+		char *record;
+		while ((record = spsc_ring_reserve(ring, record_len(i))) == NULL) {
+			spsc_ring_publish(ring);
+		}
+		fill(record, i);
+		if (i % 16 == 0) {
+			spsc_ring_publish(ring);
+		}
+	}
+	spsc_ring_publish(ring);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	spsc_ring_t ring;
+	size_t len;
+	char *record;
+
+	// the size is rounded up to a power of two
+	assert(spsc_ring_init(&ring, 1000) == 0);
+	assert(ring.size == 1024);
+	assert(spsc_ring_peek(&ring, &len) == NULL);
+
+	// records aren't seen until they're published
+	record = spsc_ring_reserve(&ring, 5);
+	assert(record != NULL);
+	assert(((uintptr_t) record) % 8 == 0);
+	memcpy(record, "hello", 5);
+	assert(spsc_ring_unpublished(&ring) == 16);
+	assert(spsc_ring_peek(&ring, &len) == NULL);
+	spsc_ring_publish(&ring);
+	assert(spsc_ring_unpublished(&ring) == 0);
+	record = spsc_ring_peek(&ring, &len);
+	assert(record != NULL && len == 5 && memcmp(record, "hello", 5) == 0);
+	// peeking again gives the same record
+	assert(spsc_ring_peek(&ring, &len) == record);
+	spsc_ring_consume(&ring);
+	assert(spsc_ring_peek(&ring, &len) == NULL);
+
+	// a record can take at most half of the ring
+	assert(spsc_ring_reserve(&ring, 512) == NULL);
+
+	// fill the ring up, without consuming anything
+	size_t reserved = 0;
+	while (spsc_ring_reserve(&ring, 100) != NULL) {
+		reserved++;
+	}
+	assert(reserved == 1024 / 112);
+	spsc_ring_publish(&ring);
+
+	// space only comes back once the consumer has caught up
+	for (size_t i = 0; i < reserved; i++) {
+		assert(spsc_ring_peek(&ring, &len) != NULL && len == 100);
+		spsc_ring_consume(&ring);
+	}
+	assert(spsc_ring_peek(&ring, &len) == NULL);
+
+	// a record that doesn't fit at the end starts over at the start
+	record = spsc_ring_reserve(&ring, 400);
+	assert(record == ring.data + sizeof(uint64_t));
+	spsc_ring_publish(&ring);
+	assert(spsc_ring_peek(&ring, &len) == record && len == 400);
+	spsc_ring_consume(&ring);
+	assert(spsc_ring_peek(&ring, &len) == NULL);
+	spsc_ring_destroy(&ring);
+
+	// a producer and a consumer on different threads
+	pthread_t producer;
+	assert(spsc_ring_init(&ring, 4096) == 0);
+	assert(pthread_create(&producer, NULL, produce, &ring) == 0);
+	for (uint64_t i = 0; i < NUM_RECORDS; i++) {
+		while ((record = spsc_ring_peek(&ring, &len)) == NULL) {
+		}
+		check(record, len, i);
+		spsc_ring_consume(&ring);
+	}
+	assert(pthread_join(producer, NULL) == 0);
+	assert(spsc_ring_peek(&ring, &len) == NULL);
+	spsc_ring_destroy(&ring);
+	return 0;
+}
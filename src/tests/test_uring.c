@@ -0,0 +1,111 @@
+#include "../uring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// automake's exit status for a skipped test
+#define SKIP 77
+
+#ifdef HAVE_IO_URING
+
+#define NUM_BUFS 4
+#define BUF_SIZE 64
+
+static char bufs[NUM_BUFS][BUF_SIZE];
+
+static void arm(uring_t *ring, int sd) {
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	assert(sqe != NULL);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 1;
+	sqe->user_data = 42;
+	assert(uring_pending(ring) == 1);
+	assert(uring_submit(ring, 0) == 1);
+	assert(uring_pending(ring) == 0);
+}
+
+// Wait for the next completion, and check that it's for a datagram of
+// data in buffer id
+static unsigned int expect(uring_t *ring, const char *data, unsigned int id) {
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_peek_cqe(ring)) == NULL) {
+		assert(uring_submit(ring, 1) == 0);
+	}
+	assert(cqe->user_data == 42);
+	assert(cqe->res == (int) strlen(data));
+	assert(cqe->flags & IORING_CQE_F_BUFFER);
+	assert(cqe->flags >> IORING_CQE_BUFFER_SHIFT == id);
+	assert(memcmp(bufs[id], data, strlen(data)) == 0);
+	const unsigned int flags = cqe->flags;
+	uring_cqe_seen(ring);
+	return flags;
+}
+
+int main(int argc, char **argv) {
+	uring_t ring;
+	uring_bufring_t provided;
+	int sv[2];
+
+	if (uring_init(&ring, 8, 64) != 0) {
+		printf("io_uring is not available: %s\n", strerror(errno));
+		return SKIP;
+	}
+	if (uring_bufring_init(&ring, &provided, 1, NUM_BUFS) != 0) {
+		printf("provided buffer rings are not available: %s\n", strerror(errno));
+		uring_destroy(&ring);
+		return SKIP;
+	}
+	for (uint16_t i = 0; i < NUM_BUFS; i++) {
+		uring_bufring_add(&provided, bufs[i], BUF_SIZE, i);
+	}
+	uring_bufring_publish(&provided);
+	assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0);
+
+	// every datagram takes a buffer of its own, and the receive stays
+	// armed while there are buffers left
+	arm(&ring, sv[0]);
+	const char *datagrams[] = {"foo", "barbaz", "a:1|c", "b:2|c", "last"};
+	for (int i = 0; i < 5; i++) {
+		assert(send(sv[1], datagrams[i], strlen(datagrams[i]), 0) > 0);
+	}
+	for (unsigned int i = 0; i < NUM_BUFS; i++) {
+		assert(expect(&ring, datagrams[i], i) & IORING_CQE_F_MORE);
+	}
+
+	// then it ends with ENOBUFS, and has to be armed again once the
+	// buffers have been given back
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_peek_cqe(&ring)) == NULL) {
+		assert(uring_submit(&ring, 1) == 0);
+	}
+	assert(cqe->res == -ENOBUFS);
+	assert(!(cqe->flags & IORING_CQE_F_MORE));
+	uring_cqe_seen(&ring);
+	assert(uring_peek_cqe(&ring) == NULL);
+	uring_bufring_add(&provided, bufs[2], BUF_SIZE, 2);
+	uring_bufring_publish(&provided);
+	arm(&ring, sv[0]);
+	expect(&ring, "last", 2);
+
+	uring_destroy(&ring);
+	uring_bufring_destroy(&provided);
+	close(sv[0]);
+	close(sv[1]);
+	return 0;
+}
+
+#else
+
+int main(int argc, char **argv) {
+	printf("statsrelay was built without io_uring\n");
+	return SKIP;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#include "../log.h"
+#include "../validate.h"
+
+#include <assert.h>
+#include <string.h>
+
+static int statsd(const char *line) {
+	return validate_statsd(line, strlen(line));
+}
+
+static int carbon(const char *line) {
+	return validate_carbon(line, strlen(line));
+}
+
+int main(int argc, char **argv) {
+	stats_set_log_level(STATSRELAY_LOG_ERROR);
+
+	assert(statsd("foo:1|c") == 0);
+	assert(statsd("foo.bar:-1.5|g") == 0);
+	assert(statsd("foo.bar:+3|g") == 0);
+	assert(statsd("foo:1e3|ms") == 0);
+	assert(statsd("foo:.5|h") == 0);
+	assert(statsd("foo:12|s") == 0);
+	assert(statsd("foo:12|kv") == 0);
+	assert(statsd("foo:1|c|@0.1") == 0);
+	assert(statsd("foo:1|ms|@1e-2") == 0);
+	assert(statsd("foo:1|c|@0.5|#tag") == 0);
+
+	assert(statsd("") != 0);
+	assert(statsd("foo") != 0);
+	assert(statsd(":1|c") != 0);
+	assert(statsd("foo:|c") != 0);
+	assert(statsd("foo:xxx") != 0);
+	assert(statsd("foo:1") != 0);
+	assert(statsd("foo:1|") != 0);
+	assert(statsd("foo:1|x") != 0);
+	assert(statsd("foo:1|mss") != 0);
+	assert(statsd("foo:1|cc") != 0);
+	assert(statsd("foo:1e|c") != 0);
+	assert(statsd("foo:1|c|") != 0);
+	assert(statsd("foo:1|c|@") != 0);
+	assert(statsd("foo:1|c|0.1") != 0);
+	assert(statsd("foo:1|c|@abc") != 0);
+	assert(statsd("foo.bar:undefined|quux.quuxly.200:1c") != 0);
+
+	// the line must not be read past its length
+	assert(validate_statsd("foo:1|c|@0.1", 7) == 0);
+	assert(validate_statsd("foo:1|cxyz", 7) == 0);
+	assert(validate_statsd("foo:12|c", 5) != 0);
+
+	assert(carbon("a b c") == 0);
+	assert(carbon("a b") != 0);
+	assert(carbon("a b c d") != 0);
+	assert(validate_carbon_spaces("a b c", 5, 2) == 0);
+	assert(validate_carbon_spaces("a b c d", 7, 3) != 0);
+
+	return 0;
+}
@@ -1,7 +1,10 @@
 #include "udpserver.h"
 #include "log.h"
+#include "unixsock.h"
+#include "uring.h"
 
 #include <arpa/inet.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -15,6 +18,10 @@
 #include <ev.h>
 
 #define MAX_UDP_HANDLERS 32
+#define UDPSERVER_SLOT_SIZE (UDPSERVER_MAX_DATAGRAM + 1)
+#define UDPSERVER_URING_ENTRIES 64
+#define UDPSERVER_URING_COMPLETIONS 4096
+#define UDPSERVER_URING_MIN_SLOTS 16	// provided to the kernel per listener
 
 typedef struct udplistener_t udplistener_t;
 
@@ -24,7 +31,20 @@ struct udpserver_t {
 	struct ev_loop *loop;
 	udplistener_t *listeners[MAX_UDP_HANDLERS];
 	int listeners_len;
+	unsigned int batch_size;
+	bool reuseport;
 	void *data;
+	mode_t unix_mode;
+	int unix_recv_buffer;
+#ifdef HAVE_IO_URING
+	// With the io_uring engine, every listener has a multishot receive
+	// armed on the server's ring, and the ring's fd is watched for
+	// completions instead of the listeners' sockets
+	bool use_uring;
+	uring_t ring;
+	ev_io ring_watcher;
+	ev_prepare submit_watcher;	// submits once per loop iteration
+#endif
 };
 
 // udplistener_t represents a socket listening on a port
@@ -33,19 +53,122 @@ struct udplistener_t {
 	int sd;
 	struct ev_io *watcher;
 	void *data;
-	int (*cb_recv)(int, void *);
+	udpserver_recv_cb cb_recv;
+	char *path;			// of a unix socket, NULL for UDP
+
+	// Receive buffers, one UDPSERVER_MAX_DATAGRAM slot (plus a spare
+	// byte) per datagram in a batch. These are allocated once when the
+	// listener is created and reused for every wakeup. With io_uring,
+	// there are more slots than that, and the kernel picks them.
+	unsigned int batch_size;
+	unsigned int num_slots;
+	char *buffers;
+	struct iovec *iovecs;
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr *msgs;
+#endif
+#ifdef HAVE_IO_URING
+	uint16_t index;			// in the server's listeners, and the buffer group
+	uring_bufring_t provided;
+	uint16_t *batch_slots;		// the slot of each datagram in iovecs
+	unsigned int batch_len;
+#endif
 };
 
 
-udpserver_t *udpserver_create(struct ev_loop *loop, void *data) {
+#ifdef HAVE_IO_URING
+static void udpserver_ring_callback(struct ev_loop *loop, struct ev_io *watcher, int revents);
+static void udpserver_submit_callback(struct ev_loop *loop, struct ev_prepare *watcher, int revents);
+#endif
+
+udpserver_t *udpserver_create(struct ev_loop *loop,
+			      struct proto_config *config,
+			      void *data) {
 	udpserver_t *server;
 	server = malloc(sizeof(udpserver_t));
+	if (server == NULL) {
+		return NULL;
+	}
 	server->loop = loop;
 	server->listeners_len = 0;
+	server->batch_size = config->udp_batch_size;
+	// every worker binds its own listener to the same address
+	server->reuseport = config->workers > 1;
 	server->data = data;
+	server->unix_mode = config->unix_socket_mode;
+	server->unix_recv_buffer = config->unix_recv_buffer;
+#ifndef HAVE_RECVMMSG
+	if (server->batch_size > 1) {
+		stats_log("udpserver: recvmmsg(2) is not available, ignoring udp_batch_size of %u",
+			  server->batch_size);
+		server->batch_size = 1;
+	}
+#endif
+#ifdef HAVE_IO_URING
+	server->use_uring = false;
+	if (config->io_engine == IO_ENGINE_IO_URING) {
+		if (uring_init(&server->ring, UDPSERVER_URING_ENTRIES, UDPSERVER_URING_COMPLETIONS) != 0) {
+			stats_log("udpserver: io_uring is not available (%s), using libev", strerror(errno));
+		} else {
+			stats_debug_log("udpserver: reading UDP listeners through io_uring, fd = %d", server->ring.fd);
+			server->use_uring = true;
+			ev_io_init(&server->ring_watcher, udpserver_ring_callback, server->ring.fd, EV_READ);
+			server->ring_watcher.data = server;
+			ev_io_start(loop, &server->ring_watcher);
+			ev_prepare_init(&server->submit_watcher, udpserver_submit_callback);
+			server->submit_watcher.data = server;
+			ev_prepare_start(loop, &server->submit_watcher);
+			ev_unref(loop);
+		}
+	}
+#else
+	if (config->io_engine == IO_ENGINE_IO_URING) {
+		stats_log("udpserver: statsrelay was built without io_uring, using libev");
+	}
+#endif
 	return server;
 }
 
+// Read as many datagrams as are available, up to the batch size, into
+// the listener's buffers. Returns the number of datagrams read, or -1
+// on error.
+static int udplistener_read(udplistener_t *listener) {
+	ssize_t bytes_read;
+
+#ifdef HAVE_RECVMMSG
+	if (listener->batch_size > 1) {
+		for (unsigned int i = 0; i < listener->batch_size; i++) {
+			listener->iovecs[i].iov_len = UDPSERVER_MAX_DATAGRAM;
+		}
+		int count = recvmmsg(listener->sd, listener->msgs, listener->batch_size, MSG_DONTWAIT, NULL);
+		if (count < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				stats_debug_log("udplistener: spurious wakeup on fd %d", listener->sd);
+			} else {
+				stats_error_log("udplistener: Error calling recvmmsg: %s", strerror(errno));
+			}
+			return -1;
+		}
+		for (int i = 0; i < count; i++) {
+			listener->iovecs[i].iov_len = listener->msgs[i].msg_len;
+		}
+		return count;
+	}
+#endif
+
+	bytes_read = read(listener->sd, listener->iovecs[0].iov_base, UDPSERVER_MAX_DATAGRAM);
+	if (bytes_read < 0) {
+		if (errno == EAGAIN) {
+			stats_error_log("udplistener: interrupted during recvfrom");
+		} else {
+			stats_error_log("udplistener: Error calling recvfrom: %s", strerror(errno));
+		}
+		return -1;
+	}
+	listener->iovecs[0].iov_len = bytes_read;
+	return 1;
+}
+
 static void udplistener_recv_callback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
 	udplistener_t *listener;
 	listener = (udplistener_t *)watcher->data;
@@ -55,13 +178,197 @@ static void udplistener_recv_callback(struct ev_loop *loop, struct ev_io *watche
 		return;
 	}
 
-	if (listener->cb_recv(listener->sd, listener->data) != 0) {
+	int count = udplistener_read(listener);
+	if (count <= 0) {
+		return;
+	}
+
+	if (listener->cb_recv(listener->sd, listener->data, listener->iovecs, count) != 0) {
 		//stats_log("udplistener: recv callback returned non-zero");
 		return;
 	}
 }
 
-static udplistener_t *udplistener_create(udpserver_t *server, struct addrinfo *addr, int (*cb_recv)(int, void *)) {
+// Allocate the per-datagram receive buffers and, when batching, the
+// mmsghdr array handed to recvmmsg(2).
+static int udplistener_alloc_buffers(udpserver_t *server, udplistener_t *listener) {
+	const unsigned int batch_size = server->batch_size;
+	listener->batch_size = batch_size;
+	listener->num_slots = batch_size;
+#ifdef HAVE_IO_URING
+	// The kernel needs a power of two, and enough that it doesn't run
+	// out while a batch is being handled
+	if (server->use_uring) {
+		listener->num_slots = UDPSERVER_URING_MIN_SLOTS;
+		while (listener->num_slots < 2 * batch_size) {
+			listener->num_slots *= 2;
+		}
+		listener->batch_slots = calloc(batch_size, sizeof(uint16_t));
+		if (listener->batch_slots == NULL) {
+			return 1;
+		}
+	}
+#endif
+	listener->buffers = malloc((size_t) listener->num_slots * UDPSERVER_SLOT_SIZE);
+	listener->iovecs = calloc(batch_size, sizeof(struct iovec));
+	if (listener->buffers == NULL || listener->iovecs == NULL) {
+		return 1;
+	}
+	for (unsigned int i = 0; i < batch_size; i++) {
+		listener->iovecs[i].iov_base = listener->buffers + (size_t) i * UDPSERVER_SLOT_SIZE;
+		listener->iovecs[i].iov_len = UDPSERVER_MAX_DATAGRAM;
+	}
+#ifdef HAVE_RECVMMSG
+	listener->msgs = calloc(batch_size, sizeof(struct mmsghdr));
+	if (listener->msgs == NULL) {
+		return 1;
+	}
+	for (unsigned int i = 0; i < batch_size; i++) {
+		listener->msgs[i].msg_hdr.msg_iov = &listener->iovecs[i];
+		listener->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+	return 0;
+}
+
+static void udplistener_free_buffers(udplistener_t *listener) {
+	free(listener->buffers);
+	free(listener->iovecs);
+#ifdef HAVE_RECVMMSG
+	free(listener->msgs);
+#endif
+#ifdef HAVE_IO_URING
+	uring_bufring_destroy(&listener->provided);
+	free(listener->batch_slots);
+#endif
+}
+
+#ifdef HAVE_IO_URING
+// Queue a multishot receive for a listener. It's submitted before the
+// loop next waits, along with anything else that was queued.
+static void udplistener_arm(udpserver_t *server, udplistener_t *listener) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+	if (sqe == NULL) {
+		uring_submit(&server->ring, 0);
+		sqe = uring_get_sqe(&server->ring);
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = listener->sd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = listener->index;
+	sqe->user_data = listener->index;
+}
+
+// Go back to reading a listener's socket when libev says it's readable
+static void udplistener_use_libev(udpserver_t *server, udplistener_t *listener) {
+	for (unsigned int i = 0; i < listener->batch_size; i++) {
+		listener->iovecs[i].iov_base = listener->buffers + (size_t) i * UDPSERVER_SLOT_SIZE;
+	}
+	ev_io_start(server->loop, listener->watcher);
+}
+
+static int udplistener_start_uring(udpserver_t *server, udplistener_t *listener) {
+	if (uring_bufring_init(&server->ring, &listener->provided, listener->index, listener->num_slots) != 0) {
+		stats_log("udplistener: io_uring buffer rings are not available (%s), reading fd %d with libev",
+			  strerror(errno), listener->sd);
+		return 1;
+	}
+	for (unsigned int i = 0; i < listener->num_slots; i++) {
+		uring_bufring_add(&listener->provided, listener->buffers + (size_t) i * UDPSERVER_SLOT_SIZE,
+				  UDPSERVER_MAX_DATAGRAM, i);
+	}
+	uring_bufring_publish(&listener->provided);
+	udplistener_arm(server, listener);
+	return 0;
+}
+
+// Hand the datagrams received so far to the callback, and their slots
+// back to the kernel
+static void udplistener_flush(udplistener_t *listener) {
+	if (listener->batch_len == 0) {
+		return;
+	}
+	listener->cb_recv(listener->sd, listener->data, listener->iovecs, listener->batch_len);
+	for (unsigned int i = 0; i < listener->batch_len; i++) {
+		const uint16_t slot = listener->batch_slots[i];
+		uring_bufring_add(&listener->provided, listener->buffers + (size_t) slot * UDPSERVER_SLOT_SIZE,
+				  UDPSERVER_MAX_DATAGRAM, slot);
+	}
+	uring_bufring_publish(&listener->provided);
+	listener->batch_len = 0;
+}
+
+// A receive stops once it ran out of slots or the completion queue
+// overflowed, and is armed again. Any other error means the kernel
+// can't do it on this socket.
+static void udplistener_rearm(udpserver_t *server, udplistener_t *listener, int res) {
+	if (res >= 0 || res == -ENOBUFS || res == -EINTR || res == -EAGAIN) {
+		udplistener_arm(server, listener);
+		return;
+	}
+	stats_error_log("udplistener: io_uring receive on fd %d failed (%s), reading it with libev",
+			listener->sd, strerror(-res));
+	udplistener_use_libev(server, listener);
+}
+
+static void udpserver_ring_callback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	udpserver_t *server = (udpserver_t *) watcher->data;
+	udplistener_t *current = NULL;
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = uring_peek_cqe(&server->ring)) != NULL) {
+		udplistener_t *listener = server->listeners[cqe->user_data];
+		const int res = cqe->res;
+		const unsigned int flags = cqe->flags;
+		uring_cqe_seen(&server->ring);
+
+		if (listener != current && current != NULL) {
+			udplistener_flush(current);
+		}
+		current = listener;
+		if (res >= 0 && (flags & IORING_CQE_F_BUFFER)) {
+			const uint16_t slot = flags >> IORING_CQE_BUFFER_SHIFT;
+			listener->iovecs[listener->batch_len].iov_base = listener->buffers + (size_t) slot * UDPSERVER_SLOT_SIZE;
+			listener->iovecs[listener->batch_len].iov_len = res;
+			listener->batch_slots[listener->batch_len] = slot;
+			if (++listener->batch_len == listener->batch_size) {
+				udplistener_flush(listener);
+			}
+		}
+		if (!(flags & IORING_CQE_F_MORE)) {
+			udplistener_rearm(server, listener, res);
+		}
+	}
+	if (current != NULL) {
+		udplistener_flush(current);
+	}
+}
+
+static void udpserver_submit_callback(struct ev_loop *loop, struct ev_prepare *watcher, int revents) {
+	udpserver_t *server = (udpserver_t *) watcher->data;
+	if (uring_pending(&server->ring) > 0 && uring_submit(&server->ring, 0) < 0) {
+		stats_error_log("udpserver: io_uring submission failed: %s", strerror(errno));
+	}
+}
+#endif
+
+// Start reading a listener that was just added to the server
+static void udpserver_start_listener(udpserver_t *server, udplistener_t *listener) {
+	server->listeners[server->listeners_len] = listener;
+#ifdef HAVE_IO_URING
+	listener->index = server->listeners_len;
+	server->listeners_len++;
+	if (server->use_uring && udplistener_start_uring(server, listener) == 0) {
+		return;
+	}
+#else
+	server->listeners_len++;
+#endif
+	ev_io_start(server->loop, listener->watcher);
+}
+
+static udplistener_t *udplistener_create(udpserver_t *server, struct addrinfo *addr, udpserver_recv_cb cb_recv) {
 	udplistener_t *listener;
 	char addr_string[INET6_ADDRSTRLEN];
 	void *ip;
@@ -69,7 +376,11 @@ static udplistener_t *udplistener_create(udpserver_t *server, struct addrinfo *a
 	int yes = 1;
 	int err;
 
-	listener = (udplistener_t *)malloc(sizeof(udplistener_t));
+	listener = (udplistener_t *)calloc(1, sizeof(udplistener_t));
+	if (listener == NULL) {
+		stats_log("udplistener: Unable to allocate listener");
+		return NULL;
+	}
 	listener->loop = server->loop;
 	listener->data = server->data;
 	listener->cb_recv = cb_recv;
@@ -106,6 +417,17 @@ static udplistener_t *udplistener_create(udpserver_t *server, struct addrinfo *a
 		return NULL;
 	}
 
+#ifdef SO_REUSEPORT
+	if (server->reuseport) {
+		err = setsockopt(listener->sd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+		if (err != 0) {
+			stats_log("udplistener: Error setting SO_REUSEPORT on %s[:%i]: %s", addr_string, port, strerror(errno));
+			free(listener);
+			return NULL;
+		}
+	}
+#endif
+
 	err = fcntl(listener->sd, F_SETFL, (fcntl(listener->sd, F_GETFL) | O_NONBLOCK));
 	if (err != 0) {
 		stats_log("udplistener: Error setting socket to non-blocking for %s[:%i]: %s", addr_string, port, strerror(errno));
@@ -120,11 +442,19 @@ static udplistener_t *udplistener_create(udpserver_t *server, struct addrinfo *a
 		return NULL;
 	}
 
+	if (udplistener_alloc_buffers(server, listener) != 0) {
+		stats_log("udplistener: Unable to allocate receive buffers for %s[:%i]", addr_string, port);
+		udplistener_free_buffers(listener);
+		free(listener);
+		return NULL;
+	}
+
 	listener->watcher = (struct ev_io *)malloc(sizeof(struct ev_io));
 	listener->watcher->data = (void *)listener;
 
 	ev_io_init(listener->watcher, udplistener_recv_callback, listener->sd, EV_READ);
-	stats_log("udpserver: Listening on frontend %s[:%i], fd = %d", addr_string, port, listener->sd);
+	stats_log("udpserver: Listening on frontend %s[:%i], fd = %d, batch size = %u",
+		  addr_string, port, listener->sd, listener->batch_size);
 
 	return listener;
 }
@@ -135,13 +465,70 @@ static void udplistener_destroy(udpserver_t *server, udplistener_t *listener) {
 		ev_io_stop(server->loop, listener->watcher);
 		free(listener->watcher);
 	}
+	if (listener->path != NULL) {
+		unixsock_close(listener->sd, listener->path);
+		free(listener->path);
+	}
+	udplistener_free_buffers(listener);
 	free(listener);
 }
 
+int udpserver_bind_unix(udpserver_t *server,
+			const char *path,
+			udpserver_recv_cb cb_recv) {
+	if (server->listeners_len >= MAX_UDP_HANDLERS) {
+		stats_log("udpserver: Unable to create more than %i UDP listeners", MAX_UDP_HANDLERS);
+		return 1;
+	}
+	udplistener_t *listener = calloc(1, sizeof(udplistener_t));
+	if (listener == NULL) {
+		stats_log("udplistener: Unable to allocate listener");
+		return 1;
+	}
+	listener->loop = server->loop;
+	listener->data = server->data;
+	listener->cb_recv = cb_recv;
+	listener->path = strdup(path);
+	if (listener->path == NULL) {
+		stats_log("udpserver: strdup(3) failed");
+		free(listener);
+		return 1;
+	}
+	listener->sd = unixsock_bind(path, SOCK_DGRAM, server->unix_mode);
+	if (listener->sd < 0) {
+		free(listener->path);
+		free(listener);
+		return 1;
+	}
+	listener->watcher = malloc(sizeof(struct ev_io));
+	if (listener->watcher == NULL ||
+	    udplistener_alloc_buffers(server, listener) != 0) {
+		stats_log("udplistener: Unable to allocate receive buffers for %s", path);
+		free(listener->watcher);
+		listener->watcher = NULL;
+		udplistener_destroy(server, listener);
+		return 1;
+	}
+	listener->watcher->data = (void *) listener;
+	ev_io_init(listener->watcher, udplistener_recv_callback, listener->sd, EV_READ);
+
+	// Local senders can outpace a single reader in bursts, so leave them
+	// more room than the default before they block
+	if (setsockopt(listener->sd, SOL_SOCKET, SO_RCVBUF,
+		       &server->unix_recv_buffer, sizeof(int)) != 0) {
+		stats_log("udplistener: Error setting SO_RCVBUF on %s: %s", path, strerror(errno));
+	}
+
+	stats_log("udpserver: Listening on frontend unixgram:%s, fd = %d, batch size = %u",
+		  path, listener->sd, listener->batch_size);
+	udpserver_start_listener(server, listener);
+	return 0;
+}
+
 
 int udpserver_bind(udpserver_t *server,
 		   const char *address_and_port,
-		   int (*cb_recv)(int, void *)) {
+		   udpserver_recv_cb cb_recv) {
 	udplistener_t *listener;
 	struct addrinfo hints;
 	struct addrinfo *addrs, *p;
@@ -185,9 +572,7 @@ int udpserver_bind(udpserver_t *server,
 		if (listener == NULL) {
 			continue;
 		}
-		server->listeners[server->listeners_len] = listener;
-		server->listeners_len++;
-		ev_io_start(server->loop, listener->watcher);
+		udpserver_start_listener(server, listener);
 	}
 
 	free(address);
@@ -199,6 +584,16 @@ int udpserver_bind(udpserver_t *server,
 void udpserver_destroy(udpserver_t *server) {
 	int i;
 
+#ifdef HAVE_IO_URING
+	// Closing the ring cancels the receives, which have to be gone
+	// before their buffers are freed
+	if (server->use_uring) {
+		ev_io_stop(server->loop, &server->ring_watcher);
+		ev_ref(server->loop);
+		ev_prepare_stop(server->loop, &server->submit_watcher);
+		uring_destroy(&server->ring);
+	}
+#endif
 	for (i = 0; i < server->listeners_len; i++) {
 		udplistener_destroy(server, server->listeners[i]);
 	}
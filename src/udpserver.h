@@ -4,15 +4,35 @@
 #include "config.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <ev.h>
 
+#include "yaml_config.h"
+
+#define UDPSERVER_MAX_DATAGRAM 65536
+
 typedef struct udpserver_t udpserver_t;
 
-udpserver_t *udpserver_create(struct ev_loop *loop, void *data);
+// The receive callback is handed every datagram read during a single
+// wakeup of the listener; each iovec points at one datagram and its
+// iov_len is the number of bytes received. The memory belongs to the
+// listener and is reused on the next wakeup. There is always one spare
+// byte after the end of each datagram which the callback may write to,
+// e.g. to newline terminate the last line in place.
+typedef int (*udpserver_recv_cb)(int, void *, struct iovec *, unsigned int);
+
+udpserver_t *udpserver_create(struct ev_loop *loop,
+			      struct proto_config *config,
+			      void *data);
 int udpserver_bind(udpserver_t *server,
 		   const char *address_and_port,
-		   int (*cb_recv)(int, void *));
+		   udpserver_recv_cb cb_recv);
+
+// Listen on a unix domain datagram socket at path
+int udpserver_bind_unix(udpserver_t *server,
+			const char *path,
+			udpserver_recv_cb cb_recv);
 void udpserver_destroy(udpserver_t *server);
 
 #endif
@@ -0,0 +1,60 @@
+#include "unixsock.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int unixsock_bind(const char *path, int type, mode_t mode) {
+	struct sockaddr_un addr;
+	struct stat st;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		stats_error_log("unixsock: path is too long: %s", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int sd = socket(AF_UNIX, type, 0);
+	if (sd < 0) {
+		stats_error_log("unixsock: Error creating socket %s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (fcntl(sd, F_SETFL, (fcntl(sd, F_GETFL) | O_NONBLOCK)) != 0) {
+		stats_error_log("unixsock: Error setting socket to non-blocking for %s: %s", path, strerror(errno));
+		goto err;
+	}
+
+	// Only ever remove a socket, never a file that happens to be there
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && unlink(path) != 0) {
+		stats_error_log("unixsock: Error removing old socket %s: %s", path, strerror(errno));
+		goto err;
+	}
+	if (bind(sd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		stats_error_log("unixsock: Error binding socket for %s: %s", path, strerror(errno));
+		goto err;
+	}
+	if (chmod(path, mode) != 0) {
+		stats_error_log("unixsock: Error setting the permissions of %s: %s", path, strerror(errno));
+		unlink(path);
+		goto err;
+	}
+	return sd;
+
+err:
+	close(sd);
+	return -1;
+}
+
+void unixsock_close(int sd, const char *path) {
+	close(sd);
+	if (unlink(path) != 0 && errno != ENOENT) {
+		stats_error_log("unixsock: Error removing socket %s: %s", path, strerror(errno));
+	}
+}
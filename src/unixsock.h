@@ -0,0 +1,16 @@
+// Listening on unix domain sockets, for clients on the same host
+
+#ifndef STATSRELAY_UNIXSOCK_H
+#define STATSRELAY_UNIXSOCK_H
+
+#include <sys/types.h>
+
+// Create a non-blocking socket of type (SOCK_STREAM or SOCK_DGRAM) bound
+// to path, with the permissions in mode. A socket left behind at path by
+// an earlier run is replaced. Returns the socket, or -1 on error.
+int unixsock_bind(const char *path, int type, mode_t mode);
+
+// Close a socket made by unixsock_bind and remove its path
+void unixsock_close(int sd, const char *path);
+
+#endif  // STATSRELAY_UNIXSOCK_H
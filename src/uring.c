@@ -0,0 +1,185 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+bool uring_supported(void) {
+	return true;
+}
+
+int uring_init(uring_t *ring, unsigned int sq_entries, unsigned int cq_entries) {
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(uring_t));
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = cq_entries;
+	ring->fd = syscall(__NR_io_uring_setup, sq_entries, &params);
+	if (ring->fd < 0) {
+		return 1;
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = 0;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		goto err;
+	}
+	if (ring->cq_ring_size == 0) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			goto err;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	char *sq = ring->sq_ring;
+	ring->sq_khead = (unsigned int *) (sq + params.sq_off.head);
+	ring->sq_ktail = (unsigned int *) (sq + params.sq_off.tail);
+	ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+	ring->sq_mask = *(unsigned int *) (sq + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_tail = *ring->sq_ktail;
+
+	char *cq = ring->cq_ring;
+	ring->cq_khead = (unsigned int *) (cq + params.cq_off.head);
+	ring->cq_ktail = (unsigned int *) (cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned int *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	return 0;
+
+err:
+	uring_destroy(ring);
+	return 1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+	const unsigned int head = __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE);
+	if (ring->sq_tail - head >= ring->sq_entries) {
+		return NULL;
+	}
+	const unsigned int index = ring->sq_tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	ring->sq_array[index] = index;
+	ring->sq_tail++;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+unsigned int uring_pending(const uring_t *ring) {
+	return ring->sq_tail - *ring->sq_ktail;
+}
+
+int uring_submit(uring_t *ring, unsigned int wait_nr) {
+	const unsigned int pending = uring_pending(ring);
+	__atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+	return syscall(__NR_io_uring_enter, ring->fd, pending, wait_nr,
+		       wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+	const unsigned int head = *ring->cq_khead;
+	if (head == __atomic_load_n(ring->cq_ktail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+	__atomic_store_n(ring->cq_khead, *ring->cq_khead + 1, __ATOMIC_RELEASE);
+}
+
+void uring_destroy(uring_t *ring) {
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring != NULL) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	memset(ring, 0, sizeof(uring_t));
+	ring->fd = -1;
+}
+
+int uring_bufring_init(uring_t *ring, uring_bufring_t *bufs, uint16_t group, unsigned int entries) {
+	struct io_uring_buf_reg reg;
+
+	bufs->entries = entries;
+	bufs->group = group;
+	bufs->tail = 0;
+	// the kernel wants the ring page aligned
+	bufs->ring_size = entries * sizeof(struct io_uring_buf);
+	bufs->ring = mmap(NULL, bufs->ring_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufs->ring == MAP_FAILED) {
+		bufs->ring = NULL;
+		return 1;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) bufs->ring;
+	reg.ring_entries = entries;
+	reg.bgid = group;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		const int register_errno = errno;
+		uring_bufring_destroy(bufs);
+		errno = register_errno;
+		return 1;
+	}
+	return 0;
+}
+
+void uring_bufring_add(uring_bufring_t *bufs, void *addr, unsigned int len, uint16_t id) {
+	struct io_uring_buf *buf = &bufs->ring->bufs[bufs->tail & (bufs->entries - 1)];
+	buf->addr = (uintptr_t) addr;
+	buf->len = len;
+	buf->bid = id;
+	bufs->tail++;
+}
+
+void uring_bufring_publish(uring_bufring_t *bufs) {
+	__atomic_store_n(&bufs->ring->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+void uring_bufring_destroy(uring_bufring_t *bufs) {
+	if (bufs->ring != NULL) {
+		munmap(bufs->ring, bufs->ring_size);
+		bufs->ring = NULL;
+	}
+}
+
+#else
+
+bool uring_supported(void) {
+	return false;
+}
+
+#endif  // HAVE_IO_URING
@@ -0,0 +1,104 @@
+// A minimal io_uring, set up with the raw system calls: a submission
+// and a completion queue shared with the kernel, and rings of provided
+// buffers that the kernel picks receive buffers from. A ring is only
+// ever used by one thread at a time.
+
+#ifndef STATSRELAY_URING_H
+#define STATSRELAY_URING_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#elif defined(__has_include)
+// Built outside of autotools, e.g. a test on its own
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_LINUX_IO_URING_H 1
+#endif
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+// multishot receives, and with them provided buffer rings, came with
+// the Linux 6.0 headers
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+// Whether statsrelay was built with io_uring support
+bool uring_supported(void);
+
+#ifdef HAVE_IO_URING
+
+typedef struct uring {
+	int fd;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;			// the same mapping as sq_ring on newer kernels
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_khead;
+	unsigned int *sq_ktail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_tail;		// queued, not necessarily submitted yet
+
+	unsigned int *cq_khead;
+	unsigned int *cq_ktail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+} uring_t;
+
+typedef struct uring_bufring {
+	struct io_uring_buf_ring *ring;
+	size_t ring_size;
+	unsigned int entries;		// a power of two
+	uint16_t group;
+	uint16_t tail;			// added, not necessarily published yet
+} uring_bufring_t;
+
+// Room for cq_entries completions is made. Returns non-zero, with errno
+// set, if the kernel doesn't support io_uring (or it's disabled).
+int uring_init(uring_t *ring, unsigned int sq_entries, unsigned int cq_entries);
+
+// A cleared submission queue entry, or NULL if the queue is full
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+// Entries queued since the last uring_submit
+unsigned int uring_pending(const uring_t *ring);
+
+// Hand the queued entries to the kernel with a single system call, and
+// wait for at least wait_nr completions. Returns the number of entries
+// submitted, or -1 with errno set.
+int uring_submit(uring_t *ring, unsigned int wait_nr);
+
+// The oldest completion, or NULL if there is none. It stays valid until
+// uring_cqe_seen.
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+void uring_cqe_seen(uring_t *ring);
+
+void uring_destroy(uring_t *ring);
+
+// Register a ring of entries (a power of two) buffers as buffer group
+// group. Returns non-zero, with errno set, if that failed.
+int uring_bufring_init(uring_t *ring, uring_bufring_t *bufs, uint16_t group, unsigned int entries);
+
+// Give a buffer to the kernel. It isn't picked until the next
+// uring_bufring_publish.
+void uring_bufring_add(uring_bufring_t *bufs, void *addr, unsigned int len, uint16_t id);
+
+void uring_bufring_publish(uring_bufring_t *bufs);
+
+// Only once the ring it was registered with has been destroyed
+void uring_bufring_destroy(uring_bufring_t *bufs);
+
+#endif  // HAVE_IO_URING
+
+#endif  // STATSRELAY_URING_H
@@ -2,112 +2,173 @@
 
 #include "log.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
-static char *valid_stat_types[6] = {
-	"c",
-	"ms",
-	"kv",
-	"g",
-	"h",
-	"s"
+// Powers of ten that are exactly representable as a double
+static const double powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
 };
-static size_t valid_stat_types_len = 6;
+#define MAX_EXACT_POWER 22
 
-
-int validate_statsd(const char *line, size_t len) {
-	size_t plen;
-	char c;
-	int i, valid;
-
-	// FIXME: this is dumb, don't do a memory copy
-	char *line_copy = strndup(line, len);
-	char *start, *end;
-	char *err;
-
-	start = line_copy;
-	plen = len;
-	end = memchr(start, ':', plen);
-	if (end == NULL) {
-		stats_log("validate: Invalid line \"%.*s\" missing ':'", len, line);
-		goto statsd_err;
+static double scale_by_power_of_ten(double value, int exponent) {
+	while (exponent > MAX_EXACT_POWER) {
+		value *= powers_of_ten[MAX_EXACT_POWER];
+		exponent -= MAX_EXACT_POWER;
 	}
-
-	if ((end - start) < 1) {
-		stats_log("validate: Invalid line \"%.*s\" zero length key", len, line);
-		goto statsd_err;
+	while (exponent < -MAX_EXACT_POWER) {
+		value /= powers_of_ten[MAX_EXACT_POWER];
+		exponent += MAX_EXACT_POWER;
 	}
-
-	start = end + 1;
-	plen = len - (start - line_copy);
-
-	c = end[0];
-	end[0] = '\0';
-	if ((strtod(start, &err) == 0.0) && (err == start)) {
-		stats_log("validate: Invalid line \"%.*s\" unable to parse value as double", len, line);
-		goto statsd_err;
+	if (exponent >= 0) {
+		return value * powers_of_ten[exponent];
 	}
-	end[0] = c;
+	return value / powers_of_ten[-exponent];
+}
 
-	end = memchr(start, '|', plen);
-	if (end == NULL) {
-		stats_log("validate: Invalid line \"%.*s\" missing '|'", len, line);
-		goto statsd_err;
+// Parse a decimal number (an optional sign, digits with an optional
+// fraction, and an optional exponent) starting at p and ending no later
+// than end. The buffer doesn't need to be NUL terminated. Returns a
+// pointer to the first byte after the number, or NULL if there is no
+// number at p.
+static const char *parse_number(const char *p, const char *end, double *value) {
+	uint64_t mantissa = 0;
+	int exponent = 0;
+	int digits = 0;
+	bool negative = false;
+
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		p++;
+	}
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+		if (mantissa < UINT64_MAX / 10 - 10) {
+			mantissa = mantissa * 10 + (*p - '0');
+		} else {
+			exponent++;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+			if (mantissa < UINT64_MAX / 10 - 10) {
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
+			}
+		}
+	}
+	if (digits == 0) {
+		return NULL;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		bool negative_exponent = false;
+		int explicit_exponent = 0;
+		if (q < end && (*q == '-' || *q == '+')) {
+			negative_exponent = (*q == '-');
+			q++;
+		}
+		if (q == end || *q < '0' || *q > '9') {
+			return NULL;
+		}
+		for (; q < end && *q >= '0' && *q <= '9'; q++) {
+			if (explicit_exponent < 10000) {
+				explicit_exponent = explicit_exponent * 10 + (*q - '0');
+			}
+		}
+		exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+		p = q;
 	}
 
-	start = end + 1;
-	plen = len - (start - line_copy);
-
-	end = memchr(start, '|', plen);
-	if (end != NULL) {
-		c = end[0];
-		end[0] = '\0';
-		plen = end - start;
+	*value = scale_by_power_of_ten((double) mantissa, exponent);
+	if (negative) {
+		*value = -*value;
 	}
+	return p;
+}
 
-	valid = 0;
-	for (i = 0; i < valid_stat_types_len; i++) {
-		if (strlen(valid_stat_types[i]) != plen) {
-			continue;
+// Check the stat type, i.e. one of c, ms, kv, g, h or s.
+static bool valid_stat_type(const char *type, size_t len) {
+	switch (len) {
+	case 1:
+		switch (type[0]) {
+		case 'c':
+		case 'g':
+		case 'h':
+		case 's':
+			return true;
 		}
-		if (strncmp(start, valid_stat_types[i], plen) == 0) {
-			valid = 1;
-			break;
+		return false;
+	case 2:
+		switch (type[0]) {
+		case 'm':
+			return type[1] == 's';
+		case 'k':
+			return type[1] == 'v';
 		}
+		return false;
 	}
+	return false;
+}
 
-	if (valid == 0) {
-		stats_log("validate: Invalid line \"%.*s\" unknown stat type \"%.*s\"", len, line, plen, start);
-		goto statsd_err;
+// Validate a line of the form <key>:<value>|<type>[|@<sample rate>]
+// in a single pass over the line, without copying it.
+int validate_statsd(const char *line, size_t len) {
+	const char *end = line + len;
+	const char *p, *type;
+	double value, sample_rate;
+
+	// <key>:
+	p = memchr(line, ':', len);
+	if (p == NULL) {
+		stats_log("validate: Invalid line \"%.*s\" missing ':'", (int) len, line);
+		return 1;
+	}
+	if (p == line) {
+		stats_log("validate: Invalid line \"%.*s\" zero length key", (int) len, line);
+		return 1;
 	}
 
-	if (end != NULL) {
-		end[0] = c;
-		// end[0] is currently the second | char
-		// test if we have at least 1 char following it (@)
-		if ((len - (end - line_copy) > 1) && (end[1] == '@')) {
-			start = end + 2;
-			plen = len - (start - line_copy);
-			if (plen == 0) {
-				stats_log("validate: Invalid line \"%.*s\" @ sample with no rate", len, line);
-				goto statsd_err;
-			}
-			if ((strtod(start, &err) == 0.0) && err == start) {
-				stats_log("validate: Invalid line \"%.*s\" invalid sample rate", len, line);
-				goto statsd_err;
-			}
-		} else {
-			stats_log("validate: Invalid line \"%.*s\" no @ sample rate specifier", len, line);
-			goto statsd_err;
-		}
+	// <value>|
+	p = parse_number(p + 1, end, &value);
+	if (p == NULL) {
+		stats_log("validate: Invalid line \"%.*s\" unable to parse value as double", (int) len, line);
+		return 1;
+	}
+	if (p == end || *p != '|') {
+		stats_log("validate: Invalid line \"%.*s\" missing '|'", (int) len, line);
+		return 1;
 	}
 
-	free(line_copy);
-	return 0;
+	// <type>
+	type = ++p;
+	while (p < end && *p != '|') {
+		p++;
+	}
+	if (!valid_stat_type(type, p - type)) {
+		stats_log("validate: Invalid line \"%.*s\" unknown stat type \"%.*s\"", (int) len, line, (int) (p - type), type);
+		return 1;
+	}
+	if (p == end) {
+		return 0;
+	}
 
-statsd_err:
-	free(line_copy);
-	return 1;
+	// |@<sample rate>, which may be followed by further sections
+	if (end - p < 2 || p[1] != '@') {
+		stats_log("validate: Invalid line \"%.*s\" no @ sample rate specifier", (int) len, line);
+		return 1;
+	}
+	if (end - p == 2) {
+		stats_log("validate: Invalid line \"%.*s\" @ sample with no rate", (int) len, line);
+		return 1;
+	}
+	p = parse_number(p + 2, end, &sample_rate);
+	if (p == NULL || (p != end && *p != '|')) {
+		stats_log("validate: Invalid line \"%.*s\" invalid sample rate", (int) len, line);
+		return 1;
+	}
+	return 0;
 }
 
 int validate_carbon(const char *line, size_t len) {
@@ -126,8 +187,12 @@ int validate_carbon(const char *line, size_t len) {
 			break;
 		}
 	}
-	if (spaces_found != 2) {
-		stats_log("validate: found %d spaces in invalid carbon line", spaces_found);
+	return validate_carbon_spaces(line, len, spaces_found);
+}
+
+int validate_carbon_spaces(const char *line, size_t len, unsigned int spaces) {
+	if (spaces != 2) {
+		stats_log("validate: found %u spaces in invalid carbon line", spaces);
 		return 1;
 	}
 	return 0;
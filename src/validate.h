@@ -8,4 +8,7 @@ typedef int (*validate_line_validator_t)(const char *, size_t);
 int validate_statsd(const char *, size_t);
 int validate_carbon(const char *, size_t);
 
+// Validate a carbon line whose spaces have already been counted
+int validate_carbon_spaces(const char *, size_t, unsigned int spaces);
+
 #endif  // STATSRELAY_VALIDATE_H
@@ -14,6 +14,12 @@ static bool convert_number(const char *str, long *num) {
 	return endptr != str;
 }
 
+static bool convert_octal(const char *str, long *num) {
+	char *endptr;
+	*num = strtol(str, &endptr, 8);
+	return endptr != str && *endptr == '\0';
+}
+
 static bool set_boolean(const char *strval, bool *bool_val) {
 	if (strcmp(strval, "true") == 0) {
 		*bool_val = true;
@@ -30,10 +36,42 @@ static bool set_boolean(const char *strval, bool *bool_val) {
 static void init_proto_config(struct proto_config *protoc) {
 	protoc->initialized = false;
 	protoc->bind = NULL;
+	protoc->admin_bind = NULL;
 	protoc->enable_validation = true;
 	protoc->enable_tcp_cork = true;
 	protoc->always_resolve_dns = false;
+	protoc->dns_cache_ttl = 30;
+	protoc->backoff_min_ms = 1000;
+	protoc->backoff_max_ms = 30000;
+	protoc->max_client_connections = 0;
+	protoc->client_idle_timeout_ms = 0;
+	protoc->listen_backlog = 128;
+	protoc->tcp_defer_accept_ms = 0;
+	protoc->unix_socket_mode = 0660;
+	protoc->unix_recv_buffer = 8388608;
 	protoc->max_send_queue = 134217728;
+	protoc->overflow_policy = OVERFLOW_DROP;
+	protoc->udp_batch_size = 1;
+	protoc->io_engine = IO_ENGINE_LIBEV;
+	protoc->workers = 1;
+	protoc->egress_threads = 0;
+	protoc->connections = 1;
+	protoc->udp_max_payload = 1432;
+	protoc->udp_flush_interval_ms = 10;
+	protoc->aggregate_interval_ms = 0;
+	protoc->ring_algorithm = RING_MODULO;
+	protoc->failover = FAILOVER_NONE;
+	protoc->health_check_interval_ms = 1000;
+	protoc->health_max_failures = 3;
+	protoc->health_max_queue = 16777216;
+	protoc->health_probe = false;
+	protoc->self_metrics_interval_ms = 0;
+	protoc->self_metrics_prefix = strdup("statsrelay");
+	protoc->self_metrics_hostname = NULL;
+	protoc->spool_dir = NULL;
+	protoc->spool_high_watermark = 16777216;
+	protoc->spool_max_bytes = 1073741824;
+	protoc->spool_replay_rate = 4194304;
 	protoc->ring = statsrelay_list_new();
 }
 
@@ -73,7 +111,39 @@ struct config* parse_config(FILE *input) {
 	bool keep_going = true;
 	bool is_key = false;
 	bool update_bind = false;
+	bool update_admin_bind = false;
 	bool update_send_queue = false;
+	bool update_overflow_policy = false;
+	bool update_io_engine = false;
+	bool update_udp_batch_size = false;
+	bool update_workers = false;
+	bool update_egress_threads = false;
+	bool update_connections = false;
+	bool update_udp_max_payload = false;
+	bool update_udp_flush_interval = false;
+	bool update_aggregate_interval = false;
+	bool update_ring_algorithm = false;
+	bool update_failover = false;
+	bool update_health_check_interval = false;
+	bool update_health_max_failures = false;
+	bool update_health_max_queue = false;
+	bool update_health_probe = false;
+	bool update_self_metrics_interval = false;
+	bool update_self_metrics_prefix = false;
+	bool update_self_metrics_hostname = false;
+	bool update_dns_cache_ttl = false;
+	bool update_backoff_min = false;
+	bool update_backoff_max = false;
+	bool update_max_client_connections = false;
+	bool update_client_idle_timeout = false;
+	bool update_listen_backlog = false;
+	bool update_tcp_defer_accept = false;
+	bool update_unix_socket_mode = false;
+	bool update_unix_recv_buffer = false;
+	bool update_spool_dir = false;
+	bool update_spool_high_watermark = false;
+	bool update_spool_max_bytes = false;
+	bool update_spool_replay_rate = false;
 	bool update_validate = false;
 	bool update_tcp_cork = false;
 	bool always_resolve_dns = false;
@@ -139,8 +209,76 @@ struct config* parse_config(FILE *input) {
 				if (is_key) {
 					if (strcmp(strval, "bind") == 0) {
 						update_bind = true;
+					} else if (strcmp(strval, "admin_bind") == 0) {
+						update_admin_bind = true;
 					} else if (strcmp(strval, "max_send_queue") == 0) {
 						update_send_queue = true;
+					} else if (strcmp(strval, "overflow_policy") == 0) {
+						update_overflow_policy = true;
+					} else if (strcmp(strval, "io_engine") == 0) {
+						update_io_engine = true;
+					} else if (strcmp(strval, "udp_batch_size") == 0) {
+						update_udp_batch_size = true;
+					} else if (strcmp(strval, "workers") == 0) {
+						update_workers = true;
+					} else if (strcmp(strval, "egress_threads") == 0) {
+						update_egress_threads = true;
+					} else if (strcmp(strval, "connections") == 0) {
+						update_connections = true;
+					} else if (strcmp(strval, "udp_max_payload") == 0) {
+						update_udp_max_payload = true;
+					} else if (strcmp(strval, "udp_flush_interval_ms") == 0) {
+						update_udp_flush_interval = true;
+					} else if (strcmp(strval, "aggregate_interval_ms") == 0) {
+						if (protoc != &config->statsd_config) {
+							stats_error_log("aggregate_interval_ms is only supported for statsd");
+							goto parse_err;
+						}
+						update_aggregate_interval = true;
+					} else if (strcmp(strval, "ring_algorithm") == 0) {
+						update_ring_algorithm = true;
+					} else if (strcmp(strval, "failover") == 0) {
+						update_failover = true;
+					} else if (strcmp(strval, "health_check_interval_ms") == 0) {
+						update_health_check_interval = true;
+					} else if (strcmp(strval, "health_max_failures") == 0) {
+						update_health_max_failures = true;
+					} else if (strcmp(strval, "health_max_queue") == 0) {
+						update_health_max_queue = true;
+					} else if (strcmp(strval, "health_probe") == 0) {
+						update_health_probe = true;
+					} else if (strcmp(strval, "self_metrics_interval_ms") == 0) {
+						update_self_metrics_interval = true;
+					} else if (strcmp(strval, "self_metrics_prefix") == 0) {
+						update_self_metrics_prefix = true;
+					} else if (strcmp(strval, "self_metrics_hostname") == 0) {
+						update_self_metrics_hostname = true;
+					} else if (strcmp(strval, "dns_cache_ttl") == 0) {
+						update_dns_cache_ttl = true;
+					} else if (strcmp(strval, "backoff_min_ms") == 0) {
+						update_backoff_min = true;
+					} else if (strcmp(strval, "backoff_max_ms") == 0) {
+						update_backoff_max = true;
+					} else if (strcmp(strval, "max_client_connections") == 0) {
+						update_max_client_connections = true;
+					} else if (strcmp(strval, "client_idle_timeout_ms") == 0) {
+						update_client_idle_timeout = true;
+					} else if (strcmp(strval, "listen_backlog") == 0) {
+						update_listen_backlog = true;
+					} else if (strcmp(strval, "tcp_defer_accept_ms") == 0) {
+						update_tcp_defer_accept = true;
+					} else if (strcmp(strval, "unix_socket_mode") == 0) {
+						update_unix_socket_mode = true;
+					} else if (strcmp(strval, "unix_recv_buffer") == 0) {
+						update_unix_recv_buffer = true;
+					} else if (strcmp(strval, "spool_dir") == 0) {
+						update_spool_dir = true;
+					} else if (strcmp(strval, "spool_high_watermark") == 0) {
+						update_spool_high_watermark = true;
+					} else if (strcmp(strval, "spool_max_bytes") == 0) {
+						update_spool_max_bytes = true;
+					} else if (strcmp(strval, "spool_replay_rate") == 0) {
+						update_spool_replay_rate = true;
 					} else if (strcmp(strval, "shard_map") == 0) {
 						shard_count = -1;
 						expect_shard_map = true;
@@ -156,12 +294,283 @@ struct config* parse_config(FILE *input) {
 						free(protoc->bind);
 						protoc->bind = strdup(strval);
 						update_bind = false;
+					} else if (update_admin_bind) {
+						free(protoc->admin_bind);
+						protoc->admin_bind = strdup(strval);
+						update_admin_bind = false;
 					} else if (update_send_queue) {
 						if (!convert_number(strval, &numval)) {
 							stats_error_log("max_send_queue was not a number: %s", strval);
 						}
 						protoc->max_send_queue = numval;
 						update_send_queue = false;
+					} else if (update_udp_batch_size) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 1 || numval > MAX_UDP_BATCH_SIZE) {
+							stats_error_log("udp_batch_size must be a number between 1 and %d: %s",
+									MAX_UDP_BATCH_SIZE, strval);
+							goto parse_err;
+						}
+						protoc->udp_batch_size = numval;
+						update_udp_batch_size = false;
+					} else if (update_workers) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 1 || numval > MAX_WORKERS) {
+							stats_error_log("workers must be a number between 1 and %d: %s",
+									MAX_WORKERS, strval);
+							goto parse_err;
+						}
+						protoc->workers = numval;
+						update_workers = false;
+					} else if (update_egress_threads) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 0 || numval > MAX_EGRESS_THREADS) {
+							stats_error_log("egress_threads must be a number between 0 and %d: %s",
+									MAX_EGRESS_THREADS, strval);
+							goto parse_err;
+						}
+						protoc->egress_threads = numval;
+						update_egress_threads = false;
+					} else if (update_connections) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 1 || numval > MAX_CONNECTIONS) {
+							stats_error_log("connections must be a number between 1 and %d: %s",
+									MAX_CONNECTIONS, strval);
+							goto parse_err;
+						}
+						protoc->connections = numval;
+						update_connections = false;
+					} else if (update_udp_max_payload) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 1 || numval > MAX_UDP_PAYLOAD) {
+							stats_error_log("udp_max_payload must be a number between 1 and %d: %s",
+									MAX_UDP_PAYLOAD, strval);
+							goto parse_err;
+						}
+						protoc->udp_max_payload = numval;
+						update_udp_max_payload = false;
+					} else if (update_udp_flush_interval) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 0 || numval > MAX_UDP_FLUSH_INTERVAL) {
+							stats_error_log("udp_flush_interval_ms must be a number between 0 and %d: %s",
+									MAX_UDP_FLUSH_INTERVAL, strval);
+							goto parse_err;
+						}
+						protoc->udp_flush_interval_ms = numval;
+						update_udp_flush_interval = false;
+					} else if (update_aggregate_interval) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 0 || numval > MAX_AGGREGATE_INTERVAL) {
+							stats_error_log("aggregate_interval_ms must be a number between 0 and %d: %s",
+									MAX_AGGREGATE_INTERVAL, strval);
+							goto parse_err;
+						}
+						protoc->aggregate_interval_ms = numval;
+						update_aggregate_interval = false;
+					} else if (update_ring_algorithm) {
+						if (strcmp(strval, "modulo") == 0) {
+							protoc->ring_algorithm = RING_MODULO;
+	protoc->failover = FAILOVER_NONE;
+	protoc->health_check_interval_ms = 1000;
+	protoc->health_max_failures = 3;
+	protoc->health_max_queue = 16777216;
+	protoc->health_probe = false;
+						} else if (strcmp(strval, "jump") == 0) {
+							protoc->ring_algorithm = RING_JUMP;
+						} else if (strcmp(strval, "ketama") == 0) {
+							protoc->ring_algorithm = RING_KETAMA;
+						} else {
+							stats_error_log("unexpected value \"%s\" for ring_algorithm, "
+									"must be modulo/jump/ketama", strval);
+							goto parse_err;
+						}
+						update_ring_algorithm = false;
+					} else if (update_overflow_policy) {
+						if (strcmp(strval, "drop") == 0) {
+							protoc->overflow_policy = OVERFLOW_DROP;
+						} else if (strcmp(strval, "backpressure") == 0) {
+							protoc->overflow_policy = OVERFLOW_BACKPRESSURE;
+						} else {
+							stats_error_log("unexpected value \"%s\" for overflow_policy, "
+									"must be drop/backpressure", strval);
+							goto parse_err;
+						}
+						update_overflow_policy = false;
+					} else if (update_io_engine) {
+						if (strcmp(strval, "libev") == 0) {
+							protoc->io_engine = IO_ENGINE_LIBEV;
+						} else if (strcmp(strval, "io_uring") == 0) {
+							protoc->io_engine = IO_ENGINE_IO_URING;
+						} else {
+							stats_error_log("unexpected value \"%s\" for io_engine, "
+									"must be libev/io_uring", strval);
+							goto parse_err;
+						}
+						update_io_engine = false;
+					} else if (update_failover) {
+						if (strcmp(strval, "none") == 0) {
+							protoc->failover = FAILOVER_NONE;
+						} else if (strcmp(strval, "next") == 0) {
+							protoc->failover = FAILOVER_NEXT;
+						} else {
+							stats_error_log("unexpected value \"%s\" for failover, "
+									"must be none/next", strval);
+							goto parse_err;
+						}
+						update_failover = false;
+					} else if (update_health_check_interval) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 1 || numval > MAX_HEALTH_CHECK_INTERVAL) {
+							stats_error_log("health_check_interval_ms must be a number between 1 and %d: %s",
+									MAX_HEALTH_CHECK_INTERVAL, strval);
+							goto parse_err;
+						}
+						protoc->health_check_interval_ms = numval;
+						update_health_check_interval = false;
+					} else if (update_health_max_failures) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 1 || numval > MAX_HEALTH_FAILURES) {
+							stats_error_log("health_max_failures must be a number between 1 and %d: %s",
+									MAX_HEALTH_FAILURES, strval);
+							goto parse_err;
+						}
+						protoc->health_max_failures = numval;
+						update_health_max_failures = false;
+					} else if (update_health_max_queue) {
+						if (!convert_number(strval, &numval) || numval < 1) {
+							stats_error_log("health_max_queue must be a positive number: %s", strval);
+							goto parse_err;
+						}
+						protoc->health_max_queue = numval;
+						update_health_max_queue = false;
+					} else if (update_health_probe) {
+						if (!set_boolean(strval, &protoc->health_probe)) {
+							goto parse_err;
+						}
+						update_health_probe = false;
+					} else if (update_self_metrics_interval) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 0 || numval > MAX_SELF_METRICS_INTERVAL) {
+							stats_error_log("self_metrics_interval_ms must be a number between 0 and %d: %s",
+									MAX_SELF_METRICS_INTERVAL, strval);
+							goto parse_err;
+						}
+						protoc->self_metrics_interval_ms = numval;
+						update_self_metrics_interval = false;
+					} else if (update_self_metrics_prefix) {
+						free(protoc->self_metrics_prefix);
+						protoc->self_metrics_prefix = strdup(strval);
+						update_self_metrics_prefix = false;
+					} else if (update_self_metrics_hostname) {
+						free(protoc->self_metrics_hostname);
+						protoc->self_metrics_hostname = strdup(strval);
+						update_self_metrics_hostname = false;
+					} else if (update_dns_cache_ttl) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 0 || numval > MAX_DNS_CACHE_TTL) {
+							stats_error_log("dns_cache_ttl must be a number between 0 and %d: %s",
+									MAX_DNS_CACHE_TTL, strval);
+							goto parse_err;
+						}
+						protoc->dns_cache_ttl = numval;
+						update_dns_cache_ttl = false;
+					} else if (update_backoff_min) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 1 || numval > MAX_BACKOFF) {
+							stats_error_log("backoff_min_ms must be a number between 1 and %d: %s",
+									MAX_BACKOFF, strval);
+							goto parse_err;
+						}
+						protoc->backoff_min_ms = numval;
+						update_backoff_min = false;
+					} else if (update_backoff_max) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 1 || numval > MAX_BACKOFF) {
+							stats_error_log("backoff_max_ms must be a number between 1 and %d: %s",
+									MAX_BACKOFF, strval);
+							goto parse_err;
+						}
+						protoc->backoff_max_ms = numval;
+						update_backoff_max = false;
+					} else if (update_max_client_connections) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 0 || numval > MAX_CLIENT_CONNECTIONS) {
+							stats_error_log("max_client_connections must be a number between 0 and %d: %s",
+									MAX_CLIENT_CONNECTIONS, strval);
+							goto parse_err;
+						}
+						protoc->max_client_connections = numval;
+						update_max_client_connections = false;
+					} else if (update_client_idle_timeout) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 0 || numval > MAX_CLIENT_IDLE_TIMEOUT) {
+							stats_error_log("client_idle_timeout_ms must be a number between 0 and %d: %s",
+									MAX_CLIENT_IDLE_TIMEOUT, strval);
+							goto parse_err;
+						}
+						protoc->client_idle_timeout_ms = numval;
+						update_client_idle_timeout = false;
+					} else if (update_listen_backlog) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 1 || numval > MAX_LISTEN_BACKLOG) {
+							stats_error_log("listen_backlog must be a number between 1 and %d: %s",
+									MAX_LISTEN_BACKLOG, strval);
+							goto parse_err;
+						}
+						protoc->listen_backlog = numval;
+						update_listen_backlog = false;
+					} else if (update_tcp_defer_accept) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 0 || numval > MAX_DEFER_ACCEPT) {
+							stats_error_log("tcp_defer_accept_ms must be a number between 0 and %d: %s",
+									MAX_DEFER_ACCEPT, strval);
+							goto parse_err;
+						}
+						protoc->tcp_defer_accept_ms = numval;
+						update_tcp_defer_accept = false;
+					} else if (update_unix_socket_mode) {
+						if (!convert_octal(strval, &numval) ||
+						    numval < 0 || numval > 0777) {
+							stats_error_log("unix_socket_mode must be an octal mode between 0 and 0777: %s",
+									strval);
+							goto parse_err;
+						}
+						protoc->unix_socket_mode = numval;
+						update_unix_socket_mode = false;
+					} else if (update_unix_recv_buffer) {
+						if (!convert_number(strval, &numval) ||
+						    numval < 4096 || numval > MAX_UNIX_RECV_BUFFER) {
+							stats_error_log("unix_recv_buffer must be a number between 4096 and %d: %s",
+									MAX_UNIX_RECV_BUFFER, strval);
+							goto parse_err;
+						}
+						protoc->unix_recv_buffer = numval;
+						update_unix_recv_buffer = false;
+					} else if (update_spool_dir) {
+						free(protoc->spool_dir);
+						protoc->spool_dir = strdup(strval);
+						update_spool_dir = false;
+					} else if (update_spool_high_watermark) {
+						if (!convert_number(strval, &numval) || numval < 1) {
+							stats_error_log("spool_high_watermark must be a positive number: %s", strval);
+							goto parse_err;
+						}
+						protoc->spool_high_watermark = numval;
+						update_spool_high_watermark = false;
+					} else if (update_spool_max_bytes) {
+						if (!convert_number(strval, &numval) || numval < 1) {
+							stats_error_log("spool_max_bytes must be a positive number: %s", strval);
+							goto parse_err;
+						}
+						protoc->spool_max_bytes = numval;
+						update_spool_max_bytes = false;
+					} else if (update_spool_replay_rate) {
+						if (!convert_number(strval, &numval) || numval < 1) {
+							stats_error_log("spool_replay_rate must be a positive number: %s", strval);
+							goto parse_err;
+						}
+						protoc->spool_replay_rate = numval;
+						update_spool_replay_rate = false;
 					} else if (update_validate) {
 						if (!set_boolean(strval, &protoc->enable_validation)) {
 							goto parse_err;
@@ -229,8 +638,16 @@ void destroy_config(struct config *config) {
 	if (config != NULL) {
 		statsrelay_list_destroy_full(config->carbon_config.ring);
 		free(config->carbon_config.bind);
+		free(config->carbon_config.admin_bind);
+		free(config->carbon_config.spool_dir);
+		free(config->carbon_config.self_metrics_prefix);
+		free(config->carbon_config.self_metrics_hostname);
 		statsrelay_list_destroy_full(config->statsd_config.ring);
 		free(config->statsd_config.bind);
+		free(config->statsd_config.admin_bind);
+		free(config->statsd_config.spool_dir);
+		free(config->statsd_config.self_metrics_prefix);
+		free(config->statsd_config.self_metrics_hostname);
 		free(config);
 	}
 }
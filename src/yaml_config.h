@@ -7,13 +7,88 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#define MAX_UDP_BATCH_SIZE 1024
+#define MAX_WORKERS 256
+#define MAX_EGRESS_THREADS 64
+#define MAX_CONNECTIONS 64
+#define MAX_UDP_PAYLOAD 65507
+#define MAX_UDP_FLUSH_INTERVAL 1000
+#define MAX_DNS_CACHE_TTL 86400
+#define MAX_BACKOFF 3600000
+#define MAX_CLIENT_CONNECTIONS 1000000
+#define MAX_CLIENT_IDLE_TIMEOUT 86400000
+#define MAX_LISTEN_BACKLOG 65535
+#define MAX_DEFER_ACCEPT 600000
+#define MAX_UNIX_RECV_BUFFER 268435456
+#define MAX_AGGREGATE_INTERVAL 60000
+#define MAX_SELF_METRICS_INTERVAL 3600000
+#define MAX_HEALTH_CHECK_INTERVAL 60000
+#define MAX_HEALTH_FAILURES 1000
+
+// How a key's hash is mapped to a shard
+enum ring_algorithm {
+	RING_MODULO = 0,	// hash % number of shards
+	RING_JUMP,		// Jump Consistent Hash
+	RING_KETAMA		// weighted continuum, like libketama
+};
+
+// What happens to a TCP client's lines for a backend whose queue is full
+enum overflow_policy {
+	OVERFLOW_DROP = 0,	// they're dropped, and the client disconnected
+	OVERFLOW_BACKPRESSURE	// the client isn't read from until there's room
+};
+
+// How the UDP listeners are read
+enum io_engine {
+	IO_ENGINE_LIBEV = 0,	// readiness from libev, then recvmmsg(2)
+	IO_ENGINE_IO_URING	// multishot receives on an io_uring
+};
+
+// What happens to the shards of a backend that is down
+enum failover_policy {
+	FAILOVER_NONE = 0,	// lines are still queued for it
+	FAILOVER_NEXT		// the next shard whose backend is up takes them
+};
+
 struct proto_config {
 	bool initialized;
 	char *bind;
+	char *admin_bind;		// NULL disables the HTTP stats listener
 	bool enable_validation;
 	bool enable_tcp_cork;
 	bool always_resolve_dns;
+	unsigned int dns_cache_ttl;	// seconds
+	unsigned int backoff_min_ms;	// longest wait before the first reconnect
+	unsigned int backoff_max_ms;	// longest wait before any reconnect
+	unsigned int max_client_connections;	// per listener, 0 for no limit
+	unsigned int client_idle_timeout_ms;	// 0 keeps idle clients connected
+	unsigned int listen_backlog;
+	unsigned int tcp_defer_accept_ms;	// 0 accepts clients before they send
+	unsigned int unix_socket_mode;	// permissions of unix: and unixgram: sockets
+	unsigned int unix_recv_buffer;	// SO_RCVBUF of unixgram: sockets
 	uint64_t max_send_queue;
+	enum overflow_policy overflow_policy;
+	unsigned int udp_batch_size;
+	enum io_engine io_engine;
+	unsigned int workers;
+	unsigned int egress_threads;	// per worker, 0 sends from the worker itself
+	unsigned int connections;	// to each backend, from each worker
+	unsigned int udp_max_payload;
+	unsigned int udp_flush_interval_ms;
+	unsigned int aggregate_interval_ms;	// 0 disables aggregation
+	enum ring_algorithm ring_algorithm;
+	enum failover_policy failover;
+	unsigned int health_check_interval_ms;
+	unsigned int health_max_failures;	// connect failures before a backend is down
+	uint64_t health_max_queue;	// queued bytes before a backend that isn't sending is down
+	bool health_probe;		// probe backends with a connection of their own
+	unsigned int self_metrics_interval_ms;	// 0 disables self metrics
+	char *self_metrics_prefix;
+	char *self_metrics_hostname;	// NULL for this machine's name
+	char *spool_dir;		// NULL disables spooling
+	uint64_t spool_high_watermark;
+	uint64_t spool_max_bytes;
+	uint64_t spool_replay_rate;	// bytes per second
 	list_t ring;
 };
 